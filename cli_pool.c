@@ -20,7 +20,7 @@
 
 extern log_t *g_log;
 
-static genpool_handler_t *cli_pool;
+static __thread genpool_handler_t *cli_pool;
 
 /*
  * fun: init client connection pool
@@ -9,7 +9,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
 #include <sys/types.h>
 #include <fcntl.h>
 #include <sys/epoll.h>
@@ -18,34 +20,45 @@
 #include <log.h>
 #include <list.h>
 #include <timer.h>
+#include <handler.h>
 #include "conn_pool.h"
 #include "my_pool.h"
 #include "cli_pool.h"
 #include "my_buf.h"
 #include "mysql_com.h"
 #include "my_conf.h"
+#include "my_scatter.h"
+#include "my_cache.h"
+#include "my_digest.h"
+#include "my_local.h"
+#include "my_route.h"
+#include "my_flight.h"
+#include "my_sql.h"
+#include "my_ops.h"
 
 extern log_t *g_log;
 extern struct conf_t g_conf;
 
-static genpool_handler_t *conn_pool;
-static uint32_t connid;
+static __thread genpool_handler_t *conn_pool;
+static __thread uint32_t connid;
 
 static int conn_init(conn_t *c);
 static conn_t *conn_alloc(void);
 static int conn_release(conn_t *c);
 
-static int read_client_timeout_timer(unsigned long arg);
-static int write_mysql_timeout_timer(unsigned long arg);
-static int read_mysql_write_client_timeout_timer(unsigned long arg);
-static int prepare_mysql_timeout_timer(unsigned long arg);
-static int idle_timeout_timer(unsigned long arg);
+static int conn_timeout(void *arg);
+static int conn_need(conn_t *c, int *dirty);
+static const char *conn_slave_key(conn_t *c, int *len);
+static int conn_movable(conn_t *c);
+static int conn_retryable(conn_t *c);
 
-static struct list_head read_client_head;
-static struct list_head write_mysql_head;
-static struct list_head read_mysql_write_client_head;
-static struct list_head prepare_mysql_head;
-static struct list_head idle_head;
+static __thread struct list_head idle_head;
+
+// read retry and hedge budgets of worker in hundredths of a retry or a
+// hedge, a burst of RETRY_BURST is allowed
+#define RETRY_BURST 10
+static __thread int retry_tokens = RETRY_BURST * 100;
+static __thread int hedge_tokens = RETRY_BURST * 100;
 
 /*
  * fun: init connection pool and timer
@@ -67,45 +80,11 @@ int conn_pool_init(size_t count)
         return -1;
     }
 
-    INIT_LIST_HEAD(&read_client_head);
-    INIT_LIST_HEAD(&write_mysql_head);
-    INIT_LIST_HEAD(&read_mysql_write_client_head);
-    INIT_LIST_HEAD(&prepare_mysql_head);
     INIT_LIST_HEAD(&idle_head);
 
     srand(pid * time(NULL));
     connid = rand();
 
-    if( (res = timer_register(read_client_timeout_timer, 30, \
-                                "read_client_timeout_timer", 1) < 0) ){
-        log(g_log, "read_client_timeout_timer register error\n");
-        return res;
-    }
-
-    if( (res = timer_register(write_mysql_timeout_timer, 30, \
-                                "write_mysql_timeout_timer", 1) < 0) ){
-        log(g_log, "write_mysql_timeout_timer register error\n");
-        return res;
-    }
-
-    if( (res = timer_register(read_mysql_write_client_timeout_timer, 30, \
-                        "read_mysql_write_client_timeout_timer", 1) < 0) ){
-        log(g_log, "read_mysql_write_client_timeout_timer register error\n");
-        return res;
-    }
-
-    if( (res = timer_register(prepare_mysql_timeout_timer, 30, \
-                        "prepare_mysql_timeout_timer", 1) < 0) ){
-        log(g_log, "prepare_mysql_timeout_timer register error\n");
-        return res;
-    }
-
-    if( (res = timer_register(idle_timeout_timer, 30, \
-                                        "idle_timeout_timer", 1) < 0) ){
-        log(g_log, "idle_timeout_timer register error\n");
-        return res;
-    }
-
     return res;
 }
 
@@ -127,15 +106,32 @@ static int conn_init(conn_t *c)
     c->cli = NULL;
     c->my = NULL;
     c->state = STATE_UNAVAIL;
-    c->state_time = time(NULL);
+    c->route = ROUTE_AUTO;
     bzero(c->curdb, sizeof(c->curdb));
     c->comno = 0;
     bzero(c->arg, sizeof(c->arg));
+    c->arglen = -1;
+    c->retry = 0;
 
-    gettimeofday(&(c->tv_start), NULL);
-    gettimeofday(&(c->tv_end), NULL);
+    c->start_us = c->end_us = timer_us();
+    c->my_us = 0;
+    c->hedge = NULL;
+    c->hedge_us = 0;
+
+    c->sg = NULL;
+    c->qc = NULL;
+    c->dg = NULL;
+    c->lc = NULL;
+    c->fl = NULL;
+    c->local = LOCAL_NONE;
+
+    INIT_LIST_HEAD(&(c->wait));
+    c->wait_node = NULL;
+    c->wait_cb = NULL;
 
     INIT_LIST_HEAD(&(c->link));
+    timer_node_init(&(c->timer), conn_timeout, c);
+    timer_node_init(&(c->hedge_timer), my_hedge_cb, c);
 
     return buf_init(&(c->buf));
 }
@@ -207,6 +203,8 @@ static int conn_release(conn_t *c)
 
     c->my = NULL;
     c->cli = NULL;
+    timer_del(&(c->timer));
+    timer_del(&(c->hedge_timer));
     buf_reset(&(c->buf));
 
     return genpool_release_page(conn_pool, c);
@@ -225,6 +223,32 @@ int conn_close(conn_t *c)
 
     list_del_init(&(c->link));
 
+    if(c->wait_node){
+        my_conn_wait_cancel(c, 1);
+    }
+
+    if(c->sg){
+        my_scatter_abort(c);
+    }
+
+    if(c->qc){
+        my_cache_close(c);
+    }
+
+    if(c->dg){
+        my_digest_close(c);
+    }
+
+    if(c->lc){
+        my_local_close(c);
+    }
+
+    if(c->fl){
+        my_flight_close(c);
+    }
+
+    conn_hedge_cancel(c);
+
     if(c->my){
         if( (res = my_conn_put(c->my)) < 0 ){
             log(g_log, "put my conn error\n");
@@ -259,6 +283,32 @@ int conn_close_with_my(conn_t *c)
 
     list_del_init(&(c->link));
 
+    if(c->wait_node){
+        my_conn_wait_cancel(c, 1);
+    }
+
+    if(c->sg){
+        my_scatter_abort(c);
+    }
+
+    if(c->qc){
+        my_cache_close(c);
+    }
+
+    if(c->dg){
+        my_digest_close(c);
+    }
+
+    if(c->lc){
+        my_local_close(c);
+    }
+
+    if(c->fl){
+        my_flight_close(c);
+    }
+
+    conn_hedge_cancel(c);
+
     if(c->my){
         if( (res = my_conn_close(c->my)) < 0 ){
             log(g_log, "my conn close error\n");
@@ -281,35 +331,32 @@ int conn_close_with_my(conn_t *c)
 }
 
 /*
- * fun: alloc mysql connection for connection
- * arg: connection struct pointer
- * ret: success 0, error -1
+ * fun: get mysql role needed by current command, clients of read and
+ *      write ports skip the classification
+ * arg: connection struct pointer, dirty flag to set
+ * ret: NEED_MASTER, NEED_SLAVE or NEED_MASTER_OR_SLAVE
  *
  */
 
-int conn_alloc_my_conn(conn_t *c)
+static int conn_need(conn_t *c, int *dirty)
 {
-    int type = NEED_MASTER_OR_SLAVE, dirty = 0;
-    int myrole = UNAVAIL_ROLE;
-    my_conn_t *my = c->my;
-    cli_conn_t *cli = c->cli;
-    my_node_t *node;
+    int type = NEED_MASTER_OR_SLAVE;
 
-    if(my && my_conn_ctx_is_dirty(my)){
-        return 0;
-    }
-
-    if(my != NULL){
-        node = my->node;
-        myrole = node->role;
-    }
+    *dirty = 0;
 
     if( (!strncasecmp(c->arg, "begin", 5)) || \
                         (!strncasecmp(c->arg, "start", 5)) || \
                             (!strncasecmp(c->arg, "set", 3)) || \
                                 (!strncasecmp(c->arg, "lock", 4)) ){
         type = NEED_MASTER;
-        dirty = 1;
+        *dirty = 1;
+    }
+
+    // session state still pins the mysql connection
+    if(c->route == ROUTE_WRITE){
+        return NEED_MASTER;
+    } else if(c->route == ROUTE_READ) {
+        return NEED_SLAVE;
     }
 
     if( (c->comno == COM_CREATE_DB) || (c->comno == COM_DROP_DB) ){
@@ -324,6 +371,73 @@ int conn_alloc_my_conn(conn_t *c)
         }
     }
 
+    return type;
+}
+
+/*
+ * fun: get key of slave hash ring, the key=name comment hint of query or
+ *      else current db
+ * arg: connection struct pointer, key length to set
+ * ret: key, length 0 without key
+ *
+ */
+
+static const char *conn_slave_key(conn_t *c, int *len)
+{
+    const char *key;
+
+    *len = 0;
+
+    if(!g_conf.slave_hash){
+        return NULL;
+    }
+
+    if( (c->comno == COM_QUERY) && ((key = strstr(c->arg, "/*key=")) != NULL) ){
+        key += 6;
+        while( (key[*len] != '\0') && (key[*len] != '*') && (key[*len] != ' ') ){
+            (*len)++;
+        }
+        if(*len > 0){
+            return key;
+        }
+    }
+
+    *len = strlen(c->curdb);
+
+    return c->curdb;
+}
+
+/*
+ * fun: alloc mysql connection for connection
+ * arg: connection struct pointer
+ * ret: success 0, error -1
+ *
+ */
+
+int conn_alloc_my_conn(conn_t *c)
+{
+    int type, dirty, len;
+    int myrole = UNAVAIL_ROLE;
+    const char *key, *group = NULL;
+    my_conn_t *my = c->my, *alt;
+    cli_conn_t *cli = c->cli;
+    my_node_t *node;
+
+    if(my && my_conn_ctx_is_dirty(my)){
+        return 0;
+    }
+
+    if(my != NULL){
+        node = my->node;
+        myrole = node->role;
+    }
+
+    type = conn_need(c, &dirty);
+    key = conn_slave_key(c, &len);
+    if(type != NEED_MASTER){
+        group = my_route_group(c);
+    }
+
     if(myrole == UNAVAIL_ROLE){
         if(type == NEED_MASTER){
             if( (my = my_master_conn_get(c, cli->ip, cli->port)) == NULL ){
@@ -332,7 +446,7 @@ int conn_alloc_my_conn(conn_t *c)
                 c->my = my;
             }
         } else {
-            if( (my = my_slave_conn_get(c, cli->ip, cli->port)) == NULL ){
+            if( (my = my_slave_conn_get(c, cli->ip, cli->port, group, key, len)) == NULL ){
                 if( (my = my_master_conn_get(c, cli->ip, cli->port)) == NULL ){
                     return -1;
                 } else {
@@ -344,9 +458,9 @@ int conn_alloc_my_conn(conn_t *c)
         }
     } else if(myrole == MASTER_ROLE) {
         if(type == NEED_SLAVE) {
-            if( (my = my_slave_conn_get(c, cli->ip, cli->port)) != NULL ){
+            if( (alt = my_slave_conn_get(c, cli->ip, cli->port, group, key, len)) != NULL ){
                 my_conn_put(c->my);
-                c->my = my;
+                c->my = alt;
             }
         }
     } else {
@@ -357,248 +471,546 @@ int conn_alloc_my_conn(conn_t *c)
             } else {
                 return -1;
             }
+        } else if( (type == NEED_SLAVE) && \
+                ((alt = my_slave_conn_home(c, c->my, group, key, len)) != NULL) ){
+            // read from the slave group or home slave of the query
+            my_conn_put(c->my);
+            c->my = alt;
         }
     }
 
     if(dirty){
-        my_conn_ctx_set_dirty(my);
+        my_conn_ctx_set_dirty(c->my);
+    }
+
+    // every read earns read_retry_budget hundredths of a retry
+    if( g_conf.read_retry && (type == NEED_SLAVE) && \
+                            (retry_tokens < RETRY_BURST * 100) ){
+        retry_tokens += g_conf.read_retry_budget;
+    }
+    if( g_conf.hedge_read && (type == NEED_SLAVE) && \
+                            (hedge_tokens < RETRY_BURST * 100) ){
+        hedge_tokens += g_conf.hedge_budget;
     }
 
     return 0;
 }
 
 /*
- * fun: set connection state: reading_client
+ * fun: move a read whose slave failed before answering to another slave,
+ *      the mysql connection failed is closed
  * arg: connection struct pointer
- * ret: success 0, error -1
+ * ret: success 0, read not retryable or no other slave -1
  *
  */
 
-int conn_state_set_reading_client(conn_t *c)
+int conn_retry_my_conn(conn_t *c)
 {
-    if(c == NULL){
+    int len;
+    const char *key, *group;
+    my_conn_t *my;
+    my_node_t *node;
+
+    if( (c->retry >= g_conf.read_retry) || (retry_tokens < 100) || \
+                                            (!conn_retryable(c)) ){
         return -1;
     }
 
-    c->state = STATE_READING_CLIENT;
-    c->state_time = time(NULL);
+    key = conn_slave_key(c, &len);
+    group = my_route_group(c);
+    if( (my = my_slave_conn_other(c, c->my, group, key, len, NULL)) == NULL ){
+        return -1;
+    }
 
-    list_move_tail(&(c->link), &read_client_head);
+    node = c->my->node;
+    log(g_log, "conn:%u read retried, slave %s:%s failed\n", \
+                                    c->connid, node->host, node->srv);
 
-    log(g_log, "conn:%d reading client\n", c->connid);
+    my_conn_close(c->my);
+    c->my = my;
+    c->retry++;
+    retry_tokens -= 100;
 
     return 0;
 }
 
 /*
- * fun: set connection state: writing mysql 
+ * fun: start the hedge timer of a read sent to a slave, it fires after
+ *      the hedge_read percentile of read latency
  * arg: connection struct pointer
- * ret: success 0, error -1
+ * ret: armed 0, not hedged -1
  *
  */
 
-int conn_state_set_writing_mysql(conn_t *c)
+int conn_hedge_arm(conn_t *c)
 {
-    if(c == NULL){
+    uint64_t us;
+
+    if( (!g_conf.hedge_read) || (c->hedge != NULL) || (c->my == NULL) || \
+                    (c->comno != COM_QUERY) || (c->arglen < 0) || \
+                        (((my_node_t *)c->my->node)->role != SLAVE_ROLE) ){
         return -1;
     }
 
-    c->state = STATE_WRITING_MYSQL;
-    c->state_time = time(NULL);
-
-    list_move_tail(&(c->link), &write_mysql_head);
-
-    log(g_log, "conn:%d writing mysql\n", c->connid);
+    if( (us = my_slave_latency(g_conf.hedge_read)) == 0 ){
+        return -1;
+    }
 
-    return 0;
+    return timer_add(&(c->hedge_timer), (us + 999) / 1000);
 }
 
 /*
- * fun: set connection state: read mysql and write client
+ * fun: get a connection of another slave to send a read not answered yet
+ *      again, in the same db and session as the connection in use
  * arg: connection struct pointer
- * ret: success 0, error -1
+ * ret: success 0, read not hedged -1
  *
  */
 
-int conn_state_set_read_mysql_write_client(conn_t *c)
+int conn_hedge_my_conn(conn_t *c)
 {
-    if(c == NULL){
+    int len;
+    const char *key, *group;
+    my_conn_t *my;
+    my_ctx_t ctx;
+
+    if( (c->hedge != NULL) || (c->my_us == 0) || (hedge_tokens < 100) || \
+                                                (!conn_retryable(c)) ){
         return -1;
     }
 
-    c->state = STATE_READ_MYSQL_WRITE_CLIENT;
-    c->state_time = time(NULL);
+    strncpy(ctx.curdb, c->curdb, sizeof(ctx.curdb) - 1);
+    ctx.curdb[sizeof(ctx.curdb) - 1] = '\0';
+    ctx.sess_key = c->my->ctx.sess_key;
 
-    list_move_tail(&(c->link), &read_mysql_write_client_head);
+    key = conn_slave_key(c, &len);
+    group = my_route_group(c);
+    if( (my = my_slave_conn_other(c, c->my, group, key, len, &ctx)) == NULL ){
+        return -1;
+    }
 
-    log(g_log, "conn:%d read mysql write client\n", c->connid);
+    c->hedge = my;
+    c->hedge_us = timer_us();
+    hedge_tokens -= 100;
 
     return 0;
 }
 
 /*
- * fun: set connection state: prepare mysql
+ * fun: stop the hedge timer and close the hedge connection of connection
  * arg: connection struct pointer
- * ret: success 0, error -1
+ * ret: always return 0
  *
  */
 
-int conn_state_set_prepare_mysql(conn_t *c)
+int conn_hedge_cancel(conn_t *c)
 {
-    if(c == NULL){
-        return -1;
+    timer_del(&(c->hedge_timer));
+
+    if(c->hedge != NULL){
+        my_conn_close(c->hedge);
+        c->hedge = NULL;
     }
 
-    c->state = STATE_PREPARE_MYSQL;
-    c->state_time = time(NULL);
+    return 0;
+}
 
-    list_move_tail(&(c->link), &prepare_mysql_head);
+/*
+ * fun: check command of connection is a read safe to send again, an
+ *      autocommit select of a slave, kept whole in arg
+ * arg: connection struct pointer
+ * ret: yes 1, no 0
+ *
+ */
 
-    log(g_log, "conn:%d prepare to write mysql\n", c->connid);
+static int conn_retryable(conn_t *c)
+{
+    int dirty;
+    my_conn_t *my = c->my;
+
+    if( (my == NULL) || (c->comno != COM_QUERY) || (c->arglen < 0) || \
+                (c->local != LOCAL_NONE) || (c->sg != NULL) || \
+                        (((my_node_t *)my->node)->role != SLAVE_ROLE) || \
+                                            my_conn_ctx_is_dirty(my) ){
+        return 0;
+    }
+
+    if( (conn_need(c, &dirty) != NEED_SLAVE) || dirty ){
+        return 0;
+    }
+
+    return sql_is_pure_read(c->arg, c->arglen);
+}
+
+/*
+ * fun: wait for a mysql connection after conn_alloc_my_conn failed
+ * arg: connection struct pointer, callback to resume with mysql connection
+ * ret: queued 0, wait queue disabled or full -1
+ *
+ */
+
+int conn_wait_my_conn(conn_t *c, int (*cb)(conn_t *c))
+{
+    int type, dirty, len;
+    const char *key, *group = NULL;
+    cli_conn_t *cli = c->cli;
+
+    if(g_conf.wait_mysql_queue <= 0){
+        return -1;
+    }
+
+    type = conn_need(c, &dirty);
+    key = conn_slave_key(c, &len);
+    if(type != NEED_MASTER){
+        group = my_route_group(c);
+    }
+    if(my_conn_wait(c, (type == NEED_MASTER) ? MASTER_ROLE : SLAVE_ROLE, \
+                            cli->ip, cli->port, group, key, len) < 0){
+        return -1;
+    }
+
+    c->wait_cb = cb;
+    conn_state_set_waiting_mysql(c);
 
     return 0;
 }
 
 /*
- * fun: set connection state: idle
+ * fun: resume waiting connection with the mysql connection handed to it
+ * arg: connection struct pointer, mysql connection already set used
+ * ret: success 0, error -1, connection is closed on error
+ *
+ */
+
+int conn_wait_resume(conn_t *c, my_conn_t *my)
+{
+    int res;
+
+    if(c->my){
+        my_conn_put(c->my);
+    }
+    c->my = my;
+    list_del_init(&(c->link));
+    timer_del(&(c->timer));
+
+    if( (res = c->wait_cb(c)) < 0 ){
+        log(g_log, "conn:%u resume after waiting error\n", c->connid);
+        conn_close_with_my(c);
+    }
+
+    return res;
+}
+
+/*
+ * fun: give up waiting, answer client with an error
  * arg: connection struct pointer
- * ret: success 0, error -1
+ * ret: success 0, error -1, connection is closed on error
  *
  */
 
-int conn_state_set_idle(conn_t *c)
+int conn_wait_expire(conn_t *c)
 {
-    if(c == NULL){
-        return -1;
+    int res;
+
+    my_conn_wait_cancel(c, 1);
+    list_del_init(&(c->link));
+
+    if( (res = cli_wait_expire(c)) < 0 ){
+        log(g_log, "conn:%u cli_wait_expire error\n", c->connid);
+        conn_close(c);
     }
 
-    c->state = STATE_IDLE;
-    c->state_time = time(NULL);
+    return res;
+}
 
-    list_move_tail(&(c->link), &idle_head);
+/*
+ * fun: check idle connection can be handed to another worker, it holds
+ *      no query state and no mysql connection with session state
+ * arg: connection struct pointer
+ * ret: movable 1, not 0
+ *
+ */
 
-    log(g_log, "conn:%d connection idle\n", c->connid);
+static int conn_movable(conn_t *c)
+{
+    if( (c->state != STATE_IDLE) || c->sg || c->qc || c->dg || c->wait_node ){
+        return 0;
+    }
 
-    return 0;
+    if(c->my && my_conn_ctx_is_dirty(c->my)){
+        return 0;
+    }
+
+    // session variables kept by proxy are not handed over
+    if(!my_local_sess_empty(c)){
+        return 0;
+    }
+
+    return 1;
 }
 
 /*
- * fun: connection timeout timer
- * arg: max connection, connection timer head, 
- * arg: timeout seconds, extend message
- * ret: success 0, error -1
+ * fun: count idle connections can be handed to another worker
+ * arg:
+ * ret: connection number
  *
  */
 
-static int
-_conn_state_timeout_timer(unsigned long arg, \
-                            struct list_head *head, \
-                            int timeout, const char *msg)
+int conn_idle_movable(void)
 {
     int count = 0;
-    struct list_head *pos, *n;
+    struct list_head *pos;
+
+    list_for_each(pos, &idle_head){
+        count += conn_movable(list_entry(pos, conn_t, link));
+    }
+
+    return count;
+}
+
+/*
+ * fun: hand idle connections to another worker, longest idle first
+ * arg: max connection number, send function passing client fd and session
+ * ret: connection number handed off
+ *
+ */
+
+int conn_handoff(int count, int (*send)(conn_t *c, void *arg), void *arg)
+{
+    int n = 0;
+    struct list_head *pos, *tmp;
     conn_t *c;
-    time_t now = time(NULL);
 
-    list_for_each_safe(pos, n, head){
-        if(count++ >= arg){
+    list_for_each_safe(pos, tmp, &idle_head){
+        if(n >= count){
             break;
         }
 
         c = list_entry(pos, conn_t, link);
+        if(!conn_movable(c)){
+            continue;
+        }
 
-        if(now - c->state_time > timeout){
-            log(g_log, "conn:%u %s\n", c->connid, msg);
-            list_del_init(pos);
-            conn_close(c);
-        } else {
+        if(send(c, arg) < 0){
             break;
         }
+
+        log(g_log, "conn:%u hand off\n", c->connid);
+        conn_close(c);
+        n++;
     }
 
+    return n;
+}
+
+/*
+ * fun: adopt idle client connection handed off by another worker
+ * arg: client fd, client ip and port, current db, routing policy
+ * ret: success connection, error NULL, fd is closed on error
+ *
+ */
+
+conn_t *conn_adopt(int fd, uint32_t ip, uint16_t port, \
+                            const char *curdb, int route)
+{
+    conn_t *c;
+
+    if( (c = conn_open(fd, ip, port)) == NULL ){
+        log(g_log, "connection alloc fail, close connection\n");
+        close(fd);
+        return NULL;
+    }
+
+    strncpy(c->curdb, curdb, sizeof(c->curdb) - 1);
+    c->curdb[sizeof(c->curdb) - 1] = '\0';
+    c->route = route;
+
+    if(add_handler(fd, EPOLLIN, cli_query_cb, c->cli) < 0){
+        log(g_log, "conn:%u add_handler error\n", c->connid);
+        conn_close(c);
+        return NULL;
+    }
+
+    conn_state_set_idle(c);
+
+    return c;
+}
+
+/*
+ * fun: set connection state: reading_client
+ * arg: connection struct pointer
+ * ret: success 0, error -1
+ *
+ */
+
+int conn_state_set_reading_client(conn_t *c)
+{
+    if(c == NULL){
+        return -1;
+    }
+
+    c->state = STATE_READING_CLIENT;
+
+    list_del_init(&(c->link));
+    timer_add(&(c->timer), (uint64_t)g_conf.read_client_timeout * 1000);
+
+    log(g_log, "conn:%d reading client\n", c->connid);
+
     return 0;
 }
 
 /*
- * fun: connection timeout timer: read client
- * arg: max connection to be processed
+ * fun: set connection state: writing mysql 
+ * arg: connection struct pointer
  * ret: success 0, error -1
  *
  */
 
-static int read_client_timeout_timer(unsigned long arg)
+int conn_state_set_writing_mysql(conn_t *c)
 {
-    struct list_head *head;
+    if(c == NULL){
+        return -1;
+    }
+
+    c->state = STATE_WRITING_MYSQL;
 
-    head = &read_client_head;
-    return _conn_state_timeout_timer(arg, head, \
-                    g_conf.read_client_timeout, "read_client_timeout");
+    list_del_init(&(c->link));
+    timer_add(&(c->timer), (uint64_t)g_conf.write_mysql_timeout * 1000);
+
+    log(g_log, "conn:%d writing mysql\n", c->connid);
+
+    return 0;
 }
 
 /*
- * fun: connection timeout timer: write mysql
- * arg: max connection to be processed
+ * fun: set connection state: read mysql and write client
+ * arg: connection struct pointer
  * ret: success 0, error -1
  *
  */
 
-static int write_mysql_timeout_timer(unsigned long arg)
+int conn_state_set_read_mysql_write_client(conn_t *c)
 {
-    struct list_head *head;
+    if(c == NULL){
+        return -1;
+    }
 
-    head = &write_mysql_head;
-    return _conn_state_timeout_timer(arg, head, \
-                    g_conf.write_mysql_timeout, "write_mysql_timeout");
+    c->state = STATE_READ_MYSQL_WRITE_CLIENT;
+
+    list_del_init(&(c->link));
+    timer_add(&(c->timer), (uint64_t)g_conf.read_mysql_write_client_timeout * 1000);
+
+    log(g_log, "conn:%d read mysql write client\n", c->connid);
+
+    return 0;
 }
 
 /*
- * fun: connection timeout timer: read mysql and write client
- * arg: max connection to be processed
+ * fun: set connection state: prepare mysql
+ * arg: connection struct pointer
  * ret: success 0, error -1
  *
  */
 
-static int read_mysql_write_client_timeout_timer(unsigned long arg)
+int conn_state_set_prepare_mysql(conn_t *c)
 {
-    struct list_head *head;
+    if(c == NULL){
+        return -1;
+    }
+
+    c->state = STATE_PREPARE_MYSQL;
 
-    head = &read_mysql_write_client_head;
-    return _conn_state_timeout_timer(arg, head, \
-                    g_conf.read_mysql_write_client_timeout, \
-                    "read_mysql_write_client_timeout");
+    list_del_init(&(c->link));
+    timer_add(&(c->timer), (uint64_t)g_conf.prepare_mysql_timeout * 1000);
+
+    log(g_log, "conn:%d prepare to write mysql\n", c->connid);
+
+    return 0;
 }
 
 /*
- * fun: connection timeout timer: prepare mysql
- * arg: max connection to be processed
+ * fun: set connection state: idle
+ * arg: connection struct pointer
  * ret: success 0, error -1
  *
  */
 
-static int prepare_mysql_timeout_timer(unsigned long arg)
+int conn_state_set_idle(conn_t *c)
 {
-    struct list_head *head;
+    if(c == NULL){
+        return -1;
+    }
 
-    head = &prepare_mysql_head;
-    return _conn_state_timeout_timer(arg, head, \
-                    g_conf.prepare_mysql_timeout, \
-                    "prepare_mysql_timeout");
+    c->state = STATE_IDLE;
+
+    list_move_tail(&(c->link), &idle_head);
+    timer_add(&(c->timer), (uint64_t)g_conf.idle_timeout * 1000);
+
+    log(g_log, "conn:%d connection idle\n", c->connid);
+
+    return 0;
 }
 
 /*
- * fun: connection timeout timer: idle
- * arg: max connection to be processed
+ * fun: set connection state: waiting for mysql connection
+ * arg: connection struct pointer
  * ret: success 0, error -1
  *
  */
 
-static int idle_timeout_timer(unsigned long arg)
+int conn_state_set_waiting_mysql(conn_t *c)
 {
-    struct list_head *head;
+    if(c == NULL){
+        return -1;
+    }
 
-    head = &idle_head;
-    return _conn_state_timeout_timer(arg, head, \
-                    g_conf.idle_timeout, "idle_timeout");
+    c->state = STATE_WAITING_MYSQL;
+
+    list_del_init(&(c->link));
+    timer_add(&(c->timer), (uint64_t)g_conf.wait_mysql_timeout * 1000);
+
+    log(g_log, "conn:%d waiting mysql\n", c->connid);
 
     return 0;
 }
+
+/*
+ * fun: connection timeout of its state, armed when the state is set
+ * arg: connection struct pointer
+ * ret: success 0, error -1
+ *
+ */
+
+static int conn_timeout(void *arg)
+{
+    conn_t *c = arg;
+
+    switch(c->state){
+        case STATE_READING_CLIENT:
+            log(g_log, "conn:%u read_client_timeout\n", c->connid);
+            break;
+        case STATE_WRITING_MYSQL:
+            log(g_log, "conn:%u write_mysql_timeout\n", c->connid);
+            break;
+        case STATE_READ_MYSQL_WRITE_CLIENT:
+            log(g_log, "conn:%u read_mysql_write_client_timeout\n", c->connid);
+            break;
+        case STATE_PREPARE_MYSQL:
+            log(g_log, "conn:%u prepare_mysql_timeout\n", c->connid);
+            break;
+        case STATE_IDLE:
+            log(g_log, "conn:%u idle_timeout\n", c->connid);
+            break;
+        case STATE_WAITING_MYSQL:
+            if(c->wait_node == NULL){
+                return 0;
+            }
+            // answer client with an error, connection stays open
+            log(g_log, "conn:%u wait_mysql_timeout\n", c->connid);
+            return conn_wait_expire(c);
+        default:
+            return 0;
+    }
+
+    return conn_close(c);
+}
@@ -2,7 +2,7 @@
 #define __CONN_POOL_H_
 
 #include <stdint.h>
-#include <sys/time.h>
+#include <timer.h>
 #include "my_pool.h"
 #include "my_buf.h"
 
@@ -13,6 +13,22 @@ enum{
     NEED_MASTER_OR_SLAVE
 };
 
+// routing policy of the listener a client came from
+enum{
+    ROUTE_AUTO = 0,
+    ROUTE_READ,
+    ROUTE_WRITE,
+    ROUTE_NUM
+};
+
+enum{
+    LOCAL_NONE = 0,
+    LOCAL_CACHE,
+    LOCAL_ADMIN,
+    LOCAL_SESSION,
+    LOCAL_FLIGHT
+};
+
 enum{
     STATE_UNAVAIL = 0,
     STATE_AUTH_FAIL,
@@ -21,22 +37,40 @@ enum{
     STATE_PREPARE_MYSQL,
     STATE_WRITING_MYSQL,
     STATE_READ_MYSQL_WRITE_CLIENT,
-    STATE_IDLE
+    STATE_IDLE,
+    STATE_WAITING_MYSQL
 };
 
-typedef struct{
+typedef struct conn_s{
     uint32_t connid;
     my_conn_t *my;
     void *cli;
     buf_t buf;
     int state;
-    time_t state_time;
     char curdb[64];
     uint8_t comno;
     char arg[1024];
-    struct timeval tv_start;
-    struct timeval tv_end;
+    int arglen;
+    uint8_t retry;
+    uint64_t start_us;
+    uint64_t end_us;
+    uint64_t my_us;
+    my_conn_t *hedge;
+    uint64_t hedge_us;
+    timer_node_t hedge_timer;
+    void *sg;
+    void *qc;
+    void *dg;
+    void *lc;
+    void *fl;
+    uint8_t local;
+    uint8_t route;
+    struct list_head wait;
+    void *wait_node;
+    uint64_t wait_us;
+    int (*wait_cb)(struct conn_s *c);
     struct list_head link;
+    timer_node_t timer;
 } conn_t;
 
 int conn_pool_init(size_t count);
@@ -44,12 +78,24 @@ conn_t *conn_open(int fd, uint32_t ip, uint16_t port);
 int conn_close(conn_t *c);
 int conn_close_with_my(conn_t *c);
 int conn_alloc_my_conn(conn_t *c);
+int conn_wait_my_conn(conn_t *c, int (*cb)(conn_t *c));
+int conn_retry_my_conn(conn_t *c);
+int conn_hedge_arm(conn_t *c);
+int conn_hedge_my_conn(conn_t *c);
+int conn_hedge_cancel(conn_t *c);
+int conn_wait_resume(conn_t *c, my_conn_t *my);
+int conn_wait_expire(conn_t *c);
+int conn_idle_movable(void);
+int conn_handoff(int count, int (*send)(conn_t *c, void *arg), void *arg);
+conn_t *conn_adopt(int fd, uint32_t ip, uint16_t port, \
+                            const char *curdb, int route);
 
 int conn_state_set_reading_client(conn_t *c);
 int conn_state_set_writing_mysql(conn_t *c);
 int conn_state_set_read_mysql_write_client(conn_t *c);
 int conn_state_set_prepare_mysql(conn_t *c);
 int conn_state_set_idle(conn_t *c);
+int conn_state_set_waiting_mysql(conn_t *c);
 int conn_state_set_auth_fail(conn_t *c);
 int conn_state_set_auth_success(conn_t *c);
 
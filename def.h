@@ -7,7 +7,10 @@
 #define MAX_SRV_LEN 16
 #define MAX_USER_LEN 64
 #define MAX_PASS_LEN 64
+#define MAX_GROUP_LEN 32
 #define MAX_SLAVE_NODE 64
 #define MAX_MASTER_NODE 1
+#define MAX_SHARD_NODE 16
+#define MAX_WORKER 64
 
 #endif
@@ -11,25 +11,44 @@
 #include <errno.h>
 #include <arpa/inet.h>
 #include <stdint.h>
+#include <unistd.h>
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <pthread.h>
 #include <log.h>
 #include <handler.h>
+#include <sock.h>
 #include "cli_pool.h"
 #include "my_pool.h"
 #include "conn_pool.h"
 #include "my_conf.h"
+#include "my_cache.h"
+#include "my_binlog.h"
+#include "my_broker.h"
+#include "my_balance.h"
+#include "def.h"
 
 #define VERSION "0.3.2"
 
-int g_usr1_reload = 0;
+// usr1 count, every worker loop compares with the count it has seen
+volatile int g_usr1_reload = 0;
 log_t *g_log = NULL;
 
 extern struct conf_t g_conf;
 
 static int signal_init(void);
 static void signal_usr1(int signal);
+static int listen_init(void);
+static int listen_port(int route, const char *port);
+static int work_thread_start(void);
+static void *work_thread(void *arg);
+
+// listen fds of every worker by route, one shared fd per port unless
+// reuseport, -1 for ports not configured
+static int listenfd[MAX_WORKER][ROUTE_NUM];
+// unix socket listen fd shared by all workers
+static int unixfd = -1;
 
 #define USAGE(){ \
     fprintf(stderr, "Version: %s\n", VERSION); \
@@ -41,8 +60,10 @@ static void signal_usr1(int signal);
 
 int main(int argc, char *argv[])
 {
-    int i, listenfd;
-    pid_t pid;
+    int i;
+    int brokerfd = -1;
+    pid_t pid, binlog_pid = -1, broker_pid = -1;
+    pid_t worker_pid[MAX_WORKER] = {0};
 
     // argument parse
     if(argc != 2){
@@ -60,18 +81,26 @@ int main(int argc, char *argv[])
         log(g_log, "conf[%s] init success\n", argv[1]);
     }
 
-    // make listen
-    while(1){
-        listenfd = make_listen_nonblock(g_conf.ip, g_conf.port);
-        if(listenfd < 0){
-            log_err(g_log, "%s:%s listen socket error\n", g_conf.ip, g_conf.port);
-        } else {
-            log(g_log, "make listen socket success\n");
-            break;
-        }
+    if(g_conf.worker > MAX_WORKER){
+        log(g_log, "worker %d exceed limit, use %d\n", g_conf.worker, MAX_WORKER);
+        g_conf.worker = MAX_WORKER;
+    }
 
+    // make listen
+    while(listen_init() < 0){
+        log_err(g_log, "%s:%s listen socket error\n", g_conf.ip, g_conf.port);
         sleep(5);
     }
+    log(g_log, "make listen socket success\n");
+
+    // clients on this host skip the tcp stack
+    if(g_conf.unix_socket[0] != '\0'){
+        if( (unixfd = make_listen_unix(g_conf.unix_socket)) < 0 ){
+            log(g_log, "%s unix socket error\n", g_conf.unix_socket);
+            exit(-1);
+        }
+        log(g_log, "make unix socket %s success\n", g_conf.unix_socket);
+    }
 
     // signal init
     if( (signal_init()) < 0 ){
@@ -81,41 +110,108 @@ int main(int argc, char *argv[])
         log(g_log, "signal init success\n");
     }
 
+    // result cache table versions are shared by all workers
+    if(my_cache_shm_init() < 0){
+        log(g_log, "cache shm init error\n");
+        exit(-1);
+    }
+
+    // connection counters of all workers for connection cap
+    if(my_pool_shm_init() < 0){
+        log(g_log, "pool shm init error\n");
+        exit(-1);
+    }
+
+    // worker loads for client rebalance
+    if(g_conf.balance && (my_balance_shm_init() < 0)){
+        log(g_log, "balance shm init error\n");
+        exit(-1);
+    }
+
     if(g_conf.daemon){
         daemon(1, 1);
     }
 
+    // binlog process tails master for result cache invalidation
+    if(g_conf.cache && g_conf.binlog){
+        binlog_pid = my_binlog_start();
+    }
+
+    // broker process passes idle mysql connections between workers
+    if(g_conf.broker){
+        if( (brokerfd = my_broker_listen()) < 0 ){
+            log(g_log, "broker listen error\n");
+            exit(-1);
+        }
+        broker_pid = my_broker_start(brokerfd);
+    }
+
+    // worker threads share one process, there is nothing to restart
+    if(g_conf.thread){
+        if(work_thread_start() < 0){
+            log(g_log, "worker thread start error\n");
+            exit(-1);
+        }
+    }
+
     // fork children
-    for(i = 0; i < g_conf.worker; i++){
+    for(i = 0; !g_conf.thread && (i < g_conf.worker); i++){
         while( (pid = fork()) < 0 ){
             log_err(g_log, "fork error\n");
             sleep(3);
         }
 
         if(pid == 0){
-            work(listenfd);
+            work(listenfd[i], unixfd, i);
             exit(-1);
         }
+        worker_pid[i] = pid;
     }
 
     // wait for children exit and restart it
     while(1){
-        while( (pid = waitpid(-1, NULL, 0)) < 0 ){
-            sleep(3);
+        while( (pid = waitpid(-1, NULL, g_conf.balance ? WNOHANG : 0)) <= 0 ){
+            if(g_conf.balance){
+                my_balance_check();
+                sleep(1);
+            } else {
+                sleep(3);
+            }
         }
 
         log(g_log, "process exit, pid = %d\n", pid);
         sleep(3);
 
+        if(pid == binlog_pid){
+            my_cache_binlog_set(0);
+            binlog_pid = my_binlog_start();
+            continue;
+        }
+
+        my_pool_shm_release(pid);
+        my_balance_shm_release(pid);
+
+        if(pid == broker_pid){
+            broker_pid = my_broker_start(brokerfd);
+            continue;
+        }
+
+        // restart the worker on its own cpu and listen socket
+        for(i = 0; (i < g_conf.worker) && (worker_pid[i] != pid); i++);
+        if(i == g_conf.worker){
+            continue;
+        }
+
         while( (pid = fork()) < 0 ){
             log_err(g_log, "fork error\n");
             sleep(3);
         }
 
         if(pid == 0){
-            work(listenfd);
+            work(listenfd[i], unixfd, i);
             exit(-1);
         }
+        worker_pid[i] = pid;
     }
 
     return 0;
@@ -155,7 +251,155 @@ static int signal_init(void)
 
 static void signal_usr1(int signal)
 {
-    g_usr1_reload = 1;
+    g_usr1_reload++;
 
     return;
 }
+
+/*
+ * fun: make listen sockets of the auto split port and the read and write
+ *      ports
+ * arg:
+ * ret: success 0, error -1
+ *
+ */
+
+static int listen_init(void)
+{
+    int i, r;
+    const char *port[ROUTE_NUM];
+
+    port[ROUTE_AUTO] = g_conf.port;
+    port[ROUTE_READ] = g_conf.read_port;
+    port[ROUTE_WRITE] = g_conf.write_port;
+
+    for(r = 0; r < ROUTE_NUM; r++){
+        for(i = 0; i < MAX_WORKER; i++){
+            listenfd[i][r] = -1;
+        }
+
+        if(port[r][0] == '\0'){
+            continue;
+        }
+
+        if(listen_port(r, port[r]) < 0){
+            log(g_log, "%s:%s listen error\n", g_conf.ip, port[r]);
+            goto end;
+        }
+    }
+
+    return 0;
+
+end:
+    while(r-- > 0){
+        for(i = 0; i < g_conf.worker; i++){
+            if( (listenfd[i][r] >= 0) && \
+                ((i == 0) || (listenfd[i][r] != listenfd[0][r])) ){
+                close(listenfd[i][r]);
+            }
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * fun: make listen sockets of one port, with reuseport every worker has its
+ *      own socket and connections are steered to the worker on the cpu
+ *      receiving them
+ * arg: route of the port, port
+ * ret: success 0, error -1
+ *
+ */
+
+static int listen_port(int route, const char *port)
+{
+    int i, n, fd;
+    int cpus[MAX_WORKER], cpu[MAX_WORKER];
+
+    if(!g_conf.reuseport){
+        if( (fd = make_listen_nonblock(g_conf.ip, port)) < 0 ){
+            return -1;
+        }
+
+        for(i = 0; i < g_conf.worker; i++){
+            listenfd[i][route] = fd;
+        }
+
+        return 0;
+    }
+
+    // sockets join the reuseport group in worker order
+    for(i = 0; i < g_conf.worker; i++){
+        if( (listenfd[i][route] = make_listen_reuseport(g_conf.ip, port)) < 0 ){
+            while(i-- > 0){
+                close(listenfd[i][route]);
+                listenfd[i][route] = -1;
+            }
+            return -1;
+        }
+    }
+
+    if( (n = my_conf_cpus(cpus, MAX_WORKER)) > 0 ){
+        for(i = 0; i < g_conf.worker; i++){
+            cpu[i] = cpus[i % n];
+        }
+
+        if(reuseport_steer_cpu(listenfd[0][route], cpu, g_conf.worker) < 0){
+            log(g_log, "reuseport cpu steering error, hash steering\n");
+        } else {
+            log(g_log, "reuseport cpu steering success\n");
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * fun: init shared log and start worker threads
+ * arg:
+ * ret: success 0, error -1
+ *
+ */
+
+static int work_thread_start(void)
+{
+    int i, res;
+    pthread_t tid;
+
+    if( (g_log = log_init(g_conf.log, my_conf_loglevel())) == NULL ){
+        fprintf(stderr, "log init error\n");
+        return -1;
+    }
+
+    for(i = 0; i < g_conf.worker; i++){
+        if( (res = pthread_create(&tid, NULL, work_thread, \
+                                        (void *)(long)i)) != 0 ){
+            errno = res;
+            log_err(g_log, "pthread_create error\n");
+            return -1;
+        }
+        pthread_detach(tid);
+    }
+
+    log(g_log, "%d worker threads start\n", g_conf.worker);
+
+    return 0;
+}
+
+/*
+ * fun: worker thread entry
+ * arg: worker index
+ * ret: it should not return
+ *
+ */
+
+static void *work_thread(void *arg)
+{
+    int i = (int)(long)arg;
+
+    work(listenfd[i], unixfd, i);
+    exit(-1);
+
+    return NULL;
+}
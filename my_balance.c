@@ -0,0 +1,409 @@
+/*
+ * Copyright 2011-2013 Alibaba Group Holding Limited. All rights reserved.
+ * Use and distribution licensed under the GPL license.
+ *
+ * Authors: XiaoJinliang <xiaoshi.xjl@taobao.com>
+ *
+ */
+
+/*
+ * client rebalance between workers
+ *
+ * every worker publishes its event loop utilization and the number of
+ * idle clients it could give away in shared memory once a second. master
+ * compares the workers in its wait loop, when the busiest one is more than
+ * balance percent above the least busy one, it orders the busy worker to
+ * move part of its idle clients. the busy worker passes the client fds and
+ * the session (current db, routing policy) over SCM_RIGHTS to the abstract
+ * unix socket of the target worker, which adopts them as idle clients.
+ *
+ * only idle clients without query state and without a dirty mysql
+ * connection move, their clean mysql connection goes back to the pool.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <log.h>
+#include <timer.h>
+#include <handler.h>
+#include <sock.h>
+#include "my_balance.h"
+#include "conn_pool.h"
+#include "cli_pool.h"
+#include "my_conf.h"
+#include "def.h"
+
+extern log_t *g_log;
+extern struct conf_t g_conf;
+
+#define BALANCE_NAME "myrelay.balance.%d.%d"
+#define BALANCE_MAX_MOVE 64
+
+typedef struct{
+    pid_t pid;
+    int busy;
+    int idle;
+    int move;
+    int to;
+} balance_worker_t;
+
+typedef struct{
+    pid_t owner;
+    balance_worker_t worker[MAX_WORKER];
+} balance_shm_t;
+
+typedef struct{
+    uint32_t connid;
+    uint32_t ip;
+    uint16_t port;
+    uint8_t route;
+    char curdb[64];
+} balance_msg_t;
+
+static balance_shm_t *balanceshm = NULL;
+
+static __thread int balance_slot = -1;
+static __thread uint64_t last_idle;
+static __thread uint64_t last_us;
+
+static int balance_name(char *name, int size, int slot);
+static int balance_timer(unsigned long arg);
+static int balance_send(conn_t *c, void *arg);
+static int balance_accept_cb(int listenfd, void *arg);
+static int balance_peer_cb(int fd, void *arg);
+
+/*
+ * fun: init worker load table in shared memory, must be called before fork
+ * arg:
+ * ret: success 0, error -1
+ *
+ */
+
+int my_balance_shm_init(void)
+{
+    void *ptr;
+
+    ptr = mmap(NULL, sizeof(balance_shm_t), PROT_READ | PROT_WRITE, \
+                                    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(ptr == MAP_FAILED){
+        log_err(g_log, "mmap error\n");
+        return -1;
+    }
+
+    balanceshm = ptr;
+    memset(balanceshm, 0, sizeof(balance_shm_t));
+    balanceshm->owner = getpid();
+
+    return 0;
+}
+
+/*
+ * fun: release load slots of an exited worker
+ * arg: worker pid
+ * ret: success 0, not found -1
+ *
+ */
+
+int my_balance_shm_release(pid_t pid)
+{
+    int i, res = -1;
+    balance_worker_t *w;
+
+    if(balanceshm == NULL){
+        return -1;
+    }
+
+    // worker threads share one pid, release all of them
+    for(i = 0; i < MAX_WORKER; i++){
+        w = &(balanceshm->worker[i]);
+        if(w->pid == pid){
+            w->busy = w->idle = w->move = 0;
+            w->pid = 0;
+            res = 0;
+        }
+    }
+
+    return res;
+}
+
+/*
+ * fun: compare worker loads and order the busiest worker to move idle
+ *      clients to the least busy one, called by master once a second
+ * arg:
+ * ret: ordered 1, nothing to do 0
+ *
+ */
+
+int my_balance_check(void)
+{
+    int i, hot = -1, cold = -1, move;
+    balance_worker_t *w, *h, *l;
+
+    if(balanceshm == NULL){
+        return 0;
+    }
+
+    for(i = 0; i < MAX_WORKER; i++){
+        w = &(balanceshm->worker[i]);
+        if(w->pid == 0){
+            continue;
+        }
+
+        if( (hot < 0) || (w->busy > balanceshm->worker[hot].busy) ){
+            hot = i;
+        }
+        if( (cold < 0) || (w->busy < balanceshm->worker[cold].busy) ){
+            cold = i;
+        }
+    }
+
+    if( (hot < 0) || (hot == cold) ){
+        return 0;
+    }
+
+    h = &(balanceshm->worker[hot]);
+    l = &(balanceshm->worker[cold]);
+
+    // busy is per mille, balance is percent
+    if( (h->busy - l->busy < g_conf.balance * 10) || (h->move > 0) ){
+        return 0;
+    }
+
+    // load is taken as spread over clients, move enough to meet halfway
+    move = h->idle * (h->busy - l->busy) / (2 * h->busy);
+    if(move > BALANCE_MAX_MOVE){
+        move = BALANCE_MAX_MOVE;
+    }
+    if(move <= 0){
+        return 0;
+    }
+
+    h->to = cold;
+    __sync_synchronize();
+    h->move = move;
+
+    log(g_log, "worker %d busy %d.%d%%, worker %d busy %d.%d%%, " \
+                "move %d idle clients\n", hot, h->busy / 10, h->busy % 10, \
+                cold, l->busy / 10, l->busy % 10, move);
+
+    return 1;
+}
+
+/*
+ * fun: take a load slot, listen for clients from other workers and
+ *      start publishing load
+ * arg:
+ * ret: success 0, error -1
+ *
+ */
+
+int my_balance_init(void)
+{
+    int i, fd;
+    char name[64];
+
+    if( (!g_conf.balance) || (balanceshm == NULL) ){
+        return 0;
+    }
+
+    for(i = 0; i < MAX_WORKER; i++){
+        if(__sync_bool_compare_and_swap(&(balanceshm->worker[i].pid), \
+                                                        0, getpid())){
+            balance_slot = i;
+            break;
+        }
+    }
+
+    if(balance_slot < 0){
+        log(g_log, "no worker slot, balance disabled\n");
+        return -1;
+    }
+
+    balance_name(name, sizeof(name), balance_slot);
+    if( (fd = make_unix_listen(name)) < 0 ){
+        log(g_log, "balance listen error\n");
+        goto end;
+    }
+
+    if(add_handler(fd, EPOLLIN, balance_accept_cb, NULL) < 0){
+        log(g_log, "add_handler balance fd[%d] fail\n", fd);
+        close(fd);
+        goto end;
+    }
+
+    last_idle = handler_idle();
+    last_us = timer_us();
+
+    if(timer_register(balance_timer, 0, "balance_timer", 1) < 0){
+        log(g_log, "balance_timer register error\n");
+        goto end;
+    }
+
+    return 0;
+
+end:
+    balanceshm->worker[balance_slot].pid = 0;
+    balance_slot = -1;
+
+    return -1;
+}
+
+/*
+ * fun: make abstract unix socket name of a worker
+ * arg: name buffer, buffer size, worker slot
+ * ret: name length
+ *
+ */
+
+static int balance_name(char *name, int size, int slot)
+{
+    return snprintf(name, size, BALANCE_NAME, balanceshm->owner, slot);
+}
+
+/*
+ * fun: publish loop utilization and movable clients, move clients when
+ *      master ordered
+ * arg: not used
+ * ret: success 0, error -1
+ *
+ */
+
+static int balance_timer(unsigned long arg)
+{
+    int fd, move, to, n;
+    int64_t wall, idle;
+    uint64_t now_idle;
+    char name[64];
+    uint64_t now;
+    balance_worker_t *w = &(balanceshm->worker[balance_slot]);
+
+    now = timer_us();
+    now_idle = handler_idle();
+
+    wall = now - last_us;
+    idle = now_idle - last_idle;
+
+    if(wall > 0){
+        w->busy = (idle >= wall) ? 0 : (wall - idle) * 1000 / wall;
+    }
+    w->idle = conn_idle_movable();
+
+    last_us = now;
+    last_idle = now_idle;
+
+    if( (move = __sync_lock_test_and_set(&(w->move), 0)) <= 0 ){
+        return 0;
+    }
+
+    to = w->to;
+    if( (to == balance_slot) || (to < 0) || (to >= MAX_WORKER) ){
+        return 0;
+    }
+
+    balance_name(name, sizeof(name), to);
+    if( (fd = connect_unix(name)) < 0 ){
+        log(g_log, "connect worker %d error\n", to);
+        return -1;
+    }
+
+    n = conn_handoff(move, balance_send, &fd);
+    close(fd);
+
+    log(g_log, "move %d of %d idle clients to worker %d\n", n, move, to);
+
+    return 0;
+}
+
+/*
+ * fun: pass client fd and session to the target worker
+ * arg: connection struct pointer, pointer to worker socket fd
+ * ret: success 0, error -1
+ *
+ */
+
+static int balance_send(conn_t *c, void *arg)
+{
+    balance_msg_t msg;
+    cli_conn_t *cli = c->cli;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.connid = c->connid;
+    msg.ip = cli->ip;
+    msg.port = cli->port;
+    msg.route = c->route;
+    snprintf(msg.curdb, sizeof(msg.curdb), "%s", c->curdb);
+
+    if(send_fd(*(int *)arg, &msg, sizeof(msg), cli->fd) < 0){
+        log_err(g_log, "conn:%u send to worker error\n", c->connid);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * fun: accept connection from a worker moving clients
+ * arg: listen fd, arg(not used)
+ * ret: success 0, error -1
+ *
+ */
+
+static int balance_accept_cb(int listenfd, void *arg)
+{
+    int fd;
+
+    while( (fd = accept(listenfd, NULL, NULL)) >= 0 ){
+        if( (setnonblock(fd) < 0) || \
+            (add_handler(fd, EPOLLIN, balance_peer_cb, NULL) < 0) ){
+            log(g_log, "balance peer fd[%d] init fail\n", fd);
+            close(fd);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * fun: adopt clients moved by another worker
+ * arg: peer fd, arg(not used)
+ * ret: success 0, error -1
+ *
+ */
+
+static int balance_peer_cb(int fd, void *arg)
+{
+    int n, passfd;
+    balance_msg_t msg;
+    conn_t *c;
+
+    while( (n = recv_fd(fd, &msg, sizeof(msg), &passfd)) > 0 ){
+        if( (n != sizeof(msg)) || (passfd < 0) ){
+            log(g_log, "balance message size %d error\n", n);
+            if(passfd >= 0){
+                close(passfd);
+            }
+            continue;
+        }
+
+        msg.curdb[sizeof(msg.curdb) - 1] = '\0';
+        if( (c = conn_adopt(passfd, msg.ip, msg.port, \
+                                        msg.curdb, msg.route)) != NULL ){
+            log(g_log, "conn:%u adopted from conn:%u\n", c->connid, msg.connid);
+        }
+    }
+
+    if(n < 0){
+        del_handler(fd);
+        close(fd);
+    }
+
+    return 0;
+}
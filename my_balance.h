@@ -0,0 +1,12 @@
+#ifndef _MY_BALANCE_H_
+#define _MY_BALANCE_H_
+
+#include <sys/types.h>
+
+int my_balance_shm_init(void);
+int my_balance_shm_release(pid_t pid);
+int my_balance_check(void);
+
+int my_balance_init(void);
+
+#endif
@@ -0,0 +1,880 @@
+/*
+ * Copyright 2011-2013 Alibaba Group Holding Limited. All rights reserved.
+ * Use and distribution licensed under the GPL license.
+ *
+ * Authors: XiaoJinliang <xiaoshi.xjl@taobao.com>
+ *
+ */
+
+/*
+ * binlog process, registers to master as a replica and tails its binlog
+ *
+ * row events are mapped to the table of their TABLE_MAP event, statement
+ * events are parsed like client writes, and versions of written tables are
+ * bumped in the result cache shared memory. the process uses blocking io,
+ * it is forked by master process and restarted when it exits.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <log.h>
+#include "my_binlog.h"
+#include "my_buf.h"
+#include "my_protocol.h"
+#include "my_cache.h"
+#include "my_conf.h"
+#include "mysql_com.h"
+#include "passwd.h"
+
+extern log_t *g_log;
+extern struct conf_t g_conf;
+extern volatile int g_usr1_reload;
+
+#define BINLOG_HEADER_SIZE 19
+#define BINLOG_TABLE_MAP 1024
+#define BINLOG_DUMMY_TABLE_ID 0x00ffffff
+
+enum{
+    BINLOG_QUERY_EVENT = 2,
+    BINLOG_ROTATE_EVENT = 4,
+    BINLOG_FORMAT_DESCRIPTION_EVENT = 15,
+    BINLOG_TABLE_MAP_EVENT = 19,
+    BINLOG_PRE_GA_WRITE_ROWS_EVENT = 20,
+    BINLOG_PRE_GA_UPDATE_ROWS_EVENT = 21,
+    BINLOG_PRE_GA_DELETE_ROWS_EVENT = 22,
+    BINLOG_WRITE_ROWS_EVENT_V1 = 23,
+    BINLOG_UPDATE_ROWS_EVENT_V1 = 24,
+    BINLOG_DELETE_ROWS_EVENT_V1 = 25,
+    BINLOG_WRITE_ROWS_EVENT = 30,
+    BINLOG_UPDATE_ROWS_EVENT = 31,
+    BINLOG_DELETE_ROWS_EVENT = 32,
+    BINLOG_PARTIAL_UPDATE_ROWS_EVENT = 39
+};
+
+typedef struct{
+    int used;
+    uint64_t id;
+    uint32_t slot;
+} binlog_table_t;
+
+static buf_t binlog_buf;
+static my_conf_t binlog_myconf;
+static my_node_conf_t master;
+
+static char binlog_file[256];
+static uint32_t binlog_pos;
+static int binlog_up;
+
+static int checksum_len;
+static int table_id_len;
+static binlog_table_t table_map[BINLOG_TABLE_MAP];
+
+static void binlog_work(void);
+static int binlog_connect(buf_t *buf);
+static int binlog_sock(const char *host, const char *port);
+static int binlog_readn(int fd, char *ptr, size_t len);
+static int binlog_read(int fd, buf_t *buf);
+static int binlog_write(int fd, buf_t *buf);
+static int binlog_error(buf_t *buf, const char *what);
+static int binlog_query(int fd, buf_t *buf, const char *sql, char *row, int size);
+static int binlog_master_status(int fd, buf_t *buf);
+static int binlog_dump(int fd, buf_t *buf);
+static int binlog_event(char *ev, uint32_t len);
+static int binlog_format_desc(char *ev, uint32_t len);
+static int binlog_rows(char *body, uint32_t len);
+static int binlog_table_map(char *body, uint32_t len);
+static int binlog_statement(char *body, uint32_t len);
+
+/*
+ * fun: fork binlog process
+ * arg:
+ * ret: parent return pid of binlog process, child never return
+ *
+ */
+
+pid_t my_binlog_start(void)
+{
+    pid_t pid;
+
+    while( (pid = fork()) < 0 ){
+        log_err(g_log, "fork error\n");
+        sleep(3);
+    }
+
+    if(pid == 0){
+        binlog_work();
+        exit(-1);
+    }
+
+    return pid;
+}
+
+/*
+ * fun: binlog process loop, reconnect to master when stream breaks
+ * arg:
+ * ret: it should not return
+ *
+ */
+
+static void binlog_work(void)
+{
+    int fd;
+    struct timeval tv;
+
+    if( (g_log = log_init(g_conf.log, my_conf_loglevel())) == NULL ){
+        fprintf(stderr, "log init error\n");
+        exit(-1);
+    }
+
+    buf_init(&binlog_buf);
+
+    while(1){
+        g_usr1_reload = 0;
+
+        if( (fd = binlog_connect(&binlog_buf)) >= 0 ){
+            // heartbeat keeps the stream alive, so silence means master is gone
+            if(g_conf.binlog_heartbeat > 0){
+                tv.tv_sec = g_conf.binlog_heartbeat * 3;
+                tv.tv_usec = 0;
+                setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            }
+
+            binlog_dump(fd, &binlog_buf);
+            close(fd);
+        }
+
+        if(binlog_up){
+            binlog_up = 0;
+            my_cache_binlog_set(0);
+            log(g_log, "binlog stream of %s:%s stopped at %s:%u\n", \
+                        master.host, master.port, binlog_file, binlog_pos);
+        }
+
+        buf_reset(&binlog_buf);
+        sleep(3);
+    }
+}
+
+/*
+ * fun: connect and login master, then request binlog stream
+ * arg: buffer
+ * ret: success return fd, error -1
+ *
+ */
+
+static int binlog_connect(buf_t *buf)
+{
+    int i, n, fd = -1, len;
+    char message[21], token[20], host[64], sql[128], row[256], *val;
+    uint64_t vlen;
+    uint8_t res;
+    my_auth_init_t init;
+    cli_auth_login_t login;
+    my_register_slave_t reg;
+    my_binlog_dump_t dump;
+
+    if( (mysql_conf_parse(g_conf.mysql_conf, &binlog_myconf) < 0) || \
+                                    (binlog_myconf.mcount < 1) ){
+        log(g_log, "mysql conf %s parse error\n", g_conf.mysql_conf);
+        return -1;
+    }
+
+    // binlog position is only meaningful on the same master
+    if( strcmp(master.host, binlog_myconf.master[0].host) || \
+        strcmp(master.port, binlog_myconf.master[0].port) ){
+        binlog_file[0] = '\0';
+        binlog_pos = 0;
+    }
+    master = binlog_myconf.master[0];
+
+    if( (fd = binlog_sock(master.host, master.port)) < 0 ){
+        goto end;
+    }
+
+    // handshake
+    if( (binlog_read(fd, buf) < 0) || (parse_init(buf, &init) < 0) ){
+        log(g_log, "read init packet from %s:%s error\n", master.host, master.port);
+        goto end;
+    }
+
+    memcpy(message, init.scram, 8);
+    memcpy(message + 8, init.plug, 12);
+    message[20] = '\0';
+
+    login.pktno = 1;
+    login.client_flags = init.cap & (CLIENT_LONG_PASSWORD | CLIENT_LONG_FLAG | \
+        CLIENT_PROTOCOL_41 | CLIENT_TRANSACTIONS | CLIENT_SECURE_CONNECTION);
+    login.max_pkt_size = 16777216;
+    login.charset = init.lang;
+    strncpy(login.user, master.user, sizeof(login.user) - 1);
+    login.user[sizeof(login.user) - 1] = '\0';
+    if(master.pass[0] == '\0'){
+        login.scram[0] = 0;
+    } else {
+        login.scram[0] = 20;
+        scramble(token, message, master.pass);
+        memcpy(login.scram + 1, token, 20);
+    }
+    login.db[0] = '\0';
+
+    make_login(buf, &login);
+    if( (binlog_write(fd, buf) < 0) || (binlog_read(fd, buf) < 1) ){
+        goto end;
+    }
+
+    res = buf->ptr[HEADER_SIZE];
+    if(res == 0xff){
+        binlog_error(buf, "login");
+        goto end;
+    } else if(res != 0) {
+        log(g_log, "login %s:%s error, auth method switch not supported\n", \
+                                                    master.host, master.port);
+        goto end;
+    }
+
+    // events keep the checksum of master, fake rotate event comes before
+    // format description so checksum must be known in advance
+    checksum_len = 0;
+    if( (n = binlog_query(fd, buf, "SELECT @@global.binlog_checksum", \
+                                                row, sizeof(row))) < 0 ){
+        // servers before 5.6.1 have no checksum
+        if(buf->used == 0){
+            goto end;
+        }
+    } else if(n > 0) {
+        if( (parse_row_value(row, n, 0, &val, &vlen) == 0) && \
+                        (vlen == 5) && (!strncasecmp(val, "CRC32", 5)) ){
+            checksum_len = 4;
+        }
+        if(binlog_query(fd, buf, "SET @master_binlog_checksum = @@global.binlog_checksum", \
+                                                                NULL, 0) < 0){
+            goto end;
+        }
+    }
+
+    // heartbeat period in nanoseconds
+    if(g_conf.binlog_heartbeat > 0){
+        snprintf(sql, sizeof(sql), "SET @master_heartbeat_period = %llu", \
+                (unsigned long long)g_conf.binlog_heartbeat * 1000000000ULL);
+        if(binlog_query(fd, buf, sql, NULL, 0) < 0){
+            goto end;
+        }
+    }
+
+    if( (binlog_file[0] == '\0') && (binlog_master_status(fd, buf) < 0) ){
+        goto end;
+    }
+
+    // register as replica, then request the stream
+    reg.pktno = 0;
+    reg.server_id = g_conf.binlog_server_id;
+    if(gethostname(host, sizeof(host)) < 0){
+        strcpy(host, "myrelay");
+    }
+    host[sizeof(host) - 1] = '\0';
+    len = strlen(host);
+    len = (len > sizeof(reg.host) - 1) ? sizeof(reg.host) - 1 : len;
+    memcpy(reg.host, host, len);
+    reg.host[len] = '\0';
+    reg.user[0] = '\0';
+    reg.pass[0] = '\0';
+    reg.port = atoi(g_conf.port);
+
+    make_register_slave(buf, &reg);
+    if( (binlog_write(fd, buf) < 0) || (binlog_read(fd, buf) < 1) ){
+        goto end;
+    }
+    if((uint8_t)buf->ptr[HEADER_SIZE] == 0xff){
+        binlog_error(buf, "register slave");
+        goto end;
+    }
+
+    dump.pktno = 0;
+    dump.pos = binlog_pos;
+    dump.flags = 0;
+    dump.server_id = g_conf.binlog_server_id;
+    strncpy(dump.file, binlog_file, sizeof(dump.file) - 1);
+    dump.file[sizeof(dump.file) - 1] = '\0';
+
+    make_binlog_dump(buf, &dump);
+    if(binlog_write(fd, buf) < 0){
+        goto end;
+    }
+
+    for(i = 0; i < BINLOG_TABLE_MAP; i++){
+        table_map[i].used = 0;
+    }
+    table_id_len = 6;
+
+    log(g_log, "binlog dump %s:%s from %s:%u\n", \
+                master.host, master.port, binlog_file, binlog_pos);
+
+    return fd;
+
+end:
+    if(fd >= 0){
+        close(fd);
+    }
+
+    return -1;
+}
+
+/*
+ * fun: make blocking tcp connection
+ * arg: host, port
+ * ret: success return fd, error -1
+ *
+ */
+
+static int binlog_sock(const char *host, const char *port)
+{
+    int fd, res;
+    struct addrinfo hints, *ai, *p;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if( (res = getaddrinfo(host, port, &hints, &ai)) != 0 ){
+        log(g_log, "getaddrinfo %s:%s error, %s\n", host, port, gai_strerror(res));
+        return -1;
+    }
+
+    fd = -1;
+    for(p = ai; p; p = p->ai_next){
+        if( (fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0 ){
+            continue;
+        }
+        if(connect(fd, p->ai_addr, p->ai_addrlen) == 0){
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+
+    freeaddrinfo(ai);
+
+    if(fd < 0){
+        log(g_log, "connect %s:%s error\n", host, port);
+    }
+
+    return fd;
+}
+
+/*
+ * fun: read exactly len bytes
+ * arg: fd, buffer, length
+ * ret: success 0, error -1
+ *
+ */
+
+static int binlog_readn(int fd, char *ptr, size_t len)
+{
+    ssize_t n;
+
+    while(len > 0){
+        n = read(fd, ptr, len);
+        if(n < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            log_strerr(g_log, "read master %s:%s error\n", master.host, master.port);
+            return -1;
+        } else if(n == 0) {
+            log(g_log, "master %s:%s closed\n", master.host, master.port);
+            return -1;
+        }
+
+        ptr += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/*
+ * fun: read one packet, continuation packets of 16M are joined
+ * arg: fd, buffer
+ * ret: success return payload length, error -1
+ *
+ */
+
+static int binlog_read(int fd, buf_t *buf)
+{
+    char header[HEADER_SIZE];
+    uint32_t pktlen;
+    size_t total = 0;
+
+    buf_reset(buf);
+
+    do{
+        if(binlog_readn(fd, header, HEADER_SIZE) < 0){
+            return -1;
+        }
+
+        pktlen = 0;
+        memcpy(&pktlen, header, 3);
+
+        if(buf_realloc(buf, HEADER_SIZE + total + pktlen) == NULL){
+            log_err(g_log, "buf_realloc error\n");
+            return -1;
+        }
+        if(total == 0){
+            memcpy(buf->ptr, header, HEADER_SIZE);
+        }
+
+        if(binlog_readn(fd, buf->ptr + HEADER_SIZE + total, pktlen) < 0){
+            return -1;
+        }
+
+        total += pktlen;
+        buf->used = HEADER_SIZE + total;
+    } while(pktlen == 0xffffff);
+
+    return total;
+}
+
+/*
+ * fun: write whole buffer
+ * arg: fd, buffer
+ * ret: success 0, error -1
+ *
+ */
+
+static int binlog_write(int fd, buf_t *buf)
+{
+    ssize_t n;
+    size_t pos = 0;
+
+    while(pos < buf->used){
+        n = write(fd, buf->ptr + pos, buf->used - pos);
+        if(n < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            log_strerr(g_log, "write master %s:%s error\n", master.host, master.port);
+            return -1;
+        }
+        pos += n;
+    }
+
+    return 0;
+}
+
+/*
+ * fun: log error packet
+ * arg: buffer with error packet, what was requested
+ * ret: always return -1
+ *
+ */
+
+static int binlog_error(buf_t *buf, const char *what)
+{
+    uint16_t err = 0;
+    int len = buf->used - HEADER_SIZE;
+    char *ptr = buf->ptr + HEADER_SIZE;
+
+    if(len >= 3){
+        memcpy(&err, ptr + 1, 2);
+    }
+
+    // skip marker, error code and sql state
+    if(len >= 9){
+        ptr += 9;
+        len -= 9;
+    } else {
+        len = 0;
+    }
+
+    log(g_log, "%s on %s:%s error[%u], %.*s\n", \
+            what, master.host, master.port, err, len, ptr);
+
+    return -1;
+}
+
+/*
+ * fun: run a query, the first row is copied out
+ * arg: fd, buffer, sql, row buffer, row buffer size
+ * ret: success return row length, 0 without row, error -1 and buffer is
+ *      empty if the connection broke
+ *
+ */
+
+static int binlog_query(int fd, buf_t *buf, const char *sql, char *row, int size)
+{
+    int n, rlen = 0;
+    uint8_t first;
+    cli_com_t com;
+
+    com.pktno = 0;
+    com.comno = COM_QUERY;
+    com.len = strlen(sql);
+    memcpy(com.arg, sql, com.len);
+
+    make_com(buf, &com);
+    if( (binlog_write(fd, buf) < 0) || ((n = binlog_read(fd, buf)) < 1) ){
+        buf->used = 0;
+        return -1;
+    }
+
+    first = buf->ptr[HEADER_SIZE];
+    if(first == 0){
+        return 0;
+    } else if(first == 0xff) {
+        return binlog_error(buf, sql);
+    }
+
+    // column definitions, then rows, each ends with eof
+    do{
+        if( (n = binlog_read(fd, buf)) < 1 ){
+            buf->used = 0;
+            return -1;
+        }
+    } while( !(((uint8_t)buf->ptr[HEADER_SIZE] == 0xfe) && (n < 9)) );
+
+    while(1){
+        if( (n = binlog_read(fd, buf)) < 1 ){
+            buf->used = 0;
+            return -1;
+        }
+
+        first = buf->ptr[HEADER_SIZE];
+        if( (first == 0xfe) && (n < 9) ){
+            break;
+        } else if(first == 0xff) {
+            return binlog_error(buf, sql);
+        }
+
+        if( row && (rlen == 0) && (n <= size) ){
+            memcpy(row, buf->ptr + HEADER_SIZE, n);
+            rlen = n;
+        }
+    }
+
+    return rlen;
+}
+
+/*
+ * fun: get current binlog position of master
+ * arg: fd, buffer
+ * ret: success 0, error -1
+ *
+ */
+
+static int binlog_master_status(int fd, buf_t *buf)
+{
+    int n;
+    char row[1024], pos[32], *val;
+    uint64_t vlen;
+
+    if( (n = binlog_query(fd, buf, "SHOW MASTER STATUS", row, sizeof(row))) < 0 ){
+        // renamed since mysql 8.4
+        if( (buf->used == 0) || ((n = binlog_query(fd, buf, \
+                    "SHOW BINARY LOG STATUS", row, sizeof(row))) < 0) ){
+            return -1;
+        }
+    }
+
+    if(n == 0){
+        log(g_log, "master %s:%s binlog is not enabled\n", master.host, master.port);
+        return -1;
+    }
+
+    if( (parse_row_value(row, n, 0, &val, &vlen) != 0) || \
+                                (vlen >= sizeof(binlog_file)) ){
+        return -1;
+    }
+    memcpy(binlog_file, val, vlen);
+    binlog_file[vlen] = '\0';
+
+    if( (parse_row_value(row, n, 1, &val, &vlen) != 0) || (vlen >= sizeof(pos)) ){
+        binlog_file[0] = '\0';
+        return -1;
+    }
+    memcpy(pos, val, vlen);
+    pos[vlen] = '\0';
+    binlog_pos = strtoul(pos, NULL, 10);
+
+    return 0;
+}
+
+/*
+ * fun: read binlog stream until it breaks
+ * arg: fd, buffer
+ * ret: always return -1
+ *
+ */
+
+static int binlog_dump(int fd, buf_t *buf)
+{
+    int n;
+    uint8_t first;
+
+    while(1){
+        if( (n = binlog_read(fd, buf)) < 1 ){
+            return -1;
+        }
+
+        first = buf->ptr[HEADER_SIZE];
+        if(first == 0xff){
+            return binlog_error(buf, "binlog dump");
+        } else if( (first == 0xfe) && (n < 9) ) {
+            log(g_log, "binlog stream of %s:%s ended\n", master.host, master.port);
+            return -1;
+        }
+
+        if(!binlog_up){
+            binlog_up = 1;
+            my_cache_binlog_set(1);
+            log(g_log, "binlog stream of %s:%s started\n", master.host, master.port);
+        }
+
+        if(binlog_event(buf->ptr + HEADER_SIZE + 1, n - 1) < 0){
+            return -1;
+        }
+
+        // master switched by reload, restart from the new one
+        if(g_usr1_reload){
+            g_usr1_reload = 0;
+            if( (mysql_conf_parse(g_conf.mysql_conf, &binlog_myconf) == 0) && \
+                (binlog_myconf.mcount > 0) && \
+                ( strcmp(master.host, binlog_myconf.master[0].host) || \
+                  strcmp(master.port, binlog_myconf.master[0].port) ) ){
+                log(g_log, "master changed, restart binlog stream\n");
+                return -1;
+            }
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * fun: handle one binlog event
+ * arg: event, event length
+ * ret: success 0, error -1
+ *
+ */
+
+static int binlog_event(char *ev, uint32_t len)
+{
+    uint8_t type;
+    uint32_t next = 0;
+    uint64_t pos = 0;
+    char *body;
+
+    if(len < BINLOG_HEADER_SIZE){
+        log(g_log, "binlog event too short, len = %u\n", len);
+        return -1;
+    }
+
+    type = ev[4];
+    memcpy(&next, ev + 13, 4);
+
+    if(type == BINLOG_FORMAT_DESCRIPTION_EVENT){
+        return binlog_format_desc(ev, len);
+    }
+
+    if(len < BINLOG_HEADER_SIZE + checksum_len){
+        return -1;
+    }
+    body = ev + BINLOG_HEADER_SIZE;
+    len -= BINLOG_HEADER_SIZE + checksum_len;
+
+    switch(type){
+        case BINLOG_ROTATE_EVENT:
+            if( (len < 8) || (len - 8 >= sizeof(binlog_file)) ){
+                return -1;
+            }
+            memcpy(&pos, body, 8);
+            memcpy(binlog_file, body + 8, len - 8);
+            binlog_file[len - 8] = '\0';
+            binlog_pos = pos;
+            return 0;
+
+        case BINLOG_QUERY_EVENT:
+            binlog_statement(body, len);
+            break;
+
+        case BINLOG_TABLE_MAP_EVENT:
+            binlog_table_map(body, len);
+            break;
+
+        case BINLOG_PRE_GA_WRITE_ROWS_EVENT:
+        case BINLOG_PRE_GA_UPDATE_ROWS_EVENT:
+        case BINLOG_PRE_GA_DELETE_ROWS_EVENT:
+        case BINLOG_WRITE_ROWS_EVENT_V1:
+        case BINLOG_UPDATE_ROWS_EVENT_V1:
+        case BINLOG_DELETE_ROWS_EVENT_V1:
+        case BINLOG_WRITE_ROWS_EVENT:
+        case BINLOG_UPDATE_ROWS_EVENT:
+        case BINLOG_DELETE_ROWS_EVENT:
+        case BINLOG_PARTIAL_UPDATE_ROWS_EVENT:
+            binlog_rows(body, len);
+            break;
+
+        default:
+            break;
+    }
+
+    // artificial events have no position
+    if(next > 0){
+        binlog_pos = next;
+    }
+
+    return 0;
+}
+
+/*
+ * fun: handle format description event, checksum and table id size
+ * arg: event, event length
+ * ret: success 0, error -1
+ *
+ */
+
+static int binlog_format_desc(char *ev, uint32_t len)
+{
+    int major = 0, minor = 0, patch = 0, alg = 0, count;
+    char ver[51];
+    uint8_t *lens;
+
+    // binlog version, server version, create time, header length
+    if(len < BINLOG_HEADER_SIZE + 57){
+        return -1;
+    }
+
+    memcpy(ver, ev + BINLOG_HEADER_SIZE + 2, 50);
+    ver[50] = '\0';
+    sscanf(ver, "%d.%d.%d", &major, &minor, &patch);
+
+    // checksum algorithm follows post header lengths since 5.6.1
+    count = len - BINLOG_HEADER_SIZE - 57;
+    if( (major * 10000 + minor * 100 + patch >= 50601) && (count >= 5) ){
+        alg = (uint8_t)ev[len - 5];
+        count -= 5;
+    }
+    checksum_len = (alg == 1) ? 4 : 0;
+
+    lens = (uint8_t *)(ev + BINLOG_HEADER_SIZE + 57);
+    if( (count >= BINLOG_TABLE_MAP_EVENT) && (lens[BINLOG_TABLE_MAP_EVENT - 1] == 6) ){
+        table_id_len = 4;
+    } else {
+        table_id_len = 6;
+    }
+
+    debug(g_log, "binlog server %s, checksum %d, table id len %d\n", \
+                                    ver, checksum_len, table_id_len);
+
+    return 0;
+}
+
+/*
+ * fun: remember table of table map event
+ * arg: event body, body length
+ * ret: success 0, error -1
+ *
+ */
+
+static int binlog_table_map(char *body, uint32_t len)
+{
+    uint64_t id = 0;
+    uint8_t dblen, tlen;
+    char *db, *name;
+    binlog_table_t *t;
+
+    // table id, flags, db length, db, 0, table length, table, 0
+    if(len < table_id_len + 2 + 1){
+        return -1;
+    }
+    memcpy(&id, body, table_id_len);
+
+    db = body + table_id_len + 2;
+    dblen = *db++;
+    if(len < table_id_len + 2 + 1 + dblen + 1 + 1){
+        return -1;
+    }
+
+    name = db + dblen + 1;
+    tlen = *name++;
+    if(len < table_id_len + 2 + 1 + dblen + 1 + 1 + tlen){
+        return -1;
+    }
+
+    t = &(table_map[id % BINLOG_TABLE_MAP]);
+    t->used = 1;
+    t->id = id;
+    t->slot = my_cache_table_slot(db, dblen, name, tlen);
+
+    return 0;
+}
+
+/*
+ * fun: bump table of row event
+ * arg: event body, body length
+ * ret: success 0, error -1
+ *
+ */
+
+static int binlog_rows(char *body, uint32_t len)
+{
+    uint64_t id = 0;
+    binlog_table_t *t;
+
+    if(len < table_id_len){
+        return -1;
+    }
+    memcpy(&id, body, table_id_len);
+
+    if(id == BINLOG_DUMMY_TABLE_ID){
+        return 0;
+    }
+
+    t = &(table_map[id % BINLOG_TABLE_MAP]);
+    if( t->used && (t->id == id) ){
+        return my_cache_table_bump(t->slot);
+    }
+
+    // table map is lost, do not guess
+    return my_cache_bump_all();
+}
+
+/*
+ * fun: bump tables written by statement of query event
+ * arg: event body, body length
+ * ret: success 0, error -1
+ *
+ */
+
+static int binlog_statement(char *body, uint32_t len)
+{
+    uint8_t dblen;
+    uint16_t vlen;
+    uint32_t skip;
+    char *db;
+
+    // thread id, exec time, db length, error code, status vars length
+    if(len < 13){
+        return -1;
+    }
+    dblen = body[8];
+    memcpy(&vlen, body + 11, 2);
+
+    skip = 13 + vlen + dblen + 1;
+    if(len < skip){
+        return -1;
+    }
+    db = body + 13 + vlen;
+
+    return my_cache_sql_bump(db, dblen, body + skip, len - skip);
+}
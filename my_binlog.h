@@ -0,0 +1,8 @@
+#ifndef _MY_BINLOG_H_
+#define _MY_BINLOG_H_
+
+#include <sys/types.h>
+
+pid_t my_binlog_start(void);
+
+#endif
@@ -0,0 +1,596 @@
+/*
+ * Copyright 2011-2013 Alibaba Group Holding Limited. All rights reserved.
+ * Use and distribution licensed under the GPL license.
+ *
+ * Authors: XiaoJinliang <xiaoshi.xjl@taobao.com>
+ *
+ */
+
+/*
+ * broker process, keeps idle mysql connections given up by workers
+ *
+ * a worker shrinking its pool passes idle connection fds to broker over
+ * SCM_RIGHTS instead of closing them, a worker growing its pool asks
+ * broker first and opens new connections only for those broker has not.
+ * so connections to mysql follow the load instead of the worker number.
+ * broker closes connections idle longer than mysql_idle_timeout. it is
+ * forked by master process and restarted when it exits, workers reach it
+ * by an abstract unix socket named by master pid.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <log.h>
+#include <list.h>
+#include <timer.h>
+#include <handler.h>
+#include <sock.h>
+#include "my_broker.h"
+#include "my_pool.h"
+#include "my_conf.h"
+#include "def.h"
+
+extern log_t *g_log;
+extern struct conf_t g_conf;
+
+#define BROKER_NAME "myrelay.broker.%d"
+
+enum{
+    BROKER_PUT = 1,
+    BROKER_GET,
+    BROKER_GIVE,
+    BROKER_NONE
+};
+
+typedef struct{
+    uint8_t type;
+    uint16_t count;
+    char host[MAX_HOST_LEN];
+    char srv[MAX_SRV_LEN];
+    char curdb[64];
+} broker_msg_t;
+
+typedef struct{
+    struct list_head link;
+    int fd;
+    char curdb[64];
+    time_t time;
+} broker_conn_t;
+
+typedef struct{
+    struct list_head link;
+    struct list_head conn_head;
+    char host[MAX_HOST_LEN];
+    char srv[MAX_SRV_LEN];
+    int count;
+} broker_node_t;
+
+// broker process
+static struct list_head broker_nodes;
+static pid_t broker_owner;
+
+// worker
+static __thread int broker_fd = -1;
+
+static int broker_name(char *name, int size);
+static int broker_send(int fd, broker_msg_t *msg, int passfd);
+static int broker_recv(int fd, broker_msg_t *msg, int *passfd);
+
+static void broker_work(int listenfd);
+static int broker_accept_cb(int listenfd, void *arg);
+static int broker_peer_cb(int fd, void *arg);
+static broker_node_t *broker_node_get(const char *host, const char *srv);
+static int broker_keep(broker_msg_t *msg, int passfd);
+static int broker_give(int fd, broker_msg_t *msg);
+static int broker_expire_timer(unsigned long arg);
+
+static int broker_connect(void);
+static int broker_reply_cb(int fd, void *arg);
+static int broker_reconnect_timer(unsigned long arg);
+
+/*
+ * fun: make broker listen socket, must be called by master process
+ * arg:
+ * ret: success return listen fd, error -1
+ *
+ */
+
+int my_broker_listen(void)
+{
+    char name[64];
+
+    broker_owner = getpid();
+    broker_name(name, sizeof(name));
+
+    return make_unix_listen(name);
+}
+
+/*
+ * fun: make abstract unix socket name of broker
+ * arg: name buffer, buffer size
+ * ret: name length
+ *
+ */
+
+static int broker_name(char *name, int size)
+{
+    return snprintf(name, size, BROKER_NAME, broker_owner);
+}
+
+/*
+ * fun: fork broker process
+ * arg: listen fd
+ * ret: parent return pid of broker process, child never return
+ *
+ */
+
+pid_t my_broker_start(int listenfd)
+{
+    pid_t pid;
+
+    while( (pid = fork()) < 0 ){
+        log_err(g_log, "fork error\n");
+        sleep(3);
+    }
+
+    if(pid == 0){
+        broker_work(listenfd);
+        exit(-1);
+    }
+
+    return pid;
+}
+
+/*
+ * fun: send broker message, with a fd if passfd >= 0
+ * arg: socket fd, message, fd to pass
+ * ret: success 0, error -1
+ *
+ */
+
+static int broker_send(int fd, broker_msg_t *msg, int passfd)
+{
+    return send_fd(fd, msg, sizeof(broker_msg_t), passfd);
+}
+
+/*
+ * fun: receive broker message and the fd passed with it
+ * arg: socket fd, message, passed fd or -1
+ * ret: success 1, no message 0, closed or error -1
+ *
+ */
+
+static int broker_recv(int fd, broker_msg_t *msg, int *passfd)
+{
+    int n;
+
+    if( (n = recv_fd(fd, msg, sizeof(broker_msg_t), passfd)) <= 0 ){
+        return n;
+    }
+
+    if(n != sizeof(broker_msg_t)){
+        log(g_log, "broker message size %d error\n", n);
+        if(*passfd >= 0){
+            close(*passfd);
+            *passfd = -1;
+        }
+        return 0;
+    }
+
+    msg->host[MAX_HOST_LEN - 1] = '\0';
+    msg->srv[MAX_SRV_LEN - 1] = '\0';
+    msg->curdb[sizeof(msg->curdb) - 1] = '\0';
+
+    return 1;
+}
+
+/*
+ * fun: broker process loop
+ * arg: listen fd
+ * ret: it should not return
+ *
+ */
+
+static void broker_work(int listenfd)
+{
+    if( (g_log = log_init(g_conf.log, my_conf_loglevel())) == NULL ){
+        fprintf(stderr, "log init error\n");
+        exit(-1);
+    }
+
+    if( (init_handler(g_conf.max_connections) < 0) || (timer_init() < 0) ){
+        log(g_log, "broker handler or timer init error\n");
+        exit(-1);
+    }
+
+    INIT_LIST_HEAD(&broker_nodes);
+    my_pool_shm_attach();
+
+    if(timer_register(broker_expire_timer, 0, "broker_expire_timer", 1) < 0){
+        log(g_log, "broker_expire_timer register error\n");
+        exit(-1);
+    }
+
+    if(add_handler(listenfd, EPOLLIN, broker_accept_cb, NULL) < 0){
+        log(g_log, "add_handler listenfd[%d] fail\n", listenfd);
+        exit(-1);
+    }
+
+    log(g_log, "broker start\n");
+
+    while(1){
+        epoll_handler(timer_wait(1000));
+        timer();
+    }
+}
+
+/*
+ * fun: accept worker callback
+ * arg: listen fd, arg(not used)
+ * ret: success 0, error -1
+ *
+ */
+
+static int broker_accept_cb(int listenfd, void *arg)
+{
+    int fd;
+
+    while( (fd = accept(listenfd, NULL, NULL)) >= 0 ){
+        if( (setnonblock(fd) < 0) || \
+            (add_handler(fd, EPOLLIN, broker_peer_cb, NULL) < 0) ){
+            log(g_log, "add_handler fd[%d] fail\n", fd);
+            close(fd);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * fun: worker message callback
+ * arg: worker fd, arg(not used)
+ * ret: success 0, error -1
+ *
+ */
+
+static int broker_peer_cb(int fd, void *arg)
+{
+    int res, passfd;
+    broker_msg_t msg;
+
+    while( (res = broker_recv(fd, &msg, &passfd)) > 0 ){
+        if( (msg.type == BROKER_PUT) && (passfd >= 0) ){
+            broker_keep(&msg, passfd);
+        } else if(msg.type == BROKER_GET) {
+            broker_give(fd, &msg);
+        } else if(passfd >= 0) {
+            close(passfd);
+        }
+    }
+
+    if(res < 0){
+        del_handler(fd);
+        close(fd);
+    }
+
+    return 0;
+}
+
+/*
+ * fun: get broker node, alloc it if not exists
+ * arg: host, srv
+ * ret: success return broker node, error return NULL
+ *
+ */
+
+static broker_node_t *broker_node_get(const char *host, const char *srv)
+{
+    struct list_head *pos;
+    broker_node_t *bn;
+
+    list_for_each(pos, &broker_nodes){
+        bn = list_entry(pos, broker_node_t, link);
+        if( (!strcmp(bn->host, host)) && (!strcmp(bn->srv, srv)) ){
+            return bn;
+        }
+    }
+
+    if( (bn = calloc(1, sizeof(broker_node_t))) == NULL ){
+        log_err(g_log, "calloc error\n");
+        return NULL;
+    }
+
+    INIT_LIST_HEAD(&(bn->conn_head));
+    strncpy(bn->host, host, sizeof(bn->host) - 1);
+    strncpy(bn->srv, srv, sizeof(bn->srv) - 1);
+    list_add_tail(&(bn->link), &broker_nodes);
+
+    return bn;
+}
+
+/*
+ * fun: keep idle connection given up by a worker
+ * arg: message, connection fd
+ * ret: success 0, error -1
+ *
+ */
+
+static int broker_keep(broker_msg_t *msg, int passfd)
+{
+    broker_node_t *bn;
+    broker_conn_t *bc;
+
+    if( ((bn = broker_node_get(msg->host, msg->srv)) == NULL) || \
+        ((bc = malloc(sizeof(broker_conn_t))) == NULL) ){
+        close(passfd);
+        return -1;
+    }
+
+    bc->fd = passfd;
+    bc->time = timer_sec();
+    strncpy(bc->curdb, msg->curdb, sizeof(bc->curdb) - 1);
+    bc->curdb[sizeof(bc->curdb) - 1] = '\0';
+
+    // last kept is given first, older ones expire
+    list_add(&(bc->link), &(bn->conn_head));
+    bn->count++;
+    my_pool_shm_set(bn->host, bn->srv, bn->count);
+
+    debug(g_log, "%s:%s keep connection, %d kept\n", \
+                                        bn->host, bn->srv, bn->count);
+
+    return 0;
+}
+
+/*
+ * fun: give kept connections to a worker, answer none for the rest
+ * arg: worker fd, message
+ * ret: connection number given
+ *
+ */
+
+static int broker_give(int fd, broker_msg_t *msg)
+{
+    int given = 0;
+    broker_node_t *bn;
+    broker_conn_t *bc;
+    broker_msg_t reply;
+
+    memset(&reply, 0, sizeof(reply));
+    snprintf(reply.host, sizeof(reply.host), "%s", msg->host);
+    snprintf(reply.srv, sizeof(reply.srv), "%s", msg->srv);
+
+    bn = broker_node_get(msg->host, msg->srv);
+
+    while( (bn != NULL) && (given < msg->count) && \
+                                (!list_empty(&(bn->conn_head))) ){
+        bc = list_first_entry(&(bn->conn_head), broker_conn_t, link);
+
+        reply.type = BROKER_GIVE;
+        reply.count = 1;
+        snprintf(reply.curdb, sizeof(reply.curdb), "%s", bc->curdb);
+        if(broker_send(fd, &reply, bc->fd) < 0){
+            break;
+        }
+
+        list_del(&(bc->link));
+        close(bc->fd);
+        free(bc);
+        bn->count--;
+        given++;
+    }
+
+    if(bn != NULL){
+        my_pool_shm_set(bn->host, bn->srv, bn->count);
+    }
+
+    if(given < msg->count){
+        reply.type = BROKER_NONE;
+        reply.count = msg->count - given;
+        reply.curdb[0] = '\0';
+        broker_send(fd, &reply, -1);
+    }
+
+    log(g_log, "%s:%s give %d of %d connections\n", \
+                            msg->host, msg->srv, given, msg->count);
+
+    return given;
+}
+
+/*
+ * fun: close connections kept longer than mysql idle timeout
+ * arg: not used
+ * ret: success 0, error -1
+ *
+ */
+
+static int broker_expire_timer(unsigned long arg)
+{
+    int count;
+    struct list_head *pos, *p, *m;
+    broker_node_t *bn;
+    broker_conn_t *bc;
+    time_t now = timer_sec();
+
+    list_for_each(pos, &broker_nodes){
+        bn = list_entry(pos, broker_node_t, link);
+        count = 0;
+
+        list_for_each_safe(p, m, &(bn->conn_head)){
+            bc = list_entry(p, broker_conn_t, link);
+            if(now - bc->time > g_conf.mysql_idle_timeout){
+                list_del(p);
+                close(bc->fd);
+                free(bc);
+                bn->count--;
+                count++;
+            }
+        }
+
+        if(count > 0){
+            my_pool_shm_set(bn->host, bn->srv, bn->count);
+            log(g_log, "%s:%s close %d idle connections, %d kept\n", \
+                                    bn->host, bn->srv, count, bn->count);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * fun: connect worker to broker
+ * arg:
+ * ret: success 0, error -1
+ *
+ */
+
+int my_broker_init(void)
+{
+    if(!g_conf.broker){
+        return 0;
+    }
+
+    if(timer_register(broker_reconnect_timer, 0, \
+                                "broker_reconnect_timer", 3) < 0){
+        log(g_log, "broker_reconnect_timer register error\n");
+        return -1;
+    }
+
+    return broker_connect();
+}
+
+/*
+ * fun: connect to broker and wait for its replies
+ * arg:
+ * ret: success 0, error -1
+ *
+ */
+
+static int broker_connect(void)
+{
+    int fd;
+    char name[64];
+
+    broker_name(name, sizeof(name));
+    if( (fd = connect_unix(name)) < 0 ){
+        log(g_log, "connect broker error\n");
+        return -1;
+    }
+
+    if(add_handler(fd, EPOLLIN, broker_reply_cb, NULL) < 0){
+        log(g_log, "add_handler broker fd[%d] fail\n", fd);
+        close(fd);
+        return -1;
+    }
+
+    broker_fd = fd;
+    log(g_log, "broker connected\n");
+
+    return 0;
+}
+
+/*
+ * fun: reconnect to broker when it restarted
+ * arg: not used
+ * ret: success 0, error -1
+ *
+ */
+
+static int broker_reconnect_timer(unsigned long arg)
+{
+    if(broker_fd >= 0){
+        return 0;
+    }
+
+    return broker_connect();
+}
+
+/*
+ * fun: broker reply callback, adopt given connections and open the
+ *      connections broker has not
+ * arg: broker fd, arg(not used)
+ * ret: success 0, error -1
+ *
+ */
+
+static int broker_reply_cb(int fd, void *arg)
+{
+    int res, passfd;
+    broker_msg_t msg;
+
+    while( (res = broker_recv(fd, &msg, &passfd)) > 0 ){
+        if( (msg.type == BROKER_GIVE) && (passfd >= 0) ){
+            my_pool_conn_adopt(msg.host, msg.srv, passfd, msg.curdb);
+        } else if(msg.type == BROKER_NONE) {
+            my_pool_conn_refused(msg.host, msg.srv, msg.count);
+        } else if(passfd >= 0) {
+            close(passfd);
+        }
+    }
+
+    if(res < 0){
+        log(g_log, "broker closed\n");
+        del_handler(fd);
+        close(fd);
+        broker_fd = -1;
+    }
+
+    return 0;
+}
+
+/*
+ * fun: ask broker for idle connections of a mysql node
+ * arg: host, srv, connection number
+ * ret: success 0, broker unavailable -1
+ *
+ */
+
+int my_broker_ask(const char *host, const char *srv, int count)
+{
+    broker_msg_t msg;
+
+    if(broker_fd < 0){
+        return -1;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.type = BROKER_GET;
+    msg.count = count;
+    strncpy(msg.host, host, sizeof(msg.host) - 1);
+    strncpy(msg.srv, srv, sizeof(msg.srv) - 1);
+
+    return broker_send(broker_fd, &msg, -1);
+}
+
+/*
+ * fun: give idle mysql connection to broker, caller still closes its fd
+ * arg: connection fd, host, srv, current db of connection
+ * ret: success 0, broker unavailable -1
+ *
+ */
+
+int my_broker_put(int fd, const char *host, const char *srv, const char *curdb)
+{
+    broker_msg_t msg;
+
+    if(broker_fd < 0){
+        return -1;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.type = BROKER_PUT;
+    strncpy(msg.host, host, sizeof(msg.host) - 1);
+    strncpy(msg.srv, srv, sizeof(msg.srv) - 1);
+    strncpy(msg.curdb, curdb, sizeof(msg.curdb) - 1);
+
+    return broker_send(broker_fd, &msg, fd);
+}
@@ -0,0 +1,13 @@
+#ifndef _MY_BROKER_H_
+#define _MY_BROKER_H_
+
+#include <sys/types.h>
+
+int my_broker_listen(void);
+pid_t my_broker_start(int listenfd);
+
+int my_broker_init(void);
+int my_broker_ask(const char *host, const char *srv, int count);
+int my_broker_put(int fd, const char *host, const char *srv, const char *curdb);
+
+#endif
@@ -0,0 +1,993 @@
+/*
+ * Copyright 2011-2013 Alibaba Group Holding Limited. All rights reserved.
+ * Use and distribution licensed under the GPL license.
+ *
+ * Authors: XiaoJinliang <xiaoshi.xjl@taobao.com>
+ *
+ */
+
+/*
+ * select result cache
+ *
+ * entries are keyed by mmhash64 of session variables, current db and
+ * normalized query, the whole response packet stream is stored in a bounded lru. every entry
+ * records versions of the tables it reads. table versions live in shared
+ * memory mapped before fork, so a write seen by any worker invalidates the
+ * entries of all workers. with binlog enabled the binlog process bumps
+ * the same versions for writes that do not pass through the proxy.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <list.h>
+#include <log.h>
+#include <hash.h>
+#include <timer.h>
+#include <common.h>
+#include "my_cache.h"
+#include "my_resp.h"
+#include "my_sql.h"
+#include "my_buf.h"
+#include "my_pool.h"
+#include "my_local.h"
+#include "conn_pool.h"
+#include "mysql_com.h"
+#include "my_conf.h"
+
+extern log_t *g_log;
+extern struct conf_t g_conf;
+
+#define CACHE_BUCKET (16 * 1024)
+#define CACHE_MAX_RULE 256
+#define CACHE_MAX_TEXT (8 * 1024)
+
+enum{
+    CACHE_RULE_TABLE = 0,
+    CACHE_RULE_QUERY
+};
+
+typedef struct{
+    int type;
+    int ttl;
+    int len;
+    char pattern[256];
+} cache_rule_t;
+
+typedef struct{
+    uint64_t global;
+    uint32_t binlog;
+    uint64_t table[CACHE_TABLE_SLOT];
+} cache_shm_t;
+
+typedef struct{
+    int ntab;
+    uint32_t tab[CACHE_MAX_TABLE];
+    uint64_t ver[CACHE_MAX_TABLE];
+    uint64_t global;
+} cache_ver_t;
+
+typedef struct{
+    uint64_t key;
+    char *text;
+    int tlen;
+    char *data;
+    size_t len;
+    time_t expire;
+    cache_ver_t ver;
+    struct list_head hlink;
+    struct list_head lru;
+} cache_entry_t;
+
+typedef struct{
+    int active;
+    uint64_t key;
+    char *text;
+    int tlen;
+    int ttl;
+    cache_ver_t ver;
+    char *data;
+    size_t len;
+    size_t size;
+    my_resp_t resp;
+
+    int nwtab;
+    int woverflow;
+    uint32_t wtab[CACHE_MAX_TABLE];
+} cache_conn_t;
+
+static cache_shm_t *shm = NULL;
+
+static __thread struct list_head *bucket = NULL;
+static __thread struct list_head lru_head;
+static __thread size_t mem_used;
+static __thread int entry_count;
+
+static __thread cache_rule_t rule[CACHE_MAX_RULE];
+static __thread int rule_count;
+
+static __thread uint64_t hits, misses, stores, evicts;
+
+static const char *cache_write[] = {
+    "insert", "update", "delete", "replace", "truncate", "alter", "drop",
+    "create", "rename", "load", "call", "do", "handler", "import",
+    NULL
+};
+
+static int cache_status_timer(unsigned long arg);
+static cache_conn_t *cache_conn_get(conn_t *c);
+static int cache_query_tables(conn_t *c, const char *sql, int len, \
+                                cache_ver_t *ver, int *ttl);
+static int cache_ver_get(cache_ver_t *ver);
+static int cache_ver_equal(cache_ver_t *a, cache_ver_t *b);
+static cache_entry_t *cache_lookup(uint64_t key, char *text, int tlen);
+static int cache_store(cache_conn_t *cc);
+static int cache_evict(cache_entry_t *e);
+static int cache_capture_drop(cache_conn_t *cc);
+static int cache_write_bump(cache_conn_t *cc);
+
+/*
+ * fun: init table versions in shared memory, must be called before fork
+ * arg:
+ * ret: success 0, error -1
+ *
+ */
+
+int my_cache_shm_init(void)
+{
+    void *ptr;
+
+    if(!g_conf.cache){
+        return 0;
+    }
+
+    ptr = mmap(NULL, sizeof(cache_shm_t), PROT_READ | PROT_WRITE, \
+                                    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(ptr == MAP_FAILED){
+        log_err(g_log, "mmap error\n");
+        return -1;
+    }
+
+    shm = ptr;
+    memset(shm, 0, sizeof(cache_shm_t));
+
+    return 0;
+}
+
+/*
+ * fun: init result cache of worker
+ * arg:
+ * ret: success 0, error -1
+ *
+ */
+
+int my_cache_init(void)
+{
+    int i, res = 0;
+
+    if( (!g_conf.cache) || (shm == NULL) ){
+        return 0;
+    }
+
+    if( (bucket = malloc(sizeof(struct list_head) * CACHE_BUCKET)) == NULL ){
+        log_err(g_log, "malloc error\n");
+        return -1;
+    }
+
+    for(i = 0; i < CACHE_BUCKET; i++){
+        INIT_LIST_HEAD(bucket + i);
+    }
+    INIT_LIST_HEAD(&lru_head);
+
+    mem_used = 0;
+    entry_count = 0;
+
+    if(my_cache_rule_load(g_conf.cache_conf) < 0){
+        log(g_log, "cache rule %s load error\n", g_conf.cache_conf);
+    }
+
+    res = timer_register(cache_status_timer, 0, "cache_status_timer", 60);
+    if(res < 0){
+        log(g_log, "cache_status_timer register error\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * fun: load cache rules, "table ttl name" or "query ttl sql prefix"
+ * arg: rule config path
+ * ret: success 0, error -1
+ *
+ */
+
+int my_cache_rule_load(const char *conf)
+{
+    int line = 0, ttl, n, count = 0;
+    FILE *fp;
+    char buf[1024], type[64], *ptr;
+    cache_rule_t *r;
+
+    if( (fp = fopen(conf, "r")) == NULL ){
+        log(g_log, "fopen %s error\n", conf);
+        rule_count = 0;
+        return -1;
+    }
+
+    while(fgets(buf, sizeof(buf), fp)){
+        line++;
+        trim(buf);
+        if( (*buf == '#') || (*buf == '\0') ){
+            continue;
+        }
+
+        if( (sscanf(buf, "%63s %d %n", type, &ttl, &n) < 2) || (buf[n] == '\0') ){
+            log(g_log, "cache rule line[%d] error\n", line);
+            continue;
+        }
+
+        if(count >= CACHE_MAX_RULE){
+            log(g_log, "cache rule line[%d] error, rule num limit\n", line);
+            break;
+        }
+
+        r = &(rule[count]);
+        r->ttl = ttl;
+        ptr = buf + n;
+
+        if(!strcmp(type, "table")){
+            r->type = CACHE_RULE_TABLE;
+            strncpy(r->pattern, ptr, sizeof(r->pattern) - 1);
+            r->pattern[sizeof(r->pattern) - 1] = '\0';
+            r->len = strlen(r->pattern);
+        } else if(!strcmp(type, "query")) {
+            r->type = CACHE_RULE_QUERY;
+            if( (r->len = sql_normalize(ptr, strlen(ptr), \
+                                    r->pattern, sizeof(r->pattern))) < 0 ){
+                log(g_log, "cache rule line[%d] error, query too long\n", line);
+                continue;
+            }
+        } else {
+            log(g_log, "cache rule line[%d] error, unknown type %s\n", line, type);
+            continue;
+        }
+
+        count++;
+    }
+
+    fclose(fp);
+
+    rule_count = count;
+    log(g_log, "cache rule %s loaded, %d rules\n", conf, count);
+
+    return 0;
+}
+
+/*
+ * fun: get version slot of table
+ * arg: db, db length, table, table length
+ * ret: slot index
+ *
+ */
+
+uint32_t my_cache_table_slot(const char *db, int dblen, const char *name, int len)
+{
+    int i, n = 0;
+    char buf[256];
+
+    for(i = 0; (i < dblen) && (n < sizeof(buf) - 1); i++){
+        buf[n++] = tolower((unsigned char)db[i]);
+    }
+    if(n < sizeof(buf) - 1){
+        buf[n++] = '.';
+    }
+    for(i = 0; (i < len) && (n < sizeof(buf)); i++){
+        buf[n++] = tolower((unsigned char)name[i]);
+    }
+
+    return mmhash64(buf, n) % CACHE_TABLE_SLOT;
+}
+
+/*
+ * fun: bump table version, entries reading the table become invalid
+ * arg: slot index
+ * ret: success 0, error -1
+ *
+ */
+
+int my_cache_table_bump(uint32_t slot)
+{
+    if( (shm == NULL) || (slot >= CACHE_TABLE_SLOT) ){
+        return -1;
+    }
+
+    __sync_fetch_and_add(&(shm->table[slot]), 1);
+
+    return 0;
+}
+
+/*
+ * fun: bump global version, all entries become invalid
+ * arg:
+ * ret: success 0, error -1
+ *
+ */
+
+int my_cache_bump_all(void)
+{
+    if(shm == NULL){
+        return -1;
+    }
+
+    __sync_fetch_and_add(&(shm->global), 1);
+
+    return 0;
+}
+
+/*
+ * fun: set binlog tailing state, entries cached before are dropped
+ * arg: binlog is tailed 1, not 0
+ * ret: success 0, error -1
+ *
+ */
+
+int my_cache_binlog_set(int up)
+{
+    if(shm == NULL){
+        return -1;
+    }
+
+    shm->binlog = up;
+    __sync_fetch_and_add(&(shm->global), 1);
+
+    return 0;
+}
+
+/*
+ * fun: invalidate tables written by statement from binlog
+ * arg: default db, db length, statement, statement length
+ * ret: success 0, error -1
+ *
+ */
+
+int my_cache_sql_bump(const char *db, int dblen, const char *sql, int len)
+{
+    int i, n;
+    sql_lexer_t lex;
+    sql_token_t tk;
+    sql_table_t tables[CACHE_MAX_TABLE];
+
+    sql_lex_init(&lex, sql, len);
+    if( (sql_lex_next(&lex, &tk) != TK_IDENT) || (!sql_tk_in(&tk, cache_write)) ){
+        return 0;
+    }
+
+    n = sql_tables(sql, len, tables, CACHE_MAX_TABLE);
+    if( (n == 0) || (n > CACHE_MAX_TABLE) ){
+        return my_cache_bump_all();
+    }
+
+    for(i = 0; i < n; i++){
+        if(tables[i].db.len > 0){
+            my_cache_table_bump(my_cache_table_slot(tables[i].db.ptr, \
+                tables[i].db.len, tables[i].name.ptr, tables[i].name.len));
+        } else {
+            my_cache_table_bump(my_cache_table_slot(db, dblen, \
+                tables[i].name.ptr, tables[i].name.len));
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * fun: lookup result cache, capture the response on miss
+ * arg: connection, client query is in connection buffer
+ * ret: hit 1 and response is copied into connection buffer, miss 0
+ *
+ */
+
+int my_cache_get(conn_t *c)
+{
+    int ttl, len, tlen, dblen;
+    uint32_t pktlen;
+    char *sql, text[CACHE_MAX_TEXT];
+    uint64_t key, sess;
+    buf_t *buf = &(c->buf);
+    cache_ver_t ver;
+    cache_entry_t *e;
+    cache_conn_t *cc;
+
+    if( (bucket == NULL) || (c->comno != COM_QUERY) ){
+        return 0;
+    }
+
+    // writes from other clients are invisible while binlog is not tailed
+    if(g_conf.binlog && (!shm->binlog)){
+        return 0;
+    }
+
+    if(c->my && my_conn_ctx_is_dirty(c->my)){
+        return 0;
+    }
+
+    if(buf->used < HEADER_SIZE + 1){
+        return 0;
+    }
+
+    pktlen = 0;
+    memcpy(&pktlen, buf->ptr, 3);
+    if( (pktlen < 1) || (pktlen + HEADER_SIZE > buf->used) ){
+        return 0;
+    }
+
+    sql = buf->ptr + HEADER_SIZE + 1;
+    len = pktlen - 1;
+
+    if(cache_query_tables(c, sql, len, &ver, &ttl) <= 0){
+        return 0;
+    }
+
+    // key text: session key, db '\0' normalized query
+    sess = my_local_sess_key(c);
+    memcpy(text, &sess, sizeof(sess));
+    dblen = strlen(c->curdb);
+    memcpy(text + sizeof(sess), c->curdb, dblen + 1);
+    tlen = sizeof(sess) + dblen + 1;
+    if( (len = sql_normalize(sql, len, text + tlen, sizeof(text) - tlen)) < 0 ){
+        return 0;
+    }
+    tlen += len;
+    key = mmhash64(text, tlen);
+
+    if( (e = cache_lookup(key, text, tlen)) != NULL ){
+        cache_ver_get(&ver);
+        if( (timer_sec() < e->expire) && cache_ver_equal(&(e->ver), &ver) ){
+            buf_reset(buf);
+            if(buf_realloc(buf, e->len) == NULL){
+                log(g_log, "conn:%u buf_realloc error\n", c->connid);
+                return 0;
+            }
+            memcpy(buf->ptr, e->data, e->len);
+            buf->used = e->len;
+            buf->pos = 0;
+
+            list_move_tail(&(e->lru), &lru_head);
+            hits++;
+
+            return 1;
+        }
+
+        cache_evict(e);
+    }
+
+    misses++;
+
+    if( (cc = cache_conn_get(c)) == NULL ){
+        return 0;
+    }
+
+    cache_capture_drop(cc);
+
+    if( (cc->text = malloc(tlen)) == NULL ){
+        log_err(g_log, "malloc error\n");
+        return 0;
+    }
+    memcpy(cc->text, text, tlen);
+    cc->tlen = tlen;
+    cc->key = key;
+    cc->ttl = ttl;
+    cc->ver = ver;
+    cache_ver_get(&(cc->ver));
+    my_resp_init(&(cc->resp));
+    cc->active = 1;
+
+    return 0;
+}
+
+/*
+ * fun: feed response read from mysql into capture
+ * arg: connection, data, data length
+ * ret: success 0, error -1
+ *
+ */
+
+int my_cache_feed(conn_t *c, const char *ptr, size_t len)
+{
+    int res;
+    size_t size;
+    char *data;
+    cache_conn_t *cc = c->qc;
+
+    if( (cc == NULL) || (!cc->active) ){
+        return 0;
+    }
+
+    if(cc->len + len > (size_t)g_conf.cache_max_entry * 1024){
+        cache_capture_drop(cc);
+        return 0;
+    }
+
+    if(cc->len + len > cc->size){
+        size = (cc->size == 0) ? PREALLOC_BUF_SIZE : cc->size;
+        while(size < cc->len + len){
+            size *= 2;
+        }
+        if( (data = realloc(cc->data, size)) == NULL ){
+            log_err(g_log, "realloc error\n");
+            cache_capture_drop(cc);
+            return -1;
+        }
+        cc->data = data;
+        cc->size = size;
+    }
+
+    memcpy(cc->data + cc->len, ptr, len);
+    cc->len += len;
+
+    if( (res = my_resp_feed(&(cc->resp), ptr, len)) < 0 ){
+        log(g_log, "conn:%u cache capture protocol error\n", c->connid);
+        cache_capture_drop(cc);
+        return -1;
+    } else if(res == 1) {
+        if(cc->resp.type == RESP_TYPE_RESULT){
+            cache_store(cc);
+        }
+        cache_capture_drop(cc);
+    }
+
+    return 0;
+}
+
+/*
+ * fun: invalidate tables written by client query
+ * arg: connection, client query is in connection buffer
+ * ret: success 0, error -1
+ *
+ */
+
+int my_cache_write(conn_t *c)
+{
+    int i, n, len;
+    uint32_t pktlen, slot;
+    char *sql;
+    const char *db;
+    int dblen;
+    buf_t *buf = &(c->buf);
+    sql_lexer_t lex;
+    sql_token_t tk;
+    sql_table_t tables[CACHE_MAX_TABLE];
+    cache_conn_t *cc;
+
+    if(bucket == NULL){
+        return 0;
+    }
+
+    if(c->comno == COM_DROP_DB){
+        return my_cache_bump_all();
+    }
+
+    if( (c->comno != COM_QUERY) || (buf->used < HEADER_SIZE + 1) ){
+        return 0;
+    }
+
+    pktlen = 0;
+    memcpy(&pktlen, buf->ptr, 3);
+    if( (pktlen < 1) || (pktlen + HEADER_SIZE > buf->used) ){
+        return 0;
+    }
+
+    sql = buf->ptr + HEADER_SIZE + 1;
+    len = pktlen - 1;
+
+    sql_lex_init(&lex, sql, len);
+    if( (sql_lex_next(&lex, &tk) != TK_IDENT) || (!sql_tk_in(&tk, cache_write)) ){
+        return 0;
+    }
+
+    if( (cc = cache_conn_get(c)) == NULL ){
+        return my_cache_bump_all();
+    }
+
+    n = sql_tables(sql, len, tables, CACHE_MAX_TABLE);
+    if( (n == 0) || (n > CACHE_MAX_TABLE) ){
+        cc->woverflow = 1;
+        n = 0;
+    }
+
+    for(i = 0; i < n; i++){
+        if(tables[i].db.len > 0){
+            db = tables[i].db.ptr;
+            dblen = tables[i].db.len;
+        } else {
+            db = c->curdb;
+            dblen = strlen(c->curdb);
+        }
+        slot = my_cache_table_slot(db, dblen, tables[i].name.ptr, tables[i].name.len);
+
+        if(cc->nwtab < CACHE_MAX_TABLE){
+            cc->wtab[cc->nwtab++] = slot;
+        } else {
+            cc->woverflow = 1;
+        }
+    }
+
+    return cache_write_bump(cc);
+}
+
+/*
+ * fun: response of last query is complete, bump written tables again
+ * arg: connection
+ * ret: success 0, error -1
+ *
+ */
+
+int my_cache_query_end(conn_t *c)
+{
+    cache_conn_t *cc = c->qc;
+
+    if(cc == NULL){
+        return 0;
+    }
+
+    cache_capture_drop(cc);
+
+    // reads started before the write is committed may not see it
+    cache_write_bump(cc);
+
+    if( (c->my == NULL) || (!my_conn_ctx_is_dirty(c->my)) ){
+        cc->nwtab = 0;
+        cc->woverflow = 0;
+    }
+
+    return 0;
+}
+
+/*
+ * fun: release cache state of connection
+ * arg: connection
+ * ret: always return 0
+ *
+ */
+
+int my_cache_close(conn_t *c)
+{
+    cache_conn_t *cc = c->qc;
+
+    if(cc == NULL){
+        return 0;
+    }
+
+    cache_capture_drop(cc);
+    cache_write_bump(cc);
+
+    free(cc);
+    c->qc = NULL;
+
+    return 0;
+}
+
+/*
+ * fun: get cache state of connection, alloc it if not exists
+ * arg: connection
+ * ret: success return cache state, error return NULL
+ *
+ */
+
+static cache_conn_t *cache_conn_get(conn_t *c)
+{
+    cache_conn_t *cc;
+
+    if(c->qc){
+        return c->qc;
+    }
+
+    if( (cc = calloc(1, sizeof(cache_conn_t))) == NULL ){
+        log_err(g_log, "calloc error\n");
+        return NULL;
+    }
+    c->qc = cc;
+
+    return cc;
+}
+
+/*
+ * fun: check query is cacheable and find its tables and ttl
+ * arg: connection, sql text, sql length, table versions, ttl
+ * ret: cacheable return number of tables, not cacheable 0
+ *
+ */
+
+static int cache_query_tables(conn_t *c, const char *sql, int len, \
+                                cache_ver_t *ver, int *ttl)
+{
+    int i, j, n, dblen, tlen;
+    const char *db;
+    char text[CACHE_MAX_TEXT];
+    sql_table_t tables[CACHE_MAX_TABLE];
+    cache_rule_t *r;
+
+    if(!sql_is_stable_read(sql, len)){
+        return 0;
+    }
+
+    n = sql_tables(sql, len, tables, CACHE_MAX_TABLE);
+    if( (n == 0) || (n > CACHE_MAX_TABLE) ){
+        return 0;
+    }
+
+    *ttl = g_conf.cache_ttl;
+    tlen = -1;
+
+    for(i = 0; i < rule_count; i++){
+        r = &(rule[i]);
+        if(r->type == CACHE_RULE_QUERY){
+            if( (tlen < 0) && \
+                ((tlen = sql_normalize(sql, len, text, sizeof(text))) < 0) ){
+                return 0;
+            }
+            if( (tlen >= r->len) && (!strncmp(text, r->pattern, r->len)) ){
+                *ttl = r->ttl;
+                break;
+            }
+        } else {
+            for(j = 0; j < n; j++){
+                if( (tables[j].name.len == r->len) && \
+                    (!strncasecmp(tables[j].name.ptr, r->pattern, r->len)) ){
+                    break;
+                }
+            }
+            if(j < n){
+                *ttl = r->ttl;
+                break;
+            }
+        }
+    }
+
+    if(*ttl <= 0){
+        return 0;
+    }
+
+    ver->ntab = n;
+    for(i = 0; i < n; i++){
+        if(tables[i].db.len > 0){
+            db = tables[i].db.ptr;
+            dblen = tables[i].db.len;
+        } else {
+            db = c->curdb;
+            dblen = strlen(c->curdb);
+        }
+        ver->tab[i] = my_cache_table_slot(db, dblen, \
+                                tables[i].name.ptr, tables[i].name.len);
+    }
+
+    return n;
+}
+
+/*
+ * fun: read current versions of tables
+ * arg: table versions, slots are filled
+ * ret: always return 0
+ *
+ */
+
+static int cache_ver_get(cache_ver_t *ver)
+{
+    int i;
+
+    ver->global = shm->global;
+    for(i = 0; i < ver->ntab; i++){
+        ver->ver[i] = shm->table[ver->tab[i]];
+    }
+
+    return 0;
+}
+
+/*
+ * fun: compare table versions
+ * arg: table versions
+ * ret: equal 1, not equal 0
+ *
+ */
+
+static int cache_ver_equal(cache_ver_t *a, cache_ver_t *b)
+{
+    int i;
+
+    if( (a->global != b->global) || (a->ntab != b->ntab) ){
+        return 0;
+    }
+
+    for(i = 0; i < a->ntab; i++){
+        if( (a->tab[i] != b->tab[i]) || (a->ver[i] != b->ver[i]) ){
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * fun: lookup cache entry
+ * arg: key, key text, text length
+ * ret: found return entry, not found return NULL
+ *
+ */
+
+static cache_entry_t *cache_lookup(uint64_t key, char *text, int tlen)
+{
+    struct list_head *head, *pos;
+    cache_entry_t *e;
+
+    head = bucket + (key % CACHE_BUCKET);
+    list_for_each(pos, head){
+        e = list_entry(pos, cache_entry_t, hlink);
+        if( (e->key == key) && (e->tlen == tlen) && (!memcmp(e->text, text, tlen)) ){
+            return e;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * fun: store captured response, evict lru entries if memory exceed
+ * arg: connection cache state
+ * ret: success 0, error -1
+ *
+ */
+
+static int cache_store(cache_conn_t *cc)
+{
+    size_t size, limit;
+    char *data;
+    cache_ver_t now;
+    cache_entry_t *e;
+
+    // table written while reading, result may be stale
+    now = cc->ver;
+    cache_ver_get(&now);
+    if(!cache_ver_equal(&(cc->ver), &now)){
+        return 0;
+    }
+
+    limit = (size_t)g_conf.cache_size * 1024 * 1024;
+    size = sizeof(cache_entry_t) + cc->tlen + cc->len;
+    if(size > limit){
+        return 0;
+    }
+
+    if( (e = cache_lookup(cc->key, cc->text, cc->tlen)) != NULL ){
+        cache_evict(e);
+    }
+
+    while( (mem_used + size > limit) && (!list_empty(&lru_head)) ){
+        cache_evict(list_first_entry(&lru_head, cache_entry_t, lru));
+        evicts++;
+    }
+
+    if( (e = malloc(sizeof(cache_entry_t))) == NULL ){
+        log_err(g_log, "malloc error\n");
+        return -1;
+    }
+
+    if( (data = realloc(cc->data, cc->len)) != NULL ){
+        cc->data = data;
+    }
+
+    e->key = cc->key;
+    e->text = cc->text;
+    e->tlen = cc->tlen;
+    e->data = cc->data;
+    e->len = cc->len;
+    e->expire = timer_sec() + cc->ttl;
+    e->ver = cc->ver;
+
+    cc->text = NULL;
+    cc->data = NULL;
+    cc->len = 0;
+    cc->size = 0;
+
+    list_add_tail(&(e->hlink), bucket + (e->key % CACHE_BUCKET));
+    list_add_tail(&(e->lru), &lru_head);
+
+    mem_used += size;
+    entry_count++;
+    stores++;
+
+    return 0;
+}
+
+/*
+ * fun: remove cache entry
+ * arg: cache entry
+ * ret: always return 0
+ *
+ */
+
+static int cache_evict(cache_entry_t *e)
+{
+    list_del(&(e->hlink));
+    list_del(&(e->lru));
+
+    mem_used -= sizeof(cache_entry_t) + e->tlen + e->len;
+    entry_count--;
+
+    free(e->text);
+    free(e->data);
+    free(e);
+
+    return 0;
+}
+
+/*
+ * fun: drop capture of connection
+ * arg: connection cache state
+ * ret: always return 0
+ *
+ */
+
+static int cache_capture_drop(cache_conn_t *cc)
+{
+    if(cc->text){
+        free(cc->text);
+        cc->text = NULL;
+    }
+
+    if(cc->data){
+        free(cc->data);
+        cc->data = NULL;
+    }
+
+    cc->len = 0;
+    cc->size = 0;
+    cc->active = 0;
+
+    return 0;
+}
+
+/*
+ * fun: bump versions of tables written by connection
+ * arg: connection cache state
+ * ret: always return 0
+ *
+ */
+
+static int cache_write_bump(cache_conn_t *cc)
+{
+    int i;
+
+    if(cc->woverflow){
+        my_cache_bump_all();
+    }
+
+    for(i = 0; i < cc->nwtab; i++){
+        my_cache_table_bump(cc->wtab[i]);
+    }
+
+    return 0;
+}
+
+/*
+ * fun: result cache status timer
+ * arg: not used
+ * ret: always return 0
+ *
+ */
+
+static int cache_status_timer(unsigned long arg)
+{
+    log(g_log, "cache entries[%d] bytes[%zu] hits[%llu] misses[%llu] " \
+                "stores[%llu] evicts[%llu]\n", entry_count, mem_used, \
+                (unsigned long long)hits, (unsigned long long)misses, \
+                (unsigned long long)stores, (unsigned long long)evicts);
+
+    return 0;
+}
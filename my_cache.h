@@ -0,0 +1,26 @@
+#ifndef _MY_CACHE_H_
+#define _MY_CACHE_H_
+
+#include <stdint.h>
+#include "conn_pool.h"
+
+#define CACHE_MAX_TABLE 8
+#define CACHE_TABLE_SLOT (64 * 1024)
+
+int my_cache_shm_init(void);
+int my_cache_init(void);
+int my_cache_rule_load(const char *conf);
+
+uint32_t my_cache_table_slot(const char *db, int dblen, const char *name, int len);
+int my_cache_table_bump(uint32_t slot);
+int my_cache_bump_all(void);
+int my_cache_binlog_set(int up);
+int my_cache_sql_bump(const char *db, int dblen, const char *sql, int len);
+
+int my_cache_get(conn_t *c);
+int my_cache_feed(conn_t *c, const char *ptr, size_t len);
+int my_cache_write(conn_t *c);
+int my_cache_query_end(conn_t *c);
+int my_cache_close(conn_t *c);
+
+#endif
@@ -38,17 +38,58 @@ int my_conf_init(const char *log)
 
     CONF_FILL_INT(daemon);
     CONF_FILL_INT(worker);
+    CONF_FILL_INT(thread);
+    CONF_FILL_STR(cpu_affinity);
+    CONF_FILL_INT(reuseport);
     CONF_FILL_INT(max_connections);
     CONF_FILL_STR(ip);
     CONF_FILL_STR(port);
+    CONF_FILL_STR(unix_socket);
+    CONF_FILL_STR(read_port);
+    CONF_FILL_STR(write_port);
     CONF_FILL_INT(read_client_timeout);
     CONF_FILL_INT(write_mysql_timeout);
     CONF_FILL_INT(read_mysql_write_client_timeout);
     CONF_FILL_INT(prepare_mysql_timeout);
     CONF_FILL_INT(idle_timeout);
+    CONF_FILL_INT(precise_clock);
     CONF_FILL_INT(mysql_ping_timeout);
+    CONF_FILL_INT(mysql_idle_timeout);
+    CONF_FILL_INT(dns_ttl);
+    CONF_FILL_INT(wait_mysql_queue);
+    CONF_FILL_INT(wait_mysql_timeout);
+    CONF_FILL_INT(broker);
+    CONF_FILL_INT(balance);
+    CONF_FILL_INT(slave_hash);
+    CONF_FILL_INT(slave_vnode);
+    CONF_FILL_STR(route_conf);
+    CONF_FILL_INT(outlier_eject);
+    CONF_FILL_INT(outlier_error_rate);
+    CONF_FILL_INT(outlier_latency);
+    CONF_FILL_INT(read_retry);
+    CONF_FILL_INT(read_retry_budget);
+    CONF_FILL_INT(hedge_read);
+    CONF_FILL_INT(hedge_budget);
+    CONF_FILL_INT(scatter);
+    CONF_FILL_INT(cache);
+    CONF_FILL_INT(cache_size);
+    CONF_FILL_INT(cache_max_entry);
+    CONF_FILL_INT(cache_ttl);
+    CONF_FILL_STR(cache_conf);
+    CONF_FILL_INT(flight);
+    CONF_FILL_INT(flight_max_size);
+    CONF_FILL_INT(digest);
+    CONF_FILL_INT(digest_max);
+    CONF_FILL_INT(digest_interval);
+    CONF_FILL_STR(digest_log);
+    CONF_FILL_INT(local);
+    CONF_FILL_STR(local_conf);
+    CONF_FILL_INT(binlog);
+    CONF_FILL_INT(binlog_server_id);
+    CONF_FILL_INT(binlog_heartbeat);
     CONF_FILL_STR(user);
     CONF_FILL_STR(passwd);
+    CONF_FILL_STR(user_conf);
     CONF_FILL_STR(mysql_conf);
     CONF_FILL_STR(log);
     CONF_FILL_STR(loglevel);
@@ -57,6 +98,72 @@ int my_conf_init(const char *log)
     return 0;
 }
 
+/*
+ * fun: get log level from config
+ * arg:
+ * ret: log level
+ *
+ */
+
+int my_conf_loglevel(void)
+{
+    if(!strcmp(g_conf.loglevel, "none")){
+        return LOG_NONE;
+    } else if(!strcmp(g_conf.loglevel, "log")) {
+        return LOG_LEVEL_LOG;
+    } else if(!strcmp(g_conf.loglevel, "debug")) {
+        return LOG_LEVEL_DEBUG;
+    } else if(!strcmp(g_conf.loglevel, "info")) {
+        return LOG_LEVEL_INFO;
+    }
+
+    return LOG_LEVEL_LOG;
+}
+
+/*
+ * fun: parse cpu list of cpu_affinity, like "0-3,8,10-11"
+ * arg: cpu array, array size
+ * ret: cpu number, 0 when not set or wrong
+ *
+ */
+
+int my_conf_cpus(int *cpus, int size)
+{
+    int n = 0, from, to, len;
+    const char *ptr = g_conf.cpu_affinity;
+
+    while(ptr && *ptr){
+        if(sscanf(ptr, "%d%n", &from, &len) < 1){
+            return 0;
+        }
+        ptr += len;
+        to = from;
+
+        if(*ptr == '-'){
+            if(sscanf(ptr + 1, "%d%n", &to, &len) < 1){
+                return 0;
+            }
+            ptr += len + 1;
+        }
+
+        if( (from < 0) || (to < from) ){
+            return 0;
+        }
+
+        for(; (from <= to) && (n < size); from++){
+            cpus[n++] = from;
+        }
+
+        if(*ptr == ','){
+            ptr++;
+        } else if(*ptr != '\0') {
+            return 0;
+        }
+    }
+
+    return n;
+}
+
 #define MAX_LINE_LEN 1024
 
 /*
@@ -68,17 +175,18 @@ int my_conf_init(const char *log)
 
 int mysql_conf_parse(const char *conf, my_conf_t *myconf)
 {
-    int i, res, line = 0;
+    int i, res, len, line = 0;
     FILE *fp;
     char buf[MAX_LINE_LEN];
-    char type[64], host[128], port[128], user[64], pass[64];
-    int  cnum;
-    int  mcount = 0, scount = 0;
+    char type[64], host[MAX_LINE_LEN], port[128], user[64], pass[64];
+    int  cnum, cmax, ccap;
+    int  mcount = 0, scount = 0, shcount = 0;
 
     my_node_conf_t *mynode;
 
     myconf->mcount = 0;
     myconf->scount = 0;
+    myconf->shcount = 0;
 
     for(i = 0; i < 1; i++){
         mynode = myconf->master + i;
@@ -86,8 +194,11 @@ int mysql_conf_parse(const char *conf, my_conf_t *myconf)
         bzero(mynode->port, sizeof(mynode->port));
         bzero(mynode->user, sizeof(mynode->user));
         bzero(mynode->pass, sizeof(mynode->pass));
+        bzero(mynode->group, sizeof(mynode->group));
 
         mynode->cnum = 0;
+        mynode->cmax = 0;
+        mynode->ccap = 0;
     }
 
     for(i = 0; i < 64; i++){
@@ -96,8 +207,24 @@ int mysql_conf_parse(const char *conf, my_conf_t *myconf)
         bzero(mynode->port, sizeof(mynode->port));
         bzero(mynode->user, sizeof(mynode->user));
         bzero(mynode->pass, sizeof(mynode->pass));
+        bzero(mynode->group, sizeof(mynode->group));
 
         mynode->cnum = 0;
+        mynode->cmax = 0;
+        mynode->ccap = 0;
+    }
+
+    for(i = 0; i < 16; i++){
+        mynode = myconf->shard + i;
+        bzero(mynode->host, sizeof(mynode->host));
+        bzero(mynode->port, sizeof(mynode->port));
+        bzero(mynode->user, sizeof(mynode->user));
+        bzero(mynode->pass, sizeof(mynode->pass));
+        bzero(mynode->group, sizeof(mynode->group));
+
+        mynode->cnum = 0;
+        mynode->cmax = 0;
+        mynode->ccap = 0;
     }
 
     if( (fp = fopen(conf, "r")) == NULL ){
@@ -110,31 +237,55 @@ int mysql_conf_parse(const char *conf, my_conf_t *myconf)
         line++;
         trim(buf);
         if( (*buf != '#') && (*buf != '\0') ){
-            res = sscanf(buf, "%s %s %s %s %s %d", \
-                            type, host, port, user, pass, &cnum);
-            if(res == 6){
+            cmax = ccap = 0;
+            res = sscanf(buf, "%s %s %s %s %s %d %d %d", \
+                    type, host, port, user, pass, &cnum, &cmax, &ccap);
+            if(res >= 6){
                 if(!strcmp(type, "master")){
                     if(mcount >= 1){
                         log(g_log, "line[%d] error, master num limit\n", line);
                         return -1;
                     }
                     mynode = &(myconf->master[mcount++]);
-                } else if(!strcmp(type, "slave")) {
+                } else if( (!strcmp(type, "slave")) || \
+                                        (!strncmp(type, "slave:", 6)) ) {
                     if(scount >= 64){
                         log(g_log, "line[%d] error, slave num limit\n", line);
                         return -1;
                     }
                     mynode = &(myconf->slave[scount++]);
+                    // slave:name is a slave of group name
+                    if(type[5] == ':'){
+                        if( (len = strlen(type + 6)) >= sizeof(mynode->group) ){
+                            log(g_log, "line[%d] error, group too long\n", line);
+                            return -1;
+                        }
+                        memcpy(mynode->group, type + 6, len + 1);
+                    }
+                } else if(!strcmp(type, "shard")) {
+                    if(shcount >= 16){
+                        log(g_log, "line[%d] error, shard num limit\n", line);
+                        return -1;
+                    }
+                    mynode = &(myconf->shard[shcount++]);
                 } else {
                     log(g_log, "line[%d] error, unknown mysql type\n", line);
                     return -1;
                 }
 
+                // a cut unix:/path would name another socket
+                if(strlen(host) >= sizeof(mynode->host)){
+                    log(g_log, "line[%d] error, host too long\n", line);
+                    return -1;
+                }
+
                 strncpy(mynode->host, host, sizeof(mynode->host) - 1);
                 strncpy(mynode->port, port, sizeof(mynode->port) - 1);
                 strncpy(mynode->user, user, sizeof(mynode->user) - 1);
                 strncpy(mynode->pass, pass, sizeof(mynode->pass) - 1);
                 mynode->cnum = cnum;
+                mynode->cmax = (cmax > cnum) ? cmax : cnum;
+                mynode->ccap = ccap;
             } else {
                 log(g_log, "line[%d] error\n", line);
                 return -1;
@@ -146,6 +297,7 @@ int mysql_conf_parse(const char *conf, my_conf_t *myconf)
     fclose(fp);
     myconf->mcount = mcount;
     myconf->scount = scount;
+    myconf->shcount = shcount;
 
     return 0;
 }
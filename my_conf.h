@@ -1,22 +1,78 @@
 #ifndef _MY_CONF_H_
 #define _MY_CONF_H_
 
+#include "def.h"
+
 #define conf_def_daemon 1
 #define conf_def_worker 2
+#define conf_def_thread 0
+#define conf_def_cpu_affinity ""
+#define conf_def_reuseport 0
 #define conf_def_max_connections 100000
 
 #define conf_def_ip "0.0.0.0"
 #define conf_def_port "13306"
+#define conf_def_unix_socket ""
+#define conf_def_read_port ""
+#define conf_def_write_port ""
 
 #define conf_def_read_client_timeout 60
 #define conf_def_write_mysql_timeout 60
 #define conf_def_read_mysql_write_client_timeout 300
 #define conf_def_prepare_mysql_timeout 15
 #define conf_def_idle_timeout 60
+#define conf_def_precise_clock 0
 #define conf_def_mysql_ping_timeout 10
+#define conf_def_mysql_idle_timeout 300
+#define conf_def_dns_ttl 60
+
+#define conf_def_wait_mysql_queue 0
+#define conf_def_wait_mysql_timeout 3
+
+#define conf_def_broker 0
+
+#define conf_def_balance 0
+
+#define conf_def_slave_hash 0
+#define conf_def_slave_vnode 100
+#define conf_def_route_conf ""
+
+#define conf_def_outlier_eject 0
+#define conf_def_outlier_error_rate 50
+#define conf_def_outlier_latency 300
+
+#define conf_def_read_retry 0
+#define conf_def_read_retry_budget 10
+
+#define conf_def_hedge_read 0
+#define conf_def_hedge_budget 5
+
+#define conf_def_scatter 0
+
+#define conf_def_cache 0
+#define conf_def_cache_size 64
+#define conf_def_cache_max_entry 1024
+#define conf_def_cache_ttl 0
+#define conf_def_cache_conf "./conf/cache.conf"
+
+#define conf_def_flight 0
+#define conf_def_flight_max_size 1024
+
+#define conf_def_digest 0
+#define conf_def_digest_max 1024
+#define conf_def_digest_interval 60
+#define conf_def_digest_log "./digest.log"
+
+#define conf_def_local 0
+#define conf_def_local_conf "./conf/local.conf"
+
+#define conf_def_binlog 0
+#define conf_def_binlog_server_id 13306
+#define conf_def_binlog_heartbeat 5
 
 #define conf_def_user ""
 #define conf_def_passwd ""
+#define conf_def_user_conf ""
 
 #define conf_def_mysql_conf "./conf/mysql.conf"
 
@@ -25,34 +81,80 @@
 #define conf_def_sqllog "./sql.log"
 
 typedef struct{
-    char host[64];
+    char host[MAX_HOST_LEN];
     char port[16];
     char user[16];
     char pass[16];
     int  cnum;
+    int  cmax;
+    int  ccap;
+    char group[32];
 }my_node_conf_t;
 
 typedef struct{
     int mcount;
     int scount;
+    int shcount;
     my_node_conf_t master[1];
     my_node_conf_t slave[64];
+    my_node_conf_t shard[16];
 }my_conf_t;
 
 struct conf_t{
     int daemon;
     int worker;
+    int thread;
+    char *cpu_affinity;
+    int reuseport;
     int max_connections;
     char *ip;
     char *port;
+    char *unix_socket;
+    char *read_port;
+    char *write_port;
     int read_client_timeout;
     int write_mysql_timeout;
     int read_mysql_write_client_timeout;
     int prepare_mysql_timeout;
     int idle_timeout;
+    int precise_clock;
     int mysql_ping_timeout;
+    int mysql_idle_timeout;
+    int dns_ttl;
+    int wait_mysql_queue;
+    int wait_mysql_timeout;
+    int broker;
+    int balance;
+    int slave_hash;
+    int slave_vnode;
+    char *route_conf;
+    int outlier_eject;
+    int outlier_error_rate;
+    int outlier_latency;
+    int read_retry;
+    int read_retry_budget;
+    int hedge_read;
+    int hedge_budget;
+    int scatter;
+    int cache;
+    int cache_size;
+    int cache_max_entry;
+    int cache_ttl;
+    char *cache_conf;
+    int flight;
+    int flight_max_size;
+    int digest;
+    int digest_max;
+    int digest_interval;
+    char *digest_log;
+    int local;
+    char *local_conf;
+    int binlog;
+    int binlog_server_id;
+    int binlog_heartbeat;
     char *user;
     char *passwd;
+    char *user_conf;
     char *mysql_conf;
     char *log;
     char *loglevel;
@@ -60,6 +162,8 @@ struct conf_t{
 };
 
 int my_conf_init(const char *log);
+int my_conf_loglevel(void);
+int my_conf_cpus(int *cpus, int size);
 int mysql_conf_parse(const char *conf, my_conf_t *myconf);
 
 #endif
@@ -0,0 +1,549 @@
+/*
+ * Copyright 2011-2013 Alibaba Group Holding Limited. All rights reserved.
+ * Use and distribution licensed under the GPL license.
+ *
+ * Authors: XiaoJinliang <xiaoshi.xjl@taobao.com>
+ *
+ */
+
+/*
+ * query digest statistics
+ *
+ * every query is fingerprinted, literals replaced and literal lists
+ * collapsed, and accounted to the mmhash64 of its fingerprint. the table is
+ * per worker and bounded, least recently seen digests are evicted. it is
+ * dumped periodically and answered to "show myrelay digest".
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <list.h>
+#include <log.h>
+#include <hash.h>
+#include <timer.h>
+#include "my_digest.h"
+#include "my_resp.h"
+#include "my_sql.h"
+#include "my_buf.h"
+#include "my_pool.h"
+#include "my_protocol.h"
+#include "conn_pool.h"
+#include "mysql_com.h"
+#include "my_conf.h"
+
+extern log_t *g_log;
+extern struct conf_t g_conf;
+
+#define DIGEST_BUCKET 4096
+#define DIGEST_MAX_TEXT (4 * 1024)
+
+enum{
+    DIGEST_ROLE_MASTER = 0,
+    DIGEST_ROLE_SLAVE,
+    DIGEST_ROLE_SCATTER,
+    DIGEST_ROLE_CACHE,
+    DIGEST_ROLE_NUM
+};
+
+typedef struct{
+    uint64_t key;
+    char *text;
+    uint64_t count;
+    uint64_t total_us;
+    uint64_t max_us;
+    uint64_t rows;
+    uint64_t bytes;
+    uint64_t errors;
+    uint64_t role[DIGEST_ROLE_NUM];
+    struct list_head hlink;
+    struct list_head lru;
+} digest_entry_t;
+
+typedef struct{
+    int active;
+    uint64_t key;
+    my_resp_t resp;
+} digest_conn_t;
+
+static __thread struct list_head *bucket = NULL;
+static __thread struct list_head lru_head;
+static __thread int entry_count;
+
+static const char *digest_fields[] = {
+    "digest", "count", "total_ms", "avg_ms", "max_ms", "rows", "bytes",
+    "errors", "master", "slave", "scatter", "cache", "query"
+};
+
+static const char *digest_show_words[] = {
+    "show", "myrelay", "digest",
+    NULL
+};
+
+static int digest_dump_timer(unsigned long arg);
+static digest_entry_t *digest_lookup(uint64_t key);
+static digest_entry_t *digest_insert(uint64_t key, const char *text, int tlen);
+static int digest_cmp(const void *a, const void *b);
+static digest_entry_t **digest_sorted(void);
+
+/*
+ * fun: init query digest table of worker
+ * arg:
+ * ret: success 0, error -1
+ *
+ */
+
+int my_digest_init(void)
+{
+    int i, res;
+
+    if(!g_conf.digest){
+        return 0;
+    }
+
+    if( (bucket = malloc(sizeof(struct list_head) * DIGEST_BUCKET)) == NULL ){
+        log_err(g_log, "malloc error\n");
+        return -1;
+    }
+
+    for(i = 0; i < DIGEST_BUCKET; i++){
+        INIT_LIST_HEAD(bucket + i);
+    }
+    INIT_LIST_HEAD(&lru_head);
+    entry_count = 0;
+
+    if(g_conf.digest_interval > 0){
+        res = timer_register(digest_dump_timer, 0, "digest_dump_timer", \
+                                                    g_conf.digest_interval);
+        if(res < 0){
+            log(g_log, "digest_dump_timer register error\n");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * fun: start accounting client query
+ * arg: connection, client query is in connection buffer
+ * ret: success 0, error -1
+ *
+ */
+
+int my_digest_start(conn_t *c)
+{
+    int len, tlen;
+    uint32_t pktlen;
+    uint64_t key;
+    char *sql, text[DIGEST_MAX_TEXT];
+    buf_t *buf = &(c->buf);
+    digest_conn_t *dc = c->dg;
+
+    if(bucket == NULL){
+        return 0;
+    }
+
+    if(dc == NULL){
+        if( (dc = calloc(1, sizeof(digest_conn_t))) == NULL ){
+            log_err(g_log, "calloc error\n");
+            return -1;
+        }
+        c->dg = dc;
+    }
+
+    dc->active = 0;
+
+    if( (c->comno != COM_QUERY) || (buf->used < HEADER_SIZE + 1) ){
+        return 0;
+    }
+
+    pktlen = 0;
+    memcpy(&pktlen, buf->ptr, 3);
+    if( (pktlen < 1) || (pktlen + HEADER_SIZE > buf->used) ){
+        return 0;
+    }
+
+    sql = buf->ptr + HEADER_SIZE + 1;
+    len = pktlen - 1;
+
+    // very long statement is accounted by its head
+    while( ((tlen = sql_fingerprint(sql, len, text, sizeof(text))) < 0) && \
+                                                    (len > 64) ){
+        len /= 2;
+    }
+    if(tlen < 0){
+        return 0;
+    }
+
+    key = mmhash64(text, tlen);
+    if( (digest_lookup(key) == NULL) && (digest_insert(key, text, tlen) == NULL) ){
+        return -1;
+    }
+
+    dc->key = key;
+    dc->active = 1;
+    my_resp_init(&(dc->resp));
+
+    return 0;
+}
+
+/*
+ * fun: feed response written to client
+ * arg: connection, data, data length
+ * ret: always return 0
+ *
+ */
+
+int my_digest_feed(conn_t *c, const char *ptr, size_t len)
+{
+    digest_conn_t *dc = c->dg;
+
+    if( (dc == NULL) || (!dc->active) ){
+        return 0;
+    }
+
+    if(!my_resp_is_done(&(dc->resp))){
+        my_resp_feed(&(dc->resp), ptr, len);
+    }
+
+    return 0;
+}
+
+/*
+ * fun: client query is answered, account it
+ * arg: connection
+ * ret: success 0, error -1
+ *
+ */
+
+int my_digest_end(conn_t *c)
+{
+    int role;
+    uint64_t us;
+    digest_conn_t *dc = c->dg;
+    digest_entry_t *e;
+
+    if( (dc == NULL) || (!dc->active) ){
+        return 0;
+    }
+    dc->active = 0;
+
+    // entry may be evicted while query is running
+    if( (e = digest_lookup(dc->key)) == NULL ){
+        return 0;
+    }
+
+    if( (c->local == LOCAL_CACHE) || (c->local == LOCAL_SESSION) || \
+                                        (c->local == LOCAL_FLIGHT) ){
+        role = DIGEST_ROLE_CACHE;
+    } else if(c->sg) {
+        role = DIGEST_ROLE_SCATTER;
+    } else if( c->my && \
+               (((my_node_t *)c->my->node)->role == MASTER_ROLE) ){
+        role = DIGEST_ROLE_MASTER;
+    } else {
+        role = DIGEST_ROLE_SLAVE;
+    }
+
+    us = (c->end_us > c->start_us) ? c->end_us - c->start_us : 0;
+
+    e->count++;
+    e->total_us += us;
+    if(us > e->max_us){
+        e->max_us = us;
+    }
+    e->rows += dc->resp.rows;
+    e->bytes += dc->resp.bytes;
+    if(dc->resp.type == RESP_TYPE_ERR){
+        e->errors++;
+    }
+    e->role[role]++;
+
+    return 0;
+}
+
+/*
+ * fun: release digest state of connection
+ * arg: connection
+ * ret: always return 0
+ *
+ */
+
+int my_digest_close(conn_t *c)
+{
+    free(c->dg);
+    c->dg = NULL;
+
+    return 0;
+}
+
+/*
+ * fun: answer "show myrelay digest" from digest table
+ * arg: connection, client query is in connection buffer
+ * ret: answered 1 and result set is in connection buffer, other query 0,
+ *      error -1
+ *
+ */
+
+int my_digest_show(conn_t *c)
+{
+    int i, count, res = 0;
+    uint8_t pktno;
+    uint32_t pktlen;
+    char vals[12][32];
+    const char *row[13];
+    buf_t *buf = &(c->buf);
+    sql_lexer_t lex;
+    sql_token_t tk;
+    digest_entry_t **list = NULL, *e;
+
+    if( (c->comno != COM_QUERY) || (buf->used < HEADER_SIZE + 1) ){
+        return 0;
+    }
+
+    pktlen = 0;
+    memcpy(&pktlen, buf->ptr, 3);
+    if( (pktlen < 1) || (pktlen + HEADER_SIZE > buf->used) ){
+        return 0;
+    }
+
+    sql_lex_init(&lex, buf->ptr + HEADER_SIZE + 1, pktlen - 1);
+    for(i = 0; digest_show_words[i]; i++){
+        sql_lex_next(&lex, &tk);
+        if(!sql_tk_is(&tk, digest_show_words[i])){
+            return 0;
+        }
+    }
+    while(sql_lex_next(&lex, &tk) != TK_END){
+        if(!sql_tk_is_punct(&tk, ';')){
+            return 0;
+        }
+    }
+
+    count = sizeof(digest_fields) / sizeof(digest_fields[0]);
+    if( (res = make_result_head(buf, digest_fields, count)) < 0 ){
+        goto end;
+    }
+    pktno = res;
+
+    if( (bucket != NULL) && ((list = digest_sorted()) == NULL) ){
+        res = -1;
+        goto end;
+    }
+
+    for(i = 0; (bucket != NULL) && (i < entry_count); i++){
+        e = list[i];
+        snprintf(vals[0], sizeof(vals[0]), "%016llx", (unsigned long long)e->key);
+        snprintf(vals[1], sizeof(vals[1]), "%llu", (unsigned long long)e->count);
+        snprintf(vals[2], sizeof(vals[2]), "%.3f", e->total_us / 1000.0);
+        snprintf(vals[3], sizeof(vals[3]), "%.3f", \
+                            e->count ? e->total_us / 1000.0 / e->count : 0.0);
+        snprintf(vals[4], sizeof(vals[4]), "%.3f", e->max_us / 1000.0);
+        snprintf(vals[5], sizeof(vals[5]), "%llu", (unsigned long long)e->rows);
+        snprintf(vals[6], sizeof(vals[6]), "%llu", (unsigned long long)e->bytes);
+        snprintf(vals[7], sizeof(vals[7]), "%llu", (unsigned long long)e->errors);
+        snprintf(vals[8], sizeof(vals[8]), "%llu", \
+                        (unsigned long long)e->role[DIGEST_ROLE_MASTER]);
+        snprintf(vals[9], sizeof(vals[9]), "%llu", \
+                        (unsigned long long)e->role[DIGEST_ROLE_SLAVE]);
+        snprintf(vals[10], sizeof(vals[10]), "%llu", \
+                        (unsigned long long)e->role[DIGEST_ROLE_SCATTER]);
+        snprintf(vals[11], sizeof(vals[11]), "%llu", \
+                        (unsigned long long)e->role[DIGEST_ROLE_CACHE]);
+
+        for(count = 0; count < 12; count++){
+            row[count] = vals[count];
+        }
+        row[12] = e->text;
+
+        if( (res = make_result_row(buf, pktno++, row, 13)) < 0 ){
+            goto end;
+        }
+    }
+
+    if( (res = make_result_end(buf, pktno)) < 0 ){
+        goto end;
+    }
+
+    res = 1;
+
+end:
+    free(list);
+    if(res < 0){
+        log(g_log, "conn:%u make digest result error\n", c->connid);
+    }
+
+    return res;
+}
+
+/*
+ * fun: dump digest table to digest log, most total time first
+ * arg:
+ * ret: success 0, error -1
+ *
+ */
+
+static int digest_dump_timer(unsigned long arg)
+{
+    int i;
+    FILE *fp;
+    char timebuf[64];
+    time_t t;
+    struct tm tm;
+    digest_entry_t **list, *e;
+
+    if(entry_count == 0){
+        return 0;
+    }
+
+    if( (fp = fopen(g_conf.digest_log, "a")) == NULL ){
+        log(g_log, "fopen %s error\n", g_conf.digest_log);
+        return -1;
+    }
+
+    if( (list = digest_sorted()) == NULL ){
+        fclose(fp);
+        return -1;
+    }
+
+    t = time(NULL);
+    localtime_r(&t, &tm);
+    strftime(timebuf, sizeof(timebuf), "%F %T", &tm);
+
+    for(i = 0; i < entry_count; i++){
+        e = list[i];
+        fprintf(fp, "%s pid:%d digest:%016llx count:%llu total:%.3fms "
+                    "max:%.3fms rows:%llu bytes:%llu errors:%llu "
+                    "role:%llu/%llu/%llu/%llu - %s\n", \
+                timebuf, getpid(), (unsigned long long)e->key, \
+                (unsigned long long)e->count, e->total_us / 1000.0, \
+                e->max_us / 1000.0, (unsigned long long)e->rows, \
+                (unsigned long long)e->bytes, (unsigned long long)e->errors, \
+                (unsigned long long)e->role[DIGEST_ROLE_MASTER], \
+                (unsigned long long)e->role[DIGEST_ROLE_SLAVE], \
+                (unsigned long long)e->role[DIGEST_ROLE_SCATTER], \
+                (unsigned long long)e->role[DIGEST_ROLE_CACHE], e->text);
+    }
+
+    free(list);
+    fclose(fp);
+
+    return 0;
+}
+
+/*
+ * fun: lookup digest entry, mark it recently seen
+ * arg: digest key
+ * ret: found return entry, not found NULL
+ *
+ */
+
+static digest_entry_t *digest_lookup(uint64_t key)
+{
+    struct list_head *head, *pos;
+    digest_entry_t *e;
+
+    head = bucket + (key % DIGEST_BUCKET);
+    list_for_each(pos, head){
+        e = list_entry(pos, digest_entry_t, hlink);
+        if(e->key == key){
+            list_move_tail(&(e->lru), &lru_head);
+            return e;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * fun: insert digest entry, least recently seen entry is evicted when full
+ * arg: digest key, fingerprint, fingerprint length
+ * ret: success return entry, error NULL
+ *
+ */
+
+static digest_entry_t *digest_insert(uint64_t key, const char *text, int tlen)
+{
+    digest_entry_t *e;
+
+    if( (entry_count >= g_conf.digest_max) && (!list_empty(&lru_head)) ){
+        e = list_entry(lru_head.next, digest_entry_t, lru);
+        list_del(&(e->hlink));
+        list_del(&(e->lru));
+        free(e->text);
+        free(e);
+        entry_count--;
+    }
+
+    if( (e = calloc(1, sizeof(digest_entry_t))) == NULL ){
+        log_err(g_log, "calloc error\n");
+        return NULL;
+    }
+
+    if( (e->text = malloc(tlen + 1)) == NULL ){
+        log_err(g_log, "malloc error\n");
+        free(e);
+        return NULL;
+    }
+    memcpy(e->text, text, tlen);
+    e->text[tlen] = '\0';
+    e->key = key;
+
+    list_add_tail(&(e->hlink), bucket + (key % DIGEST_BUCKET));
+    list_add_tail(&(e->lru), &lru_head);
+    entry_count++;
+
+    return e;
+}
+
+/*
+ * fun: compare digest entries by total time, descending
+ * arg: entries
+ * ret: qsort order
+ *
+ */
+
+static int digest_cmp(const void *a, const void *b)
+{
+    const digest_entry_t *x = *(digest_entry_t * const *)a;
+    const digest_entry_t *y = *(digest_entry_t * const *)b;
+
+    if(x->total_us == y->total_us){
+        return 0;
+    }
+
+    return (x->total_us > y->total_us) ? -1 : 1;
+}
+
+/*
+ * fun: list entries sorted by total time
+ * arg:
+ * ret: success return array of entry_count entries to be freed, error NULL
+ *
+ */
+
+static digest_entry_t **digest_sorted(void)
+{
+    int i = 0;
+    struct list_head *pos;
+    digest_entry_t **list;
+
+    if( (list = malloc(sizeof(digest_entry_t *) * (entry_count + 1))) == NULL ){
+        log_err(g_log, "malloc error\n");
+        return NULL;
+    }
+
+    list_for_each(pos, &lru_head){
+        list[i++] = list_entry(pos, digest_entry_t, lru);
+    }
+
+    qsort(list, entry_count, sizeof(digest_entry_t *), digest_cmp);
+
+    return list;
+}
@@ -0,0 +1,14 @@
+#ifndef _MY_DIGEST_H_
+#define _MY_DIGEST_H_
+
+#include <stddef.h>
+#include "conn_pool.h"
+
+int my_digest_init(void);
+int my_digest_start(conn_t *c);
+int my_digest_feed(conn_t *c, const char *ptr, size_t len);
+int my_digest_end(conn_t *c);
+int my_digest_close(conn_t *c);
+int my_digest_show(conn_t *c);
+
+#endif
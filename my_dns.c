@@ -0,0 +1,282 @@
+/*
+ * Copyright 2011-2013 Alibaba Group Holding Limited. All rights reserved.
+ * Use and distribution licensed under the GPL license.
+ *
+ * Authors: XiaoJinliang <xiaoshi.xjl@taobao.com>
+ *
+ */
+
+/*
+ * backend host resolution off the event loop
+ *
+ * getaddrinfo blocks, a stalled resolver would freeze the worker with all
+ * its clients. every worker starts a resolver thread, queries are passed
+ * to it as pointers over a pipe and come back over another pipe watched
+ * by the event loop, where the callback runs. numeric hosts and unix
+ * socket paths, written unix:/path/mysqld.sock, are converted in place and
+ * never reach the thread.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <log.h>
+#include <handler.h>
+#include <sock.h>
+#include "my_dns.h"
+#include "def.h"
+
+extern log_t *g_log;
+
+typedef struct{
+    char host[MAX_HOST_LEN];
+    char srv[MAX_SRV_LEN];
+    my_dns_cb_t cb;
+    void *arg;
+    int res;
+    struct sockaddr_storage addr;
+    socklen_t len;
+} dns_query_t;
+
+typedef struct{
+    int req_fd;
+    int res_fd;
+} dns_thread_t;
+
+static __thread int dns_req_fd = -1;
+
+static void *dns_thread(void *arg);
+static int dns_resolve(const char *host, const char *srv, int flags, \
+                            struct sockaddr_storage *addr, socklen_t *len);
+static int dns_answer_cb(int fd, void *arg);
+
+/*
+ * fun: start resolver thread of this worker
+ * arg:
+ * ret: success 0, error -1
+ *
+ */
+
+int my_dns_init(void)
+{
+    int res, req[2] = {-1, -1}, ans[2] = {-1, -1};
+    pthread_t tid;
+    dns_thread_t *t = NULL;
+
+    if( (pipe(req) < 0) || (pipe(ans) < 0) ){
+        log_err(g_log, "pipe error\n");
+        goto end;
+    }
+
+    if( (setnonblock(req[1]) < 0) || (setnonblock(ans[0]) < 0) ){
+        log_err(g_log, "setnonblock error\n");
+        goto end;
+    }
+
+    if( (t = malloc(sizeof(dns_thread_t))) == NULL ){
+        log_err(g_log, "malloc error\n");
+        goto end;
+    }
+    t->req_fd = req[0];
+    t->res_fd = ans[1];
+
+    if(add_handler(ans[0], EPOLLIN, dns_answer_cb, NULL) < 0){
+        log(g_log, "add_handler dns fd[%d] fail\n", ans[0]);
+        goto end;
+    }
+
+    if( (res = pthread_create(&tid, NULL, dns_thread, t)) != 0 ){
+        log(g_log, "pthread_create error, %s\n", strerror(res));
+        del_handler(ans[0]);
+        goto end;
+    }
+    pthread_detach(tid);
+
+    dns_req_fd = req[1];
+
+    return 0;
+
+end:
+    free(t);
+    if(req[0] >= 0){
+        close(req[0]);
+        close(req[1]);
+    }
+    if(ans[0] >= 0){
+        close(ans[0]);
+        close(ans[1]);
+    }
+
+    return -1;
+}
+
+/*
+ * fun: convert numeric host and port or unix socket path without resolver
+ * arg: host, port(not used for unix socket), address buffer, address length
+ * ret: success 0, not numeric -1
+ *
+ */
+
+int my_dns_numeric(const char *host, const char *srv, \
+                            struct sockaddr_storage *addr, socklen_t *len)
+{
+    struct sockaddr_un *un = (struct sockaddr_un *)addr;
+
+    if(strncmp(host, MY_DNS_UNIX, sizeof(MY_DNS_UNIX) - 1)){
+        return dns_resolve(host, srv, AI_NUMERICHOST | AI_NUMERICSERV, addr, len);
+    }
+
+    host += sizeof(MY_DNS_UNIX) - 1;
+    if( (*host == '\0') || (strlen(host) >= sizeof(un->sun_path)) ){
+        log(g_log, "unix socket path %s error\n", host);
+        return -1;
+    }
+
+    bzero(un, sizeof(struct sockaddr_un));
+    un->sun_family = AF_UNIX;
+    strcpy(un->sun_path, host);
+    *len = sizeof(struct sockaddr_un);
+
+    return 0;
+}
+
+/*
+ * fun: resolve host in resolver thread, callback is called by event loop
+ *      with NULL address on failure
+ * arg: host, port, callback, callback argument
+ * ret: queued 0, error -1
+ *
+ */
+
+int my_dns_query(const char *host, const char *srv, my_dns_cb_t cb, void *arg)
+{
+    int res;
+    struct sockaddr_storage addr;
+    socklen_t len;
+    dns_query_t *q;
+
+    // no resolver thread, resolve in loop rather than never
+    if(dns_req_fd < 0){
+        if( (res = dns_resolve(host, srv, 0, &addr, &len)) < 0 ){
+            cb(arg, host, srv, NULL, 0);
+        } else {
+            cb(arg, host, srv, (struct sockaddr *)&addr, len);
+        }
+        return 0;
+    }
+
+    if( (q = malloc(sizeof(dns_query_t))) == NULL ){
+        log_err(g_log, "malloc error\n");
+        return -1;
+    }
+
+    bzero(q, sizeof(dns_query_t));
+    strncpy(q->host, host, sizeof(q->host) - 1);
+    strncpy(q->srv, srv, sizeof(q->srv) - 1);
+    q->cb = cb;
+    q->arg = arg;
+
+    // pointer size write to pipe is atomic
+    if(write(dns_req_fd, &q, sizeof(q)) != sizeof(q)){
+        log_err(g_log, "dns query %s:%s error\n", host, srv);
+        free(q);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * fun: resolver thread, blocks in getaddrinfo for every query
+ * arg: pipe fds
+ * ret: NULL
+ *
+ */
+
+static void *dns_thread(void *arg)
+{
+    int n;
+    dns_thread_t t = *(dns_thread_t *)arg;
+    dns_query_t *q;
+
+    free(arg);
+
+    while( (n = read(t.req_fd, &q, sizeof(q))) != 0 ){
+        if(n != sizeof(q)){
+            if(errno == EINTR){
+                continue;
+            }
+            break;
+        }
+
+        q->res = dns_resolve(q->host, q->srv, 0, &(q->addr), &(q->len));
+
+        if(write(t.res_fd, &q, sizeof(q)) != sizeof(q)){
+            free(q);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * fun: resolve host and port to the first stream address
+ * arg: host, port, getaddrinfo flags, address buffer, address length
+ * ret: success 0, error -1
+ *
+ */
+
+static int dns_resolve(const char *host, const char *srv, int flags, \
+                            struct sockaddr_storage *addr, socklen_t *len)
+{
+    struct addrinfo hints, *ai;
+
+    bzero(&hints, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = flags;
+
+    if(getaddrinfo(host, srv, &hints, &ai) != 0){
+        return -1;
+    }
+
+    memcpy(addr, ai->ai_addr, ai->ai_addrlen);
+    *len = ai->ai_addrlen;
+
+    freeaddrinfo(ai);
+
+    return 0;
+}
+
+/*
+ * fun: call back resolved queries
+ * arg: answer pipe fd, arg(not used)
+ * ret: always return 0
+ *
+ */
+
+static int dns_answer_cb(int fd, void *arg)
+{
+    dns_query_t *q;
+
+    while(read(fd, &q, sizeof(q)) == sizeof(q)){
+        if(q->res < 0){
+            q->cb(q->arg, q->host, q->srv, NULL, 0);
+        } else {
+            q->cb(q->arg, q->host, q->srv, \
+                            (struct sockaddr *)&(q->addr), q->len);
+        }
+        free(q);
+    }
+
+    return 0;
+}
@@ -0,0 +1,16 @@
+#ifndef _MY_DNS_H_
+#define _MY_DNS_H_
+
+#include <sys/socket.h>
+
+#define MY_DNS_UNIX "unix:"
+
+typedef int (*my_dns_cb_t)(void *arg, const char *host, const char *srv, \
+                            const struct sockaddr *addr, socklen_t len);
+
+int my_dns_init(void);
+int my_dns_numeric(const char *host, const char *srv, \
+                            struct sockaddr_storage *addr, socklen_t *len);
+int my_dns_query(const char *host, const char *srv, my_dns_cb_t cb, void *arg);
+
+#endif
@@ -0,0 +1,408 @@
+/*
+ * Copyright 2011-2013 Alibaba Group Holding Limited. All rights reserved.
+ * Use and distribution licensed under the GPL license.
+ *
+ * Authors: XiaoJinliang <xiaoshi.xjl@taobao.com>
+ *
+ */
+
+/*
+ * single flight of identical reads
+ *
+ * an autocommit select sent to mysql is registered by mmhash64 of current
+ * db, session key and normalized query. an identical select arriving
+ * before the first byte of answer waits on it instead of being sent. the
+ * result set of the first client is kept and copied to every waiting
+ * client, every command starts at packet 0, so the sequence numbers of the
+ * stream are right for all of them. an error, an answer above
+ * flight_max_size or a lost first client sends the waiting reads to mysql
+ * themselves. a flight nobody waits on is dropped at the first answer.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <list.h>
+#include <log.h>
+#include <hash.h>
+#include <handler.h>
+#include <timer.h>
+#include "my_flight.h"
+#include "my_resp.h"
+#include "my_sql.h"
+#include "my_buf.h"
+#include "my_ops.h"
+#include "my_pool.h"
+#include "my_local.h"
+#include "cli_pool.h"
+#include "conn_pool.h"
+#include "mysql_com.h"
+#include "my_conf.h"
+
+extern log_t *g_log;
+extern struct conf_t g_conf;
+
+#define FLIGHT_BUCKET 1024
+#define FLIGHT_MAX_TEXT (8 * 1024)
+
+typedef struct{
+    uint64_t key;
+    char *text;
+    int tlen;
+    conn_t *leader;
+    conn_t **wait;
+    int nwait;
+    int size;
+    int started;
+    char *data;
+    size_t len;
+    size_t dsize;
+    my_resp_t resp;
+    struct list_head hlink;
+} flight_t;
+
+static __thread struct list_head *bucket = NULL;
+
+static __thread uint64_t flights, joins, shares, fallbacks;
+
+static int flight_status_timer(unsigned long arg);
+static flight_t *flight_lookup(uint64_t key, char *text, int tlen);
+static int flight_join(flight_t *f, conn_t *c);
+static int flight_land(flight_t *f, int ok);
+
+/*
+ * fun: init flight table of worker
+ * arg:
+ * ret: success 0, error -1
+ *
+ */
+
+int my_flight_init(void)
+{
+    int i, res = 0;
+
+    if(!g_conf.flight){
+        return 0;
+    }
+
+    if( (bucket = malloc(sizeof(struct list_head) * FLIGHT_BUCKET)) == NULL ){
+        log_err(g_log, "malloc error\n");
+        return -1;
+    }
+
+    for(i = 0; i < FLIGHT_BUCKET; i++){
+        INIT_LIST_HEAD(bucket + i);
+    }
+
+    res = timer_register(flight_status_timer, 0, "flight_status_timer", 60);
+    if(res < 0){
+        log(g_log, "flight_status_timer register error\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * fun: wait on an identical read in flight, or register the read as
+ *      the flight others wait on
+ * arg: connection, client query is in connection buffer
+ * ret: waiting 1 and client is answered when the flight lands, sent by
+ *      caller 0
+ *
+ */
+
+int my_flight_get(conn_t *c)
+{
+    int len, tlen, dblen;
+    uint32_t pktlen;
+    uint64_t key, sess;
+    char *sql, text[FLIGHT_MAX_TEXT];
+    buf_t *buf = &(c->buf);
+    cli_conn_t *cli = c->cli;
+    flight_t *f;
+
+    if( (bucket == NULL) || (c->comno != COM_QUERY) || (c->fl != NULL) ){
+        return 0;
+    }
+
+    // reads of slaves only, as conn_need classifies them
+    if( (c->route == ROUTE_WRITE) || \
+        ((c->route != ROUTE_READ) && strncasecmp(c->arg, "select", 6)) ){
+        return 0;
+    }
+
+    if(c->my && my_conn_ctx_is_dirty(c->my)){
+        return 0;
+    }
+
+    // one whole packet numbered 0
+    if( (buf->used < HEADER_SIZE + 1) || (buf->ptr[3] != 0) ){
+        return 0;
+    }
+
+    pktlen = 0;
+    memcpy(&pktlen, buf->ptr, 3);
+    if( (pktlen < 1) || (pktlen + HEADER_SIZE != buf->used) ){
+        return 0;
+    }
+
+    sql = buf->ptr + HEADER_SIZE + 1;
+    len = pktlen - 1;
+
+    if(!sql_is_stable_read(sql, len)){
+        return 0;
+    }
+
+    // key text: session key, db '\0' normalized query
+    sess = my_local_sess_key(c);
+    memcpy(text, &sess, sizeof(sess));
+    dblen = strlen(c->curdb);
+    memcpy(text + sizeof(sess), c->curdb, dblen + 1);
+    tlen = sizeof(sess) + dblen + 1;
+    if( (len = sql_normalize(sql, len, text + tlen, sizeof(text) - tlen)) < 0 ){
+        return 0;
+    }
+    tlen += len;
+    key = mmhash64(text, tlen);
+
+    if( (f = flight_lookup(key, text, tlen)) != NULL ){
+        if(flight_join(f, c) < 0){
+            return 0;
+        }
+
+        if(del_handler(cli->fd) < 0){
+            log(g_log, "conn:%u del_handler error\n", c->connid);
+        }
+
+        conn_state_set_read_mysql_write_client(c);
+        joins++;
+
+        debug(g_log, "conn:%u wait on flight of conn:%u\n", \
+                                    c->connid, f->leader->connid);
+
+        return 1;
+    }
+
+    if( (f = calloc(1, sizeof(flight_t))) == NULL ){
+        log_err(g_log, "calloc error\n");
+        return 0;
+    }
+
+    if( (f->text = malloc(tlen)) == NULL ){
+        log_err(g_log, "malloc error\n");
+        free(f);
+        return 0;
+    }
+    memcpy(f->text, text, tlen);
+    f->tlen = tlen;
+    f->key = key;
+    f->leader = c;
+    my_resp_init(&(f->resp));
+
+    list_add_tail(&(f->hlink), bucket + (key % FLIGHT_BUCKET));
+    c->fl = f;
+
+    return 0;
+}
+
+/*
+ * fun: feed response read from mysql into flight of its first client
+ * arg: connection, data, data length
+ * ret: success 0, error -1
+ *
+ */
+
+int my_flight_feed(conn_t *c, const char *ptr, size_t len)
+{
+    int res;
+    size_t size;
+    char *data;
+    flight_t *f = c->fl;
+
+    if( (f == NULL) || (f->leader != c) ){
+        return 0;
+    }
+
+    // nobody waits, identical reads from now on start their own flight
+    if(!f->started){
+        f->started = 1;
+        if(f->nwait == 0){
+            return flight_land(f, 0);
+        }
+    }
+
+    if(f->len + len > (size_t)g_conf.flight_max_size * 1024){
+        return flight_land(f, 0);
+    }
+
+    if(f->len + len > f->dsize){
+        size = (f->dsize == 0) ? PREALLOC_BUF_SIZE : f->dsize;
+        while(size < f->len + len){
+            size *= 2;
+        }
+        if( (data = realloc(f->data, size)) == NULL ){
+            log_err(g_log, "realloc error\n");
+            flight_land(f, 0);
+            return -1;
+        }
+        f->data = data;
+        f->dsize = size;
+    }
+
+    memcpy(f->data + f->len, ptr, len);
+    f->len += len;
+
+    if( (res = my_resp_feed(&(f->resp), ptr, len)) < 0 ){
+        log(g_log, "conn:%u flight protocol error\n", c->connid);
+        flight_land(f, 0);
+        return -1;
+    } else if(res == 1) {
+        // errors may be transient, waiting reads try for themselves
+        flight_land(f, f->resp.type == RESP_TYPE_RESULT);
+    }
+
+    return 0;
+}
+
+/*
+ * fun: leave flight, reads waiting on a first client that is gone are
+ *      sent to mysql
+ * arg: connection
+ * ret: always return 0
+ *
+ */
+
+int my_flight_close(conn_t *c)
+{
+    int i;
+    flight_t *f = c->fl;
+
+    if(f == NULL){
+        return 0;
+    }
+
+    if(f->leader == c){
+        return flight_land(f, 0);
+    }
+
+    for(i = 0; i < f->nwait; i++){
+        if(f->wait[i] == c){
+            f->wait[i] = f->wait[--f->nwait];
+            break;
+        }
+    }
+    c->fl = NULL;
+
+    return 0;
+}
+
+/*
+ * fun: find flight in table
+ * arg: key, key text, text length
+ * ret: found return flight, not found NULL
+ *
+ */
+
+static flight_t *flight_lookup(uint64_t key, char *text, int tlen)
+{
+    struct list_head *head, *pos;
+    flight_t *f;
+
+    head = bucket + (key % FLIGHT_BUCKET);
+    list_for_each(pos, head){
+        f = list_entry(pos, flight_t, hlink);
+        if( (f->key == key) && (f->tlen == tlen) && (!memcmp(f->text, text, tlen)) ){
+            return f;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * fun: add connection to clients waiting on flight
+ * arg: flight, connection
+ * ret: success 0, error -1
+ *
+ */
+
+static int flight_join(flight_t *f, conn_t *c)
+{
+    int size;
+    conn_t **wait;
+
+    if(f->nwait == f->size){
+        size = (f->size == 0) ? 8 : f->size * 2;
+        if( (wait = realloc(f->wait, sizeof(conn_t *) * size)) == NULL ){
+            log_err(g_log, "realloc error\n");
+            return -1;
+        }
+        f->wait = wait;
+        f->size = size;
+    }
+
+    f->wait[f->nwait++] = c;
+    c->fl = f;
+
+    return 0;
+}
+
+/*
+ * fun: end flight, answer waiting clients with the kept response or send
+ *      their reads to mysql
+ * arg: flight, response is complete and shared
+ * ret: always return 0
+ *
+ */
+
+static int flight_land(flight_t *f, int ok)
+{
+    int i;
+    conn_t *c;
+
+    list_del(&(f->hlink));
+    f->leader->fl = NULL;
+
+    if(f->nwait > 0){
+        flights++;
+        if(ok){
+            shares += f->nwait;
+        } else {
+            fallbacks += f->nwait;
+        }
+    }
+
+    for(i = 0; i < f->nwait; i++){
+        c = f->wait[i];
+        c->fl = NULL;
+        cli_flight_answer(c, ok ? f->data : NULL, f->len);
+    }
+
+    free(f->wait);
+    free(f->text);
+    free(f->data);
+    free(f);
+
+    return 0;
+}
+
+/*
+ * fun: single flight status timer
+ * arg: not used
+ * ret: always return 0
+ *
+ */
+
+static int flight_status_timer(unsigned long arg)
+{
+    log(g_log, "flight flights[%llu] joins[%llu] shares[%llu] fallbacks[%llu]\n", \
+                (unsigned long long)flights, (unsigned long long)joins, \
+                (unsigned long long)shares, (unsigned long long)fallbacks);
+
+    return 0;
+}
@@ -0,0 +1,12 @@
+#ifndef _MY_FLIGHT_H_
+#define _MY_FLIGHT_H_
+
+#include "conn_pool.h"
+
+int my_flight_init(void);
+
+int my_flight_get(conn_t *c);
+int my_flight_feed(conn_t *c, const char *ptr, size_t len);
+int my_flight_close(conn_t *c);
+
+#endif
@@ -0,0 +1,110 @@
+/*
+ * Copyright 2011-2013 Alibaba Group Holding Limited. All rights reserved.
+ * Use and distribution licensed under the GPL license.
+ *
+ * Authors: XiaoJinliang <xiaoshi.xjl@taobao.com>
+ *
+ */
+
+/*
+ * open addressing table
+ *
+ * fixed size entries headed by my_htab_entry_t, found by rule type and 64
+ * bit key with linear probing. a table is sized once for the entries it
+ * will hold and never grows, owners build a new one from config and swap
+ * it in whole, so readers need no lock.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <log.h>
+#include "my_htab.h"
+
+extern log_t *g_log;
+
+static my_htab_entry_t *htab_slot(my_htab_t *t, int type, uint64_t key);
+
+/*
+ * fun: create table
+ * arg: max entries to add, size of entry
+ * ret: success return table, error NULL
+ *
+ */
+
+my_htab_t *my_htab_new(int count, int esize)
+{
+    uint32_t size;
+    my_htab_t *t;
+
+    // load factor at most one half
+    for(size = 16; size < count * 2; size <<= 1);
+
+    if( (t = calloc(1, sizeof(my_htab_t) + (size_t)esize * size)) == NULL ){
+        log_err(g_log, "calloc error\n");
+        return NULL;
+    }
+    t->mask = size - 1;
+    t->esize = esize;
+
+    return t;
+}
+
+/*
+ * fun: add entry to table, an entry of same type and key is returned as is
+ * arg: table, entry type, key
+ * ret: success return entry, table full NULL
+ *
+ */
+
+void *my_htab_add(my_htab_t *t, int type, uint64_t key)
+{
+    my_htab_entry_t *e = htab_slot(t, type, key);
+
+    if(e->type == 0){
+        if((t->count + 1) * 2 > t->mask + 1){
+            return NULL;
+        }
+        e->type = type;
+        e->key = key;
+        t->count++;
+    }
+
+    return e;
+}
+
+/*
+ * fun: find entry in table
+ * arg: table, entry type, key
+ * ret: found return entry, not found NULL
+ *
+ */
+
+void *my_htab_find(my_htab_t *t, int type, uint64_t key)
+{
+    my_htab_entry_t *e = htab_slot(t, type, key);
+
+    return (e->type == 0) ? NULL : e;
+}
+
+/*
+ * fun: probe slot of type and key
+ * arg: table, entry type, key
+ * ret: entry of type and key, or the empty slot ending the probe
+ *
+ */
+
+static my_htab_entry_t *htab_slot(my_htab_t *t, int type, uint64_t key)
+{
+    uint32_t i;
+    my_htab_entry_t *e;
+
+    for(i = key & t->mask; ; i = (i + 1) & t->mask){
+        e = (my_htab_entry_t *)(t->entry + (size_t)t->esize * i);
+        if( (e->type == 0) || ((e->type == type) && (e->key == key)) ){
+            return e;
+        }
+    }
+
+    return NULL;
+}
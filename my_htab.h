@@ -0,0 +1,23 @@
+#ifndef _MY_HTAB_H_
+#define _MY_HTAB_H_
+
+#include <stdint.h>
+
+// head of every entry, type 0 marks an empty slot
+typedef struct{
+    uint64_t key;
+    int type;
+} my_htab_entry_t;
+
+typedef struct{
+    uint32_t mask;
+    int count;
+    int esize;
+    char entry[0];
+} my_htab_t;
+
+my_htab_t *my_htab_new(int count, int esize);
+void *my_htab_add(my_htab_t *t, int type, uint64_t key);
+void *my_htab_find(my_htab_t *t, int type, uint64_t key);
+
+#endif
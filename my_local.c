@@ -0,0 +1,1071 @@
+/*
+ * Copyright 2011-2013 Alibaba Group Holding Limited. All rights reserved.
+ * Use and distribution licensed under the GPL license.
+ *
+ * Authors: XiaoJinliang <xiaoshi.xjl@taobao.com>
+ *
+ */
+
+/*
+ * local answers of session setup and metadata queries
+ *
+ * connectors send the same statements on every connect. a select of
+ * system variables listed by var rules is answered from the values
+ * captured the first time such a select is forwarded, a statement of a
+ * query rule from its whole response captured the same way. a set of
+ * variables listed by set rules is answered with ok and kept as session
+ * state of the client. before the next command is forwarded the mysql
+ * connection is brought to that state with one set statement, variables
+ * it has and the client has not are set back to default.
+ *
+ * captures are only taken by clients without session variables, such a
+ * client only gets the values it set itself answered locally.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <log.h>
+#include <hash.h>
+#include <common.h>
+#include "my_local.h"
+#include "my_resp.h"
+#include "my_sql.h"
+#include "my_buf.h"
+#include "my_pool.h"
+#include "conn_pool.h"
+#include "mysql_com.h"
+#include "my_protocol.h"
+#include "my_conf.h"
+
+extern log_t *g_log;
+extern struct conf_t g_conf;
+
+#define LOCAL_MAX_RULE 64
+#define LOCAL_MAX_SET 16
+#define LOCAL_MAX_VALUE 8
+#define LOCAL_MAX_COLUMN 16
+#define LOCAL_NAME_LEN 64
+#define LOCAL_VALUE_LEN 64
+#define LOCAL_MAX_TEXT 1024
+#define LOCAL_MAX_CAPTURE (64 * 1024)
+
+typedef struct{
+    char name[LOCAL_NAME_LEN];
+    int captured;
+    int null;
+    char value[LOCAL_VALUE_LEN];
+} local_var_t;
+
+typedef struct{
+    char name[LOCAL_NAME_LEN];
+    int nvalue;
+    char value[LOCAL_MAX_VALUE][LOCAL_VALUE_LEN];
+} local_set_t;
+
+typedef struct{
+    char *text;
+    int tlen;
+    char *data;
+    size_t len;
+} local_query_t;
+
+typedef struct{
+    uint32_t mask;
+    uint64_t key;
+    char value[LOCAL_MAX_SET][LOCAL_VALUE_LEN];
+
+    int active;
+    int query;
+    int nvar;
+    int var[LOCAL_MAX_COLUMN];
+    char *data;
+    size_t len;
+    size_t size;
+    my_resp_t resp;
+} local_conn_t;
+
+static __thread int local_on = 0;
+
+static __thread local_var_t var_rule[LOCAL_MAX_RULE];
+static __thread int var_count;
+static __thread local_set_t set_rule[LOCAL_MAX_SET];
+static __thread int set_count;
+static __thread local_query_t query_rule[LOCAL_MAX_RULE];
+static __thread int query_count;
+
+static local_conn_t *local_conn_get(conn_t *c);
+static int local_capture_drop(local_conn_t *lc);
+static int local_capture_start(conn_t *c, int query, int *var, int n);
+static int local_capture_vars(local_conn_t *lc);
+static int local_sess_key(local_conn_t *lc);
+static int local_find(const char *name, int len, int set);
+static int local_var_name(sql_token_t *tk, const char **name, int *len);
+static int local_set_accept(int index, sql_token_t *tk, int count);
+static int local_unquote(const char *ptr, int len, char *out, int size);
+static int local_normalize(const char *sql, int len, char *out, int size);
+static int local_set(conn_t *c, const char *sql, int len);
+static int local_select(conn_t *c, const char *sql, int len);
+static int local_query(conn_t *c, const char *sql, int len);
+
+/*
+ * fun: init local responder of worker
+ * arg:
+ * ret: success 0, error -1
+ *
+ */
+
+int my_local_init(void)
+{
+    if(!g_conf.local){
+        return 0;
+    }
+
+    if(my_local_rule_load(g_conf.local_conf) < 0){
+        log(g_log, "local rule %s load error\n", g_conf.local_conf);
+    }
+
+    local_on = 1;
+
+    return 0;
+}
+
+/*
+ * fun: load local rules, "var name", "set name [value ...]" or
+ *      "query statement"
+ * arg: rule config path
+ * ret: success 0, error -1
+ *
+ */
+
+int my_local_rule_load(const char *conf)
+{
+    int i, n, line = 0;
+    FILE *fp;
+    char buf[1024], type[64], *ptr, *tok, *save;
+    char text[LOCAL_MAX_TEXT];
+    local_set_t *s;
+    local_query_t *q;
+
+    for(i = 0; i < query_count; i++){
+        free(query_rule[i].text);
+        free(query_rule[i].data);
+    }
+    var_count = set_count = query_count = 0;
+
+    if( (fp = fopen(conf, "r")) == NULL ){
+        log(g_log, "fopen %s error\n", conf);
+        return -1;
+    }
+
+    while(fgets(buf, sizeof(buf), fp)){
+        line++;
+        trim(buf);
+        if( (*buf == '#') || (*buf == '\0') ){
+            continue;
+        }
+
+        if( (sscanf(buf, "%63s %n", type, &n) < 1) || (buf[n] == '\0') ){
+            log(g_log, "local rule line[%d] error\n", line);
+            continue;
+        }
+        ptr = buf + n;
+
+        if(!strcmp(type, "var")){
+            if( (var_count >= LOCAL_MAX_RULE) || (strlen(ptr) >= LOCAL_NAME_LEN) ){
+                log(g_log, "local rule line[%d] error, var limit\n", line);
+                continue;
+            }
+            bzero(&(var_rule[var_count]), sizeof(local_var_t));
+            strcpy(var_rule[var_count].name, ptr);
+            var_count++;
+        } else if(!strcmp(type, "set")) {
+            if(set_count >= LOCAL_MAX_SET){
+                log(g_log, "local rule line[%d] error, set limit\n", line);
+                continue;
+            }
+            s = &(set_rule[set_count]);
+            bzero(s, sizeof(local_set_t));
+
+            tok = strtok_r(ptr, " \t", &save);
+            strncpy(s->name, tok, sizeof(s->name) - 1);
+            while( (s->nvalue < LOCAL_MAX_VALUE) && \
+                   ((tok = strtok_r(NULL, " \t", &save)) != NULL) ){
+                strncpy(s->value[s->nvalue], tok, sizeof(s->value[0]) - 1);
+                s->nvalue++;
+            }
+            set_count++;
+        } else if(!strcmp(type, "query")) {
+            if(query_count >= LOCAL_MAX_RULE){
+                log(g_log, "local rule line[%d] error, query limit\n", line);
+                continue;
+            }
+            if( (n = local_normalize(ptr, strlen(ptr), text, sizeof(text))) < 0 ){
+                log(g_log, "local rule line[%d] error, query too long\n", line);
+                continue;
+            }
+            q = &(query_rule[query_count]);
+            if( (q->text = malloc(n)) == NULL ){
+                log_err(g_log, "malloc error\n");
+                continue;
+            }
+            memcpy(q->text, text, n);
+            q->tlen = n;
+            q->data = NULL;
+            q->len = 0;
+            query_count++;
+        } else {
+            log(g_log, "local rule line[%d] error, unknown type %s\n", line, type);
+            continue;
+        }
+    }
+
+    fclose(fp);
+
+    log(g_log, "local rule %s loaded, %d var, %d set, %d query\n", \
+                                conf, var_count, set_count, query_count);
+
+    return 0;
+}
+
+/*
+ * fun: answer client query locally, capture the response if it is
+ *      forwarded for lack of values
+ * arg: connection, client query is in connection buffer
+ * ret: answered 1 and answer is in connection buffer, not 0
+ *
+ */
+
+int my_local_get(conn_t *c)
+{
+    int res, len;
+    uint32_t pktlen;
+    char *sql;
+    buf_t *buf = &(c->buf);
+    sql_lexer_t lex;
+    sql_token_t tk;
+
+    if( (!local_on) || (c->comno != COM_QUERY) ){
+        return 0;
+    }
+
+    // statements in a transaction or pinned session go to mysql as before
+    if(c->my && my_conn_ctx_is_dirty(c->my)){
+        return 0;
+    }
+
+    if(buf->used < HEADER_SIZE + 1){
+        return 0;
+    }
+
+    pktlen = 0;
+    memcpy(&pktlen, buf->ptr, 3);
+    if( (pktlen < 1) || (pktlen + HEADER_SIZE > buf->used) ){
+        return 0;
+    }
+
+    sql = buf->ptr + HEADER_SIZE + 1;
+    len = pktlen - 1;
+
+    sql_lex_init(&lex, sql, len);
+    sql_lex_next(&lex, &tk);
+
+    if(sql_tk_is(&tk, "set")){
+        return local_set(c, sql, len);
+    }
+
+    if( sql_tk_is(&tk, "select") && \
+        ((res = local_select(c, sql, len)) >= 0) ){
+        return res;
+    }
+
+    return local_query(c, sql, len);
+}
+
+/*
+ * fun: feed response read from mysql into capture
+ * arg: connection, data, data length
+ * ret: success 0, error -1
+ *
+ */
+
+int my_local_feed(conn_t *c, const char *ptr, size_t len)
+{
+    int res;
+    size_t size;
+    char *data;
+    local_conn_t *lc = c->lc;
+    local_query_t *q;
+
+    if( (lc == NULL) || (!lc->active) ){
+        return 0;
+    }
+
+    if(lc->len + len > LOCAL_MAX_CAPTURE){
+        local_capture_drop(lc);
+        return 0;
+    }
+
+    if(lc->len + len > lc->size){
+        size = (lc->size == 0) ? 1024 : lc->size;
+        while(size < lc->len + len){
+            size *= 2;
+        }
+        if( (data = realloc(lc->data, size)) == NULL ){
+            log_err(g_log, "realloc error\n");
+            local_capture_drop(lc);
+            return -1;
+        }
+        lc->data = data;
+        lc->size = size;
+    }
+
+    memcpy(lc->data + lc->len, ptr, len);
+    lc->len += len;
+
+    if( (res = my_resp_feed(&(lc->resp), ptr, len)) < 0 ){
+        log(g_log, "conn:%u local capture protocol error\n", c->connid);
+        local_capture_drop(lc);
+        return -1;
+    } else if(res == 0) {
+        return 0;
+    }
+
+    if(lc->resp.type == RESP_TYPE_RESULT){
+        if(lc->query >= 0){
+            q = &(query_rule[lc->query]);
+            if(q->data == NULL){
+                q->data = lc->data;
+                q->len = lc->len;
+                lc->data = NULL;
+                lc->len = lc->size = 0;
+            }
+        } else if(local_capture_vars(lc) < 0) {
+            log(g_log, "conn:%u local capture of variables error\n", c->connid);
+        }
+    }
+
+    local_capture_drop(lc);
+
+    return 0;
+}
+
+/*
+ * fun: command is done, drop unfinished capture
+ * arg: connection
+ * ret: always return 0
+ *
+ */
+
+int my_local_query_end(conn_t *c)
+{
+    if(c->lc){
+        local_capture_drop(c->lc);
+    }
+
+    return 0;
+}
+
+/*
+ * fun: release local state of connection
+ * arg: connection
+ * ret: always return 0
+ *
+ */
+
+int my_local_close(conn_t *c)
+{
+    local_conn_t *lc = c->lc;
+
+    if(lc == NULL){
+        return 0;
+    }
+
+    local_capture_drop(lc);
+    free(lc->data);
+    free(lc);
+    c->lc = NULL;
+
+    return 0;
+}
+
+/*
+ * fun: check client has no session variables
+ * arg: connection
+ * ret: yes 1, no 0
+ *
+ */
+
+int my_local_sess_empty(conn_t *c)
+{
+    local_conn_t *lc = c->lc;
+
+    return (lc == NULL) || (lc->key == 0);
+}
+
+/*
+ * fun: get key of client session variables
+ * arg: connection
+ * ret: session key, 0 without session variables
+ *
+ */
+
+uint64_t my_local_sess_key(conn_t *c)
+{
+    local_conn_t *lc = c->lc;
+
+    return lc ? lc->key : 0;
+}
+
+/*
+ * fun: check session variables of mysql connection differ from client
+ * arg: connection
+ * ret: yes 1, no 0
+ *
+ */
+
+int my_local_sess_diff(conn_t *c)
+{
+    local_conn_t *lc = c->lc;
+
+    if(c->my == NULL){
+        return 0;
+    }
+
+    return c->my->ctx.sess_key != (lc ? lc->key : 0);
+}
+
+/*
+ * fun: make set statement bringing mysql connection to client session
+ * arg: connection, sql buffer, buffer size
+ * ret: success return sql length, error -1
+ *
+ */
+
+int my_local_sess_make(conn_t *c, char *sql, int size)
+{
+    int i, n, len;
+    uint32_t mask, cmask;
+    const char *value;
+    local_conn_t *lc = c->lc;
+
+    cmask = lc ? lc->mask : 0;
+    mask = c->my->ctx.sess_mask | cmask;
+
+    len = snprintf(sql, size, "SET ");
+    for(i = 0, n = 0; i < set_count; i++){
+        if(!(mask & (1U << i))){
+            continue;
+        }
+
+        value = (cmask & (1U << i)) ? lc->value[i] : "DEFAULT";
+        if(!strcasecmp(set_rule[i].name, "names")){
+            len += snprintf(sql + len, size - len, "%sNAMES %s", \
+                                            n ? ", " : "", value);
+        } else {
+            len += snprintf(sql + len, size - len, "%s%s = %s", \
+                                            n ? ", " : "", set_rule[i].name, value);
+        }
+        n++;
+
+        if(len >= size){
+            return -1;
+        }
+    }
+
+    return len;
+}
+
+/*
+ * fun: mysql connection is brought to client session
+ * arg: connection
+ * ret: always return 0
+ *
+ */
+
+int my_local_sess_done(conn_t *c)
+{
+    local_conn_t *lc = c->lc;
+
+    c->my->ctx.sess_mask = lc ? lc->mask : 0;
+    c->my->ctx.sess_key = lc ? lc->key : 0;
+
+    return 0;
+}
+
+/*
+ * fun: get local state of connection, alloc it if not exists
+ * arg: connection
+ * ret: success return local state, error return NULL
+ *
+ */
+
+static local_conn_t *local_conn_get(conn_t *c)
+{
+    local_conn_t *lc;
+
+    if(c->lc){
+        return c->lc;
+    }
+
+    if( (lc = calloc(1, sizeof(local_conn_t))) == NULL ){
+        log_err(g_log, "calloc error\n");
+        return NULL;
+    }
+    c->lc = lc;
+
+    return lc;
+}
+
+/*
+ * fun: drop capture, buffer is kept for the next one
+ * arg: local state
+ * ret: always return 0
+ *
+ */
+
+static int local_capture_drop(local_conn_t *lc)
+{
+    lc->active = 0;
+    lc->len = 0;
+
+    return 0;
+}
+
+/*
+ * fun: capture response of forwarded query
+ * arg: connection, query rule index or -1, var rule of every column,
+ *      column count
+ * ret: success 0, error -1
+ *
+ */
+
+static int local_capture_start(conn_t *c, int query, int *var, int n)
+{
+    local_conn_t *lc;
+
+    if( (lc = local_conn_get(c)) == NULL ){
+        return -1;
+    }
+
+    local_capture_drop(lc);
+
+    lc->query = query;
+    lc->nvar = n;
+    if(n > 0){
+        memcpy(lc->var, var, sizeof(int) * n);
+    }
+    my_resp_init(&(lc->resp));
+    lc->active = 1;
+
+    return 0;
+}
+
+/*
+ * fun: keep variable values of the first row of captured result
+ * arg: local state
+ * ret: success 0, error -1
+ *
+ */
+
+static int local_capture_vars(local_conn_t *lc)
+{
+    int i, res;
+    uint32_t pktlen;
+    uint8_t pktno;
+    uint64_t count, vlen;
+    char *ptr = lc->data, *end = lc->data + lc->len, *val;
+    local_var_t *v;
+
+    // column count, fields and eof, then the row
+    for(i = 0; ; i++){
+        if(ptr + HEADER_SIZE > end){
+            return -1;
+        }
+        parse_pkt_header(ptr, &pktlen, &pktno);
+        if(ptr + HEADER_SIZE + pktlen > end){
+            return -1;
+        }
+        ptr += HEADER_SIZE;
+
+        if(i == 0){
+            val = ptr;
+            if( (parse_lenenc(&val, ptr + pktlen, &count) != 0) || \
+                (count != lc->nvar) ){
+                return -1;
+            }
+        } else if(i == lc->nvar + 2) {
+            break;
+        }
+
+        ptr += pktlen;
+    }
+
+    // no row
+    if( (pktlen < 9) && ((uint8_t)*ptr == 0xfe) ){
+        return -1;
+    }
+
+    for(i = 0; i < lc->nvar; i++){
+        if( (res = parse_row_value(ptr, pktlen, i, &val, &vlen)) < 0 ){
+            return -1;
+        }
+
+        v = &(var_rule[lc->var[i]]);
+        if(res == 1){
+            v->null = 1;
+        } else if(vlen < sizeof(v->value)) {
+            memcpy(v->value, val, vlen);
+            v->value[vlen] = '\0';
+            v->null = 0;
+        } else {
+            continue;
+        }
+        v->captured = 1;
+    }
+
+    return 0;
+}
+
+/*
+ * fun: hash session variables of client, 0 without any
+ * arg: local state
+ * ret: always return 0
+ *
+ */
+
+static int local_sess_key(local_conn_t *lc)
+{
+    int i, len = 0;
+    char text[LOCAL_MAX_SET * (LOCAL_VALUE_LEN + 8)];
+
+    if(lc->mask == 0){
+        lc->key = 0;
+        return 0;
+    }
+
+    for(i = 0; i < set_count; i++){
+        if(lc->mask & (1U << i)){
+            len += snprintf(text + len, sizeof(text) - len, "%d=%s\n", i, lc->value[i]);
+        }
+    }
+
+    lc->key = mmhash64(text, len);
+    if(lc->key == 0){
+        lc->key = 1;
+    }
+
+    return 0;
+}
+
+/*
+ * fun: find var or set rule by variable name
+ * arg: name, name length, 1 set rule, 0 var rule
+ * ret: found return rule index, not found -1
+ *
+ */
+
+static int local_find(const char *name, int len, int set)
+{
+    int i, count = set ? set_count : var_count;
+    const char *rule;
+
+    for(i = 0; i < count; i++){
+        rule = set ? set_rule[i].name : var_rule[i].name;
+        if( (strlen(rule) == len) && (!strncasecmp(rule, name, len)) ){
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * fun: get session variable name of @@name, @@session.name, @@local.name
+ * arg: variable token, name, name length
+ * ret: success 0, global or user variable -1
+ *
+ */
+
+static int local_var_name(sql_token_t *tk, const char **name, int *len)
+{
+    const char *ptr = tk->ptr, *end = tk->ptr + tk->len;
+
+    if( (tk->len < 3) || (ptr[1] != '@') ){
+        return -1;
+    }
+    ptr += 2;
+
+    if( (end - ptr > 8) && (!strncasecmp(ptr, "session.", 8)) ){
+        ptr += 8;
+    } else if( (end - ptr > 6) && (!strncasecmp(ptr, "local.", 6)) ){
+        ptr += 6;
+    }
+
+    if( (ptr >= end) || memchr(ptr, '.', end - ptr) || memchr(ptr, '@', end - ptr) ){
+        return -1;
+    }
+
+    *name = ptr;
+    *len = end - ptr;
+
+    return 0;
+}
+
+/*
+ * fun: check value is accepted by set rule, default is always accepted
+ * arg: set rule index, first token of value, token count of value
+ * ret: yes 1, no 0
+ *
+ */
+
+static int local_set_accept(int index, sql_token_t *tk, int count)
+{
+    int i;
+    local_set_t *s = &(set_rule[index]);
+
+    if(s->nvalue == 0){
+        return 1;
+    }
+
+    if(count != 1){
+        return 0;
+    }
+
+    if(sql_tk_is(tk, "default")){
+        return 1;
+    }
+
+    for(i = 0; i < s->nvalue; i++){
+        if( (strlen(s->value[i]) == tk->len) && \
+            (!strncasecmp(s->value[i], tk->ptr, tk->len)) ){
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * fun: copy value text, quotes of a single string are removed
+ * arg: value text, length, output buffer, buffer size
+ * ret: success return length, too long -1
+ *
+ */
+
+static int local_unquote(const char *ptr, int len, char *out, int size)
+{
+    if( (len >= 2) && ((*ptr == '\'') || (*ptr == '"')) && (ptr[len - 1] == *ptr) ){
+        ptr++;
+        len -= 2;
+    }
+
+    if(len >= size){
+        return -1;
+    }
+
+    memcpy(out, ptr, len);
+    out[len] = '\0';
+
+    return len;
+}
+
+/*
+ * fun: normalize statement, trailing semicolons are removed
+ * arg: sql text, sql length, output buffer, buffer size
+ * ret: success return normalized length, too long -1
+ *
+ */
+
+static int local_normalize(const char *sql, int len, char *out, int size)
+{
+    int n;
+
+    if( (n = sql_normalize(sql, len, out, size)) < 0 ){
+        return -1;
+    }
+
+    while( (n > 0) && ((out[n - 1] == ';') || (out[n - 1] == ' ')) ){
+        n--;
+    }
+
+    return n;
+}
+
+/*
+ * fun: answer set of session variables listed by set rules
+ * arg: connection, sql text, sql length
+ * ret: answered 1, not 0
+ *
+ */
+
+static int local_set(conn_t *c, const char *sql, int len)
+{
+    int i, n = 0, count, depth, nlen;
+    int index[LOCAL_MAX_SET], vlen[LOCAL_MAX_SET];
+    const char *name, *start, *vptr[LOCAL_MAX_SET];
+    sql_lexer_t lex;
+    sql_token_t tk, first;
+    local_conn_t *lc;
+
+    sql_lex_init(&lex, sql, len);
+    sql_lex_next(&lex, &tk);
+    sql_lex_next(&lex, &tk);
+
+    while(1){
+        if(n >= LOCAL_MAX_SET){
+            return 0;
+        }
+
+        if(sql_tk_is(&tk, "session") || sql_tk_is(&tk, "local")){
+            sql_lex_next(&lex, &tk);
+        }
+
+        if(tk.type == TK_VARIABLE){
+            if(local_var_name(&tk, &name, &nlen) < 0){
+                return 0;
+            }
+        } else if(tk.type == TK_IDENT) {
+            name = tk.ptr;
+            nlen = tk.len;
+        } else {
+            return 0;
+        }
+
+        if( (index[n] = local_find(name, nlen, 1)) < 0 ){
+            return 0;
+        }
+
+        // names takes charset and collation, others an assignment
+        sql_lex_next(&lex, &tk);
+        if( (nlen != 5) || strncasecmp(name, "names", 5) ){
+            if(!sql_tk_is_punct(&tk, '=')){
+                return 0;
+            }
+            sql_lex_next(&lex, &tk);
+        }
+
+        first = tk;
+        start = tk.ptr;
+        if( (tk.type == TK_STRING) || (tk.type == TK_QIDENT) ){
+            start--;
+        }
+
+        count = depth = 0;
+        vlen[n] = 0;
+        while( (tk.type != TK_END) && \
+               ((depth > 0) || ((!sql_tk_is_punct(&tk, ',')) && \
+                                (!sql_tk_is_punct(&tk, ';')))) ){
+            if(sql_tk_is_punct(&tk, '(')){
+                depth++;
+            } else if(sql_tk_is_punct(&tk, ')') && (--depth < 0)) {
+                return 0;
+            }
+            vlen[n] = lex.ptr - start;
+            count++;
+            sql_lex_next(&lex, &tk);
+        }
+
+        if( (count == 0) || (vlen[n] >= LOCAL_VALUE_LEN) || \
+            (!local_set_accept(index[n], &first, count)) ){
+            return 0;
+        }
+        vptr[n] = start;
+        n++;
+
+        if(sql_tk_is_punct(&tk, ',')){
+            sql_lex_next(&lex, &tk);
+            continue;
+        }
+
+        while(tk.type != TK_END){
+            if(!sql_tk_is_punct(&tk, ';')){
+                return 0;
+            }
+            sql_lex_next(&lex, &tk);
+        }
+
+        break;
+    }
+
+    if( (lc = local_conn_get(c)) == NULL ){
+        return 0;
+    }
+
+    for(i = 0; i < n; i++){
+        if( (vlen[i] == 7) && (!strncasecmp(vptr[i], "default", 7)) ){
+            lc->mask &= ~(1U << index[i]);
+            continue;
+        }
+        memcpy(lc->value[index[i]], vptr[i], vlen[i]);
+        lc->value[index[i]][vlen[i]] = '\0';
+        lc->mask |= 1U << index[i];
+    }
+    local_sess_key(lc);
+
+    if(make_result_ok(&(c->buf), 1, SERVER_STATUS_AUTOCOMMIT) < 0){
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * fun: answer select of variables listed by var rules
+ * arg: connection, sql text, sql length
+ * ret: answered 1, forwarded 0, not such a select -1
+ *
+ */
+
+static int local_select(conn_t *c, const char *sql, int len)
+{
+    int i, n = 0, index, nlen, miss = 0, pktno;
+    int var[LOCAL_MAX_COLUMN];
+    char names[LOCAL_MAX_COLUMN][LOCAL_NAME_LEN];
+    char values[LOCAL_MAX_COLUMN][LOCAL_VALUE_LEN];
+    const char *name, *cols[LOCAL_MAX_COLUMN], *vals[LOCAL_MAX_COLUMN];
+    sql_lexer_t lex;
+    sql_token_t tk;
+    local_conn_t *lc = c->lc;
+
+    sql_lex_init(&lex, sql, len);
+    sql_lex_next(&lex, &tk);
+    sql_lex_next(&lex, &tk);
+
+    while(1){
+        if( (n >= LOCAL_MAX_COLUMN) || (tk.type != TK_VARIABLE) || \
+            (local_var_name(&tk, &name, &nlen) < 0) || \
+            ((var[n] = local_find(name, nlen, 0)) < 0) || \
+            (tk.len >= LOCAL_NAME_LEN) ){
+            return -1;
+        }
+
+        // column is named as written unless aliased
+        memcpy(names[n], tk.ptr, tk.len);
+        names[n][tk.len] = '\0';
+
+        sql_lex_next(&lex, &tk);
+        if(sql_tk_is(&tk, "as")){
+            sql_lex_next(&lex, &tk);
+            if( ((tk.type != TK_IDENT) && (tk.type != TK_QIDENT) && \
+                 (tk.type != TK_STRING)) || (tk.len >= LOCAL_NAME_LEN) ){
+                return -1;
+            }
+            memcpy(names[n], tk.ptr, tk.len);
+            names[n][tk.len] = '\0';
+            sql_lex_next(&lex, &tk);
+        }
+        n++;
+
+        if(!sql_tk_is_punct(&tk, ',')){
+            break;
+        }
+        sql_lex_next(&lex, &tk);
+    }
+
+    if(sql_tk_is(&tk, "limit")){
+        if(sql_lex_next(&lex, &tk) != TK_NUMBER){
+            return -1;
+        }
+        sql_lex_next(&lex, &tk);
+    }
+
+    while(tk.type != TK_END){
+        if(!sql_tk_is_punct(&tk, ';')){
+            return -1;
+        }
+        sql_lex_next(&lex, &tk);
+    }
+
+    for(i = 0; i < n; i++){
+        cols[i] = names[i];
+        name = var_rule[var[i]].name;
+
+        // value the client set itself
+        index = local_find(name, strlen(name), 1);
+        if( lc && (index >= 0) && (lc->mask & (1U << index)) ){
+            local_unquote(lc->value[index], strlen(lc->value[index]), \
+                                                values[i], sizeof(values[i]));
+            vals[i] = values[i];
+            continue;
+        }
+
+        // other session variables may change it
+        if(lc && lc->mask){
+            return 0;
+        }
+
+        if(!var_rule[var[i]].captured){
+            miss = 1;
+            continue;
+        }
+        vals[i] = var_rule[var[i]].null ? NULL : var_rule[var[i]].value;
+    }
+
+    if(miss){
+        local_capture_start(c, -1, var, n);
+        return 0;
+    }
+
+    if( ((pktno = make_result_head(&(c->buf), cols, n)) < 0) || \
+        (make_result_row(&(c->buf), pktno, vals, n) < 0) || \
+        (make_result_end(&(c->buf), pktno + 1) < 0) ){
+        log(g_log, "conn:%u make local result error\n", c->connid);
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * fun: answer statement of query rule with captured response
+ * arg: connection, sql text, sql length
+ * ret: answered 1, not 0
+ *
+ */
+
+static int local_query(conn_t *c, const char *sql, int len)
+{
+    int i, tlen;
+    char text[LOCAL_MAX_TEXT];
+    buf_t *buf = &(c->buf);
+    local_query_t *q;
+
+    if( (query_count == 0) || (!my_local_sess_empty(c)) ){
+        return 0;
+    }
+
+    if( (tlen = local_normalize(sql, len, text, sizeof(text))) < 0 ){
+        return 0;
+    }
+
+    for(i = 0; i < query_count; i++){
+        q = &(query_rule[i]);
+        if( (q->tlen == tlen) && (!memcmp(q->text, text, tlen)) ){
+            break;
+        }
+    }
+
+    if(i >= query_count){
+        return 0;
+    }
+
+    if(q->data == NULL){
+        local_capture_start(c, i, NULL, 0);
+        return 0;
+    }
+
+    buf_reset(buf);
+    if(buf_realloc(buf, q->len) == NULL){
+        log(g_log, "conn:%u buf_realloc error\n", c->connid);
+        return 0;
+    }
+    memcpy(buf->ptr, q->data, q->len);
+    buf->used = q->len;
+    buf->pos = 0;
+
+    return 1;
+}
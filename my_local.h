@@ -0,0 +1,20 @@
+#ifndef _MY_LOCAL_H_
+#define _MY_LOCAL_H_
+
+#include "conn_pool.h"
+
+int my_local_init(void);
+int my_local_rule_load(const char *conf);
+
+int my_local_get(conn_t *c);
+int my_local_feed(conn_t *c, const char *ptr, size_t len);
+int my_local_query_end(conn_t *c);
+int my_local_close(conn_t *c);
+
+int my_local_sess_empty(conn_t *c);
+uint64_t my_local_sess_key(conn_t *c);
+int my_local_sess_diff(conn_t *c);
+int my_local_sess_make(conn_t *c, char *sql, int size);
+int my_local_sess_done(conn_t *c);
+
+#endif
@@ -18,6 +18,7 @@
 #include <errno.h>
 #include <log.h>
 #include <handler.h>
+#include <timer.h>
 #include "my_ops.h"
 #include "my_buf.h"
 #include "conn_pool.h"
@@ -28,31 +29,45 @@
 #include "sqldump.h"
 #include "passwd.h"
 #include "my_conf.h"
+#include "my_scatter.h"
+#include "my_cache.h"
+#include "my_digest.h"
+#include "my_flight.h"
+#include "my_local.h"
+#include "my_user.h"
 
 extern log_t *g_log;
 extern struct conf_t g_conf;
 
 static int my_real_read(int fd, buf_t *buf, int *done);
-static int my_real_read_result_set(int fd, buf_t *buf);
-static int my_real_write(int fd, buf_t *buf, int *done);
 static int pr_cap(uint32_t cap);
 
 static int cli_com_ignored(conn_t *c);
 static int cli_com_ok_write_cb(int fd, void *arg);
 static int cli_com_forward(conn_t *c);
+static int cli_com_mysql(conn_t *c);
+static int cli_com_send(conn_t *c);
+static int cli_com_retry(conn_t *c);
+static int my_hedge_query_cb(int fd, void *arg);
 static int cli_com_unsupported(conn_t *c);
+static int cli_com_local(conn_t *c);
+static int cli_com_local_write_cb(int fd, void *arg);
 
 static int my_use_db_prepare(conn_t *c);
 static int my_use_db_resp_cb(int fd, void *arg);
 static int my_use_db_req_cb(int fd, void *arg);
 
+static int my_sess_prepare(conn_t *c);
+static int my_sess_req_cb(int fd, void *arg);
+static int my_sess_resp_cb(int fd, void *arg);
+
 static int my_ping_req_cb(int fd, void *arg);
 static int my_ping_resp_cb(int fd, void *arg);
 
 static int cli_hs_auth_fail_cb(int fd, void *arg);
 
 static uint32_t cap_umask = CLIENT_FOUND_ROWS | CLIENT_NO_SCHEMA | \
-                            CLIENT_ODBC | CLIENT_COMPRESS;
+                            CLIENT_ODBC | CLIENT_COMPRESS | CLIENT_DEPRECATE_EOF;
 
 /*
  * fun: mysql handshake stage1 callback
@@ -132,7 +147,7 @@ int my_hs_stage1_cb(int fd, void *arg)
             login.scram[0] = 0;
         } else {
             login.scram[0] = 20;
-            scramble(token, message, pass);
+            scramble_hash(token, message, node->stage1, node->stage2);
             memcpy(login.scram + 1, token, 20);
         }
         strncpy(login.db, "", sizeof(login.db) - 1);
@@ -285,25 +300,40 @@ int cli_hs_stage1_prepare(conn_t *c)
     buf_t *buf;
     my_auth_init_t init;
     my_info_t *info;
-    my_node_t *node;
-    my_conn_t *my;
+    my_result_error_t error;
 
     debug(g_log, "%s called\n", __func__);
 
     cli = c->cli;
+    buf = &(cli->buf);
 
-    if( (res = conn_alloc_my_conn(c)) < 0 ){
-        log(g_log, "conn:%u conn_alloc_my_conn error\n", c->connid);
-        return -1;
-    } else {
-        debug(g_log, "conn:%u conn_alloc_my_conn success\n", c->connid);
+    // handed after waiting for mysql info, bound on the first command
+    if(c->my){
+        my_conn_put(c->my);
+        c->my = NULL;
     }
 
-    my = c->my;
-    node = my->node;
-    info = node->info;
+    // greeting is made from the info of the last mysql handshake, a mysql
+    // connection is bound on the first command. before the first handshake
+    // of the worker the client waits for one
+    if( (info = my_info_get()) == NULL ){
+        if( (my_info_want() == 0) && \
+            (conn_wait_my_conn(c, cli_hs_stage1_prepare) == 0) ){
+            return 0;
+        }
 
-    buf = &(cli->buf);
+        log(g_log, "conn:%u no mysql connected yet\n", c->connid);
+
+        error.field_count = 0xff;
+        error.err = 1040;
+        error.marker = '#';
+        memcpy(error.sqlstate, "08004", 5);
+        snprintf(error.msg, sizeof(error.msg), "no mysql connected yet");
+        error.pktno = 0;
+        make_result_error(buf, &error);
+
+        return add_handler(cli->fd, EPOLLOUT, cli_hs_auth_fail_cb, cli);
+    }
 
     bzero(&init, sizeof(init));
     init.pktno = 0;
@@ -312,7 +342,7 @@ int cli_hs_stage1_prepare(conn_t *c)
     init.srv_ver[sizeof(init.srv_ver) - 1] = '\0';
     init.tid = c->connid;
     memcpy(init.scram, cli->scram, 8);
-    init.cap = info->cap;
+    init.cap = info->cap & (~cap_umask);
     init.lang = info->lang;
     init.status = info->status;
     init.scram_len = 0;
@@ -406,7 +436,6 @@ int cli_hs_stage2_cb(int fd, void *arg)
     my_auth_result_t result;
     cli_auth_login_t login;
     my_result_error_t error;
-    char token[128];
 
     cli = (cli_conn_t *)arg;
     c = cli->conn;
@@ -437,28 +466,25 @@ int cli_hs_stage2_cb(int fd, void *arg)
             debug(g_log, "conn:%u parse login success\n", c->connid);
         }
 
-        if(!strcmp(login.user, g_conf.user)){
-            scramble(token, cli->scram, g_conf.passwd);
-            if(memcmp(token, login.scram, 20) == 0){
-                log(g_log, "conn:%u login auth success\n", c->connid);
-
-                strncpy(c->curdb, login.db, sizeof(c->curdb) - 1);
-                result.pktno = 2;
-                if( (res = make_auth_result(buf, &result)) < 0 ){
-                    log(g_log, "conn:%u make auth result error\n", c->connid);
-                    goto end;
-                } else {
-                    debug(g_log, "conn:%u make auth result success\n", c->connid);
-                }
+        if(my_user_check(login.user, login.scram, cli->scram) == 0){
+            log(g_log, "conn:%u login auth success\n", c->connid);
 
-                res = add_handler(fd, EPOLLOUT, cli_hs_stage3_cb, arg);
-                if(res < 0){
-                    log(g_log, "conn:%u add_handler error\n", c->connid);
-                    goto end;
-                }
+            strncpy(c->curdb, login.db, sizeof(c->curdb) - 1);
+            result.pktno = 2;
+            if( (res = make_auth_result(buf, &result)) < 0 ){
+                log(g_log, "conn:%u make auth result error\n", c->connid);
+                goto end;
+            } else {
+                debug(g_log, "conn:%u make auth result success\n", c->connid);
+            }
 
-                return res;
+            res = add_handler(fd, EPOLLOUT, cli_hs_stage3_cb, arg);
+            if(res < 0){
+                log(g_log, "conn:%u add_handler error\n", c->connid);
+                goto end;
             }
+
+            return res;
         }
 
         log(g_log, "login auth fail, wrong user or passwd\n");
@@ -611,21 +637,28 @@ int cli_query_cb(int fd, void *arg)
 
     if(c->state == STATE_IDLE){
         conn_state_set_reading_client(c);
-        gettimeofday(&(c->tv_start), NULL);
+        c->start_us = timer_us();
     } else if( (c->state == STATE_PREPARE_MYSQL) || \
                (c->state == STATE_WRITING_MYSQL) ){
         log(g_log, "conn:%u client can be read when preparing or writing mysql\n", c->connid);
         goto end;
+    } else if(c->state == STATE_WAITING_MYSQL) {
+        log(g_log, "conn:%u client can be read when waiting mysql\n", c->connid);
+        goto end;
     } else if(c->state == STATE_READ_MYSQL_WRITE_CLIENT) {
         conn_state_set_reading_client(c);
+        conn_hedge_cancel(c);
         sqldump(c);
-        gettimeofday(&(c->tv_start), NULL);
+        my_digest_end(c);
+        my_cache_query_end(c);
+        my_flight_close(c);
+        c->start_us = timer_us();
 
         if( (res = del_handler(my->fd)) < 0 ){
             log(g_log, "conn:%u del_handler error\n", c->connid);
         }
     } else {
-        gettimeofday(&(c->tv_end), NULL);
+        c->end_us = timer_us();
     }
 
     if( (res = my_real_read(fd, buf, &done)) < 0 ){
@@ -644,8 +677,14 @@ int cli_query_cb(int fd, void *arg)
             goto end;
         }
         c->comno = com.comno;
+        c->local = LOCAL_NONE;
+        my_local_query_end(c);
         strncpy(c->arg, com.arg, sizeof(c->arg) - 1);
         c->arg[sizeof(c->arg) - 1] = '\0';
+        // the command can be made again from arg only if arg holds it whole
+        c->arglen = ( (com.len == com.pktlen - 1) && (com.len < sizeof(c->arg) - 1) && \
+                                (strlen(c->arg) == com.len) ) ? com.len : -1;
+        c->retry = 0;
 
         switch(c->comno)
         {
@@ -669,9 +708,33 @@ int cli_query_cb(int fd, void *arg)
                 res = cli_com_ignored(c);
                 break;
 
+            case COM_PING:
+                // not bound yet, nothing behind the proxy to check
+                if( (my == NULL) || g_conf.local ){
+                    res = cli_com_ignored(c);
+                    break;
+                }
+
+                if( (res = cli_com_mysql(c)) < 0 ){
+                    goto end;
+                }
+
+                break;
+
             case COM_INIT_DB:
                 log(g_log, "init db\n");
                 strncpy(c->curdb, c->arg, sizeof(c->curdb) - 1);
+
+                // first command binds a mysql connection, which is switched
+                // to the db before the command is forwarded
+                if(my == NULL){
+                    if( (res = cli_com_mysql(c)) < 0 ){
+                        goto end;
+                    }
+
+                    break;
+                }
+
                 if( (res = cli_com_forward(c)) < 0 ){
                     log(g_log, "conn:%u cli_com_forward error\n", c->connid);
                     goto end;
@@ -704,33 +767,65 @@ int cli_query_cb(int fd, void *arg)
             case COM_DROP_DB:
                 log(g_log, "drop db\n");
             case COM_QUERY:
-                if( (res = conn_alloc_my_conn(c)) < 0 ){
-                    log(g_log, "conn:%u alloc mysql conn error\n", c->connid);
-                    goto end;
+                if(my_digest_show(c) > 0){
+                    c->local = LOCAL_ADMIN;
+                    if( (res = cli_com_local(c)) < 0 ){
+                        log(g_log, "conn:%u cli_com_local error\n", c->connid);
+                        goto end;
+                    }
+
+                    break;
                 }
 
-                my = c->my;
-                if(strcmp(my->ctx.curdb, c->curdb)){
-                    if( (res = my_use_db_prepare(c)) < 0 ){
-                        log(g_log, "conn:%u my_use_db_prepare error\n", c->connid);
+                my_digest_start(c);
+
+                if(my_local_get(c) > 0){
+                    c->local = LOCAL_SESSION;
+                    my_digest_feed(c, buf->ptr, buf->used);
+                    if( (res = cli_com_local(c)) < 0 ){
+                        log(g_log, "conn:%u cli_com_local error\n", c->connid);
                         goto end;
-                    } else {
-                        debug(g_log, "conn:%u my_use_db_prepare success\n", c->connid);
                     }
 
-                    conn_state_set_prepare_mysql(c);
+                    break;
+                }
+
+                if(my_scatter_need(c)){
+                    if( (res = my_scatter_start(c)) < 0 ){
+                        log(g_log, "conn:%u my_scatter_start error\n", c->connid);
+                        goto end;
+                    }
 
                     break;
                 }
-            default:
-                if( (res = cli_com_forward(c)) < 0 ){
-                    log(g_log, "conn:%u cli_com_forward error\n", c->connid);
+
+                if(my_cache_get(c) > 0){
+                    c->local = LOCAL_CACHE;
+                    my_digest_feed(c, buf->ptr, buf->used);
+                    if( (res = cli_com_local(c)) < 0 ){
+                        log(g_log, "conn:%u cli_com_local error\n", c->connid);
+                        goto end;
+                    }
+
+                    break;
+                }
+
+                my_cache_write(c);
+
+                if(my_flight_get(c) > 0){
+                    break;
+                }
+
+                if( (res = cli_com_mysql(c)) < 0 ){
                     goto end;
-                } else {
-                    debug(g_log, "conn:%u cli_com_forward success\n", c->connid);
                 }
 
-                conn_state_set_writing_mysql(c);
+                break;
+            default:
+                // binds a mysql connection on the first command
+                if( (res = cli_com_mysql(c)) < 0 ){
+                    goto end;
+                }
         }
     }
 
@@ -790,13 +885,18 @@ int my_query_cb(int fd, void *arg)
 
         buf_reset(buf);
 
+        c->my_us = timer_us();
         conn_state_set_read_mysql_write_client(c);
+        conn_hedge_arm(c);
 
     }
 
     return res;
 
 end:
+    if(cli_com_retry(c) == 0){
+        return 0;
+    }
     conn_close_with_my(c);
 
     return res;
@@ -812,6 +912,8 @@ end:
 int my_answer_cb(int fd, void *arg)
 {
     int res = 0;
+    size_t used;
+    uint16_t err;
     my_conn_t *my;
     cli_conn_t *cli;
     conn_t *c;
@@ -824,6 +926,8 @@ int my_answer_cb(int fd, void *arg)
 
     debug(g_log, "%s called\n", __func__);
 
+    used = buf->used;
+
     if( (res = my_real_read_result_set(fd, buf)) < 0 ){
         log_err(g_log, "conn:%u my_real_read_result_set error\n", c->connid);
         goto end;
@@ -834,6 +938,43 @@ int my_answer_cb(int fd, void *arg)
         debug(g_log, "conn:%u my_real_read success, res[%d]\n", c->connid, res);
     }
 
+    // hedge answered first, the slow read is closed
+    if(my == c->hedge){
+        my_conn_account_lost(c->my, timer_us() - c->my_us);
+        my_conn_close(c->my);
+        c->my = my;
+        c->hedge = NULL;
+        c->my_us = c->hedge_us;
+    }
+
+    // first answer of the query, account latency and error of the node
+    if(c->my_us){
+        conn_hedge_cancel(c);
+        err = 0;
+        if( (buf->used - used > HEADER_SIZE + 2) && \
+                        ((uint8_t)buf->ptr[used + HEADER_SIZE] == 0xff) ){
+            memcpy(&err, buf->ptr + used + HEADER_SIZE + 1, 2);
+        }
+        my_conn_account(my, timer_us() - c->my_us, err);
+        c->my_us = 0;
+    }
+
+    if(c->qc){
+        my_cache_feed(c, buf->ptr + used, buf->used - used);
+    }
+
+    if(c->dg){
+        my_digest_feed(c, buf->ptr + used, buf->used - used);
+    }
+
+    if(c->lc){
+        my_local_feed(c, buf->ptr + used, buf->used - used);
+    }
+
+    if(c->fl){
+        my_flight_feed(c, buf->ptr + used, buf->used - used);
+    }
+
     if( (res = del_handler(fd)) < 0 ){
         log(g_log, "conn:%u del_handler error\n", c->connid);
         goto end;
@@ -859,11 +1000,131 @@ int my_answer_cb(int fd, void *arg)
     return res;
 
 end:
+    // hedge gone, the first read goes on
+    if(my == c->hedge){
+        my_conn_account(my, timer_us() - c->hedge_us, 2013);
+        conn_hedge_cancel(c);
+        return 0;
+    }
+
+    // mysql gone before answering, the hedge or another slave takes the read
+    if(c->my_us){
+        my_conn_account(my, timer_us() - c->my_us, 2013);
+        if(c->hedge != NULL){
+            timer_del(&(c->hedge_timer));
+            my_conn_close(c->my);
+            c->my = c->hedge;
+            c->hedge = NULL;
+            c->my_us = c->hedge_us;
+            return 0;
+        }
+        c->my_us = 0;
+        if(cli_com_retry(c) == 0){
+            return 0;
+        }
+    }
     conn_close_with_my(c);
 
     return res;
 }
 
+/*
+ * fun: hedge timer callback, send a read not answered yet to a second
+ *      slave, the command is made again from arg
+ * arg: connection
+ * ret: always return 0
+ *
+ */
+
+int my_hedge_cb(void *arg)
+{
+    conn_t *c;
+    my_conn_t *my;
+    my_node_t *node;
+    cli_com_t com;
+
+    c = (conn_t *)arg;
+
+    if(conn_hedge_my_conn(c) < 0){
+        return 0;
+    }
+
+    my = c->hedge;
+    node = my->node;
+
+    com.pktno = 0;
+    com.comno = c->comno;
+    memcpy(com.arg, c->arg, c->arglen);
+    com.len = c->arglen;
+
+    make_com(&(my->buf), &com);
+
+    if(add_handler(my->fd, EPOLLOUT, my_hedge_query_cb, my) < 0){
+        log(g_log, "conn:%u add_handler error\n", c->connid);
+        conn_hedge_cancel(c);
+        return 0;
+    }
+
+    debug(g_log, "conn:%u read hedged to slave %s:%s\n", c->connid, node->host, node->srv);
+
+    return 0;
+}
+
+/*
+ * fun: hedge query callback, the answer is read by my_answer_cb
+ * arg: fd, mysql connection
+ * ret: success 0, error -1
+ *
+ */
+
+static int my_hedge_query_cb(int fd, void *arg)
+{
+    int done, res = 0;
+    my_conn_t *my;
+    conn_t *c;
+    buf_t *buf;
+
+    my = (my_conn_t *)arg;
+    c = my->conn;
+    buf = &(my->buf);
+
+    if( (res = my_real_write(fd, buf, &done)) < 0 ){
+        log_err(g_log, "conn:%u my_real_write error\n", c->connid);
+        goto end;
+    } else if(res == 0) {
+        log(g_log, "conn:%u my_real_write error, res[%d]\n", c->connid, res);
+        goto end;
+    }
+
+    if(done){
+        if( (res = del_handler(fd)) < 0 ){
+            log(g_log, "conn:%u del_handler error\n", c->connid);
+            goto end;
+        }
+
+        res = add_handler(fd, EPOLLIN, my_answer_cb, my);
+        if(res < 0){
+            log(g_log, "conn:%u add_handler error\n", c->connid);
+            goto end;
+        }
+
+        buf_reset(buf);
+    }
+
+    return res;
+
+end:
+    // hedge took the place of the first read, which is gone
+    if(my == c->my){
+        conn_close_with_my(c);
+        return res;
+    }
+
+    conn_hedge_cancel(c);
+
+    return 0;
+}
+
 /*
  * fun: client answer callback
  * arg: fd, client connection
@@ -920,7 +1181,7 @@ int cli_answer_cb(int fd, void *arg)
             debug(g_log, "conn:%u add_handler success\n", c->connid);
         }
 
-        gettimeofday(&(c->tv_end), NULL);
+        c->end_us = timer_us();
 
         buf_reset(buf);
 
@@ -999,7 +1260,7 @@ AGAIN:
  *
  */
 
-static int my_real_read_result_set(int fd, buf_t *buf)
+int my_real_read_result_set(int fd, buf_t *buf)
 {
     int left, n;
     char *ptr;
@@ -1031,7 +1292,7 @@ AGAIN:
  *
  */
 
-static int my_real_write(int fd, buf_t *buf, int *done)
+int my_real_write(int fd, buf_t *buf, int *done)
 {
     int left, n;
     char *ptr;
@@ -1171,6 +1432,87 @@ end:
     return res;
 }
 
+/*
+ * fun: answer client from local buffer
+ * arg: connection, answer is in connection buffer
+ * ret: success 0, error -1
+ *
+ */
+
+static int cli_com_local(conn_t *c)
+{
+    int res = 0;
+    cli_conn_t *cli = c->cli;
+
+    buf_rewind(&(c->buf));
+
+    res = add_handler(cli->fd, EPOLLOUT, cli_com_local_write_cb, cli);
+    if(res < 0){
+        log(g_log, "conn:%u add_handler error\n", c->connid);
+        return res;
+    } else {
+        debug(g_log, "conn:%u add_handler success\n", c->connid);
+    }
+
+    return res;
+}
+
+/*
+ * fun: write local answer to client callback
+ * arg: fd, client connection
+ * ret: success 0, error -1
+ *
+ */
+
+static int cli_com_local_write_cb(int fd, void *arg)
+{
+    int done, res = 0;
+    cli_conn_t *cli;
+    buf_t *buf;
+    conn_t *c;
+
+    cli = (cli_conn_t *)arg;
+    c = cli->conn;
+    buf = &(c->buf);
+
+    debug(g_log, "%s called\n", __func__);
+
+    if( (res = my_real_write(fd, buf, &done)) < 0 ){
+        log_err(g_log, "conn:%u my_real_write error\n", c->connid);
+        goto end;
+    } else if(res == 0) {
+        log(g_log, "conn:%u my_real_write, res[%d]\n", c->connid, res);
+        goto end;
+    } else {
+        debug(g_log, "conn:%u my_real_write success, res[%d]\n", c->connid, res);
+    }
+
+    if(done){
+        res = add_handler(fd, EPOLLIN, cli_query_cb, cli);
+        if(res < 0){
+            log(g_log, "conn:%u add_handler error\n", c->connid);
+            goto end;
+        } else {
+            debug(g_log, "conn:%u add_handler success\n", c->connid);
+        }
+
+        c->end_us = timer_us();
+        sqldump(c);
+        my_digest_end(c);
+
+        buf_reset(buf);
+
+        conn_state_set_idle(c);
+    }
+
+    return res;
+
+end:
+    conn_close(c);
+
+    return res;
+}
+
 /*
  * fun: forward client command to mysql
  * arg: connection
@@ -1207,6 +1549,210 @@ static int cli_com_forward(conn_t *c)
     return res;
 }
 
+/*
+ * fun: alloc mysql connection and send client command to it, wait for
+ *      a mysql connection if pool is exhausted
+ * arg: connection
+ * ret: success 0, error -1
+ *
+ */
+
+static int cli_com_mysql(conn_t *c)
+{
+    int res = 0;
+
+    if( (res = conn_alloc_my_conn(c)) < 0 ){
+        if(conn_wait_my_conn(c, cli_com_mysql) == 0){
+            return 0;
+        }
+
+        log(g_log, "conn:%u alloc mysql conn error\n", c->connid);
+        return res;
+    }
+
+    return cli_com_send(c);
+}
+
+/*
+ * fun: send client command to the mysql connection of connection, the
+ *      db and session variables of client are set first if they differ
+ * arg: connection
+ * ret: success 0, error -1
+ *
+ */
+
+static int cli_com_send(conn_t *c)
+{
+    int res = 0;
+    my_conn_t *my;
+
+    my = c->my;
+    if(strcmp(my->ctx.curdb, c->curdb)){
+        if( (res = my_use_db_prepare(c)) < 0 ){
+            log(g_log, "conn:%u my_use_db_prepare error\n", c->connid);
+            return res;
+        } else {
+            debug(g_log, "conn:%u my_use_db_prepare success\n", c->connid);
+        }
+
+        conn_state_set_prepare_mysql(c);
+
+        return res;
+    }
+
+    if(my_local_sess_diff(c)){
+        if( (res = my_sess_prepare(c)) < 0 ){
+            log(g_log, "conn:%u my_sess_prepare error\n", c->connid);
+            return res;
+        }
+
+        conn_state_set_prepare_mysql(c);
+
+        return res;
+    }
+
+    if( (res = cli_com_forward(c)) < 0 ){
+        log(g_log, "conn:%u cli_com_forward error\n", c->connid);
+        return res;
+    } else {
+        debug(g_log, "conn:%u cli_com_forward success\n", c->connid);
+    }
+
+    conn_state_set_writing_mysql(c);
+
+    return res;
+}
+
+/*
+ * fun: send a read again to another slave, its slave failed before the
+ *      first byte of answer, the command is made again from arg
+ * arg: connection
+ * ret: success 0, not retried -1
+ *
+ */
+
+static int cli_com_retry(conn_t *c)
+{
+    buf_t *buf;
+    cli_com_t com;
+
+    if(conn_retry_my_conn(c) < 0){
+        return -1;
+    }
+
+    buf = &(c->buf);
+
+    com.pktno = 0;
+    com.comno = c->comno;
+    memcpy(com.arg, c->arg, c->arglen);
+    com.len = c->arglen;
+
+    make_com(buf, &com);
+    c->my_us = 0;
+
+    if(cli_com_send(c) < 0){
+        log(g_log, "conn:%u cli_com_send error\n", c->connid);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * fun: answer client waiting for mysql connection with an error
+ * arg: connection
+ * ret: success 0, error -1
+ *
+ */
+
+int cli_wait_expire(conn_t *c)
+{
+    int res = 0;
+    cli_conn_t *cli = c->cli;
+    my_result_error_t error;
+
+    error.field_count = 0xff;
+    error.err = 1040;
+    error.marker = '#';
+    memcpy(error.sqlstate, "08004", 5);
+    snprintf(error.msg, sizeof(error.msg), \
+                "no mysql connection available in %d seconds", \
+                g_conf.wait_mysql_timeout);
+
+    // still in handshake, greeting is replaced by the error
+    if(c->wait_cb == cli_hs_stage1_prepare){
+        c->wait_cb = NULL;
+        error.pktno = 0;
+        make_result_error(&(cli->buf), &error);
+
+        return add_handler(cli->fd, EPOLLOUT, cli_hs_auth_fail_cb, cli);
+    }
+
+    c->wait_cb = NULL;
+    error.pktno = 1;
+
+    my_cache_close(c);
+    my_flight_close(c);
+    my_local_query_end(c);
+    make_result_error(&(c->buf), &error);
+    my_digest_feed(c, c->buf.ptr, c->buf.used);
+
+    conn_state_set_reading_client(c);
+
+    if( (res = cli_com_local(c)) < 0 ){
+        log(g_log, "conn:%u cli_com_local error\n", c->connid);
+    }
+
+    return res;
+}
+
+/*
+ * fun: answer client waiting on an identical read with its response, or
+ *      send the read to mysql when the response is not shared
+ * arg: connection, response, response length
+ * ret: success 0, error -1
+ *
+ */
+
+int cli_flight_answer(conn_t *c, const char *data, size_t len)
+{
+    int res = 0;
+    buf_t *buf = &(c->buf);
+
+    if(data == NULL){
+        if( (res = cli_com_mysql(c)) < 0 ){
+            goto end;
+        }
+
+        return res;
+    }
+
+    buf_reset(buf);
+    if(buf_realloc(buf, len) == NULL){
+        log(g_log, "conn:%u buf_realloc error\n", c->connid);
+        res = -1;
+        goto end;
+    }
+    memcpy(buf->ptr, data, len);
+    buf->used = len;
+    buf->pos = 0;
+
+    c->local = LOCAL_FLIGHT;
+    my_digest_feed(c, buf->ptr, buf->used);
+
+    if( (res = cli_com_local(c)) < 0 ){
+        log(g_log, "conn:%u cli_com_local error\n", c->connid);
+        goto end;
+    }
+
+    return res;
+
+end:
+    conn_close_with_my(c);
+
+    return res;
+}
+
 /*
  * fun: unsupported client command, do nothing
  * arg: onnection
@@ -1344,6 +1890,168 @@ static int my_use_db_resp_cb(int fd, void *arg)
         strncpy(my->ctx.curdb, c->curdb, sizeof(my->ctx.curdb) - 1);
         my->ctx.curdb[sizeof(my->ctx.curdb) - 1] = '\0';
 
+        buf_reset(buf);
+
+        // session variables follow the db
+        if(my_local_sess_diff(c)){
+            if( (res = my_sess_prepare(c)) < 0 ){
+                log(g_log, "conn:%u my_sess_prepare error\n", c->connid);
+                goto end;
+            }
+
+            return res;
+        }
+
+        res = add_handler(fd, EPOLLOUT, my_query_cb, arg);
+        if(res < 0){
+            log(g_log, "conn:%u add_handler fd[%d] error\n", c->connid, fd);
+            goto end;
+        }
+
+        conn_state_set_writing_mysql(c);
+    }
+
+    return res;
+
+end:
+    conn_close_with_my(c);
+
+    return res;
+}
+
+/*
+ * fun: prepare send "set" of client session variables to mysql
+ * arg: connection
+ * ret: success 0, error -1
+ *
+ */
+
+static int my_sess_prepare(conn_t *c)
+{
+    int fd, len, res = 0;
+    buf_t *buf;
+    my_conn_t *my;
+    cli_com_t com;
+
+    my = c->my;
+    fd = my->fd;
+    buf = &(my->buf);
+
+    com.pktno = 0;
+    com.comno = COM_QUERY;
+    if( (len = my_local_sess_make(c, com.arg, sizeof(com.arg))) < 0 ){
+        log(g_log, "conn:%u session variables too long\n", c->connid);
+        return -1;
+    }
+    com.len = len;
+
+    debug(g_log, "conn:%u %s\n", c->connid, com.arg);
+
+    make_com(buf, &com);
+    res = add_handler(fd, EPOLLOUT, my_sess_req_cb, my);
+    if(res < 0){
+        log(g_log, "conn:%u add_handler error\n", c->connid);
+    } else {
+        debug(g_log, "conn:%u add_handler success\n", c->connid);
+    }
+
+    buf_rewind(buf);
+
+    return res;
+}
+
+/*
+ * fun: send "set" of session variables to mysql callback
+ * arg: fd, mysql connection
+ * ret: success 0, error -1
+ *
+ */
+
+static int my_sess_req_cb(int fd, void *arg)
+{
+    int res = 0, done;
+    my_conn_t *my;
+    conn_t *c;
+    buf_t *buf;
+
+    my = (my_conn_t *)arg;
+    c = my->conn;
+    buf = &(my->buf);
+
+    if( (res = my_real_write(fd, buf, &done)) < 0 ){
+        log_err(g_log, "conn:%u my_real_write error\n", c->connid);
+        goto end;
+    } else if(res == 0) {
+        log(g_log, "conn:%u my_real_write error, %d\n", c->connid, res);
+        goto end;
+    } else {
+        debug(g_log, "conn:%u my_real_write success, %d\n", c->connid, res);
+    }
+
+    if(done){
+        if( (res = del_handler(fd)) < 0 ){
+            log(g_log, "conn:%u del_handler fd[%d] error\n", c->connid, fd);
+            goto end;
+        }
+
+        res = add_handler(fd, EPOLLIN, my_sess_resp_cb, arg);
+        if(res < 0){
+            log(g_log, "conn:%u add_handler fd[%d] error\n", c->connid, fd);
+            goto end;
+        }
+
+        buf_reset(buf);
+    }
+
+    return res;
+
+end:
+    conn_close_with_my(c);
+
+    return res;
+}
+
+/*
+ * fun: read mysql resp callback after sending "set" of session variables
+ * arg: fd, mysql connection
+ * ret: success 0, error -1
+ *
+ */
+
+static int my_sess_resp_cb(int fd, void *arg)
+{
+    int res = 0, done;
+    my_conn_t *my;
+    conn_t *c;
+    buf_t *buf;
+
+    my = (my_conn_t *)arg;
+    c = my->conn;
+    buf = &(my->buf);
+
+    if( (res = my_real_read(fd, buf, &done)) < 0 ){
+        log_err(g_log, "conn:%u my_real_read error\n", c->connid);
+        goto end;
+    } else if(res == 0) {
+        log(g_log, "conn:%u mysql conn close\n", c->connid);
+        goto end;
+    } else {
+        debug(g_log, "conn:%u my_real_read success, %d\n", c->connid, res);
+    }
+
+    if(done){
+        if( (res = del_handler(fd)) < 0 ){
+            log(g_log, "conn:%u del_handler fd[%d] error\n", c->connid, fd);
+            goto end;
+        }
+
+        // client already got ok, a value mysql refuses is only logged
+        if( (buf->used > HEADER_SIZE) && ((uint8_t)buf->ptr[HEADER_SIZE] == 0xff) ){
+            log(g_log, "conn:%u set session variables error\n", c->connid);
+        }
+
+        my_local_sess_done(c);
+
         res = add_handler(fd, EPOLLOUT, my_query_cb, arg);
         if(res < 0){
             log(g_log, "conn:%u add_handler fd[%d] error\n", c->connid, fd);
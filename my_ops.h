@@ -14,10 +14,16 @@ int cli_hs_stage2_cb(int fd, void *arg);
 int cli_hs_stage3_cb(int fd, void *arg);
 
 int cli_query_cb(int fd, void *arg);
+int cli_wait_expire(conn_t *c);
+int cli_flight_answer(conn_t *c, const char *data, size_t len);
 int my_query_cb(int fd, void *arg);
 int my_answer_cb(int fd, void *arg);
 int cli_answer_cb(int fd, void *arg);
+int my_hedge_cb(void *arg);
 
 int my_ping_prepare(my_conn_t *my);
 
+int my_real_read_result_set(int fd, buf_t *buf);
+int my_real_write(int fd, buf_t *buf, int *done);
+
 #endif
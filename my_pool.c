@@ -11,6 +11,7 @@
 #include <time.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <sys/epoll.h>
 #include <errno.h>
 #include <genpool.h>
@@ -18,33 +19,103 @@
 #include <log.h>
 #include <timer.h>
 #include <handler.h>
+#include <hash.h>
+#include <sys/mman.h>
 #include "my_pool.h"
 #include "my_buf.h"
 #include "my_ops.h"
 #include "conn_pool.h"
 #include "my_conf.h"
+#include "my_broker.h"
+#include "my_dns.h"
 #include "def.h"
 
 extern log_t *g_log;
 extern struct conf_t g_conf;
 
-static my_pool_t *mypool;
-static genpool_handler_t *handler;
-
-static my_info_t myinfo;
+#define MAX_POOL_SHM_NODE 256
+#define MY_NODE_RESOLVE_RETRY 3
+
+// node health, error rate is fixed point of NODE_ERR_ONE
+#define NODE_ERR_ONE 65536
+#define NODE_MIN_SAMPLES 20
+#define NODE_CALM_SAMPLES 1000
+#define NODE_PROBE_OK 20
+#define NODE_EJECT_MAX_LEVEL 5
+#define NODE_LATENCY_FLOOR_US 10000
+
+// idle connections looked at for one in a given db and session
+#define MY_CTX_SCAN 16
+
+// connections of every node opened by every worker, shared by all workers
+typedef struct{
+    uint64_t key;
+    int count[MAX_WORKER];
+} pool_shm_node_t;
+
+typedef struct{
+    pid_t pid[MAX_WORKER];
+    pool_shm_node_t node[MAX_POOL_SHM_NODE];
+} pool_shm_t;
+
+static __thread my_pool_t *mypool;
+static __thread genpool_handler_t *handler;
+static pool_shm_t *poolshm;
+static __thread int worker_slot = -1;
+
+static __thread my_info_t myinfo;
+
+// consistent hash ring of slaves, sorted by hash
+typedef struct{
+    uint64_t hash;
+    int index;
+} ring_point_t;
+
+static __thread ring_point_t *ring = NULL;
+static __thread int ring_num = 0;
+static __thread int ring_dirty = 1;
+
+// first answer latency of slave reads, 4 buckets per power of 2 of us,
+// counts are halved every LAT_WINDOW reads to follow recent reads
+#define LAT_BUCKETS (4 * 40)
+#define LAT_RECALC 256
+#define LAT_WINDOW 8192
+
+static __thread uint32_t lat_hist[LAT_BUCKETS];
+static __thread uint32_t lat_total = 0;
+static __thread uint32_t lat_since = 0;
+static __thread int lat_pct = 0;
+static __thread uint64_t lat_pct_us = 0;
 
 static int my_conn_init(my_conn_t *my, my_node_t *n);
 static int my_node_init(my_node_t *n);
 static my_conn_t *my_conn_alloc(my_node_t *n);
 static int make_my_conn(my_conn_t *my);
-static int _my_reg(my_node_t *node, char *host, \
-                    char *srv, char *user, char *pass, int count);
+static int _my_reg(my_node_t *node, char *host, char *srv, \
+                    char *user, char *pass, int min, int max, int cap);
 static int my_conn_set_used(my_conn_t *my, void *ptr);
 static int my_conn_set_dead(my_conn_t *my);
 static int my_conn_set_raw(my_conn_t *my);
 static int my_conn_set_fail(my_conn_t *my);
 static int my_conn_set_ping(my_conn_t *my);
 
+static int my_node_admit(my_node_t *node);
+static int my_node_is_ejected(my_node_t *node);
+static int my_node_is_outlier(my_node_t *node);
+static int my_node_eject(my_node_t *node, const char *why);
+static int my_err_is_fault(uint16_t err);
+static int my_node_sample(my_node_t *node, uint64_t us, int fault);
+static int my_node_judge(my_node_t *node, int fault, int good);
+static int my_lat_bucket(uint64_t us);
+static uint64_t my_lat_bucket_us(int index);
+
+static int my_slave_ring_build(void);
+static int my_slave_ring_cmp(const void *a, const void *b);
+static int my_slave_order(uint32_t ip, uint16_t port, const char *group, \
+                        const char *key, int len, int *order, int *want);
+static int my_slave_order_group(uint32_t ip, uint16_t port, const char *group, \
+                        uint64_t hash, int onring, int *order);
+
 static int my_conn_dead_reconnect_timer(unsigned long arg);
 static int my_conn_fail_reconnect_timer(unsigned long arg);
 static int my_conn_pool_status_timer(unsigned long arg);
@@ -55,6 +126,18 @@ static int my_node_set_closing(my_node_t *node);
 static int my_node_is_closing(my_node_t *node);
 static int my_node_closing_cleanup_timer(unsigned long arg);
 
+static pool_shm_node_t *pool_shm_slot(const char *host, const char *srv);
+static int my_node_shm_update(my_node_t *node);
+static int my_node_shm_total(my_node_t *node);
+static my_node_t *my_node_find(const char *host, const char *srv);
+static int my_node_grow(my_node_t *node, int want);
+static int my_node_open(my_node_t *node, int want);
+static int my_conn_pool_adjust_timer(unsigned long arg);
+static int my_node_resolve(my_node_t *node);
+static int my_node_resolved(void *arg, const char *host, const char *srv, \
+                            const struct sockaddr *addr, socklen_t len);
+static int my_node_resolve_timer(unsigned long arg);
+
 /*
  * fun: init mysql context
  * arg: mysql context
@@ -68,6 +151,9 @@ static int my_ctx_init(my_ctx_t *ctx)
 
     bzero(ctx->curdb, sizeof(ctx->curdb));
 
+    ctx->sess_mask = 0;
+    ctx->sess_key = 0;
+
     return 0;
 }
 
@@ -82,9 +168,9 @@ int my_info_set(uint8_t prot, uint8_t lang, uint16_t status, \
                             uint32_t cap, char *ver, int ver_len)
 {
     int len;
-    time_t now = time(NULL);
+    time_t now = timer_sec();
 
-    if(now - myinfo.update_time < 10){
+    if(myinfo.avail && (now - myinfo.update_time < 10)){
         return 0;
     }
 
@@ -108,6 +194,56 @@ int my_info_set(uint8_t prot, uint8_t lang, uint16_t status, \
     return 0;
 }
 
+/*
+ * fun: get mysql info kept from the last mysql handshake
+ * arg:
+ * ret: success return mysql info, no mysql connected yet return NULL
+ *
+ */
+
+my_info_t *my_info_get(void)
+{
+    return myinfo.avail ? &myinfo : NULL;
+}
+
+/*
+ * fun: open a mysql connection of the worker itself to get mysql info,
+ *      connections given by broker skip the handshake and bring none
+ * arg:
+ * ret: handshake on its way 0, no mysql node to connect -1
+ *
+ */
+
+int my_info_want(void)
+{
+    int i, num;
+    my_node_t *node;
+    my_node_t *nodes[2] = {mypool->master, mypool->slave};
+    int count[2] = {mypool->master_num, mypool->slave_num};
+
+    for(i = 0; i < 2; i++){
+        for(num = 0; num < count[i]; num++){
+            if(nodes[i][num].connecting > 0){
+                return 0;
+            }
+        }
+    }
+
+    for(i = 0; i < 2; i++){
+        for(num = 0; num < count[i]; num++){
+            node = &(nodes[i][num]);
+            if( (node->role == UNAVAIL_ROLE) || my_node_is_closing(node) ){
+                continue;
+            }
+            if(my_node_open(node, 1) > 0){
+                return 0;
+            }
+        }
+    }
+
+    return -1;
+}
+
 /*
  * fun: init mysql connection
  * arg: mysql connection, mysql node
@@ -127,6 +263,8 @@ static int my_conn_init(my_conn_t *my, my_node_t *n)
     my_ctx_init(&(my->ctx));
 
     my->state_time = 0;
+    my->connecting = 0;
+    my->pinging = 0;
 
     return 0;
 }
@@ -145,15 +283,42 @@ static int my_node_init(my_node_t *n)
     bzero(n->user, sizeof(n->user));
     bzero(n->pass, sizeof(n->pass));
 
+    n->addrlen = 0;
+    n->addr_expire = 0;
+    n->resolving = 0;
+
     INIT_LIST_HEAD(&(n->used_head));
     INIT_LIST_HEAD(&(n->avail_head));
     INIT_LIST_HEAD(&(n->dead_head));
     INIT_LIST_HEAD(&(n->raw_head));
     INIT_LIST_HEAD(&(n->fail_head));
     INIT_LIST_HEAD(&(n->ping_head));
+    INIT_LIST_HEAD(&(n->wait_head));
 
     n->info = &myinfo;
     n->avail_count = 0;
+    n->avail_min = 0;
+    n->conn_total = 0;
+    n->connecting = 0;
+    n->min = 0;
+    n->max = 0;
+    n->cap = 0;
+    n->shm = NULL;
+    n->asking = 0;
+    n->ask_time = 0;
+    n->shrink_time = timer_sec();
+    n->wait_count = 0;
+    n->wait_done = 0;
+    n->wait_expire = 0;
+    n->wait_usec = 0;
+    n->wait_max_usec = 0;
+    n->ewma_us = 0;
+    n->ewma_err = 0;
+    n->samples = 0;
+    n->eject_level = 0;
+    n->eject_until = 0;
+    n->probe_ok = 0;
+    n->ejected = 0;
     n->role = UNAVAIL_ROLE;
     n->closing = 0;
     n->closing_time = 0;
@@ -184,6 +349,9 @@ static my_conn_t *my_conn_alloc(my_node_t *n)
         return NULL;
     }
 
+    n->conn_total++;
+    my_node_shm_update(n);
+
     return my;
 }
 
@@ -196,9 +364,110 @@ static my_conn_t *my_conn_alloc(my_node_t *n)
 
 static int my_conn_release(my_conn_t *my)
 {
+    my_node_t *node = my->node;
+
+    node->conn_total--;
+    my_node_shm_update(node);
+
     return genpool_release_page(handler, my);
 }
 
+/*
+ * fun: init connection counters in shared memory, must be called before fork
+ * arg:
+ * ret: success 0, error -1
+ *
+ */
+
+int my_pool_shm_init(void)
+{
+    void *ptr;
+
+    ptr = mmap(NULL, sizeof(pool_shm_t), PROT_READ | PROT_WRITE, \
+                                    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(ptr == MAP_FAILED){
+        log_err(g_log, "mmap error\n");
+        return -1;
+    }
+
+    poolshm = ptr;
+    memset(poolshm, 0, sizeof(pool_shm_t));
+
+    return 0;
+}
+
+/*
+ * fun: release connection counters of an exited worker
+ * arg: worker pid
+ * ret: success 0, not found -1
+ *
+ */
+
+int my_pool_shm_release(pid_t pid)
+{
+    int i, j;
+
+    if(poolshm == NULL){
+        return -1;
+    }
+
+    for(i = 0; i < MAX_WORKER; i++){
+        if(poolshm->pid[i] == pid){
+            for(j = 0; j < MAX_POOL_SHM_NODE; j++){
+                poolshm->node[j].count[i] = 0;
+            }
+            poolshm->pid[i] = 0;
+
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * fun: take a worker slot of shared connection counters
+ * arg:
+ * ret: success 0, no slot -1
+ *
+ */
+
+int my_pool_shm_attach(void)
+{
+    int i;
+
+    for(i = 0; (poolshm != NULL) && (i < MAX_WORKER); i++){
+        if(__sync_bool_compare_and_swap(&(poolshm->pid[i]), 0, getpid())){
+            worker_slot = i;
+            return 0;
+        }
+    }
+
+    log(g_log, "no worker slot, connection cap disabled\n");
+
+    return -1;
+}
+
+/*
+ * fun: publish connection number of a mysql node held by this process
+ * arg: host, srv, connection number
+ * ret: success 0, error -1
+ *
+ */
+
+int my_pool_shm_set(const char *host, const char *srv, int count)
+{
+    pool_shm_node_t *slot;
+
+    if( (slot = pool_shm_slot(host, srv)) == NULL ){
+        return -1;
+    }
+
+    slot->count[worker_slot] = count;
+
+    return 0;
+}
+
 /*
  * fun: init mysql connection pool
  * arg: max mysql connection number
@@ -223,6 +492,9 @@ int my_pool_init(int count)
 
     mypool->slave_num = 0;
     mypool->master_num = 0;
+    mypool->shard_num = 0;
+
+    my_pool_shm_attach();
 
     res = timer_register(my_conn_dead_reconnect_timer, 30, \
                         "my_conn_dead_reconnect_timer", 1);
@@ -272,6 +544,22 @@ int my_pool_init(int count)
         return -1;
     }
 
+    res = timer_register(my_conn_pool_adjust_timer, 16, \
+                        "my_conn_pool_adjust_timer", 1);
+    if(res < 0){
+        log(g_log, \
+            "my_conn_pool_adjust_timer register error\n");
+        return -1;
+    }
+
+    res = timer_register(my_node_resolve_timer, 0, \
+                        "my_node_resolve_timer", 1);
+    if(res < 0){
+        log(g_log, \
+            "my_node_resolve_timer register error\n");
+        return -1;
+    }
+
     return 0;
 }
 
@@ -293,9 +581,18 @@ static int make_my_conn(my_conn_t *my)
         return res;
     }
 
-    fd = connect_nonblock(node->host, node->srv, &done);
+    // reconnects go to the address resolved off loop
+    if(node->addrlen == 0){
+        debug(g_log, "%s:%s not resolved\n", node->host, node->srv);
+        return my_conn_close_on_fail(my);
+    }
+
+    fd = connect_addr_nonblock((struct sockaddr *)&(node->addr), \
+                                            node->addrlen, &done);
     if(fd >= 0){
         my->fd = fd;
+        my->connecting = 1;
+        node->connecting++;
         res = add_handler(fd, EPOLLIN, my_hs_stage1_cb, my);
         if(res < 0){
             log(g_log, "add_handler error\n");
@@ -312,16 +609,16 @@ static int make_my_conn(my_conn_t *my)
 
 /*
  * fun: register mysql
- * arg: mysql node, host, srv, user, pass, connection number
+ * arg: mysql node, host, srv, user, pass, min and max connection number,
+ * arg: cap of connections of all workers
  * ret: success 0, error -1
  *
  */
 
-static int _my_reg(my_node_t *node, char *host, \
-                    char *srv, char *user, char *pass, int count)
+static int _my_reg(my_node_t *node, char *host, char *srv, \
+                    char *user, char *pass, int min, int max, int cap)
 {
-    int i, fd, res = 0;
-    my_conn_t *my;
+    int res = 0;
 
     if( (res = my_node_init(node)) < 0 ){
         log(g_log, "my_node_init error\n");
@@ -332,16 +629,20 @@ static int _my_reg(my_node_t *node, char *host, \
     strncpy(node->srv, srv, MAX_SRV_LEN - 1);
     strncpy(node->user, user, MAX_USER_LEN - 1);
     strncpy(node->pass, pass, MAX_PASS_LEN - 1);
+    // hashed once, every login only does the last round
+    passwd_hash(node->stage1, node->stage2, node->pass);
 
-    for(i = 0; i < count; i++){
-        if( (my = my_conn_alloc(node)) == NULL ){
-            log(g_log, "my_conn_alloc error\n");
-            return -1;
-        }
+    node->min = min;
+    node->max = (max > min) ? max : min;
+    node->cap = cap;
 
-        if( (res = make_my_conn(my)) < 0 ){
-            log(g_log, "make my conn error\n");
-        }
+    node->shm = pool_shm_slot(host, srv);
+
+    my_node_resolve(node);
+
+    if(my_node_grow(node, min) < min){
+        log(g_log, "%s:%s %d of %d connections opened\n", \
+                            host, srv, node->conn_total, min);
     }
 
     return 0;
@@ -349,13 +650,14 @@ static int _my_reg(my_node_t *node, char *host, \
 
 /*
  * fun: register master mysql
- * arg: host, srv, user, pass, connection number
+ * arg: host, srv, user, pass, min and max connection number,
+ * arg: cap of connections of all workers
  * ret: success 0, error -1
  *
  */
 
-int my_master_reg(char *host, char *srv, \
-                        char *user, char *pass, int count)
+int my_master_reg(char *host, char *srv, char *user, \
+                            char *pass, int min, int max, int cap)
 {
     int i, res = 0;
     my_node_t *node;
@@ -376,28 +678,29 @@ int my_master_reg(char *host, char *srv, \
         mypool->master_num++;
     }
 
-    res = _my_reg(node, host, srv, user, pass, count);
+    res = _my_reg(node, host, srv, user, pass, min, max, cap);
     if(res < 0){
         log(g_log, "_my_reg error\n");
         return res;
     }
     node->role = MASTER_ROLE;
 
-    log(g_log, "host: %s, srv: %s, user: %s, cnum: %d\n", \
-                                        host, srv, user, count);
+    log(g_log, "host: %s, srv: %s, user: %s, cnum: %d-%d, cap: %d\n", \
+                                        host, srv, user, min, max, cap);
 
     return res;
 }
 
 /*
  * fun: register slave mysql
- * arg: host, srv, user, pass, connection number
+ * arg: host, srv, user, pass, min and max connection number,
+ * arg: cap of connections of all workers, slave group, empty default
  * ret: success 0, error -1
  *
  */
 
-int my_slave_reg(char *host, char *srv, \
-                        char *user, char *pass, int count)
+int my_slave_reg(char *host, char *srv, char *user, \
+                    char *pass, int min, int max, int cap, char *group)
 {
     int i, res = 0;
     my_node_t *node;
@@ -418,15 +721,90 @@ int my_slave_reg(char *host, char *srv, \
         mypool->slave_num++;
     }
 
-    res = _my_reg(node, host, srv, user, pass, count);
+    res = _my_reg(node, host, srv, user, pass, min, max, cap);
     if(res < 0){
         log(g_log, "_my_reg error\n");
         return res;
     }
     node->role = SLAVE_ROLE;
+    strncpy(node->group, group, sizeof(node->group) - 1);
+    node->group[sizeof(node->group) - 1] = '\0';
+    ring_dirty = 1;
+
+    log(g_log, "host: %s, srv: %s, user: %s, cnum: %d-%d, cap: %d, group: %s\n", \
+                                    host, srv, user, min, max, cap, node->group);
+
+    return res;
+}
+
+/*
+ * fun: move registered slave to another group
+ * arg: host, srv, slave group, empty default
+ * ret: success 0, not registered -1
+ *
+ */
 
-    log(g_log, "host: %s, srv: %s, user: %s, cnum: %d\n", \
-                                        host, srv, user, count);
+int my_slave_group_set(char *host, char *srv, char *group)
+{
+    int i;
+    my_node_t *node;
+
+    for(i = 0; i < mypool->slave_num; i++){
+        node = &(mypool->slave[i]);
+        if( (node->role == SLAVE_ROLE) && (!my_node_is_closing(node)) && \
+            (!strcmp(node->host, host)) && (!strcmp(node->srv, srv)) ){
+            if(strcmp(node->group, group)){
+                log(g_log, "slave %s:%s group %s -> %s\n", \
+                                        host, srv, node->group, group);
+                strncpy(node->group, group, sizeof(node->group) - 1);
+                node->group[sizeof(node->group) - 1] = '\0';
+            }
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * fun: register shard mysql
+ * arg: host, srv, user, pass, min and max connection number,
+ * arg: cap of connections of all workers
+ * ret: success 0, error -1
+ *
+ */
+
+int my_shard_reg(char *host, char *srv, char *user, \
+                            char *pass, int min, int max, int cap)
+{
+    int i, res = 0;
+    my_node_t *node;
+
+    for(i = 0; i < MAX_SHARD_NODE; i++){
+        node = &(mypool->shard[i]);
+        if(node->role == UNAVAIL_ROLE){
+            break;
+        }
+    }
+
+    if(i == MAX_SHARD_NODE){
+        log(g_log, "shard number exceed limit[%d]\n", MAX_SHARD_NODE);
+        return -1;
+    }
+
+    if(i == mypool->shard_num){
+        mypool->shard_num++;
+    }
+
+    res = _my_reg(node, host, srv, user, pass, min, max, cap);
+    if(res < 0){
+        log(g_log, "_my_reg error\n");
+        return res;
+    }
+    node->role = SHARD_ROLE;
+
+    log(g_log, "host: %s, srv: %s, user: %s, cnum: %d-%d, cap: %d\n", \
+                                        host, srv, user, min, max, cap);
 
     return res;
 }
@@ -441,7 +819,7 @@ int my_slave_reg(char *host, char *srv, \
 static int my_node_set_closing(my_node_t *node)
 {
     node->closing = 1;
-    node->closing_time = time(NULL);
+    node->closing_time = timer_sec();
 
     return 0;
 }
@@ -490,6 +868,15 @@ int my_unreg(char *host, char *srv)
         }
     }
 
+    for(i = 0; i < mypool->shard_num; i++){
+        node = &(mypool->shard[i]);
+        if((!strcmp(node->host, host)) && (!strcmp(node->srv, srv))){
+            my_node_set_closing(node);
+
+            log(g_log, "shard %s:%s unregister\n", host, srv);
+        }
+    }
+
     return 0;
 }
 
@@ -534,34 +921,36 @@ my_conn_t *my_master_conn_get(void *c, uint32_t ip, uint16_t port)
 
 /*
  * fun: get a slave connection
- * arg: connection, client ip, client port
+ * arg: connection, client ip, client port, slave group, NULL default,
+ * arg: key of slave hash ring and length
  * ret: success return mysql connection, error return NULL 
  *
  */
 
-my_conn_t *my_slave_conn_get(void *c, uint32_t ip, uint16_t port)
+my_conn_t *my_slave_conn_get(void *c, uint32_t ip, uint16_t port, \
+                        const char *group, const char *key, int len)
 {
-    int i, index;
+    int i, num, want;
+    int order[MAX_SLAVE_NODE];
     my_node_t *node;
     my_conn_t *my;
     struct list_head *head;
-    time_t now = time(NULL);
 
     if(mypool->slave_num == 0){
         log(g_log, "no slave register\n");
         return NULL;
     }
 
-    for(i = 0; i < mypool->slave_num; i++){
-        index = ((ip + port) + i) % (mypool->slave_num);
-        node = &(mypool->slave[index]);
+    num = my_slave_order(ip, port, group, key, len, order, &want);
+    for(i = 0; i < num; i++){
+        node = &(mypool->slave[order[i]]);
         head = &(node->avail_head);
-        if( (!my_node_is_closing(node)) && (!list_empty(head)) ){
+        if(!list_empty(head)){
             break;
         }
     }
 
-    if(i == mypool->slave_num){
+    if(i == num){
         log(g_log, "no slave available\n");
         return NULL;
     }
@@ -573,713 +962,1994 @@ my_conn_t *my_slave_conn_get(void *c, uint32_t ip, uint16_t port)
 }
 
 /*
- * fun: close mysql connection
- * arg: mysql connection
- * ret: success 0, error -1
+ * fun: get a connection of the slaves a read belongs to, for a connection
+ *      reading from another slave, the slaves are the home slave of key on
+ *      slave hash ring or else every slave of the group
+ * arg: connection, mysql connection in use, slave group, NULL default,
+ * arg: key and length
+ * ret: connection of the slaves, NULL if already there or none available
  *
  */
 
-int my_conn_close(my_conn_t *my)
+my_conn_t *my_slave_conn_home(void *c, my_conn_t *cur, \
+                        const char *group, const char *key, int len)
 {
-    int res;
+    int i, want;
+    int order[MAX_SLAVE_NODE];
+    my_node_t *node;
+    my_conn_t *my;
 
-    if( (res = del_handler(my->fd)) < 0 ){
-        log(g_log, "del_handler error, ignore it\n");
-    } else {
-        debug(g_log, "del_handler success\n");
+    if( (mypool->slave_num == 0) || \
+        ( ((!g_conf.slave_hash) || (len <= 0)) && ((group == NULL) || (*group == '\0')) && \
+                        (((my_node_t *)cur->node)->group[0] == '\0') && \
+                                    (!my_node_is_ejected(cur->node)) ) ){
+        return NULL;
     }
 
-    if(my->fd >= 0){
-        close(my->fd);
-        my->fd = -1;
+    my_slave_order(0, 0, group, key, len, order, &want);
+    for(i = 0; i < want; i++){
+        if(&(mypool->slave[order[i]]) == cur->node){
+            return NULL;
+        }
     }
 
-    my->conn = NULL;
-    buf_reset(&(my->buf));
-
-    my_conn_set_dead(my);
+    for(i = 0; i < want; i++){
+        node = &(mypool->slave[order[i]]);
+        if(!list_empty(&(node->avail_head))){
+            my = list_first_entry(&(node->avail_head), my_conn_t, link);
+            my_conn_set_used(my, c);
+            return my;
+        }
+    }
 
-    return 0;
+    return NULL;
 }
 
 /*
- * fun: close mysql connection and set fail
- * arg: mysql connection
- * ret: success 0, error -1
+ * fun: get a connection of a slave other than the one in use, the slaves
+ *      the read belongs to first
+ * arg: connection, mysql connection in use, slave group, NULL default,
+ * arg: key and length, db and session the connection must be in, NULL any
+ * ret: connection of another slave, NULL if none available
  *
  */
 
-int my_conn_close_on_fail(my_conn_t *my)
+my_conn_t *my_slave_conn_other(void *c, my_conn_t *cur, const char *group, \
+                        const char *key, int len, const my_ctx_t *ctx)
 {
-    my_conn_close(my);
-    my_conn_set_fail(my);
+    int i, n, num, want;
+    int order[MAX_SLAVE_NODE];
+    struct list_head *pos;
+    my_node_t *node;
+    my_conn_t *my;
 
-    return 0;
+    num = my_slave_order(0, 0, group, key, len, order, &want);
+    for(i = 0; i < num; i++){
+        node = &(mypool->slave[order[i]]);
+        if(node == cur->node){
+            continue;
+        }
+
+        // a few connections of the node are looked at for the context
+        n = 0;
+        list_for_each(pos, &(node->avail_head)){
+            my = list_entry(pos, my_conn_t, link);
+            if( (ctx == NULL) || ((!strcmp(my->ctx.curdb, ctx->curdb)) && \
+                                    (my->ctx.sess_key == ctx->sess_key)) ){
+                my_conn_set_used(my, c);
+                return my;
+            }
+            if(++n >= MY_CTX_SCAN){
+                break;
+            }
+        }
+    }
+
+    return NULL;
 }
 
 /*
- * fun: close mysql connection and release it
- * arg: mysql connection
- * ret: success 0, error -1
+ * fun: account a query answered by mysql, first answer latency and server
+ *      fault errors are smoothed per node, a slave turning outlier is
+ *      ejected, a slave being probed after ejection is let back or ejected
+ *      again
+ * arg: mysql connection, microseconds to first answer, error code, 0 ok
+ * ret: always return 0
  *
  */
 
-static int my_conn_close_and_release(my_conn_t *my)
+int my_conn_account(my_conn_t *my, uint64_t us, uint16_t err)
 {
-    my_conn_close(my);
-    list_del_init(&(my->link));
-    my_conn_release(my);
+    int fault = my_err_is_fault(err);
+    my_node_t *node = my->node;
 
-    return 0;
+    my_node_sample(node, us, fault);
+
+    if(node->role == SLAVE_ROLE){
+        lat_hist[my_lat_bucket(us)]++;
+        lat_total++;
+        lat_since++;
+    }
+
+    return my_node_judge(node, fault, 1);
 }
 
 /*
- * fun: put mysql connection
- * arg: mysql connection
- * ret: success 0, error -1
+ * fun: account a slave read whose hedge answered first, its latency is
+ *      only a lower bound, kept out of the hedge latency and never a good
+ *      probe
+ * arg: mysql connection, microseconds waited
+ * ret: always return 0
  *
  */
 
-int my_conn_put(my_conn_t *my)
+int my_conn_account_lost(my_conn_t *my, uint64_t us)
 {
-    int res = 0;
     my_node_t *node = my->node;
 
-    if( (res = del_handler(my->fd)) < 0 ){
-        log(g_log, "del_handler error, ignore it\n");
-    } else {
-        debug(g_log, "del_handler success\n");
-    }
-
-    if(my_conn_ctx_is_dirty(my)){
-        my_conn_close(my);
-
-        return 0;
-    }
-
-    my_conn_set_avail(my);
+    my_node_sample(node, us, 0);
 
-    return 0;
+    return my_node_judge(node, 0, 0);
 }
 
 /*
- * fun: set mysql connection used
- * arg: mysql connection, connection pointer
- * ret: success 0, error -1
+ * fun: smooth latency and fault errors of node
+ * arg: mysql node, microseconds to first answer, fault error 1, else 0
+ * ret: always return 0
  *
  */
 
-static int my_conn_set_used(my_conn_t *my, void *ptr)
+static int my_node_sample(my_node_t *node, uint64_t us, int fault)
 {
-    int res = 0;
-    my_node_t *node = my->node;
-    my->conn = ptr;
-    buf_reset(&(my->buf));
-
-    list_move_tail(&(my->link), &(node->used_head));
-    my->state_time = time(NULL);
-
-    if( (res = del_handler(my->fd)) < 0 ){
-        log(g_log, "del_handler error, ignore it\n");
+    // weight 1/8 for latency, 1/16 for errors
+    if(node->samples == 0){
+        node->ewma_us = us;
     } else {
-        debug(g_log, "del_handler success\n");
+        node->ewma_us = node->ewma_us - node->ewma_us / 8 + us / 8;
     }
-
-    node->avail_count--;
+    node->ewma_err -= node->ewma_err / 16;
+    if(fault){
+        node->ewma_err += NODE_ERR_ONE / 16;
+    }
+    node->samples++;
 
     return 0;
 }
 
 /*
- * fun: set mysql connection avail
- * arg: mysql connection
- * ret: success 0, error -1
+ * fun: eject a slave turning outlier, let back or eject again a slave
+ *      being probed
+ * arg: mysql node, last sample is a fault error, last sample is a good
+ *      answer
+ * ret: always return 0
  *
  */
 
-int my_conn_set_avail(my_conn_t *my)
+static int my_node_judge(my_node_t *node, int fault, int good)
 {
-    int res = 0;
-    my_node_t *node = my->node;
+    if( (!g_conf.outlier_eject) || (node->role != SLAVE_ROLE) || \
+                                        my_node_is_closing(node) ){
+        return 0;
+    }
 
-    my->conn = NULL;
-    buf_reset(&(my->buf));
+    if(node->eject_until){
+        if(fault){
+            my_node_eject(node, "probe error");
+        } else if( (node->samples >= NODE_PROBE_OK / 2) && my_node_is_outlier(node) ) {
+            my_node_eject(node, "probe latency");
+        } else if( good && (++node->probe_ok >= NODE_PROBE_OK) ) {
+            node->eject_until = 0;
+            log(g_log, "slave %s:%s readmitted, ewma %luus\n", \
+                                    node->host, node->srv, node->ewma_us);
+        }
+        return 0;
+    }
 
-    list_move_tail(&(my->link), &(node->avail_head));
-    my->state_time = time(NULL);
+    if(node->samples < NODE_MIN_SAMPLES){
+        return 0;
+    }
 
-    node->avail_count++;
+    if(node->ewma_err * 100 > (uint64_t)g_conf.outlier_error_rate * NODE_ERR_ONE){
+        my_node_eject(node, "error rate");
+    } else if(my_node_is_outlier(node)) {
+        my_node_eject(node, "latency");
+    } else if( (node->eject_level > 0) && (node->samples >= NODE_CALM_SAMPLES) ){
+        node->eject_level = 0;
+    }
 
     return 0;
 }
 
 /*
- * fun: set mysql connection dead 
- * arg: mysql connection
- * ret: success 0, error -1
+ * fun: get percentile of first answer latency of slave reads of worker,
+ *      recomputed every LAT_RECALC reads
+ * arg: percentile
+ * ret: latency us, 0 before enough reads
  *
  */
 
-static int my_conn_set_dead(my_conn_t *my)
+uint64_t my_slave_latency(int pct)
 {
-    int res = 0;
-    my_node_t *node = my->node;
+    int i;
+    uint32_t sum, want;
 
-    my->conn = NULL;
-    buf_reset(&(my->buf));
+    if(lat_total < LAT_RECALC){
+        return 0;
+    }
 
-    list_move_tail(&(my->link), &(node->dead_head));
-    my->state_time = time(NULL);
+    if( (lat_since < LAT_RECALC) && (lat_pct == pct) ){
+        return lat_pct_us;
+    }
 
-    return 0;
+    if(lat_total >= LAT_WINDOW){
+        lat_total = 0;
+        for(i = 0; i < LAT_BUCKETS; i++){
+            lat_hist[i] /= 2;
+            lat_total += lat_hist[i];
+        }
+    }
+
+    want = (uint64_t)lat_total * pct / 100;
+    for(i = 0, sum = 0; i < LAT_BUCKETS - 1; i++){
+        sum += lat_hist[i];
+        if(sum > want){
+            break;
+        }
+    }
+
+    lat_since = 0;
+    lat_pct = pct;
+    lat_pct_us = my_lat_bucket_us(i);
+
+    return lat_pct_us;
 }
 
 /*
- * fun: set mysql connection raw 
- * arg: mysql connection
- * ret: success 0, error -1
+ * fun: latency bucket of us, 4 buckets per power of 2
+ * arg: latency us
+ * ret: bucket index
  *
  */
 
-static int my_conn_set_raw(my_conn_t *my)
+static int my_lat_bucket(uint64_t us)
 {
-    int res = 0;
-    my_node_t *node = my->node;
+    int bit, index;
 
-    my->conn = NULL;
-    buf_reset(&(my->buf));
+    if(us < 8){
+        return us;
+    }
 
-    list_move_tail(&(my->link), &(node->raw_head));
-    my->state_time = time(NULL);
+    bit = 63 - __builtin_clzll(us);
+    index = bit * 4 + ((us >> (bit - 2)) & 3);
 
-    return 0;
+    return (index < LAT_BUCKETS) ? index : LAT_BUCKETS - 1;
 }
 
 /*
- * fun: set mysql connection fail 
- * arg: mysql connection
- * ret: success 0, error -1
+ * fun: upper bound of latency bucket
+ * arg: bucket index
+ * ret: latency us
  *
  */
 
-static int my_conn_set_fail(my_conn_t *my)
+static uint64_t my_lat_bucket_us(int index)
 {
-    int res = 0;
-    my_node_t *node = my->node;
+    int bit = index / 4;
 
-    list_move_tail(&(my->link), &(node->fail_head));
-    my->state_time = time(NULL);
+    if(index < 8){
+        return index + 1;
+    }
 
-    return 0;
+    return ((uint64_t)(4 + (index & 3) + 1)) << (bit - 2);
 }
 
 /*
- * fun: set mysql connection ping
- * arg: mysql connection
- * ret: success 0, error -1
+ * fun: check slave may take a read, an ejected slave is skipped until its
+ *      ejection ends, then gets a share of reads growing with every good
+ *      probe
+ * arg: mysql node
+ * ret: yes 1, no 0
  *
  */
 
-static int my_conn_set_ping(my_conn_t *my)
+static int my_node_admit(my_node_t *node)
 {
-    int res = 0;
-    my_node_t *node = my->node;
+    if(node->eject_until == 0){
+        return 1;
+    }
 
-    my->conn = NULL;
-    buf_reset(&(my->buf));
+    if(timer_us() < node->eject_until){
+        return 0;
+    }
 
-    list_move_tail(&(my->link), &(node->ping_head));
-    my->state_time = time(NULL);
+    return (rand() % NODE_PROBE_OK) <= node->probe_ok;
+}
 
-    return 0;
+/*
+ * fun: check slave is ejected and not probed yet
+ * arg: mysql node
+ * ret: yes 1, no 0
+ *
+ */
+
+static int my_node_is_ejected(my_node_t *node)
+{
+    return (node->eject_until != 0) && (timer_us() < node->eject_until);
 }
 
 /*
- * fun: dead reconnect timer
- * arg: max connection to be processed
- * ret: success 0, error -1
+ * fun: check slave latency is outlier, over outlier_latency percent of the
+ *      average of other slaves taking reads
+ * arg: mysql node
+ * ret: yes 1, no 0
  *
  */
 
-static int my_conn_dead_reconnect_timer(unsigned long arg)
+static int my_node_is_outlier(my_node_t *node)
 {
-    int i, res = 0;
-    my_node_t *node;
-    my_conn_t *my;
-    struct list_head *head, *pos, *n;
+    int i, count = 0;
+    uint64_t total = 0;
+    my_node_t *peer;
 
-    for(i = 0; i < mypool->master_num; i++){
-        node = &(mypool->master[i]);
-        if(my_node_is_closing(node)){
-            continue;
-        }
-        head = &(node->dead_head);
-        list_for_each_safe(pos, n, head){
-            my = list_entry(pos, my_conn_t, link);
-            list_del_init(pos);
-            if( (res = make_my_conn(my)) < 0 ){
-                log(g_log, "make_my_conn error\n");
-            }
-        }
+    if(node->ewma_us < NODE_LATENCY_FLOOR_US){
+        return 0;
     }
 
     for(i = 0; i < mypool->slave_num; i++){
-        node = &(mypool->slave[i]);
-        if(my_node_is_closing(node)){
+        peer = &(mypool->slave[i]);
+        if( (peer == node) || (peer->role != SLAVE_ROLE) || my_node_is_closing(peer) || \
+                (peer->eject_until != 0) || (peer->samples < NODE_MIN_SAMPLES) ){
             continue;
         }
-        head = &(node->dead_head);
-        list_for_each_safe(pos, n, head){
-            my = list_entry(pos, my_conn_t, link);
-            list_del_init(pos);
-            if( (res = make_my_conn(my)) < 0 ){
-                log(g_log, "make_my_conn error\n");
-            }
-        }
+        total += peer->ewma_us;
+        count++;
     }
 
-    return 0;
+    if(count == 0){
+        return 0;
+    }
+
+    return node->ewma_us * 100 > (total / count) * g_conf.outlier_latency;
 }
 
 /*
- * fun: fail reconnect timer
- * arg: max connection to be processed
- * ret: success 0, error -1
+ * fun: eject slave for outlier_eject seconds doubled on every ejection in
+ *      a row, the last slave taking reads is kept
+ * arg: mysql node, reason to log
+ * ret: ejected 0, kept -1
  *
  */
 
-static int my_conn_fail_reconnect_timer(unsigned long arg)
+static int my_node_eject(my_node_t *node, const char *why)
 {
-    int i, res = 0, count;
-    my_node_t *node;
-    my_conn_t *my;
-    struct list_head *head, *pos, *n;
+    int i, level;
+    my_node_t *peer;
 
-    for(i = 0; i < mypool->master_num; i++){
-        count = 0;
-        node = &(mypool->master[i]);
-        if(my_node_is_closing(node)){
-            continue;
-        }
-        head = &(node->fail_head);
-        list_for_each_safe(pos, n, head){
-            if(count++ >= arg){
-                break;
-            }
-            my = list_entry(pos, my_conn_t, link);
-            list_del_init(pos);
-            if( (res = make_my_conn(my)) < 0 ){
-                log(g_log, "make_my_conn error\n");
-            }
+    for(i = 0; i < mypool->slave_num; i++){
+        peer = &(mypool->slave[i]);
+        if( (peer != node) && (peer->role == SLAVE_ROLE) && \
+                (!my_node_is_closing(peer)) && (peer->eject_until == 0) ){
+            break;
         }
     }
 
-    for(i = 0; i < mypool->slave_num; i++){
-        count = 0;
-        node = &(mypool->slave[i]);
-        if(my_node_is_closing(node)){
-            continue;
-        }
-        head = &(node->fail_head);
-        list_for_each_safe(pos, n, head){
-            if(count++ >= arg){
-                break;
-            }
-            my = list_entry(pos, my_conn_t, link);
-            list_del_init(pos);
-            if( (res = make_my_conn(my)) < 0 ){
-                log(g_log, "make_my_conn error\n");
-            }
-        }
+    if(i == mypool->slave_num){
+        debug(g_log, "slave %s:%s %s, last slave kept\n", node->host, node->srv, why);
+        return -1;
     }
 
+    level = (node->eject_level < NODE_EJECT_MAX_LEVEL) ? \
+                                node->eject_level : NODE_EJECT_MAX_LEVEL;
+    node->eject_until = timer_us() + ((uint64_t)g_conf.outlier_eject << level) * 1000000;
+    node->eject_level = level + 1;
+    node->probe_ok = 0;
+    node->samples = 0;
+    node->ewma_err = 0;
+    node->ejected++;
+
+    log(g_log, "slave %s:%s ejected for %ds, %s, ewma %luus\n", node->host, \
+                node->srv, g_conf.outlier_eject << level, why, node->ewma_us);
+
     return 0;
 }
 
 /*
- * fun: mysql connection pool status timer
- * arg: void
- * ret: success 0, error -1
+ * fun: check error is a fault of the server rather than of the query
+ * arg: error code
+ * ret: yes 1, no 0
  *
  */
 
-static int my_conn_pool_status_timer(unsigned long arg)
+static int my_err_is_fault(uint16_t err)
 {
-    int i, count1, count2, count3, count4, count5, count6;
-    my_node_t *node;
-    my_conn_t *my;
-    struct list_head *head, *pos, *n;
-    conn_t *c;
-
-    for(i = 0; i < mypool->master_num; i++){
-        count1 = count2 = count3 = count4 = count5 = count6 = 0;
-        node = &(mypool->master[i]);
-        if(my_node_is_closing(node)){
-            continue;
-        }
+    switch(err){
+        case 1037:  // out of memory
+        case 1038:  // out of sort memory
+        case 1040:  // too many connections
+        case 1041:  // out of memory
+        case 1053:  // server shutdown
+        case 1203:  // max user connections
+        case 1205:  // lock wait timeout
+        case 1317:  // query interrupted
+        case 2013:  // lost connection
+        case 3024:  // max execution time exceeded
+            return 1;
+    }
 
-        head = &(node->used_head);
-        list_for_each_safe(pos, n, head){
-            my = list_entry(pos, my_conn_t, link);
-            c = my->conn;
-            if(c != NULL){
-                debug(g_log, "connid: %d\n", c->connid);
-            } else {
-                debug(g_log, "no connect attach\n");
-            }
-            count1++;
-        }
+    return 0;
+}
 
-        head = &(node->avail_head);
-        list_for_each_safe(pos, n, head){
-            count2++;
-        }
+/*
+ * fun: order slaves to try, slaves of the group then slaves of default
+ *      group, default group falls back to every slave when it has none
+ * arg: client ip, client port, slave group, NULL default, key and length,
+ * arg: order to fill, number of leading slaves the read belongs to to set,
+ * arg: only the home slave on slave hash ring
+ * ret: number of slaves in order, closing slaves are left out
+ *
+ */
 
-        head = &(node->dead_head);
-        list_for_each_safe(pos, n, head){
-            count3++;
-        }
+static int my_slave_order(uint32_t ip, uint16_t port, const char *group, \
+                        const char *key, int len, int *order, int *want)
+{
+    int num, onring;
+    uint64_t hash = 0;
 
-        head = &(node->raw_head);
-        list_for_each_safe(pos, n, head){
-            count4++;
-        }
+    onring = g_conf.slave_hash && (len > 0) && \
+                ((!ring_dirty) || (my_slave_ring_build() == 0)) && (ring_num > 0);
+    if(onring){
+        hash = mmhash64(key, len);
+    }
 
-        head = &(node->fail_head);
-        list_for_each_safe(pos, n, head){
-            count5++;
-        }
+    if( (group != NULL) && (*group == '\0') ){
+        group = NULL;
+    }
 
-        head = &(node->ping_head);
-        list_for_each_safe(pos, n, head){
-            count6++;
-        }
+    num = my_slave_order_group(ip, port, group ? group : "", hash, onring, order);
+    *want = (onring && (num > 0)) ? 1 : num;
 
-        log(g_log, \
-            "master %s:%s used,%d free,%d dead,%d raw,%d fail,%d ping,%d\n", \
-                   node->host, node->srv, count1, count2, count3, count4, count5, count6);
+    if(group != NULL){
+        num += my_slave_order_group(ip, port, "", hash, onring, order + num);
+    } else if(num == 0) {
+        num = my_slave_order_group(ip, port, NULL, hash, onring, order);
+        *want = (onring && (num > 0)) ? 1 : num;
     }
 
+    return num;
+}
+
+/*
+ * fun: order slaves of one group, walk slave hash ring clockwise from hash
+ *      of key, without ring start at (ip + port) % slave_num
+ * arg: client ip, client port, slave group, NULL every slave, hash of key,
+ * arg: use ring 1/0, order to fill
+ * ret: number of slaves in order
+ *
+ */
+
+static int my_slave_order_group(uint32_t ip, uint16_t port, const char *group, \
+                        uint64_t hash, int onring, int *order)
+{
+    int i, lo, hi, mid, index, total = 0, num = 0;
+    uint8_t seen[MAX_SLAVE_NODE];
+    my_node_t *node;
+
+    bzero(seen, sizeof(seen));
     for(i = 0; i < mypool->slave_num; i++){
-        count1 = count2 = count3 = count4 = count5 = count6 = 0;
         node = &(mypool->slave[i]);
-        if(my_node_is_closing(node)){
-            continue;
-        }
-
-        head = &(node->used_head);
-        list_for_each_safe(pos, n, head){
-            my = list_entry(pos, my_conn_t, link);
-            c = my->conn;
-            if(c != NULL){
-                debug(g_log, "connid: %d\n", c->connid);
-            } else {
-                debug(g_log, "no connect attach\n");
-            }
-            count1++;
+        if( (node->role != SLAVE_ROLE) || my_node_is_closing(node) || \
+                        ((group != NULL) && strcmp(node->group, group)) || \
+                                                    (!my_node_admit(node)) ){
+            seen[i] = 1;
+        } else {
+            total++;
         }
+    }
 
-        head = &(node->avail_head);
-        list_for_each_safe(pos, n, head){
-            count2++;
-        }
+    if(total == 0){
+        return 0;
+    }
 
-        head = &(node->dead_head);
-        list_for_each_safe(pos, n, head){
-            count3++;
+    if(!onring){
+        for(i = 0; i < mypool->slave_num; i++){
+            index = ((ip + port) + i) % (mypool->slave_num);
+            if(!seen[index]){
+                order[num++] = index;
+            }
         }
 
-        head = &(node->raw_head);
-        list_for_each_safe(pos, n, head){
-            count4++;
-        }
+        return num;
+    }
 
-        head = &(node->fail_head);
-        list_for_each_safe(pos, n, head){
-            count5++;
+    // first point not below hash
+    lo = 0;
+    hi = ring_num;
+    while(lo < hi){
+        mid = (lo + hi) / 2;
+        if(ring[mid].hash < hash){
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
+    }
 
-        head = &(node->ping_head);
-        list_for_each_safe(pos, n, head){
-            count6++;
+    for(i = 0; (i < ring_num) && (num < total); i++){
+        index = ring[(lo + i) % ring_num].index;
+        if(!seen[index]){
+            seen[index] = 1;
+            order[num++] = index;
         }
-
-        log(g_log, \
-            "slave %s:%s used,%d free,%d dead,%d raw,%d fail,%d ping,%d\n", \
-                   node->host, node->srv, count1, count2, count3, count4, count5, count6);
     }
 
-    return 0;
+    return num;
 }
 
 /*
- * fun: ping timer
- * arg: max connection to be processed
+ * fun: build slave hash ring, slave_vnode points of every registered slave,
+ *      a slave leaving only moves the keys of its own points
+ * arg:
  * ret: success 0, error -1
  *
  */
 
-static int my_conn_pool_ping_timer(unsigned long arg)
+static int my_slave_ring_build(void)
 {
-    int i, res = 0, count;
+    int i, j, len, num = 0, vnode;
+    char name[MAX_HOST_LEN + MAX_SRV_LEN + 16];
     my_node_t *node;
-    my_conn_t *my;
-    struct list_head *head, *pos, *n;
+    ring_point_t *r;
 
-    for(i = 0; i < mypool->master_num; i++){
-        count = 0;
-        node = &(mypool->master[i]);
-        if(my_node_is_closing(node)){
-            continue;
-        }
-        head = &(node->avail_head);
-        list_for_each_safe(pos, n, head){
-            if(count++ >= arg){
-                break;
-            }
-            my = list_entry(pos, my_conn_t, link);
-            if( (res = my_conn_set_ping(my)) < 0 ){
-                log(g_log, "my_conn_set_ping error\n");
-            }
+    vnode = (g_conf.slave_vnode > 0) ? g_conf.slave_vnode : 1;
 
-            my_ping_prepare(my);
-        }
+    if( (r = malloc(sizeof(ring_point_t) * vnode * (mypool->slave_num + 1))) == NULL ){
+        log_err(g_log, "malloc error\n");
+        return -1;
     }
 
     for(i = 0; i < mypool->slave_num; i++){
-        count = 0;
         node = &(mypool->slave[i]);
-        if(my_node_is_closing(node)){
+        if(node->role != SLAVE_ROLE){
             continue;
         }
-        head = &(node->avail_head);
-        list_for_each_safe(pos, n, head){
-            if(count++ >= arg){
-                break;
-            }
-            my = list_entry(pos, my_conn_t, link);
-            if( (res = my_conn_set_ping(my)) < 0 ){
-                log(g_log, "my_conn_set_ping error\n");
-            }
-
-            my_ping_prepare(my);
+        for(j = 0; j < vnode; j++){
+            len = snprintf(name, sizeof(name), "%s:%s#%d", node->host, node->srv, j);
+            r[num].hash = mmhash64(name, len);
+            r[num].index = i;
+            num++;
         }
     }
 
+    qsort(r, num, sizeof(ring_point_t), my_slave_ring_cmp);
+
+    free(ring);
+    ring = r;
+    ring_num = num;
+    ring_dirty = 0;
+
+    log(g_log, "slave hash ring built, %d points\n", num);
+
     return 0;
 }
 
+static int my_slave_ring_cmp(const void *a, const void *b)
+{
+    const ring_point_t *x = a, *y = b;
+
+    if(x->hash == y->hash){
+        return x->index - y->index;
+    }
+
+    return (x->hash < y->hash) ? -1 : 1;
+}
+
 /*
- * fun: ping timeout timer
- * arg: max connection to be processed
- * ret: success 0, error -1
+ * fun: get number of registered shard
+ * arg:
+ * ret: shard number, include closing shard
  *
  */
 
-static int my_conn_pool_ping_timeout_timer(unsigned long arg)
+int my_shard_num(void)
 {
-    int i, res = 0, count;
-    my_node_t *node;
-    my_conn_t *my;
-    struct list_head *head, *pos, *n;
-    time_t now = time(NULL);
+    return mypool->shard_num;
+}
+
+/*
+ * fun: check shard is registered and not closing
+ * arg: shard index
+ * ret: yes 1, no 0
+ *
+ */
+
+int my_shard_is_active(int index)
+{
+    my_node_t *node;
+
+    if( (index < 0) || (index >= mypool->shard_num) ){
+        return 0;
+    }
+
+    node = &(mypool->shard[index]);
+
+    return (node->role == SHARD_ROLE) && !my_node_is_closing(node);
+}
+
+/*
+ * fun: get a connection of given shard
+ * arg: connection, shard index
+ * ret: success return mysql connection, error return NULL
+ *
+ */
+
+my_conn_t *my_shard_conn_get(void *c, int index)
+{
+    my_node_t *node;
+    my_conn_t *my;
+    struct list_head *head;
+
+    if( (index < 0) || (index >= mypool->shard_num) ){
+        log(g_log, "shard[%d] not register\n", index);
+        return NULL;
+    }
+
+    node = &(mypool->shard[index]);
+    head = &(node->avail_head);
+    if( (node->role != SHARD_ROLE) || (my_node_is_closing(node)) || \
+                                                    (list_empty(head)) ){
+        log(g_log, "shard[%d] %s:%s no connection available\n", \
+                                            index, node->host, node->srv);
+        return NULL;
+    }
+
+    my = list_first_entry(head, my_conn_t, link);
+    my_conn_set_used(my, c);
+
+    return my;
+}
+
+/*
+ * fun: close mysql connection
+ * arg: mysql connection
+ * ret: success 0, error -1
+ *
+ */
+
+int my_conn_close(my_conn_t *my)
+{
+    int res;
+
+    if( (res = del_handler(my->fd)) < 0 ){
+        log(g_log, "del_handler error, ignore it\n");
+    } else {
+        debug(g_log, "del_handler success\n");
+    }
+
+    if(my->fd >= 0){
+        close(my->fd);
+        my->fd = -1;
+    }
+
+    my->conn = NULL;
+    buf_reset(&(my->buf));
+
+    if(my->connecting){
+        my->connecting = 0;
+        ((my_node_t *)my->node)->connecting--;
+    }
+
+    if(my->pinging){
+        my->pinging = 0;
+        ((my_node_t *)my->node)->avail_count--;
+    }
+
+    my_conn_set_dead(my);
+
+    return 0;
+}
+
+/*
+ * fun: close mysql connection and set fail
+ * arg: mysql connection
+ * ret: success 0, error -1
+ *
+ */
+
+int my_conn_close_on_fail(my_conn_t *my)
+{
+    my_conn_close(my);
+    my_conn_set_fail(my);
+
+    return 0;
+}
+
+/*
+ * fun: close mysql connection and release it
+ * arg: mysql connection
+ * ret: success 0, error -1
+ *
+ */
+
+static int my_conn_close_and_release(my_conn_t *my)
+{
+    my_conn_close(my);
+    list_del_init(&(my->link));
+    my_conn_release(my);
+
+    return 0;
+}
+
+/*
+ * fun: put mysql connection
+ * arg: mysql connection
+ * ret: success 0, error -1
+ *
+ */
+
+int my_conn_put(my_conn_t *my)
+{
+    int res = 0;
+    my_node_t *node = my->node;
+
+    if( (res = del_handler(my->fd)) < 0 ){
+        log(g_log, "del_handler error, ignore it\n");
+    } else {
+        debug(g_log, "del_handler success\n");
+    }
+
+    if(my_conn_ctx_is_dirty(my)){
+        my_conn_close(my);
+
+        return 0;
+    }
+
+    my_conn_set_avail(my);
+
+    return 0;
+}
+
+/*
+ * fun: set mysql connection used
+ * arg: mysql connection, connection pointer
+ * ret: success 0, error -1
+ *
+ */
+
+static int my_conn_set_used(my_conn_t *my, void *ptr)
+{
+    int res = 0;
+    my_node_t *node = my->node;
+    my->conn = ptr;
+    buf_reset(&(my->buf));
+
+    list_move_tail(&(my->link), &(node->used_head));
+    my->state_time = timer_sec();
+
+    if( (res = del_handler(my->fd)) < 0 ){
+        log(g_log, "del_handler error, ignore it\n");
+    } else {
+        debug(g_log, "del_handler success\n");
+    }
+
+    node->avail_count--;
+    if(node->avail_count < node->avail_min){
+        node->avail_min = node->avail_count;
+    }
+
+    if(node->avail_count <= 0){
+        my_node_grow(node, 1);
+    }
+
+    return 0;
+}
+
+/*
+ * fun: set mysql connection avail
+ * arg: mysql connection
+ * ret: success 0, error -1
+ *
+ */
+
+int my_conn_set_avail(my_conn_t *my)
+{
+    int res = 0;
+    my_node_t *node = my->node;
+    conn_t *c;
+
+    my->conn = NULL;
+    buf_reset(&(my->buf));
+
+    list_move_tail(&(my->link), &(node->avail_head));
+    my->state_time = timer_sec();
+
+    if(my->pinging){
+        my->pinging = 0;
+    } else {
+        node->avail_count++;
+    }
+
+    if(my->connecting){
+        my->connecting = 0;
+        node->connecting--;
+    }
+
+    if( (!list_empty(&(node->wait_head))) && (!my_node_is_closing(node)) ){
+        c = list_first_entry(&(node->wait_head), conn_t, wait);
+        my_conn_wait_cancel(c, 0);
+        my_conn_set_used(my, c);
+
+        log(g_log, "conn:%u handed mysql[%s:%s] after waiting\n", \
+                                        c->connid, node->host, node->srv);
+
+        if( (res = conn_wait_resume(c, my)) < 0 ){
+            log(g_log, "conn:%u conn_wait_resume error\n", c->connid);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * fun: queue connection waiting for a mysql connection, a waiter is
+ *      handed the next mysql connection put back to the node
+ * arg: connection, role needed, client ip, client port,
+ * arg: key of slave hash ring and length
+ * ret: success 0, queue full or no node -1
+ *
+ */
+
+int my_conn_wait(void *ptr, int role, uint32_t ip, uint16_t port, \
+                        const char *group, const char *key, int len)
+{
+    int i, num, want;
+    int order[MAX_SLAVE_NODE];
+    my_node_t *node = NULL;
+    conn_t *c = ptr;
+
+    if( (role == SLAVE_ROLE) && (mypool->slave_num > 0) ){
+        // closing slaves are not in order
+        if(my_slave_order(ip, port, group, key, len, order, &want) > 0){
+            node = &(mypool->slave[order[0]]);
+        }
+    } else {
+        num = mypool->master_num;
+        for(i = 0; i < num; i++){
+            node = &(mypool->master[((ip + port) + i) % num]);
+            if(!my_node_is_closing(node)){
+                break;
+            }
+        }
+        if(i == num){
+            node = NULL;
+        }
+    }
+
+    if(node == NULL){
+        log(g_log, "no mysql node to wait for\n");
+        return -1;
+    }
+
+    if(node->wait_count >= g_conf.wait_mysql_queue){
+        log(g_log, "conn:%u mysql[%s:%s] wait queue full, %d waiting\n", \
+                        c->connid, node->host, node->srv, node->wait_count);
+        return -1;
+    }
+
+    list_add_tail(&(c->wait), &(node->wait_head));
+    c->wait_node = node;
+    c->wait_us = timer_us();
+    node->wait_count++;
+
+    log(g_log, "conn:%u waiting for mysql[%s:%s], %d waiting\n", \
+                        c->connid, node->host, node->srv, node->wait_count);
+
+    my_node_grow(node, node->wait_count);
+
+    return 0;
+}
+
+/*
+ * fun: remove connection from wait queue and account waited time
+ * arg: connection, handed 0 or expired 1
+ * ret: always return 0
+ *
+ */
+
+int my_conn_wait_cancel(void *ptr, int expire)
+{
+    uint64_t usec;
+    conn_t *c = ptr;
+    my_node_t *node = c->wait_node;
+
+    if(node == NULL){
+        return 0;
+    }
+
+    usec = timer_us() - c->wait_us;
+
+    list_del_init(&(c->wait));
+    c->wait_node = NULL;
+    node->wait_count--;
+
+    if(expire){
+        node->wait_expire++;
+    } else {
+        node->wait_done++;
+        node->wait_usec += usec;
+        if(usec > node->wait_max_usec){
+            node->wait_max_usec = usec;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * fun: set mysql connection dead 
+ * arg: mysql connection
+ * ret: success 0, error -1
+ *
+ */
+
+static int my_conn_set_dead(my_conn_t *my)
+{
+    int res = 0;
+    my_node_t *node = my->node;
+
+    my->conn = NULL;
+    buf_reset(&(my->buf));
+
+    list_move_tail(&(my->link), &(node->dead_head));
+    my->state_time = timer_sec();
+
+    return 0;
+}
+
+/*
+ * fun: set mysql connection raw 
+ * arg: mysql connection
+ * ret: success 0, error -1
+ *
+ */
+
+static int my_conn_set_raw(my_conn_t *my)
+{
+    int res = 0;
+    my_node_t *node = my->node;
+
+    my->conn = NULL;
+    buf_reset(&(my->buf));
+
+    list_move_tail(&(my->link), &(node->raw_head));
+    my->state_time = timer_sec();
+
+    return 0;
+}
+
+/*
+ * fun: set mysql connection fail 
+ * arg: mysql connection
+ * ret: success 0, error -1
+ *
+ */
+
+static int my_conn_set_fail(my_conn_t *my)
+{
+    int res = 0;
+    my_node_t *node = my->node;
+
+    list_move_tail(&(my->link), &(node->fail_head));
+    my->state_time = timer_sec();
+
+    return 0;
+}
+
+/*
+ * fun: set mysql connection ping
+ * arg: mysql connection
+ * ret: success 0, error -1
+ *
+ */
+
+static int my_conn_set_ping(my_conn_t *my)
+{
+    int res = 0;
+    my_node_t *node = my->node;
+
+    my->conn = NULL;
+    buf_reset(&(my->buf));
+
+    list_move_tail(&(my->link), &(node->ping_head));
+    my->state_time = timer_sec();
+
+    // still counted in avail_count while pinging
+    my->pinging = 1;
+
+    return 0;
+}
+
+/*
+ * fun: dead reconnect on one mysql node
+ * arg: mysql node
+ * ret: success 0, error -1
+ *
+ */
+
+static int _my_conn_dead_reconnect(my_node_t *node)
+{
+    int res = 0;
+    my_conn_t *my;
+    struct list_head *head, *pos, *n;
+
+    if(my_node_is_closing(node)){
+        return 0;
+    }
+
+    head = &(node->dead_head);
+    list_for_each_safe(pos, n, head){
+        my = list_entry(pos, my_conn_t, link);
+        list_del_init(pos);
+        if( (res = make_my_conn(my)) < 0 ){
+            log(g_log, "make_my_conn error\n");
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * fun: dead reconnect timer
+ * arg: max connection to be processed
+ * ret: success 0, error -1
+ *
+ */
+
+static int my_conn_dead_reconnect_timer(unsigned long arg)
+{
+    int i;
+
+    for(i = 0; i < mypool->master_num; i++){
+        _my_conn_dead_reconnect(&(mypool->master[i]));
+    }
+
+    for(i = 0; i < mypool->slave_num; i++){
+        _my_conn_dead_reconnect(&(mypool->slave[i]));
+    }
+
+    for(i = 0; i < mypool->shard_num; i++){
+        _my_conn_dead_reconnect(&(mypool->shard[i]));
+    }
+
+    return 0;
+}
+
+/*
+ * fun: fail reconnect on one mysql node
+ * arg: mysql node, max connection to be processed
+ * ret: success 0, error -1
+ *
+ */
+
+static int _my_conn_fail_reconnect(my_node_t *node, unsigned long arg)
+{
+    int res = 0, count = 0;
+    my_conn_t *my;
+    struct list_head *head, *pos, *n;
+
+    if(my_node_is_closing(node)){
+        return 0;
+    }
+
+    head = &(node->fail_head);
+    list_for_each_safe(pos, n, head){
+        if(count++ >= arg){
+            break;
+        }
+        my = list_entry(pos, my_conn_t, link);
+        list_del_init(pos);
+        if( (res = make_my_conn(my)) < 0 ){
+            log(g_log, "make_my_conn error\n");
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * fun: fail reconnect timer
+ * arg: max connection to be processed
+ * ret: success 0, error -1
+ *
+ */
+
+static int my_conn_fail_reconnect_timer(unsigned long arg)
+{
+    int i;
+
+    for(i = 0; i < mypool->master_num; i++){
+        _my_conn_fail_reconnect(&(mypool->master[i]), arg);
+    }
+
+    for(i = 0; i < mypool->slave_num; i++){
+        _my_conn_fail_reconnect(&(mypool->slave[i]), arg);
+    }
+
+    for(i = 0; i < mypool->shard_num; i++){
+        _my_conn_fail_reconnect(&(mypool->shard[i]), arg);
+    }
+
+    return 0;
+}
+
+/*
+ * fun: log status of one mysql node
+ * arg: mysql node, node type name
+ * ret: success 0, error -1
+ *
+ */
+
+static int _my_conn_pool_status(my_node_t *node, const char *type)
+{
+    int count1, count2, count3, count4, count5, count6;
+    my_conn_t *my;
+    struct list_head *head, *pos, *n;
+    conn_t *c;
+
+    count1 = count2 = count3 = count4 = count5 = count6 = 0;
+    if(my_node_is_closing(node)){
+        return 0;
+    }
+
+    head = &(node->used_head);
+    list_for_each_safe(pos, n, head){
+        my = list_entry(pos, my_conn_t, link);
+        c = my->conn;
+        if(c != NULL){
+            debug(g_log, "connid: %d\n", c->connid);
+        } else {
+            debug(g_log, "no connect attach\n");
+        }
+        count1++;
+    }
+
+    head = &(node->avail_head);
+    list_for_each_safe(pos, n, head){
+        count2++;
+    }
+
+    head = &(node->dead_head);
+    list_for_each_safe(pos, n, head){
+        count3++;
+    }
+
+    head = &(node->raw_head);
+    list_for_each_safe(pos, n, head){
+        count4++;
+    }
+
+    head = &(node->fail_head);
+    list_for_each_safe(pos, n, head){
+        count5++;
+    }
+
+    head = &(node->ping_head);
+    list_for_each_safe(pos, n, head){
+        count6++;
+    }
+
+    log(g_log, \
+        "%s %s:%s used,%d free,%d dead,%d raw,%d fail,%d ping,%d\n", \
+               type, node->host, node->srv, count1, count2, count3, count4, count5, count6);
+
+    log(g_log, "%s %s:%s total,%d min,%d max,%d cap,%d all_workers,%d\n", \
+                type, node->host, node->srv, node->conn_total, \
+                node->min, node->max, node->cap, my_node_shm_total(node));
+
+    // wait max is reset every report, others are totals
+    log(g_log, "%s %s:%s wait,%d handed,%lu expired,%lu " \
+                                "avg_wait,%luus max_wait,%luus\n", \
+                type, node->host, node->srv, node->wait_count, \
+                node->wait_done, node->wait_expire, \
+                node->wait_done ? node->wait_usec / node->wait_done : 0, \
+                node->wait_max_usec);
+    node->wait_max_usec = 0;
+
+    log(g_log, "%s %s:%s ewma,%luus errors,%lu%% ejected,%lu state,%s\n", \
+                type, node->host, node->srv, node->ewma_us, \
+                (unsigned long)node->ewma_err * 100 / NODE_ERR_ONE, node->ejected, \
+                my_node_is_ejected(node) ? "ejected" : \
+                    (node->eject_until ? "probing" : "normal"));
+
+    return 0;
+}
+
+/*
+ * fun: mysql connection pool status timer
+ * arg: void
+ * ret: success 0, error -1
+ *
+ */
+
+static int my_conn_pool_status_timer(unsigned long arg)
+{
+    int i;
+
+    for(i = 0; i < mypool->master_num; i++){
+        _my_conn_pool_status(&(mypool->master[i]), "master");
+    }
+
+    for(i = 0; i < mypool->slave_num; i++){
+        _my_conn_pool_status(&(mypool->slave[i]), "slave");
+    }
+
+    for(i = 0; i < mypool->shard_num; i++){
+        _my_conn_pool_status(&(mypool->shard[i]), "shard");
+    }
+
+    return 0;
+}
+
+/*
+ * fun: ping avail connections of one mysql node
+ * arg: mysql node, max connection to be processed
+ * ret: success 0, error -1
+ *
+ */
+
+static int _my_conn_pool_ping(my_node_t *node, unsigned long arg)
+{
+    int res = 0, count = 0;
+    my_conn_t *my;
+    struct list_head *head, *pos, *n;
+
+    if(my_node_is_closing(node)){
+        return 0;
+    }
+
+    head = &(node->avail_head);
+    list_for_each_safe(pos, n, head){
+        if(count++ >= arg){
+            break;
+        }
+        my = list_entry(pos, my_conn_t, link);
+        if( (res = my_conn_set_ping(my)) < 0 ){
+            log(g_log, "my_conn_set_ping error\n");
+        }
+
+        my_ping_prepare(my);
+    }
+
+    return 0;
+}
+
+/*
+ * fun: ping timer
+ * arg: max connection to be processed
+ * ret: success 0, error -1
+ *
+ */
+
+static int my_conn_pool_ping_timer(unsigned long arg)
+{
+    int i;
+
+    for(i = 0; i < mypool->master_num; i++){
+        _my_conn_pool_ping(&(mypool->master[i]), arg);
+    }
+
+    for(i = 0; i < mypool->slave_num; i++){
+        _my_conn_pool_ping(&(mypool->slave[i]), arg);
+    }
+
+    for(i = 0; i < mypool->shard_num; i++){
+        _my_conn_pool_ping(&(mypool->shard[i]), arg);
+    }
+
+    return 0;
+}
+
+/*
+ * fun: ping timeout on one mysql node
+ * arg: mysql node, max connection to be processed, current time
+ * ret: success 0, error -1
+ *
+ */
+
+static int _my_conn_pool_ping_timeout(my_node_t *node, unsigned long arg, time_t now)
+{
+    int count = 0;
+    my_conn_t *my;
+    struct list_head *head, *pos, *n;
+
+    if(my_node_is_closing(node)){
+        return 0;
+    }
+
+    head = &(node->ping_head);
+    list_for_each_safe(pos, n, head){
+        if(count++ >= arg){
+            break;
+        }
+        my = list_entry(pos, my_conn_t, link);
+
+        if(now - my->state_time > g_conf.mysql_ping_timeout){
+            my_conn_close_on_fail(my);
+        } else {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * fun: ping timeout timer
+ * arg: max connection to be processed
+ * ret: success 0, error -1
+ *
+ */
+
+static int my_conn_pool_ping_timeout_timer(unsigned long arg)
+{
+    int i;
+    time_t now = timer_sec();
 
     for(i = 0; i < mypool->master_num; i++){
-        count = 0;
+        _my_conn_pool_ping_timeout(&(mypool->master[i]), arg, now);
+    }
+
+    for(i = 0; i < mypool->slave_num; i++){
+        _my_conn_pool_ping_timeout(&(mypool->slave[i]), arg, now);
+    }
+
+    for(i = 0; i < mypool->shard_num; i++){
+        _my_conn_pool_ping_timeout(&(mypool->shard[i]), arg, now);
+    }
+
+    return 0;
+}
+
+/*
+ * fun: cleanup closing node
+ * arg: mysql node
+ * ret: success 0, error -1
+ *
+ */
+
+static int my_node_closing_cleanup(my_node_t *node)
+{
+    struct list_head *head, *pos, *n;
+    my_conn_t *my;
+    conn_t *c;
+
+    head = &(node->wait_head);
+    list_for_each_safe(pos, n, head){
+        c = list_entry(pos, conn_t, wait);
+        log(g_log, "conn:%d wait cleanup\n", c->connid);
+        conn_wait_expire(c);
+    }
+
+    head = &(node->used_head);
+    list_for_each_safe(pos, n, head){
+        my = list_entry(pos, my_conn_t, link);
+        c  = my->conn;
+        log(g_log, "conn:%d cleanup\n", c->connid);
+        conn_close(c);
+        my_conn_close_and_release(my);
+    }
+
+    head = &(node->avail_head);
+    list_for_each_safe(pos, n, head){
+        my = list_entry(pos, my_conn_t, link);
+        my_conn_close_and_release(my);
+    }
+
+    head = &(node->dead_head);
+    list_for_each_safe(pos, n, head){
+        my = list_entry(pos, my_conn_t, link);
+        my_conn_close_and_release(my);
+    }
+
+    head = &(node->raw_head);
+    list_for_each_safe(pos, n, head){
+        my = list_entry(pos, my_conn_t, link);
+        my_conn_close_and_release(my);
+    }
+
+    head = &(node->fail_head);
+    list_for_each_safe(pos, n, head){
+        my = list_entry(pos, my_conn_t, link);
+        my_conn_close_and_release(my);
+    }
+
+    head = &(node->ping_head);
+    list_for_each_safe(pos, n, head){
+        my = list_entry(pos, my_conn_t, link);
+        my_conn_close_and_release(my);
+    }
+
+    if(node->role == SLAVE_ROLE){
+        ring_dirty = 1;
+    }
+    node->role = UNAVAIL_ROLE;
+
+    return 0;
+}
+
+/*
+ * fun: cleanup closing node timer
+ * arg: max connection to be processed
+ * ret: success 0, error -1
+ *
+ */
+
+static int my_node_closing_cleanup_timer(unsigned long arg)
+{
+    int i, num;
+    my_node_t *node;
+    time_t now = timer_sec();
+
+    num = mypool->master_num;
+    for(i = 0; i < num; i++){
         node = &(mypool->master[i]);
-        if(my_node_is_closing(node)){
-            continue;
+        if( (my_node_is_closing(node)) && \
+            (node->role != UNAVAIL_ROLE) && \
+            (now - node->closing_time > MY_NODE_CLOSING_DELAY) ){
+            my_node_closing_cleanup(node);
+            log(g_log, "master %s:%s connection cleanup\n", \
+                                                node->host, node->srv);
+        }
+    }
+
+    num = mypool->slave_num;
+    for(i = 0; i < mypool->slave_num; i++){
+        node = &(mypool->slave[i]);
+        if( (my_node_is_closing(node)) && \
+            (node->role != UNAVAIL_ROLE) && \
+            (now - node->closing_time > MY_NODE_CLOSING_DELAY) ){
+            my_node_closing_cleanup(node);
+            log(g_log, "slave %s:%s connection cleanup\n", \
+                                                node->host, node->srv);
+        }
+    }
+
+    for(i = 0; i < mypool->shard_num; i++){
+        node = &(mypool->shard[i]);
+        if( (my_node_is_closing(node)) && \
+            (node->role != UNAVAIL_ROLE) && \
+            (now - node->closing_time > MY_NODE_CLOSING_DELAY) ){
+            my_node_closing_cleanup(node);
+            log(g_log, "shard %s:%s connection cleanup\n", \
+                                                node->host, node->srv);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * fun: set mysql connection context dirty
+ * arg: mysql connection
+ * ret: always return 0
+ *
+ */
+
+int my_conn_ctx_set_dirty(my_conn_t *my)
+{
+    my_ctx_t *ctx = &(my->ctx);
+
+    ctx->dirty = 1;
+
+    return 0;
+}
+
+/*
+ * fun: check mysql connection if dirty
+ * arg: mysql connection
+ * ret: yes return 1, no return 0
+ *
+ */
+
+int my_conn_ctx_is_dirty(my_conn_t *my)
+{
+    my_ctx_t *ctx = &(my->ctx);
+
+    return ctx->dirty;
+}
+
+/*
+ * fun: get shared connection counters of a mysql node
+ * arg: host, srv
+ * ret: success return counters, error return NULL
+ *
+ */
+
+static pool_shm_node_t *pool_shm_slot(const char *host, const char *srv)
+{
+    int i, len;
+    uint64_t key;
+    char name[MAX_HOST_LEN + MAX_SRV_LEN + 2];
+    pool_shm_node_t *slot;
+
+    if( (poolshm == NULL) || (worker_slot < 0) ){
+        return NULL;
+    }
+
+    len = snprintf(name, sizeof(name), "%s:%s", host, srv);
+    key = mmhash64(name, len) | 1;
+
+    for(i = 0; i < MAX_POOL_SHM_NODE; i++){
+        slot = &(poolshm->node[(key + i) % MAX_POOL_SHM_NODE]);
+        if( (slot->key == key) || \
+            __sync_bool_compare_and_swap(&(slot->key), 0, key) || \
+            (slot->key == key) ){
+            return slot;
+        }
+    }
+
+    log(g_log, "%s no connection counter slot, cap disabled\n", name);
+
+    return NULL;
+}
+
+/*
+ * fun: publish connection number of this worker
+ * arg: mysql node
+ * ret: always return 0
+ *
+ */
+
+static int my_node_shm_update(my_node_t *node)
+{
+    pool_shm_node_t *slot = node->shm;
+
+    if(slot != NULL){
+        slot->count[worker_slot] = node->conn_total;
+    }
+
+    return 0;
+}
+
+/*
+ * fun: get connection number of all workers, it's not exact when
+ *      workers grow at the same time, cap is a soft limit
+ * arg: mysql node
+ * ret: connection number
+ *
+ */
+
+static int my_node_shm_total(my_node_t *node)
+{
+    int i, total = 0;
+    pool_shm_node_t *slot = node->shm;
+
+    if(slot == NULL){
+        return node->conn_total;
+    }
+
+    for(i = 0; i < MAX_WORKER; i++){
+        total += slot->count[i];
+    }
+
+    return total;
+}
+
+/*
+ * fun: find registered mysql node which is not closing
+ * arg: host, srv
+ * ret: success return mysql node, error return NULL
+ *
+ */
+
+static my_node_t *my_node_find(const char *host, const char *srv)
+{
+    int i;
+    my_node_t *node;
+
+    for(i = 0; i < mypool->master_num + mypool->slave_num + mypool->shard_num; i++){
+        if(i < mypool->master_num){
+            node = &(mypool->master[i]);
+        } else if(i < mypool->master_num + mypool->slave_num) {
+            node = &(mypool->slave[i - mypool->master_num]);
+        } else {
+            node = &(mypool->shard[i - mypool->master_num - mypool->slave_num]);
         }
-        head = &(node->ping_head);
-        list_for_each_safe(pos, n, head){
-            if(count++ >= arg){
-                break;
-            }
-            my = list_entry(pos, my_conn_t, link);
 
-            if(now - my->state_time > g_conf.mysql_ping_timeout){
-                my_conn_close_on_fail(my);
-            } else {
-                break;
-            }
+        if( (node->role != UNAVAIL_ROLE) && (!my_node_is_closing(node)) && \
+            (!strcmp(node->host, host)) && (!strcmp(node->srv, srv)) ){
+            return node;
         }
     }
 
-    for(i = 0; i < mypool->slave_num; i++){
-        count = 0;
-        node = &(mypool->slave[i]);
-        if(my_node_is_closing(node)){
-            continue;
+    return NULL;
+}
+
+/*
+ * fun: get more mysql connections bounded by node max, idle connections
+ *      of other workers are asked from broker first, connections still
+ *      connecting or asked are counted as got
+ * arg: mysql node, connections wanted
+ * ret: connection number opened or asked
+ *
+ */
+
+static int my_node_grow(my_node_t *node, int want)
+{
+    int room;
+
+    if(my_node_is_closing(node)){
+        return 0;
+    }
+
+    want -= node->connecting + node->asking;
+
+    room = node->max - node->conn_total - node->asking;
+    if(want > room){
+        want = room;
+    }
+
+    if(want <= 0){
+        return 0;
+    }
+
+    if(my_broker_ask(node->host, node->srv, want) == 0){
+        node->asking += want;
+        node->ask_time = timer_sec();
+
+        return want;
+    }
+
+    return my_node_open(node, want);
+}
+
+/*
+ * fun: open new mysql connections bounded by node max and cap
+ * arg: mysql node, connections wanted
+ * ret: connection number opened
+ *
+ */
+
+static int my_node_open(my_node_t *node, int want)
+{
+    int i, room, res = 0;
+    my_conn_t *my;
+
+    room = node->max - node->conn_total - node->asking;
+    if(want > room){
+        want = room;
+    }
+
+    if(node->cap > 0){
+        room = node->cap - my_node_shm_total(node);
+        if(want > room){
+            want = room;
         }
-        head = &(node->ping_head);
-        list_for_each_safe(pos, n, head){
-            if(count++ >= arg){
-                break;
-            }
-            my = list_entry(pos, my_conn_t, link);
+    }
 
-            if(now - my->state_time > g_conf.mysql_ping_timeout){
-                my_conn_close_on_fail(my);
-            } else {
-                break;
-            }
+    for(i = 0; i < want; i++){
+        if( (my = my_conn_alloc(node)) == NULL ){
+            log(g_log, "my_conn_alloc error\n");
+            break;
+        }
+
+        if( (res = make_my_conn(my)) < 0 ){
+            log(g_log, "make my conn error\n");
         }
     }
 
+    if(i > 0){
+        log(g_log, "%s:%s grow %d connections, total %d\n", \
+                            node->host, node->srv, i, node->conn_total);
+    }
+
+    return i;
+}
+
+/*
+ * fun: adopt idle mysql connection passed by broker, it is pinged before
+ *      used because it may be closed by mysql while idle
+ * arg: host, srv, connection fd, current db of connection
+ * ret: success 0, error -1 and fd is closed
+ *
+ */
+
+int my_pool_conn_adopt(const char *host, const char *srv, \
+                                        int fd, const char *curdb)
+{
+    my_node_t *node;
+    my_conn_t *my;
+
+    if( (node = my_node_find(host, srv)) == NULL ){
+        log(g_log, "%s:%s adopt on unknown node\n", host, srv);
+        close(fd);
+        return -1;
+    }
+
+    if(node->asking > 0){
+        node->asking--;
+    }
+
+    if( (my = my_conn_alloc(node)) == NULL ){
+        log(g_log, "my_conn_alloc error\n");
+        close(fd);
+        return -1;
+    }
+
+    my->fd = fd;
+    strncpy(my->ctx.curdb, curdb, sizeof(my->ctx.curdb) - 1);
+
+    node->avail_count++;
+    my_conn_set_ping(my);
+    my_ping_prepare(my);
+
+    log(g_log, "%s:%s adopt connection, total %d\n", \
+                                    host, srv, node->conn_total);
+
     return 0;
 }
 
 /*
- * fun: cleanup closing node
- * arg: mysql node
+ * fun: broker has no idle connection for asked ones, open them
+ * arg: host, srv, connection number not given
+ * ret: connection number opened
+ *
+ */
+
+int my_pool_conn_refused(const char *host, const char *srv, int count)
+{
+    my_node_t *node;
+
+    if( (node = my_node_find(host, srv)) == NULL ){
+        return 0;
+    }
+
+    node->asking -= count;
+    if(node->asking < 0){
+        node->asking = 0;
+    }
+
+    return my_node_open(node, count);
+}
+
+/*
+ * fun: grow connections of one mysql node under pressure, close
+ *      connections above min which were not needed in last idle period
+ * arg: mysql node, current time
  * ret: success 0, error -1
  *
  */
 
-static int my_node_closing_cleanup(my_node_t *node)
+static int _my_conn_pool_adjust(my_node_t *node, time_t now)
 {
-    struct list_head *head, *pos, *n;
+    int i, count = 0, excess;
     my_conn_t *my;
-    conn_t *c;
+    struct list_head *heads[2], *pos, *n;
 
-    head = &(node->used_head);
-    list_for_each_safe(pos, n, head){
-        my = list_entry(pos, my_conn_t, link);
-        c  = my->conn;
-        log(g_log, "conn:%d cleanup\n", c->connid);
-        conn_close(c);
-        my_conn_close_and_release(my);
+    if( (my_node_is_closing(node)) || (node->role == UNAVAIL_ROLE) ){
+        return 0;
     }
 
-    head = &(node->avail_head);
-    list_for_each_safe(pos, n, head){
-        my = list_entry(pos, my_conn_t, link);
-        my_conn_close_and_release(my);
+    // broker reply lost, broker restarted or socket full
+    if( (node->asking > 0) && (now - node->ask_time > 3) ){
+        log(g_log, "%s:%s %d connections asked from broker lost\n", \
+                                    node->host, node->srv, node->asking);
+        node->asking = 0;
     }
 
-    head = &(node->dead_head);
-    list_for_each_safe(pos, n, head){
-        my = list_entry(pos, my_conn_t, link);
-        my_conn_close_and_release(my);
+    if(node->wait_count > 0){
+        my_node_grow(node, node->wait_count);
+    } else if( (node->avail_count <= 0) && (!list_empty(&(node->used_head))) ){
+        my_node_grow(node, 1);
     }
 
-    head = &(node->raw_head);
-    list_for_each_safe(pos, n, head){
-        my = list_entry(pos, my_conn_t, link);
-        my_conn_close_and_release(my);
+    if( (g_conf.mysql_idle_timeout <= 0) || \
+        (now - node->shrink_time < g_conf.mysql_idle_timeout) ){
+        return 0;
     }
 
-    head = &(node->fail_head);
-    list_for_each_safe(pos, n, head){
-        my = list_entry(pos, my_conn_t, link);
-        my_conn_close_and_release(my);
+    // avail_min connections stayed free the whole period
+    excess = node->avail_min;
+    if(excess > node->conn_total - node->min){
+        excess = node->conn_total - node->min;
     }
 
-    head = &(node->ping_head);
-    list_for_each_safe(pos, n, head){
-        my = list_entry(pos, my_conn_t, link);
-        my_conn_close_and_release(my);
+    // free connections may be pinging, close them too
+    heads[0] = &(node->avail_head);
+    heads[1] = &(node->ping_head);
+    for(i = 0; i < 2; i++){
+        list_for_each_safe(pos, n, heads[i]){
+            if(count >= excess){
+                break;
+            }
+            my = list_entry(pos, my_conn_t, link);
+            if(!my->pinging){
+                node->avail_count--;
+                del_handler(my->fd);
+                // session variables do not travel with the connection
+                if(my->ctx.sess_key == 0){
+                    my_broker_put(my->fd, node->host, node->srv, my->ctx.curdb);
+                }
+            }
+            my_conn_close_and_release(my);
+            count++;
+        }
     }
 
-    node->role = UNAVAIL_ROLE;
+    if(count > 0){
+        log(g_log, "%s:%s shrink %d idle connections, total %d\n", \
+                        node->host, node->srv, count, node->conn_total);
+    }
+
+    node->avail_min = node->avail_count;
+    node->shrink_time = now;
 
     return 0;
 }
 
 /*
- * fun: cleanup closing node timer
+ * fun: adjust connection pool size timer
  * arg: max connection to be processed
  * ret: success 0, error -1
  *
  */
 
-static int my_node_closing_cleanup_timer(unsigned long arg)
+static int my_conn_pool_adjust_timer(unsigned long arg)
 {
-    int i, num;
-    my_node_t *node;
-    time_t now = time(NULL);
+    int i;
+    time_t now = timer_sec();
 
-    num = mypool->master_num;
-    for(i = 0; i < num; i++){
-        node = &(mypool->master[i]);
-        if( (my_node_is_closing(node)) && \
-            (node->role != UNAVAIL_ROLE) && \
-            (now - node->closing_time > MY_NODE_CLOSING_DELAY) ){
-            my_node_closing_cleanup(node);
-            log(g_log, "master %s:%s connection cleanup\n", \
-                                                node->host, node->srv);
-        }
+    for(i = 0; i < mypool->master_num; i++){
+        _my_conn_pool_adjust(&(mypool->master[i]), now);
     }
 
-    num = mypool->slave_num;
     for(i = 0; i < mypool->slave_num; i++){
-        node = &(mypool->slave[i]);
-        if( (my_node_is_closing(node)) && \
-            (node->role != UNAVAIL_ROLE) && \
-            (now - node->closing_time > MY_NODE_CLOSING_DELAY) ){
-            my_node_closing_cleanup(node);
-            log(g_log, "slave %s:%s connection cleanup\n", \
-                                                node->host, node->srv);
-        }
+        _my_conn_pool_adjust(&(mypool->slave[i]), now);
+    }
+
+    for(i = 0; i < mypool->shard_num; i++){
+        _my_conn_pool_adjust(&(mypool->shard[i]), now);
     }
 
     return 0;
 }
 
 /*
- * fun: set mysql connection context dirty
- * arg: mysql connection
- * ret: always return 0
+ * fun: get address of mysql node, numeric host and unix socket path are
+ *      converted at once and kept, other host is resolved off loop
+ * arg: mysql node
+ * ret: success 0, error -1
  *
  */
 
-int my_conn_ctx_set_dirty(my_conn_t *my)
+static int my_node_resolve(my_node_t *node)
 {
-    my_ctx_t *ctx = &(my->ctx);
+    if(my_dns_numeric(node->host, node->srv, \
+                    &(node->addr), &(node->addrlen)) == 0){
+        node->addr_expire = 0;
+        return 0;
+    }
 
-    ctx->dirty = 1;
+    // bad unix socket path, resolver can not help
+    if(!strncmp(node->host, MY_DNS_UNIX, sizeof(MY_DNS_UNIX) - 1)){
+        node->addr_expire = 0;
+        return -1;
+    }
+
+    node->addr_expire = timer_sec();
+    node->resolving = 1;
+
+    if(my_dns_query(node->host, node->srv, my_node_resolved, node) < 0){
+        node->resolving = 0;
+        node->addr_expire = timer_sec() + MY_NODE_RESOLVE_RETRY;
+        return -1;
+    }
 
     return 0;
 }
 
 /*
- * fun: check mysql connection if dirty
- * arg: mysql connection
- * ret: yes return 1, no return 0
+ * fun: keep resolved address of mysql node, the old address is kept when
+ *      resolve failed
+ * arg: mysql node, host, srv, address or NULL, address length
+ * ret: success 0, error -1
  *
  */
 
-int my_conn_ctx_is_dirty(my_conn_t *my)
+static int my_node_resolved(void *arg, const char *host, const char *srv, \
+                            const struct sockaddr *addr, socklen_t len)
 {
-    my_ctx_t *ctx = &(my->ctx);
+    int first;
+    char ip[64] = "";
+    my_node_t *node = arg;
 
-    return ctx->dirty;
+    // node is unregistered or its slot reused meanwhile
+    if( strcmp(node->host, host) || strcmp(node->srv, srv) || \
+        my_node_is_closing(node) ){
+        return 0;
+    }
+
+    node->resolving = 0;
+
+    if(addr == NULL){
+        log(g_log, "resolve %s:%s error\n", host, srv);
+        node->addr_expire = timer_sec() + MY_NODE_RESOLVE_RETRY;
+        return -1;
+    }
+
+    node->addr_expire = timer_sec() + g_conf.dns_ttl;
+
+    if( (len == node->addrlen) && !memcmp(addr, &(node->addr), len) ){
+        return 0;
+    }
+
+    first = (node->addrlen == 0);
+    memcpy(&(node->addr), addr, len);
+    node->addrlen = len;
+
+    if(addr->sa_family == AF_INET){
+        inet_ntop(AF_INET, &(((struct sockaddr_in *)addr)->sin_addr), \
+                                                        ip, sizeof(ip));
+    } else if(addr->sa_family == AF_INET6) {
+        inet_ntop(AF_INET6, &(((struct sockaddr_in6 *)addr)->sin6_addr), \
+                                                        ip, sizeof(ip));
+    }
+    log(g_log, "%s:%s resolved to %s\n", host, srv, ip);
+
+    // connections failed for want of address, no need to wait for timer
+    if(first){
+        _my_conn_fail_reconnect(node, node->max);
+    }
+
+    return 0;
 }
 
 /*
- * fun: check mysql connection pool if have avail connection
- * arg:
- * ret: yes return 1, no return 0
+ * fun: refresh expired addresses of one mysql node
+ * arg: mysql node, now
+ * ret: success 0, error -1
+ *
+ */
+
+static int _my_node_resolve_refresh(my_node_t *node, time_t now)
+{
+    if( (node->role == UNAVAIL_ROLE) || my_node_is_closing(node) ){
+        return 0;
+    }
+
+    // numeric host, or ttl 0 keeps the first address
+    if( (node->addr_expire == 0) || node->resolving || \
+        ((g_conf.dns_ttl == 0) && (node->addrlen > 0)) ){
+        return 0;
+    }
+
+    if(now < node->addr_expire){
+        return 0;
+    }
+
+    return my_node_resolve(node);
+}
+
+/*
+ * fun: address refresh timer
+ * arg: not used
+ * ret: success 0, error -1
  *
  */
 
-int my_pool_have_conn(void)
+static int my_node_resolve_timer(unsigned long arg)
 {
     int i;
-    my_node_t *node;
+    time_t now = timer_sec();
 
     for(i = 0; i < mypool->master_num; i++){
-        node = &(mypool->master[i]);
-        if(node->avail_count > 0){
-            return 1;
-        }
+        _my_node_resolve_refresh(&(mypool->master[i]), now);
     }
 
     for(i = 0; i < mypool->slave_num; i++){
-        node = &(mypool->slave[i]);
-        if(node->avail_count > 0){
-            return 1;
-        }
+        _my_node_resolve_refresh(&(mypool->slave[i]), now);
+    }
+
+    for(i = 0; i < mypool->shard_num; i++){
+        _my_node_resolve_refresh(&(mypool->shard[i]), now);
     }
 
     return 0;
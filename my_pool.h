@@ -4,18 +4,24 @@
 #include <time.h>
 #include <list.h>
 #include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
 #include "my_buf.h"
 #include "def.h"
+#include "passwd.h"
 
 enum{
     UNAVAIL_ROLE = 0,
     MASTER_ROLE,
     SLAVE_ROLE,
+    SHARD_ROLE,
 };
 
 typedef struct{
     uint8_t dirty;
     char curdb[64];
+    uint32_t sess_mask;
+    uint64_t sess_key;
 } my_ctx_t;
 
 typedef struct{
@@ -26,6 +32,8 @@ typedef struct{
     buf_t buf;
     my_ctx_t ctx;
     time_t state_time;
+    uint8_t connecting;
+    uint8_t pinging;
 } my_conn_t;
 
 typedef struct{
@@ -43,15 +51,45 @@ typedef struct{
     char srv[MAX_SRV_LEN];
     char user[MAX_USER_LEN];
     char pass[MAX_PASS_LEN];
+    uint8_t stage1[PASSWD_HASH_SIZE];
+    uint8_t stage2[PASSWD_HASH_SIZE];
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    time_t addr_expire;
+    int resolving;
     struct list_head used_head;
     struct list_head avail_head;
     struct list_head dead_head;
     struct list_head raw_head;
     struct list_head fail_head;
     struct list_head ping_head;
+    struct list_head wait_head;
     my_info_t *info;
     int avail_count;
+    int avail_min;
+    int conn_total;
+    int connecting;
+    int asking;
+    time_t ask_time;
+    int min;
+    int max;
+    int cap;
+    void *shm;
+    time_t shrink_time;
+    int wait_count;
+    uint64_t wait_done;
+    uint64_t wait_expire;
+    uint64_t wait_usec;
+    uint64_t wait_max_usec;
+    uint64_t ewma_us;
+    uint32_t ewma_err;
+    uint32_t samples;
+    int eject_level;
+    uint64_t eject_until;
+    int probe_ok;
+    uint64_t ejected;
     int role;
+    char group[MAX_GROUP_LEN];
     int closing;
     time_t closing_time;
 } my_node_t;
@@ -59,31 +97,62 @@ typedef struct{
 typedef struct{
     my_node_t master[MAX_MASTER_NODE];
     my_node_t slave[MAX_SLAVE_NODE];
+    my_node_t shard[MAX_SHARD_NODE];
     int slave_num;
     int master_num;
+    int shard_num;
 } my_pool_t;
 
+int my_pool_shm_init(void);
+int my_pool_shm_release(pid_t pid);
+int my_pool_shm_attach(void);
+int my_pool_shm_set(const char *host, const char *srv, int count);
 int my_pool_init(int count);
-int my_pool_have_conn(void);
 
-int my_master_reg(char *host, char *srv, char *user, char *pass, int count);
-int my_slave_reg(char *host, char *srv, char *user, char *pass, int count);
+int my_master_reg(char *host, char *srv, char *user, char *pass, \
+                                            int min, int max, int cap);
+int my_slave_reg(char *host, char *srv, char *user, char *pass, \
+                                int min, int max, int cap, char *group);
+int my_slave_group_set(char *host, char *srv, char *group);
+int my_shard_reg(char *host, char *srv, char *user, char *pass, \
+                                            int min, int max, int cap);
 
 int my_unreg(char *host, char *srv);
 
 my_conn_t *my_master_conn_get(void *c, uint32_t ip, uint16_t port);
-my_conn_t *my_slave_conn_get(void *c, uint32_t ip, uint16_t port);
+my_conn_t *my_slave_conn_get(void *c, uint32_t ip, uint16_t port, \
+                        const char *group, const char *key, int len);
+my_conn_t *my_slave_conn_home(void *c, my_conn_t *cur, \
+                        const char *group, const char *key, int len);
+my_conn_t *my_slave_conn_other(void *c, my_conn_t *cur, const char *group, \
+                        const char *key, int len, const my_ctx_t *ctx);
+my_conn_t *my_shard_conn_get(void *c, int index);
+int my_shard_num(void);
+int my_shard_is_active(int index);
 
 int my_conn_put(my_conn_t *my);
 int my_conn_close(my_conn_t *my);
 int my_conn_close_on_fail(my_conn_t *my);
 
 int my_conn_set_avail(my_conn_t *my);
+int my_conn_account(my_conn_t *my, uint64_t us, uint16_t err);
+int my_conn_account_lost(my_conn_t *my, uint64_t us);
+uint64_t my_slave_latency(int pct);
+
+int my_pool_conn_adopt(const char *host, const char *srv, \
+                                        int fd, const char *curdb);
+int my_pool_conn_refused(const char *host, const char *srv, int count);
+
+int my_conn_wait(void *c, int role, uint32_t ip, uint16_t port, \
+                        const char *group, const char *key, int len);
+int my_conn_wait_cancel(void *c, int expire);
 
 int my_conn_ctx_set_dirty(my_conn_t *my);
 int my_conn_ctx_is_dirty(my_conn_t *my);
 
 int my_info_set(uint8_t prot, uint8_t lang, uint16_t status, \
                             uint32_t cap, char *ver, int ver_len);
+my_info_t *my_info_get(void);
+int my_info_want(void);
 
 #endif
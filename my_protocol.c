@@ -90,6 +90,27 @@ static inline void S4(char **ptr, uint32_t u)
     return;
 }
 
+static inline void SLEN(char **ptr, uint64_t u)
+{
+    if(u < 0xfb){
+        S1(ptr, u);
+    } else if(u < 0x10000) {
+        S1(ptr, 0xfc);
+        S2(ptr, u);
+    } else if(u < 0x1000000) {
+        S1(ptr, 0xfd);
+        S3(ptr, u);
+    } else {
+        S1(ptr, 0xfe);
+        memcpy(*ptr, &u, 8);
+        *ptr += 8;
+    }
+
+    return;
+}
+
+static int buf_room(buf_t *buf, size_t len);
+
 /*
  * fun: make init packet
  * arg: buffer, init packet elements struct
@@ -468,6 +489,107 @@ int make_com(buf_t *buf, cli_com_t *com)
     return total;
 }
 
+/*
+ * fun: make register slave packet
+ * arg: buffer, register slave packet elements struct
+ * ret: success return payload length
+ *
+ */
+
+int make_register_slave(buf_t *buf, my_register_slave_t *reg)
+{
+    char *ptr;
+    int total = 0, len;
+
+    buf_reset(buf);
+
+    ptr = buf->ptr + 4;
+
+    S1(&ptr, COM_REGISTER_SLAVE);
+    total += 1;
+
+    S4(&ptr, reg->server_id);
+    total += 4;
+
+    len = strlen(reg->host);
+    S1(&ptr, len);
+    memcpy(ptr, reg->host, len);
+    ptr += len;
+    total += (len + 1);
+
+    len = strlen(reg->user);
+    S1(&ptr, len);
+    memcpy(ptr, reg->user, len);
+    ptr += len;
+    total += (len + 1);
+
+    len = strlen(reg->pass);
+    S1(&ptr, len);
+    memcpy(ptr, reg->pass, len);
+    ptr += len;
+    total += (len + 1);
+
+    S2(&ptr, reg->port);
+    total += 2;
+
+    // replication rank, master id
+    S4(&ptr, 0);
+    S4(&ptr, 0);
+    total += 8;
+
+    ptr = buf->ptr;
+    S3(&ptr, total);
+    S1(&ptr, reg->pktno);
+
+    buf_rewind(buf);
+    buf->used = total + 4;
+
+    return total;
+}
+
+/*
+ * fun: make binlog dump packet
+ * arg: buffer, binlog dump packet elements struct
+ * ret: success return payload length
+ *
+ */
+
+int make_binlog_dump(buf_t *buf, my_binlog_dump_t *dump)
+{
+    char *ptr;
+    int total = 0, len;
+
+    buf_reset(buf);
+
+    ptr = buf->ptr + 4;
+
+    S1(&ptr, COM_BINLOG_DUMP);
+    total += 1;
+
+    S4(&ptr, dump->pos);
+    total += 4;
+
+    S2(&ptr, dump->flags);
+    total += 2;
+
+    S4(&ptr, dump->server_id);
+    total += 4;
+
+    len = strlen(dump->file);
+    memcpy(ptr, dump->file, len);
+    ptr += len;
+    total += len;
+
+    ptr = buf->ptr;
+    S3(&ptr, total);
+    S1(&ptr, dump->pktno);
+
+    buf_rewind(buf);
+    buf->used = total + 4;
+
+    return total;
+}
+
 /*
  * fun: make error result packet
  * arg: buffer, error result packet elements struct
@@ -512,3 +634,363 @@ int make_result_error(buf_t *buf, my_result_error_t *result)
 
     return total;
 }
+
+/*
+ * fun: make eof packet, eof is always 9 bytes with header
+ * arg: memory to write, eof packet elements struct
+ * ret: packet length with header
+ *
+ */
+
+int make_eof(char *ptr, my_result_eof_t *eof)
+{
+    S3(&ptr, 5);
+    S1(&ptr, eof->pktno);
+    S1(&ptr, 0xfe);
+    S2(&ptr, eof->warnings);
+    S2(&ptr, eof->status);
+
+    return 9;
+}
+
+/*
+ * fun: make sure buffer has room to append
+ * arg: buffer, length to append
+ * ret: success 0, error -1
+ *
+ */
+
+static int buf_room(buf_t *buf, size_t len)
+{
+    size_t size = buf->size;
+
+    if(buf->used + len <= size){
+        return 0;
+    }
+
+    while(size < buf->used + len){
+        size *= 2;
+    }
+
+    return (buf_realloc(buf, size) == NULL) ? -1 : 0;
+}
+
+/*
+ * fun: make head of text result set, column count, fields and eof
+ * arg: buffer, column names, column count
+ * ret: success return packet number of first row, error -1
+ *
+ */
+
+int make_result_head(buf_t *buf, const char **names, int count)
+{
+    int i, len;
+    uint8_t pktno = 1;
+    char *ptr, *start;
+    my_result_eof_t eof;
+
+    buf_reset(buf);
+
+    ptr = buf->ptr;
+    S3(&ptr, 1);
+    S1(&ptr, pktno++);
+    S1(&ptr, count);
+    buf->used = ptr - buf->ptr;
+
+    for(i = 0; i < count; i++){
+        len = strlen(names[i]);
+        if(buf_room(buf, HEADER_SIZE + len + 32) < 0){
+            return -1;
+        }
+
+        start = ptr = buf->ptr + buf->used;
+        ptr += HEADER_SIZE;
+
+        // catalog, schema, table, org table, name, org name
+        SLEN(&ptr, 3);
+        memcpy(ptr, "def", 3);
+        ptr += 3;
+        S1(&ptr, 0);
+        S1(&ptr, 0);
+        S1(&ptr, 0);
+        SLEN(&ptr, len);
+        memcpy(ptr, names[i], len);
+        ptr += len;
+        S1(&ptr, 0);
+
+        // charset utf8, length, var string, flags, decimals, filler
+        S1(&ptr, 0x0c);
+        S2(&ptr, 33);
+        S4(&ptr, 1024);
+        S1(&ptr, MYSQL_TYPE_VAR_STRING);
+        S2(&ptr, 0);
+        S1(&ptr, 0);
+        S2(&ptr, 0);
+
+        len = ptr - start - HEADER_SIZE;
+        ptr = start;
+        S3(&ptr, len);
+        S1(&ptr, pktno++);
+        buf->used += len + HEADER_SIZE;
+    }
+
+    if(buf_room(buf, 9) < 0){
+        return -1;
+    }
+
+    eof.pktno = pktno++;
+    eof.warnings = 0;
+    eof.status = SERVER_STATUS_AUTOCOMMIT;
+    buf->used += make_eof(buf->ptr + buf->used, &eof);
+
+    return pktno;
+}
+
+/*
+ * fun: append row of text result set
+ * arg: buffer, packet number, column values, NULL value allowed, count
+ * ret: success 0, error -1
+ *
+ */
+
+int make_result_row(buf_t *buf, uint8_t pktno, const char **vals, int count)
+{
+    int i, total = 0;
+    size_t len;
+    char *ptr;
+
+    for(i = 0; i < count; i++){
+        total += vals[i] ? strlen(vals[i]) + 9 : 1;
+    }
+
+    if( (total >= 0xffffff) || (buf_room(buf, HEADER_SIZE + total) < 0) ){
+        return -1;
+    }
+
+    ptr = buf->ptr + buf->used + HEADER_SIZE;
+    for(i = 0; i < count; i++){
+        if(vals[i] == NULL){
+            S1(&ptr, 0xfb);
+            continue;
+        }
+        len = strlen(vals[i]);
+        SLEN(&ptr, len);
+        memcpy(ptr, vals[i], len);
+        ptr += len;
+    }
+
+    total = ptr - buf->ptr - buf->used - HEADER_SIZE;
+    ptr = buf->ptr + buf->used;
+    S3(&ptr, total);
+    S1(&ptr, pktno);
+    buf->used += total + HEADER_SIZE;
+
+    return 0;
+}
+
+/*
+ * fun: append eof of text result set
+ * arg: buffer, packet number
+ * ret: success 0, error -1
+ *
+ */
+
+int make_result_end(buf_t *buf, uint8_t pktno)
+{
+    my_result_eof_t eof;
+
+    if(buf_room(buf, 9) < 0){
+        return -1;
+    }
+
+    eof.pktno = pktno;
+    eof.warnings = 0;
+    eof.status = SERVER_STATUS_AUTOCOMMIT;
+    buf->used += make_eof(buf->ptr + buf->used, &eof);
+    buf->pos = 0;
+
+    return 0;
+}
+
+/*
+ * fun: make ok packet of a command answered by proxy
+ * arg: buffer, packet number, server status
+ * ret: success 0, error -1
+ *
+ */
+
+int make_result_ok(buf_t *buf, uint8_t pktno, uint16_t status)
+{
+    char *ptr;
+
+    buf_reset(buf);
+
+    // header, ok marker, affected rows, insert id, status, warnings
+    ptr = buf->ptr;
+    S3(&ptr, 7);
+    S1(&ptr, pktno);
+    S1(&ptr, 0x00);
+    S1(&ptr, 0);
+    S1(&ptr, 0);
+    S2(&ptr, status);
+    S2(&ptr, 0);
+
+    buf->used = ptr - buf->ptr;
+    buf->pos = 0;
+
+    return 0;
+}
+
+/*
+ * fun: parse packet header
+ * arg: packet pointer, packet length, packet number
+ * ret: always return 0
+ *
+ */
+
+int parse_pkt_header(char *ptr, uint32_t *pktlen, uint8_t *pktno)
+{
+    *pktlen = G3(&ptr);
+    *pktno = G1(&ptr);
+
+    return 0;
+}
+
+/*
+ * fun: parse eof packet
+ * arg: packet pointer with header, eof packet elements struct
+ * ret: success 0, error -1
+ *
+ */
+
+int parse_eof(char *ptr, my_result_eof_t *eof)
+{
+    eof->pktlen = G3(&ptr);
+    eof->pktno = G1(&ptr);
+
+    if( ((uint8_t)*ptr != 0xfe) || (eof->pktlen >= 9) ){
+        return -1;
+    }
+    ptr += 1;
+
+    if(eof->pktlen >= 5){
+        eof->warnings = G2(&ptr);
+        eof->status = G2(&ptr);
+    } else {
+        eof->warnings = 0;
+        eof->status = 0;
+    }
+
+    return 0;
+}
+
+/*
+ * fun: parse length encoded integer
+ * arg: pointer position, end of packet, value
+ * ret: success 0, null value 1, error -1
+ *
+ */
+
+int parse_lenenc(char **ptr, char *end, uint64_t *val)
+{
+    uint8_t c;
+    uint64_t v = 0;
+
+    if(*ptr >= end){
+        return -1;
+    }
+
+    c = G1(ptr);
+    if(c < 0xfb){
+        *val = c;
+        return 0;
+    } else if(c == 0xfb) {
+        *val = 0;
+        return 1;
+    } else if(c == 0xfc) {
+        if(*ptr + 2 > end){
+            return -1;
+        }
+        *val = G2(ptr);
+    } else if(c == 0xfd) {
+        if(*ptr + 3 > end){
+            return -1;
+        }
+        *val = G3(ptr);
+    } else if(c == 0xfe) {
+        if(*ptr + 8 > end){
+            return -1;
+        }
+        memcpy(&v, *ptr, 8);
+        *ptr += 8;
+        *val = v;
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * fun: parse column name from field packet
+ * arg: packet payload, payload length, name buffer, buffer size
+ * ret: success 0, error -1
+ *
+ */
+
+int parse_field_name(char *ptr, uint32_t len, char *name, int size)
+{
+    int i;
+    uint64_t n;
+    char *end = ptr + len;
+
+    // skip catalog, schema, table, org_table
+    for(i = 0; i < 5; i++){
+        if(parse_lenenc(&ptr, end, &n) != 0){
+            return -1;
+        }
+        if(ptr + n > end){
+            return -1;
+        }
+        if(i < 4){
+            ptr += n;
+        }
+    }
+
+    n = (n > size - 1) ? size - 1 : n;
+    memcpy(name, ptr, n);
+    name[n] = '\0';
+
+    return 0;
+}
+
+/*
+ * fun: parse one value of text protocol row packet
+ * arg: packet payload, payload length, column index, value, value length
+ * ret: success 0, null value 1, error -1
+ *
+ */
+
+int parse_row_value(char *ptr, uint32_t len, int index, char **val, uint64_t *vlen)
+{
+    int i, res;
+    uint64_t n;
+    char *end = ptr + len;
+
+    for(i = 0; i <= index; i++){
+        if( (res = parse_lenenc(&ptr, end, &n)) < 0 ){
+            return -1;
+        }
+        if(ptr + n > end){
+            return -1;
+        }
+        if(i == index){
+            *val = ptr;
+            *vlen = n;
+            return res;
+        }
+        ptr += n;
+    }
+
+    return -1;
+}
@@ -55,16 +55,55 @@ typedef struct{
     char msg[512];
 }my_result_error_t;
 
+typedef struct{
+    uint32_t pktlen;
+    uint8_t pktno;
+    uint16_t warnings;
+    uint16_t status;
+}my_result_eof_t;
+
+typedef struct{
+    uint32_t pktlen;
+    uint8_t pktno;
+    uint32_t server_id;
+    char host[64];
+    char user[32];
+    char pass[32];
+    uint16_t port;
+}my_register_slave_t;
+
+typedef struct{
+    uint32_t pktlen;
+    uint8_t pktno;
+    uint32_t pos;
+    uint16_t flags;
+    uint32_t server_id;
+    char file[256];
+}my_binlog_dump_t;
+
 int make_init(buf_t *buf, my_auth_init_t *init);
 int make_login(buf_t *buf, cli_auth_login_t *login);
 int make_auth_result(buf_t *buf, my_auth_result_t *result);
 int make_com(buf_t *buf, cli_com_t *com);
+int make_register_slave(buf_t *buf, my_register_slave_t *reg);
+int make_binlog_dump(buf_t *buf, my_binlog_dump_t *dump);
 
 int make_result_error(buf_t *buf, my_result_error_t *result);
+int make_eof(char *ptr, my_result_eof_t *eof);
+int make_result_head(buf_t *buf, const char **names, int count);
+int make_result_row(buf_t *buf, uint8_t pktno, const char **vals, int count);
+int make_result_end(buf_t *buf, uint8_t pktno);
+int make_result_ok(buf_t *buf, uint8_t pktno, uint16_t status);
 
 int parse_init(buf_t *buf, my_auth_init_t *init);
 int parse_login(buf_t *buf, cli_auth_login_t *login);
 int parse_auth_result(buf_t *buf, my_auth_result_t *result);
 int parse_com(buf_t *buf, cli_com_t *com);
 
+int parse_pkt_header(char *ptr, uint32_t *pktlen, uint8_t *pktno);
+int parse_eof(char *ptr, my_result_eof_t *eof);
+int parse_lenenc(char **ptr, char *end, uint64_t *val);
+int parse_field_name(char *ptr, uint32_t len, char *name, int size);
+int parse_row_value(char *ptr, uint32_t len, int index, char **val, uint64_t *vlen);
+
 #endif
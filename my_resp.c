@@ -0,0 +1,206 @@
+/*
+ * Copyright 2011-2013 Alibaba Group Holding Limited. All rights reserved.
+ * Use and distribution licensed under the GPL license.
+ *
+ * Authors: XiaoJinliang <xiaoshi.xjl@taobao.com>
+ *
+ */
+
+/*
+ * streaming classifier of mysql response, packets may be split anywhere
+ * between reads. only the first bytes of every packet are kept.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "my_resp.h"
+#include "mysql_com.h"
+#include "my_protocol.h"
+
+static int my_resp_packet(my_resp_t *resp);
+
+/*
+ * fun: init response classifier
+ * arg: response classifier
+ * ret: always return 0
+ *
+ */
+
+int my_resp_init(my_resp_t *resp)
+{
+    memset(resp, 0, sizeof(my_resp_t));
+    resp->state = RESP_HEAD;
+    resp->type = RESP_TYPE_UNKNOWN;
+
+    return 0;
+}
+
+/*
+ * fun: check response is complete
+ * arg: response classifier
+ * ret: yes 1, no 0
+ *
+ */
+
+int my_resp_is_done(my_resp_t *resp)
+{
+    return resp->state == RESP_DONE;
+}
+
+/*
+ * fun: feed bytes read from mysql
+ * arg: response classifier, data, data length
+ * ret: done 1, need more 0, protocol error -1
+ *
+ */
+
+int my_resp_feed(my_resp_t *resp, const char *ptr, size_t len)
+{
+    uint32_t n;
+    const char *end = ptr + len;
+
+    resp->bytes += len;
+
+    while(ptr < end){
+        if(resp->state == RESP_DONE){
+            // data after the end of response
+            return -1;
+        }
+
+        if(resp->hlen < 4){
+            resp->hdr[resp->hlen++] = *ptr++;
+            if(resp->hlen == 4){
+                resp->pktlen = (uint8_t)resp->hdr[0] | \
+                                ((uint8_t)resp->hdr[1] << 8) | \
+                                ((uint8_t)resp->hdr[2] << 16);
+                resp->left = resp->pktlen;
+                resp->plen = 0;
+            } else {
+                continue;
+            }
+        } else {
+            n = (end - ptr < resp->left) ? end - ptr : resp->left;
+            if(resp->plen < RESP_PREFIX_SIZE){
+                memcpy(resp->prefix + resp->plen, ptr, \
+                    (n < RESP_PREFIX_SIZE - resp->plen) ? n : RESP_PREFIX_SIZE - resp->plen);
+            }
+            resp->plen += n;
+            resp->left -= n;
+            ptr += n;
+        }
+
+        if(resp->left == 0){
+            if(my_resp_packet(resp) < 0){
+                return -1;
+            }
+            resp->hlen = 0;
+        }
+    }
+
+    return resp->state == RESP_DONE;
+}
+
+/*
+ * fun: classify one complete packet
+ * arg: response classifier
+ * ret: success 0, error -1
+ *
+ */
+
+static int my_resp_packet(my_resp_t *resp)
+{
+    uint8_t first;
+    uint64_t val;
+    char *ptr, *end;
+    uint32_t len = resp->pktlen;
+
+    // continuation of a packet larger than 16M
+    if(resp->cont){
+        resp->cont = (len == 0xffffff);
+        return 0;
+    }
+    resp->cont = (len == 0xffffff);
+
+    first = (len > 0) ? (uint8_t)resp->prefix[0] : 0;
+    ptr = resp->prefix + 1;
+    end = resp->prefix + ((len < RESP_PREFIX_SIZE) ? len : RESP_PREFIX_SIZE);
+
+    switch(resp->state)
+    {
+        case RESP_HEAD:
+            if(first == 0x00){
+                if(resp->type == RESP_TYPE_UNKNOWN){
+                    resp->type = RESP_TYPE_OK;
+                }
+                parse_lenenc(&ptr, end, &val);
+                parse_lenenc(&ptr, end, &val);
+                if(ptr + 4 <= end){
+                    resp->status = (uint8_t)ptr[0] | ((uint8_t)ptr[1] << 8);
+                    resp->warnings = (uint8_t)ptr[2] | ((uint8_t)ptr[3] << 8);
+                }
+                if(!(resp->status & SERVER_MORE_RESULTS_EXISTS)){
+                    resp->state = RESP_DONE;
+                }
+            } else if(first == 0xff) {
+                resp->type = RESP_TYPE_ERR;
+                if(len >= 3){
+                    resp->err = (uint8_t)resp->prefix[1] | ((uint8_t)resp->prefix[2] << 8);
+                }
+                resp->state = RESP_DONE;
+            } else if(first == 0xfb) {
+                resp->type = RESP_TYPE_INFILE;
+                resp->state = RESP_DONE;
+            } else {
+                ptr = resp->prefix;
+                if(parse_lenenc(&ptr, end, &val) != 0){
+                    return -1;
+                }
+                if(resp->type == RESP_TYPE_UNKNOWN){
+                    resp->type = RESP_TYPE_RESULT;
+                }
+                resp->fields = val;
+                resp->field_i = 0;
+                resp->state = RESP_FIELD;
+            }
+            break;
+
+        case RESP_FIELD:
+            if(++resp->field_i == resp->fields){
+                resp->state = RESP_FIELD_EOF;
+            }
+            break;
+
+        case RESP_FIELD_EOF:
+            if( (first != 0xfe) || (len >= 9) ){
+                return -1;
+            }
+            resp->state = RESP_ROW;
+            break;
+
+        case RESP_ROW:
+            if( (first == 0xfe) && (len < 9) ){
+                if(len >= 5){
+                    resp->warnings = (uint8_t)resp->prefix[1] | ((uint8_t)resp->prefix[2] << 8);
+                    resp->status = (uint8_t)resp->prefix[3] | ((uint8_t)resp->prefix[4] << 8);
+                }
+                resp->state = (resp->status & SERVER_MORE_RESULTS_EXISTS) ? \
+                                                        RESP_HEAD : RESP_DONE;
+            } else if(first == 0xff) {
+                resp->type = RESP_TYPE_ERR;
+                if(len >= 3){
+                    resp->err = (uint8_t)resp->prefix[1] | ((uint8_t)resp->prefix[2] << 8);
+                }
+                resp->state = RESP_DONE;
+            } else {
+                resp->rows++;
+            }
+            break;
+
+        default:
+            return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,48 @@
+#ifndef _MY_RESP_H_
+#define _MY_RESP_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+enum{
+    RESP_HEAD = 0,
+    RESP_FIELD,
+    RESP_FIELD_EOF,
+    RESP_ROW,
+    RESP_DONE
+};
+
+enum{
+    RESP_TYPE_UNKNOWN = 0,
+    RESP_TYPE_OK,
+    RESP_TYPE_ERR,
+    RESP_TYPE_RESULT,
+    RESP_TYPE_INFILE
+};
+
+#define RESP_PREFIX_SIZE 32
+
+typedef struct{
+    int state;
+    int type;
+    uint16_t err;
+    uint16_t status;
+    uint16_t warnings;
+    uint64_t fields;
+    uint64_t field_i;
+    uint64_t rows;
+    uint64_t bytes;
+    int cont;
+    int hlen;
+    char hdr[4];
+    uint32_t pktlen;
+    uint32_t left;
+    uint32_t plen;
+    char prefix[RESP_PREFIX_SIZE];
+} my_resp_t;
+
+int my_resp_init(my_resp_t *resp);
+int my_resp_feed(my_resp_t *resp, const char *ptr, size_t len);
+int my_resp_is_done(my_resp_t *resp);
+
+#endif
@@ -0,0 +1,301 @@
+/*
+ * Copyright 2011-2013 Alibaba Group Holding Limited. All rights reserved.
+ * Use and distribution licensed under the GPL license.
+ *
+ * Authors: XiaoJinliang <xiaoshi.xjl@taobao.com>
+ *
+ */
+
+/*
+ * read routing to slave groups
+ *
+ * rules of route_conf send reads of a schema, of a table or of a digest to
+ * a named slave group. rules are compiled into a my_htab table keyed by
+ * a 64 bit hash of rule type and lowercased name, a read costs one
+ * lookup per table the lexer finds plus one for the schema, and a
+ * fingerprint only when digest rules exist. the table is rebuilt on usr1
+ * and swapped in whole.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <log.h>
+#include <hash.h>
+#include <common.h>
+#include "my_route.h"
+#include "my_htab.h"
+#include "my_conf.h"
+#include "my_sql.h"
+#include "my_buf.h"
+#include "mysql_com.h"
+#include "def.h"
+
+extern log_t *g_log;
+extern struct conf_t g_conf;
+
+#define ROUTE_MAX_TABLE 8
+// as DIGEST_MAX_TEXT, so digests match show myrelay digest
+#define ROUTE_MAX_TEXT (4 * 1024)
+
+enum{
+    ROUTE_RULE_SCHEMA = 1,
+    ROUTE_RULE_TABLE,
+    ROUTE_RULE_DIGEST,
+};
+
+typedef struct{
+    my_htab_entry_t head;
+    char group[MAX_GROUP_LEN];
+} route_entry_t;
+
+static __thread my_htab_t *table = NULL;
+// table holds digest rules
+static __thread int digest = 0;
+
+static uint64_t route_key(int type, const char *db, int dblen, \
+                                        const char *name, int len);
+static const char *route_find(my_htab_t *t, int type, uint64_t key);
+
+/*
+ * fun: load routing rules of worker
+ * arg:
+ * ret: success 0, error -1
+ *
+ */
+
+int my_route_init(void)
+{
+    if(*g_conf.route_conf == '\0'){
+        return 0;
+    }
+
+    return my_route_load(g_conf.route_conf);
+}
+
+/*
+ * fun: build rule table from config, "schema name group",
+ *      "table [db.]name group" or "digest hex group", the table in use is
+ *      kept on error
+ * arg: rule config path
+ * ret: success 0, error -1
+ *
+ */
+
+int my_route_load(const char *conf)
+{
+    int line = 0, count = 0, type, dig = 0;
+    uint64_t key;
+    FILE *fp;
+    char buf[1024], kind[16], name[256], group[MAX_GROUP_LEN], *dot, *end;
+    my_htab_t *t;
+    route_entry_t *e;
+
+    if( (conf == NULL) || (*conf == '\0') ){
+        return 0;
+    }
+
+    if( (fp = fopen(conf, "r")) == NULL ){
+        log(g_log, "fopen %s error\n", conf);
+        return -1;
+    }
+
+    while(fgets(buf, sizeof(buf), fp)){
+        count++;
+    }
+    rewind(fp);
+
+    if( (t = my_htab_new(count, sizeof(route_entry_t))) == NULL ){
+        fclose(fp);
+        return -1;
+    }
+
+    while(fgets(buf, sizeof(buf), fp)){
+        line++;
+        trim(buf);
+        if( (*buf == '#') || (*buf == '\0') ){
+            continue;
+        }
+
+        if(sscanf(buf, "%15s %255s %31s", kind, name, group) < 3){
+            log(g_log, "route line[%d] error\n", line);
+            continue;
+        }
+
+        if(!strcmp(kind, "schema")){
+            type = ROUTE_RULE_SCHEMA;
+            key = route_key(type, name, strlen(name), NULL, 0);
+        } else if(!strcmp(kind, "table")) {
+            type = ROUTE_RULE_TABLE;
+            if( (dot = strchr(name, '.')) != NULL ){
+                key = route_key(type, name, dot - name, dot + 1, strlen(dot + 1));
+            } else {
+                key = route_key(type, NULL, 0, name, strlen(name));
+            }
+        } else if(!strcmp(kind, "digest")) {
+            type = ROUTE_RULE_DIGEST;
+            key = strtoull(name, &end, 16);
+            if(*end != '\0'){
+                log(g_log, "route line[%d] error, digest %s\n", line, name);
+                continue;
+            }
+            dig = 1;
+        } else {
+            log(g_log, "route line[%d] error, unknown type %s\n", line, kind);
+            continue;
+        }
+
+        // a rule already in table is replaced
+        if( (e = my_htab_add(t, type, key)) != NULL ){
+            snprintf(e->group, sizeof(e->group), "%s", group);
+        }
+    }
+
+    fclose(fp);
+
+    free(table);
+    table = t;
+    digest = dig;
+
+    log(g_log, "route %s loaded, %d rules\n", conf, t->count);
+
+    return 0;
+}
+
+/*
+ * fun: get slave group of client query, digest rules first, then table
+ *      rules, then schema rules of the tables or current db
+ * arg: connection, client query is in connection buffer
+ * ret: group name, NULL default group
+ *
+ */
+
+const char *my_route_group(conn_t *c)
+{
+    int i, n, len, tlen, dblen;
+    uint32_t pktlen;
+    const char *sql, *db, *group;
+    char text[ROUTE_MAX_TEXT];
+    buf_t *buf = &(c->buf);
+    sql_table_t tables[ROUTE_MAX_TABLE];
+
+    if( (table == NULL) || (table->count == 0) || (c->comno != COM_QUERY) || \
+                                        (buf->used < HEADER_SIZE + 1) ){
+        return NULL;
+    }
+
+    pktlen = 0;
+    memcpy(&pktlen, buf->ptr, 3);
+    if( (pktlen < 1) || (pktlen + HEADER_SIZE > buf->used) ){
+        return NULL;
+    }
+
+    sql = buf->ptr + HEADER_SIZE + 1;
+    len = pktlen - 1;
+
+    // digest as show myrelay digest prints it, long statement by its head
+    if(digest){
+        tlen = len;
+        while( ((n = sql_fingerprint(sql, tlen, text, sizeof(text))) < 0) && \
+                                                        (tlen > 64) ){
+            tlen /= 2;
+        }
+        if( (n >= 0) && \
+            ((group = route_find(table, ROUTE_RULE_DIGEST, mmhash64(text, n))) != NULL) ){
+            return group;
+        }
+    }
+
+    n = sql_tables(sql, len, tables, ROUTE_MAX_TABLE);
+    if(n > ROUTE_MAX_TABLE){
+        n = ROUTE_MAX_TABLE;
+    }
+
+    for(i = 0; i < n; i++){
+        if(tables[i].db.len > 0){
+            db = tables[i].db.ptr;
+            dblen = tables[i].db.len;
+        } else {
+            db = c->curdb;
+            dblen = strlen(c->curdb);
+        }
+
+        if( ((group = route_find(table, ROUTE_RULE_TABLE, route_key(ROUTE_RULE_TABLE, \
+                    db, dblen, tables[i].name.ptr, tables[i].name.len))) != NULL) || \
+            ((group = route_find(table, ROUTE_RULE_TABLE, route_key(ROUTE_RULE_TABLE, \
+                    NULL, 0, tables[i].name.ptr, tables[i].name.len))) != NULL) ){
+            return group;
+        }
+    }
+
+    for(i = 0; i < n; i++){
+        if(tables[i].db.len > 0){
+            db = tables[i].db.ptr;
+            dblen = tables[i].db.len;
+        } else {
+            db = c->curdb;
+            dblen = strlen(c->curdb);
+        }
+
+        if( (group = route_find(table, ROUTE_RULE_SCHEMA, \
+                    route_key(ROUTE_RULE_SCHEMA, db, dblen, NULL, 0))) != NULL ){
+            return group;
+        }
+    }
+
+    // no table, like select 1, reads the current db
+    if(n == 0){
+        return route_find(table, ROUTE_RULE_SCHEMA, \
+                route_key(ROUTE_RULE_SCHEMA, c->curdb, strlen(c->curdb), NULL, 0));
+    }
+
+    return NULL;
+}
+
+/*
+ * fun: hash rule type and lowercased "db.name"
+ * arg: rule type, db and length, name and length
+ * ret: hash key
+ *
+ */
+
+static uint64_t route_key(int type, const char *db, int dblen, \
+                                        const char *name, int len)
+{
+    int i, n = 0;
+    char buf[256];
+
+    buf[n++] = type;
+    for(i = 0; (i < dblen) && (n < sizeof(buf) - 1); i++){
+        buf[n++] = tolower((unsigned char)db[i]);
+    }
+    if(n < sizeof(buf) - 1){
+        buf[n++] = '.';
+    }
+    for(i = 0; (i < len) && (n < sizeof(buf)); i++){
+        buf[n++] = tolower((unsigned char)name[i]);
+    }
+
+    return mmhash64(buf, n);
+}
+
+/*
+ * fun: find rule in table
+ * arg: table, rule type, key
+ * ret: found return group, not found NULL
+ *
+ */
+
+static const char *route_find(my_htab_t *t, int type, uint64_t key)
+{
+    route_entry_t *e;
+
+    if( (e = my_htab_find(t, type, key)) == NULL ){
+        return NULL;
+    }
+
+    return e->group;
+}
@@ -0,0 +1,10 @@
+#ifndef _MY_ROUTE_H_
+#define _MY_ROUTE_H_
+
+#include "conn_pool.h"
+
+int my_route_init(void);
+int my_route_load(const char *conf);
+const char *my_route_group(conn_t *c);
+
+#endif
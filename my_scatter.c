@@ -0,0 +1,1455 @@
+/*
+ * Copyright 2011-2013 Alibaba Group Holding Limited. All rights reserved.
+ * Use and distribution licensed under the GPL license.
+ *
+ * Authors: XiaoJinliang <xiaoshi.xjl@taobao.com>
+ *
+ */
+
+/*
+ * scatter select to all shards and merge result set
+ *
+ * every shard gets the same query, column definitions are taken from the
+ * first shard reaching the rows, rows are streamed to client as soon as
+ * they arrive. with ORDER BY, rows are merged by a k-way heap and only
+ * emitted when every unfinished shard has a row buffered. LIMIT is applied
+ * on the merged rows, shards are asked for offset + count rows.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <log.h>
+#include <handler.h>
+#include <timer.h>
+#include "my_scatter.h"
+#include "my_ops.h"
+#include "my_buf.h"
+#include "my_pool.h"
+#include "cli_pool.h"
+#include "conn_pool.h"
+#include "mysql_com.h"
+#include "my_protocol.h"
+#include "my_sql.h"
+#include "my_conf.h"
+#include "sqldump.h"
+#include "my_digest.h"
+
+extern log_t *g_log;
+extern struct conf_t g_conf;
+
+#define SG_MAX_ORDER 8
+#define SG_READ_SIZE (16 * 1024)
+#define SG_OUT_HIGH (1024 * 1024)
+#define SG_SHARD_HIGH (4 * 1024 * 1024)
+#define SG_MAX_PKT 0xffffff
+
+enum{
+    SG_SHARD_WRITING = 0,
+    SG_SHARD_SKIP,
+    SG_SHARD_HEAD,
+    SG_SHARD_FIELD,
+    SG_SHARD_ROW,
+    SG_SHARD_DONE
+};
+
+typedef struct{
+    char name[64];
+    int pos;
+    int index;
+    int desc;
+} sg_order_t;
+
+typedef struct{
+    my_conn_t *my;
+    int state;
+    int skip;
+    int paused;
+    int inheap;
+    uint64_t fields;
+    uint64_t field_i;
+    size_t hpos;
+    size_t rpos;
+} sg_shard_t;
+
+typedef struct{
+    conn_t *c;
+    int num;
+    int done;
+    int nok;
+    int head_sent;
+    int writing;
+    int paused;
+    int ended;
+    uint8_t pktno;
+    uint16_t warnings;
+    uint16_t status;
+    uint64_t fields;
+    int has_limit;
+    int limit_done;
+    uint64_t offset;
+    uint64_t limit;
+    uint64_t skipped;
+    uint64_t sent;
+    int norder;
+    sg_order_t order[SG_MAX_ORDER];
+    int nheap;
+    int heap[MAX_SHARD_NODE];
+    sg_shard_t shard[MAX_SHARD_NODE];
+    my_result_error_t error;
+} sg_ctx_t;
+
+static int sg_parse_query(sg_ctx_t *ctx, const char *sql, int len, \
+                            const char **lstart, const char **lend);
+static int sg_shard_prepare(sg_ctx_t *ctx, sg_shard_t *sh, \
+                            char *sql, int len, const char *lstart, const char *lend);
+static sg_shard_t *sg_shard_find(sg_ctx_t *ctx, my_conn_t *my);
+static int sg_shard_write_cb(int fd, void *arg);
+static int sg_shard_read_cb(int fd, void *arg);
+static int sg_shard_parse(sg_ctx_t *ctx, sg_shard_t *sh);
+static int sg_shard_header(sg_ctx_t *ctx, sg_shard_t *sh);
+static int sg_shard_io(sg_ctx_t *ctx);
+static int sg_merge(sg_ctx_t *ctx);
+static int sg_row_cmp(sg_ctx_t *ctx, sg_shard_t *a, sg_shard_t *b);
+static int sg_value_cmp(char *a, uint64_t alen, char *b, uint64_t blen);
+static int sg_heap_less(sg_ctx_t *ctx, int a, int b);
+static int sg_heap_push(sg_ctx_t *ctx, int index);
+static int sg_heap_pop(sg_ctx_t *ctx);
+static char *sg_out_reserve(sg_ctx_t *ctx, size_t len);
+static int sg_out_pkt(sg_ctx_t *ctx, char *payload, uint32_t len);
+static int sg_emit_row(sg_ctx_t *ctx, char *payload, uint32_t len);
+static int sg_check_end(sg_ctx_t *ctx);
+static int sg_flush(sg_ctx_t *ctx);
+static int sg_cli_write_cb(int fd, void *arg);
+static int sg_release_shards(sg_ctx_t *ctx);
+static int sg_finish(sg_ctx_t *ctx);
+static int sg_fail(sg_ctx_t *ctx);
+static int sg_error(sg_ctx_t *ctx, uint16_t err, const char *fmt, ...);
+static int sg_error_pkt(sg_ctx_t *ctx, char *payload, uint32_t len);
+
+/*
+ * fun: check query should be scattered to shards
+ * arg: connection
+ * ret: yes 1, no 0
+ *
+ */
+
+int my_scatter_need(conn_t *c)
+{
+    int depth = 0, from = 0;
+    uint32_t pktlen;
+    uint8_t pktno;
+    buf_t *buf = &(c->buf);
+    sql_lexer_t lex;
+    sql_token_t tk;
+
+    if( (!g_conf.scatter) || (my_shard_num() == 0) ){
+        return 0;
+    }
+
+    if(c->comno != COM_QUERY){
+        return 0;
+    }
+
+    if(c->my && my_conn_ctx_is_dirty(c->my)){
+        return 0;
+    }
+
+    parse_pkt_header(buf->ptr, &pktlen, &pktno);
+    if( (pktlen < 1) || (pktlen + HEADER_SIZE > buf->used) ){
+        return 0;
+    }
+
+    sql_lex_init(&lex, buf->ptr + HEADER_SIZE + 1, pktlen - 1);
+    if( (sql_lex_next(&lex, &tk) != TK_IDENT) || (!sql_tk_is(&tk, "select")) ){
+        return 0;
+    }
+
+    while(sql_lex_next(&lex, &tk) != TK_END){
+        if(sql_tk_is_punct(&tk, '(')){
+            depth++;
+        } else if(sql_tk_is_punct(&tk, ')')) {
+            depth--;
+        } else if(depth == 0) {
+            if(sql_tk_is(&tk, "into")){
+                return 0;
+            } else if(sql_tk_is(&tk, "from")) {
+                from = 1;
+            }
+        }
+    }
+
+    return from;
+}
+
+/*
+ * fun: start scatter query to all shards
+ * arg: connection, client query is in connection buffer
+ * ret: success 0, error -1, scatter error is answered to client
+ *
+ */
+
+int my_scatter_start(conn_t *c)
+{
+    int i, res = 0;
+    uint32_t pktlen;
+    uint8_t pktno;
+    char *sql;
+    const char *lstart, *lend;
+    cli_conn_t *cli = c->cli;
+    buf_t *buf = &(c->buf);
+    sg_ctx_t *ctx;
+    sg_shard_t *sh;
+    my_conn_t *my;
+
+    if( (ctx = calloc(1, sizeof(sg_ctx_t))) == NULL ){
+        log_err(g_log, "conn:%u calloc error\n", c->connid);
+        return -1;
+    }
+
+    ctx->c = c;
+    ctx->pktno = 1;
+    c->sg = ctx;
+
+    if(del_handler(cli->fd) < 0){
+        log(g_log, "conn:%u del_handler error\n", c->connid);
+    }
+
+    conn_state_set_read_mysql_write_client(c);
+
+    parse_pkt_header(buf->ptr, &pktlen, &pktno);
+    sql = buf->ptr + HEADER_SIZE + 1;
+
+    if(sg_parse_query(ctx, sql, pktlen - 1, &lstart, &lend) < 0){
+        sg_fail(ctx);
+        return res;
+    }
+
+    for(i = 0; i < my_shard_num(); i++){
+        if(!my_shard_is_active(i)){
+            continue;
+        }
+
+        sh = &(ctx->shard[ctx->num]);
+        if( (my = my_shard_conn_get(c, i)) == NULL ){
+            sg_error(ctx, 1105, "shard[%d] has no connection available", i);
+            sg_fail(ctx);
+            return res;
+        }
+        sh->my = my;
+        ctx->num++;
+
+        if(sg_shard_prepare(ctx, sh, sql, pktlen - 1, lstart, lend) < 0){
+            sg_fail(ctx);
+            return res;
+        }
+    }
+
+    if(ctx->num == 0){
+        sg_error(ctx, 1105, "no shard available");
+        sg_fail(ctx);
+        return res;
+    }
+
+    log(g_log, "conn:%u scatter to %d shards\n", c->connid, ctx->num);
+
+    buf_reset(buf);
+
+    return res;
+}
+
+/*
+ * fun: abort scatter query, called when connection closed
+ * arg: connection
+ * ret: always return 0
+ *
+ */
+
+int my_scatter_abort(conn_t *c)
+{
+    sg_ctx_t *ctx = c->sg;
+
+    if(ctx == NULL){
+        return 0;
+    }
+
+    sg_release_shards(ctx);
+
+    c->sg = NULL;
+    free(ctx);
+
+    return 0;
+}
+
+/*
+ * fun: parse ORDER BY and LIMIT of query
+ * arg: scatter context, sql text, sql length, LIMIT clause start and end
+ * ret: success 0, unsupported -1
+ *
+ */
+
+static int sg_parse_query(sg_ctx_t *ctx, const char *sql, int len, \
+                            const char **lstart, const char **lend)
+{
+    int depth = 0, inorder = 0, dot = 0, n;
+    uint64_t v1, v2;
+    sg_order_t *o = NULL;
+    sql_lexer_t lex, save;
+    sql_token_t tk;
+
+    *lstart = NULL;
+    *lend = NULL;
+
+    sql_lex_init(&lex, sql, len);
+    while(sql_lex_next(&lex, &tk) != TK_END){
+        if(depth > 0){
+            if(sql_tk_is_punct(&tk, '(')){
+                depth++;
+            } else if(sql_tk_is_punct(&tk, ')')) {
+                depth--;
+            }
+            continue;
+        }
+
+        if(sql_tk_is(&tk, "limit") || sql_tk_is(&tk, "for") || \
+            sql_tk_is(&tk, "lock") || sql_tk_is_punct(&tk, ';')){
+            inorder = 0;
+        }
+
+        if(inorder){
+            if(sql_tk_is_punct(&tk, ',')){
+                if( (o == NULL) || dot ){
+                    goto unsupported;
+                }
+                o = NULL;
+            } else if(sql_tk_is(&tk, "asc") || sql_tk_is(&tk, "desc")) {
+                if( (o == NULL) || dot ){
+                    goto unsupported;
+                }
+                o->desc = sql_tk_is(&tk, "desc");
+            } else if(sql_tk_is_punct(&tk, '.')) {
+                if( (o == NULL) || (o->pos > 0) || dot ){
+                    goto unsupported;
+                }
+                dot = 1;
+            } else if( (tk.type == TK_IDENT) || (tk.type == TK_QIDENT) ) {
+                if(o == NULL){
+                    if(ctx->norder == SG_MAX_ORDER){
+                        goto unsupported;
+                    }
+                    o = &(ctx->order[ctx->norder++]);
+                } else if(!dot) {
+                    goto unsupported;
+                }
+                dot = 0;
+                n = (tk.len < sizeof(o->name)) ? tk.len : sizeof(o->name) - 1;
+                memcpy(o->name, tk.ptr, n);
+                o->name[n] = '\0';
+                o->index = -1;
+            } else if( (tk.type == TK_NUMBER) && (o == NULL) ) {
+                if(ctx->norder == SG_MAX_ORDER){
+                    goto unsupported;
+                }
+                o = &(ctx->order[ctx->norder++]);
+                o->pos = atoi(tk.ptr);
+                o->index = -1;
+                if(o->pos <= 0){
+                    goto unsupported;
+                }
+            } else {
+                goto unsupported;
+            }
+            continue;
+        }
+
+        if(sql_tk_is_punct(&tk, '(')){
+            depth++;
+        } else if(sql_tk_is(&tk, "union")) {
+            ctx->norder = 0;
+            ctx->has_limit = 0;
+            *lstart = NULL;
+        } else if(sql_tk_is(&tk, "order")) {
+            if( (sql_lex_next(&lex, &tk) != TK_IDENT) || (!sql_tk_is(&tk, "by")) ){
+                goto unsupported;
+            }
+            inorder = 1;
+            ctx->norder = 0;
+            o = NULL;
+            dot = 0;
+        } else if(sql_tk_is(&tk, "limit")) {
+            *lstart = tk.ptr;
+            if(sql_lex_next(&lex, &tk) != TK_NUMBER){
+                goto unsupported;
+            }
+            v1 = strtoull(tk.ptr, NULL, 10);
+            *lend = tk.ptr + tk.len;
+
+            save = lex;
+            sql_lex_next(&lex, &tk);
+            if(sql_tk_is_punct(&tk, ',')){
+                if(sql_lex_next(&lex, &tk) != TK_NUMBER){
+                    goto unsupported;
+                }
+                v2 = strtoull(tk.ptr, NULL, 10);
+                ctx->offset = v1;
+                ctx->limit = v2;
+                *lend = tk.ptr + tk.len;
+            } else if(sql_tk_is(&tk, "offset")) {
+                if(sql_lex_next(&lex, &tk) != TK_NUMBER){
+                    goto unsupported;
+                }
+                v2 = strtoull(tk.ptr, NULL, 10);
+                ctx->offset = v2;
+                ctx->limit = v1;
+                *lend = tk.ptr + tk.len;
+            } else {
+                lex = save;
+                ctx->offset = 0;
+                ctx->limit = v1;
+            }
+            ctx->has_limit = 1;
+        }
+    }
+
+    if( inorder && ((o == NULL) || dot) ){
+        goto unsupported;
+    }
+
+    return 0;
+
+unsupported:
+    return sg_error(ctx, 1235, "ORDER BY or LIMIT not supported by scatter query");
+}
+
+/*
+ * fun: prepare request of one shard, pipeline use db before the query
+ * arg: scatter context, shard, sql text, sql length, LIMIT clause start and end
+ * ret: success 0, error -1
+ *
+ */
+
+static int sg_shard_prepare(sg_ctx_t *ctx, sg_shard_t *sh, \
+                            char *sql, int len, const char *lstart, const char *lend)
+{
+    int n, dblen = 0, pktlen;
+    char limit[64], *ptr;
+    conn_t *c = ctx->c;
+    my_conn_t *my = sh->my;
+    buf_t *buf = &(my->buf);
+
+    buf_reset(buf);
+
+    if( (c->curdb[0] != '\0') && strcmp(my->ctx.curdb, c->curdb) ){
+        dblen = strlen(c->curdb);
+        sh->skip = 1;
+    }
+
+    if( ctx->has_limit && (ctx->offset > 0) && lstart ){
+        n = snprintf(limit, sizeof(limit), "LIMIT %llu", \
+                    (unsigned long long)(ctx->offset + ctx->limit));
+        pktlen = 1 + (lstart - sql) + n + (sql + len - lend);
+    } else {
+        n = 0;
+        pktlen = 1 + len;
+    }
+
+    if(pktlen >= SG_MAX_PKT){
+        return sg_error(ctx, 1153, "query too large for scatter");
+    }
+
+    if(buf_realloc(buf, 2 * HEADER_SIZE + 1 + dblen + pktlen) == NULL){
+        return sg_error(ctx, 1105, "out of memory");
+    }
+
+    ptr = buf->ptr;
+
+    if(dblen){
+        ptr[0] = (dblen + 1) & 0xff;
+        ptr[1] = ((dblen + 1) >> 8) & 0xff;
+        ptr[2] = ((dblen + 1) >> 16) & 0xff;
+        ptr[3] = 0;
+        ptr[4] = COM_INIT_DB;
+        memcpy(ptr + 5, c->curdb, dblen);
+        ptr += HEADER_SIZE + 1 + dblen;
+
+        strncpy(my->ctx.curdb, c->curdb, sizeof(my->ctx.curdb) - 1);
+        my->ctx.curdb[sizeof(my->ctx.curdb) - 1] = '\0';
+    }
+
+    ptr[0] = pktlen & 0xff;
+    ptr[1] = (pktlen >> 8) & 0xff;
+    ptr[2] = (pktlen >> 16) & 0xff;
+    ptr[3] = 0;
+    ptr[4] = COM_QUERY;
+    ptr += HEADER_SIZE + 1;
+
+    if(n){
+        memcpy(ptr, sql, lstart - sql);
+        ptr += lstart - sql;
+        memcpy(ptr, limit, n);
+        ptr += n;
+        memcpy(ptr, lend, sql + len - lend);
+        ptr += sql + len - lend;
+    } else {
+        memcpy(ptr, sql, len);
+        ptr += len;
+    }
+
+    buf->used = ptr - buf->ptr;
+    buf->pos = 0;
+
+    sh->state = SG_SHARD_WRITING;
+
+    if(add_handler(my->fd, EPOLLOUT, sg_shard_write_cb, my) < 0){
+        log(g_log, "conn:%u add_handler error\n", c->connid);
+        return sg_error(ctx, 1105, "scatter add handler error");
+    }
+
+    return 0;
+}
+
+/*
+ * fun: find shard of mysql connection
+ * arg: scatter context, mysql connection
+ * ret: success return shard, error return NULL
+ *
+ */
+
+static sg_shard_t *sg_shard_find(sg_ctx_t *ctx, my_conn_t *my)
+{
+    int i;
+
+    for(i = 0; i < ctx->num; i++){
+        if(ctx->shard[i].my == my){
+            return &(ctx->shard[i]);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * fun: shard write query callback
+ * arg: fd, mysql connection
+ * ret: success 0, error -1
+ *
+ */
+
+static int sg_shard_write_cb(int fd, void *arg)
+{
+    int done, res = 0;
+    my_conn_t *my = (my_conn_t *)arg;
+    conn_t *c = my->conn;
+    sg_ctx_t *ctx = c->sg;
+    sg_shard_t *sh;
+    my_node_t *node = my->node;
+
+    debug(g_log, "%s called\n", __func__);
+
+    if( (sh = sg_shard_find(ctx, my)) == NULL ){
+        log(g_log, "conn:%u shard not found\n", c->connid);
+        return -1;
+    }
+
+    if( (res = my_real_write(fd, &(my->buf), &done)) <= 0 ){
+        log_err(g_log, "conn:%u my_real_write error\n", c->connid);
+        sg_error(ctx, 2013, "lost connection to shard %s:%s", node->host, node->srv);
+        return sg_fail(ctx);
+    }
+
+    if(done){
+        buf_reset(&(my->buf));
+        sh->rpos = 0;
+        sh->hpos = 0;
+        sh->paused = 0;
+        sh->state = sh->skip ? SG_SHARD_SKIP : SG_SHARD_HEAD;
+
+        if( (res = del_handler(fd)) < 0 ){
+            log(g_log, "conn:%u del_handler error\n", c->connid);
+        }
+
+        if( (res = add_handler(fd, EPOLLIN, sg_shard_read_cb, my)) < 0 ){
+            log(g_log, "conn:%u add_handler error\n", c->connid);
+            sg_error(ctx, 1105, "scatter add handler error");
+            return sg_fail(ctx);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * fun: shard read result callback
+ * arg: fd, mysql connection
+ * ret: success 0, error -1
+ *
+ */
+
+static int sg_shard_read_cb(int fd, void *arg)
+{
+    int res = 0;
+    size_t base;
+    my_conn_t *my = (my_conn_t *)arg;
+    conn_t *c = my->conn;
+    sg_ctx_t *ctx = c->sg;
+    sg_shard_t *sh;
+    my_node_t *node = my->node;
+    buf_t *buf = &(my->buf);
+
+    debug(g_log, "%s called\n", __func__);
+
+    if( (sh = sg_shard_find(ctx, my)) == NULL ){
+        log(g_log, "conn:%u shard not found\n", c->connid);
+        return -1;
+    }
+
+    // keep unparsed data and unsent header only
+    if(buf->size - buf->used < SG_READ_SIZE){
+        base = (sh->state == SG_SHARD_FIELD) ? sh->hpos : sh->rpos;
+        if(base > 0){
+            memmove(buf->ptr, buf->ptr + base, buf->used - base);
+            buf->used -= base;
+            sh->rpos -= base;
+            sh->hpos -= (sh->hpos > base) ? base : sh->hpos;
+        }
+        if(buf->size - buf->used < SG_READ_SIZE){
+            if(buf_realloc(buf, 2 * buf->size) == NULL){
+                sg_error(ctx, 1105, "out of memory");
+                return sg_fail(ctx);
+            }
+        }
+    }
+
+    if( (res = my_real_read_result_set(fd, buf)) <= 0 ){
+        log_err(g_log, "conn:%u shard %s:%s read error\n", \
+                                    c->connid, node->host, node->srv);
+        sg_error(ctx, 2013, "lost connection to shard %s:%s", node->host, node->srv);
+        return sg_fail(ctx);
+    }
+
+    if(sg_shard_parse(ctx, sh) < 0){
+        return sg_fail(ctx);
+    }
+
+    if( (ctx->norder > 0) && (sg_merge(ctx) < 0) ){
+        return sg_fail(ctx);
+    }
+
+    if(sg_check_end(ctx) < 0){
+        return -1;
+    }
+
+    return sg_flush(ctx);
+}
+
+/*
+ * fun: parse buffered packets of one shard
+ * arg: scatter context, shard
+ * ret: success 0, complete row waiting for merge 1, error -1
+ *
+ */
+
+static int sg_shard_parse(sg_ctx_t *ctx, sg_shard_t *sh)
+{
+    uint32_t pktlen;
+    uint8_t pktno, first;
+    uint64_t fields;
+    char *pkt, *payload;
+    my_result_eof_t eof;
+    buf_t *buf = &(sh->my->buf);
+
+    for(;;){
+        if(buf->used - sh->rpos < HEADER_SIZE){
+            break;
+        }
+
+        pkt = buf->ptr + sh->rpos;
+        parse_pkt_header(pkt, &pktlen, &pktno);
+        if(pktlen == SG_MAX_PKT){
+            return sg_error(ctx, 1153, "packet too large for scatter");
+        }
+        if(buf->used - sh->rpos < HEADER_SIZE + pktlen){
+            break;
+        }
+
+        payload = pkt + HEADER_SIZE;
+        first = (pktlen > 0) ? (uint8_t)payload[0] : 0;
+
+        switch(sh->state)
+        {
+            case SG_SHARD_SKIP:
+                if(first == 0xff){
+                    return sg_error_pkt(ctx, payload, pktlen);
+                }
+                sh->state = SG_SHARD_HEAD;
+                break;
+
+            case SG_SHARD_HEAD:
+                if(first == 0xff){
+                    sh->state = SG_SHARD_DONE;
+                    return sg_error_pkt(ctx, payload, pktlen);
+                } else if(first == 0x00) {
+                    if(ctx->head_sent){
+                        return sg_error(ctx, 1105, "shards return different result type");
+                    }
+                    sh->state = SG_SHARD_DONE;
+                    ctx->done++;
+                    ctx->nok++;
+                } else if(first == 0xfb) {
+                    return sg_error(ctx, 1235, "LOCAL INFILE not supported by scatter query");
+                } else {
+                    if(parse_lenenc(&payload, payload + pktlen, &fields) != 0){
+                        return sg_error(ctx, 1105, "malformed packet from shard");
+                    }
+                    sh->fields = fields;
+                    sh->field_i = 0;
+                    sh->hpos = sh->rpos;
+                    sh->state = SG_SHARD_FIELD;
+                }
+                break;
+
+            case SG_SHARD_FIELD:
+                if(sh->field_i < sh->fields){
+                    sh->field_i++;
+                    break;
+                }
+                if( (first != 0xfe) || (pktlen >= 9) ){
+                    return sg_error(ctx, 1105, "malformed packet from shard");
+                }
+                sh->rpos += HEADER_SIZE + pktlen;
+                sh->state = SG_SHARD_ROW;
+                if(sg_shard_header(ctx, sh) < 0){
+                    return -1;
+                }
+                continue;
+
+            case SG_SHARD_ROW:
+                if( (first == 0xfe) && (pktlen < 9) ){
+                    parse_eof(pkt, &eof);
+                    if(eof.status & SERVER_MORE_RESULTS_EXISTS){
+                        return sg_error(ctx, 1235, "multi result not supported by scatter query");
+                    }
+                    ctx->warnings += eof.warnings;
+                    ctx->status = eof.status;
+                    sh->state = SG_SHARD_DONE;
+                    ctx->done++;
+                } else if(first == 0xff) {
+                    return sg_error_pkt(ctx, payload, pktlen);
+                } else if( (ctx->norder > 0) && (!ctx->limit_done) ) {
+                    return 1;
+                } else {
+                    sg_emit_row(ctx, payload, pktlen);
+                }
+                break;
+
+            default:
+                return 0;
+        }
+
+        sh->rpos += HEADER_SIZE + pktlen;
+    }
+
+    return 0;
+}
+
+/*
+ * fun: send result set header from the first shard, check the others
+ * arg: scatter context, shard
+ * ret: success 0, error -1
+ *
+ */
+
+static int sg_shard_header(sg_ctx_t *ctx, sg_shard_t *sh)
+{
+    int i, index = -1;
+    uint32_t pktlen;
+    uint8_t pktno;
+    size_t pos;
+    char *pkt, name[64];
+    sg_order_t *o;
+    buf_t *buf = &(sh->my->buf);
+
+    if(ctx->nok > 0){
+        return sg_error(ctx, 1105, "shards return different result type");
+    }
+
+    if(ctx->head_sent){
+        if(sh->fields != ctx->fields){
+            return sg_error(ctx, 1105, "shards return different column count");
+        }
+        return 0;
+    }
+
+    // column count, column definitions and eof
+    for(pos = sh->hpos; pos < sh->rpos; pos += HEADER_SIZE + pktlen){
+        pkt = buf->ptr + pos;
+        parse_pkt_header(pkt, &pktlen, &pktno);
+
+        if( (index >= 0) && (index < sh->fields) ){
+            if(parse_field_name(pkt + HEADER_SIZE, pktlen, name, sizeof(name)) < 0){
+                return sg_error(ctx, 1105, "malformed packet from shard");
+            }
+
+            for(i = 0; i < ctx->norder; i++){
+                o = &(ctx->order[i]);
+                if( (o->pos == 0) && (o->index < 0) && (!strcasecmp(o->name, name)) ){
+                    o->index = index;
+                }
+            }
+        }
+        index++;
+
+        if(sg_out_pkt(ctx, pkt + HEADER_SIZE, pktlen) < 0){
+            return sg_error(ctx, 1105, "out of memory");
+        }
+    }
+
+    for(i = 0; i < ctx->norder; i++){
+        o = &(ctx->order[i]);
+        if( (o->pos > 0) && (o->pos <= sh->fields) ){
+            o->index = o->pos - 1;
+        }
+        if(o->index < 0){
+            return sg_error(ctx, 1054, "unknown column in ORDER BY of scatter query");
+        }
+    }
+
+    ctx->fields = sh->fields;
+    ctx->head_sent = 1;
+
+    if( ctx->has_limit && (ctx->limit == 0) ){
+        ctx->limit_done = 1;
+    }
+
+    return 0;
+}
+
+/*
+ * fun: pause or resume reading of shards
+ * arg: scatter context
+ * ret: success 0, error -1
+ *
+ */
+
+static int sg_shard_io(sg_ctx_t *ctx)
+{
+    int i, want;
+    sg_shard_t *sh;
+    buf_t *buf;
+
+    for(i = 0; i < ctx->num; i++){
+        sh = &(ctx->shard[i]);
+        if( (sh->my == NULL) || (sh->state == SG_SHARD_WRITING) || \
+                                    (sh->state == SG_SHARD_DONE) ){
+            continue;
+        }
+
+        buf = &(sh->my->buf);
+        want = (!ctx->paused) && (buf->used - sh->rpos < SG_SHARD_HIGH);
+
+        if(want && sh->paused){
+            if(add_handler(sh->my->fd, EPOLLIN, sg_shard_read_cb, sh->my) < 0){
+                log(g_log, "conn:%u add_handler error\n", ctx->c->connid);
+                conn_close(ctx->c);
+                return -1;
+            }
+            sh->paused = 0;
+        } else if( (!want) && (!sh->paused) ) {
+            del_handler(sh->my->fd);
+            sh->paused = 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * fun: merge buffered rows by ORDER BY
+ * arg: scatter context
+ * ret: success 0, error -1
+ *
+ */
+
+static int sg_merge(sg_ctx_t *ctx)
+{
+    int i, res, pending;
+    uint32_t pktlen;
+    uint8_t pktno;
+    char *pkt;
+    sg_shard_t *sh;
+
+    for(;;){
+        pending = 0;
+        for(i = 0; i < ctx->num; i++){
+            sh = &(ctx->shard[i]);
+            if(sh->state == SG_SHARD_DONE){
+                continue;
+            }
+            pending++;
+
+            if( (sh->state == SG_SHARD_ROW) && (!sh->inheap) ){
+                if( (res = sg_shard_parse(ctx, sh)) < 0 ){
+                    return res;
+                } else if(res == 1) {
+                    sg_heap_push(ctx, i);
+                } else if(sh->state == SG_SHARD_DONE) {
+                    pending--;
+                }
+            }
+        }
+
+        if( (pending == 0) || (ctx->nheap < pending) || ctx->limit_done ){
+            break;
+        }
+
+        i = sg_heap_pop(ctx);
+        sh = &(ctx->shard[i]);
+        pkt = sh->my->buf.ptr + sh->rpos;
+        parse_pkt_header(pkt, &pktlen, &pktno);
+        sg_emit_row(ctx, pkt + HEADER_SIZE, pktlen);
+        sh->rpos += HEADER_SIZE + pktlen;
+    }
+
+    // limit reached, drain the rest
+    if(ctx->limit_done){
+        for(i = 0; i < ctx->num; i++){
+            sh = &(ctx->shard[i]);
+            sh->inheap = 0;
+            if( (sh->state == SG_SHARD_ROW) && (sg_shard_parse(ctx, sh) < 0) ){
+                return -1;
+            }
+        }
+        ctx->nheap = 0;
+    }
+
+    return 0;
+}
+
+/*
+ * fun: compare head rows of two shards by ORDER BY
+ * arg: scatter context, shards
+ * ret: less < 0, equal 0, greater > 0
+ *
+ */
+
+static int sg_row_cmp(sg_ctx_t *ctx, sg_shard_t *a, sg_shard_t *b)
+{
+    int i, res, ra, rb;
+    uint32_t alen, blen;
+    uint8_t pktno;
+    uint64_t avlen, bvlen;
+    char *apkt, *bpkt, *av, *bv;
+    sg_order_t *o;
+
+    apkt = a->my->buf.ptr + a->rpos;
+    bpkt = b->my->buf.ptr + b->rpos;
+    parse_pkt_header(apkt, &alen, &pktno);
+    parse_pkt_header(bpkt, &blen, &pktno);
+
+    for(i = 0; i < ctx->norder; i++){
+        o = &(ctx->order[i]);
+
+        ra = parse_row_value(apkt + HEADER_SIZE, alen, o->index, &av, &avlen);
+        rb = parse_row_value(bpkt + HEADER_SIZE, blen, o->index, &bv, &bvlen);
+        if( (ra < 0) || (rb < 0) ){
+            continue;
+        }
+
+        // NULL is the smallest
+        if( (ra == 1) && (rb == 1) ){
+            res = 0;
+        } else if(ra == 1) {
+            res = -1;
+        } else if(rb == 1) {
+            res = 1;
+        } else {
+            res = sg_value_cmp(av, avlen, bv, bvlen);
+        }
+
+        if(res != 0){
+            return o->desc ? -res : res;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * fun: compare text values, numeric if both are numbers
+ * arg: values and lengths
+ * ret: less < 0, equal 0, greater > 0
+ *
+ */
+
+static int sg_value_cmp(char *a, uint64_t alen, char *b, uint64_t blen)
+{
+    int res;
+    double da, db;
+    char abuf[64], bbuf[64], *aend, *bend;
+
+    if( (alen > 0) && (alen < sizeof(abuf)) && (blen > 0) && (blen < sizeof(bbuf)) ){
+        memcpy(abuf, a, alen);
+        abuf[alen] = '\0';
+        memcpy(bbuf, b, blen);
+        bbuf[blen] = '\0';
+
+        da = strtod(abuf, &aend);
+        db = strtod(bbuf, &bend);
+        if( (*aend == '\0') && (*bend == '\0') ){
+            return (da < db) ? -1 : ((da > db) ? 1 : 0);
+        }
+    }
+
+    res = memcmp(a, b, (alen < blen) ? alen : blen);
+    if(res == 0){
+        res = (alen < blen) ? -1 : ((alen > blen) ? 1 : 0);
+    }
+
+    return res;
+}
+
+/*
+ * fun: heap order, ties are broken by shard index
+ * arg: scatter context, shard indexes
+ * ret: a before b 1, else 0
+ *
+ */
+
+static int sg_heap_less(sg_ctx_t *ctx, int a, int b)
+{
+    int res;
+
+    res = sg_row_cmp(ctx, &(ctx->shard[a]), &(ctx->shard[b]));
+
+    return (res < 0) || ((res == 0) && (a < b));
+}
+
+/*
+ * fun: push shard into heap
+ * arg: scatter context, shard index
+ * ret: always return 0
+ *
+ */
+
+static int sg_heap_push(sg_ctx_t *ctx, int index)
+{
+    int i, parent;
+    int *heap = ctx->heap;
+
+    i = ctx->nheap++;
+    heap[i] = index;
+    ctx->shard[index].inheap = 1;
+
+    while(i > 0){
+        parent = (i - 1) / 2;
+        if(!sg_heap_less(ctx, heap[i], heap[parent])){
+            break;
+        }
+        index = heap[i];
+        heap[i] = heap[parent];
+        heap[parent] = index;
+        i = parent;
+    }
+
+    return 0;
+}
+
+/*
+ * fun: pop the smallest shard from heap
+ * arg: scatter context
+ * ret: shard index
+ *
+ */
+
+static int sg_heap_pop(sg_ctx_t *ctx)
+{
+    int i, l, r, min, top, tmp;
+    int *heap = ctx->heap;
+
+    top = heap[0];
+    ctx->shard[top].inheap = 0;
+    heap[0] = heap[--ctx->nheap];
+
+    i = 0;
+    for(;;){
+        l = 2 * i + 1;
+        r = l + 1;
+        min = i;
+        if( (l < ctx->nheap) && sg_heap_less(ctx, heap[l], heap[min]) ){
+            min = l;
+        }
+        if( (r < ctx->nheap) && sg_heap_less(ctx, heap[r], heap[min]) ){
+            min = r;
+        }
+        if(min == i){
+            break;
+        }
+        tmp = heap[i];
+        heap[i] = heap[min];
+        heap[min] = tmp;
+        i = min;
+    }
+
+    return top;
+}
+
+/*
+ * fun: reserve space at the end of client buffer
+ * arg: scatter context, length
+ * ret: success return write position, error return NULL
+ *
+ */
+
+static char *sg_out_reserve(sg_ctx_t *ctx, size_t len)
+{
+    char *ptr;
+    buf_t *out = &(ctx->c->buf);
+
+    if(out->used + len > out->size){
+        if(out->pos > 0){
+            memmove(out->ptr, out->ptr + out->pos, out->used - out->pos);
+            out->used -= out->pos;
+            out->pos = 0;
+        }
+        if(out->used + len > out->size){
+            if(buf_realloc(out, 2 * (out->used + len)) == NULL){
+                return NULL;
+            }
+        }
+    }
+
+    ptr = out->ptr + out->used;
+    out->used += len;
+
+    return ptr;
+}
+
+/*
+ * fun: append packet to client buffer with new packet number
+ * arg: scatter context, payload, payload length
+ * ret: success 0, error -1
+ *
+ */
+
+static int sg_out_pkt(sg_ctx_t *ctx, char *payload, uint32_t len)
+{
+    char *ptr;
+
+    if( (ptr = sg_out_reserve(ctx, HEADER_SIZE + len)) == NULL ){
+        return -1;
+    }
+
+    ptr[0] = len & 0xff;
+    ptr[1] = (len >> 8) & 0xff;
+    ptr[2] = (len >> 16) & 0xff;
+    ptr[3] = ctx->pktno++;
+    memcpy(ptr + HEADER_SIZE, payload, len);
+
+    return 0;
+}
+
+/*
+ * fun: send row to client with offset and limit applied
+ * arg: scatter context, row payload, payload length
+ * ret: success 0, error -1
+ *
+ */
+
+static int sg_emit_row(sg_ctx_t *ctx, char *payload, uint32_t len)
+{
+    if(ctx->limit_done){
+        return 0;
+    }
+
+    if(ctx->skipped < ctx->offset){
+        ctx->skipped++;
+        return 0;
+    }
+
+    if(sg_out_pkt(ctx, payload, len) < 0){
+        return -1;
+    }
+    ctx->sent++;
+
+    if( ctx->has_limit && (ctx->sent >= ctx->limit) ){
+        ctx->limit_done = 1;
+    }
+
+    return 0;
+}
+
+/*
+ * fun: append final eof or ok packet when all shards done
+ * arg: scatter context
+ * ret: ended 1, not yet 0, error -1
+ *
+ */
+
+static int sg_check_end(sg_ctx_t *ctx)
+{
+    char *ptr, ok[7];
+    my_result_eof_t eof;
+    uint16_t status;
+
+    if(ctx->ended){
+        return 1;
+    }
+
+    if(ctx->done < ctx->num){
+        return 0;
+    }
+
+    status = ctx->status & ~SERVER_MORE_RESULTS_EXISTS;
+
+    if(ctx->head_sent){
+        if( (ptr = sg_out_reserve(ctx, 9)) == NULL ){
+            conn_close(ctx->c);
+            return -1;
+        }
+        eof.pktno = ctx->pktno++;
+        eof.warnings = ctx->warnings;
+        eof.status = status;
+        make_eof(ptr, &eof);
+    } else {
+        ok[0] = 0x00;
+        ok[1] = 0x00;
+        ok[2] = 0x00;
+        ok[3] = SERVER_STATUS_AUTOCOMMIT;
+        ok[4] = 0;
+        ok[5] = 0;
+        ok[6] = 0;
+        if(sg_out_pkt(ctx, ok, sizeof(ok)) < 0){
+            conn_close(ctx->c);
+            return -1;
+        }
+    }
+
+    ctx->ended = 1;
+
+    return 1;
+}
+
+/*
+ * fun: write pending data to client, finish when all sent
+ * arg: scatter context
+ * ret: success 0, error -1
+ *
+ */
+
+static int sg_flush(sg_ctx_t *ctx)
+{
+    conn_t *c = ctx->c;
+    cli_conn_t *cli = c->cli;
+    buf_t *out = &(c->buf);
+
+    if(out->used > out->pos){
+        if(!ctx->writing){
+            if(add_handler(cli->fd, EPOLLOUT, sg_cli_write_cb, cli) < 0){
+                log(g_log, "conn:%u add_handler error\n", c->connid);
+                conn_close(c);
+                return -1;
+            }
+            ctx->writing = 1;
+        }
+        ctx->paused = (out->used - out->pos > SG_OUT_HIGH);
+    } else {
+        ctx->paused = 0;
+        if(ctx->ended){
+            return sg_finish(ctx);
+        }
+    }
+
+    return sg_shard_io(ctx);
+}
+
+/*
+ * fun: client write callback of scatter query
+ * arg: fd, client connection
+ * ret: success 0, error -1
+ *
+ */
+
+static int sg_cli_write_cb(int fd, void *arg)
+{
+    int done, res = 0;
+    cli_conn_t *cli = (cli_conn_t *)arg;
+    conn_t *c = cli->conn;
+    sg_ctx_t *ctx = c->sg;
+    buf_t *out = &(c->buf);
+
+    debug(g_log, "%s called\n", __func__);
+
+    if( (res = my_real_write(fd, out, &done)) <= 0 ){
+        log_err(g_log, "conn:%u my_real_write error\n", c->connid);
+        conn_close(c);
+        return -1;
+    }
+
+    if(done){
+        out->used = 0;
+        out->pos = 0;
+
+        if( (res = del_handler(fd)) < 0 ){
+            log(g_log, "conn:%u del_handler error\n", c->connid);
+        }
+        ctx->writing = 0;
+    }
+
+    return sg_flush(ctx);
+}
+
+/*
+ * fun: put back finished shard connections, close the others
+ * arg: scatter context
+ * ret: always return 0
+ *
+ */
+
+static int sg_release_shards(sg_ctx_t *ctx)
+{
+    int i;
+    sg_shard_t *sh;
+
+    for(i = 0; i < ctx->num; i++){
+        sh = &(ctx->shard[i]);
+        if(sh->my == NULL){
+            continue;
+        }
+
+        if(sh->state == SG_SHARD_DONE){
+            my_conn_put(sh->my);
+        } else {
+            my_conn_close(sh->my);
+        }
+        sh->my = NULL;
+    }
+
+    return 0;
+}
+
+/*
+ * fun: finish scatter query, wait for next client query
+ * arg: scatter context
+ * ret: success 0, error -1
+ *
+ */
+
+static int sg_finish(sg_ctx_t *ctx)
+{
+    conn_t *c = ctx->c;
+    cli_conn_t *cli = c->cli;
+
+    sg_release_shards(ctx);
+
+    c->end_us = timer_us();
+    sqldump(c);
+    my_digest_end(c);
+
+    c->sg = NULL;
+    free(ctx);
+
+    buf_reset(&(c->buf));
+
+    if(add_handler(cli->fd, EPOLLIN, cli_query_cb, cli) < 0){
+        log(g_log, "conn:%u add_handler error\n", c->connid);
+        conn_close(c);
+        return -1;
+    }
+
+    conn_state_set_idle(c);
+
+    return 0;
+}
+
+/*
+ * fun: scatter query fail, send error to client if nothing sent yet
+ * arg: scatter context
+ * ret: always return -1
+ *
+ */
+
+static int sg_fail(sg_ctx_t *ctx)
+{
+    conn_t *c = ctx->c;
+
+    log(g_log, "conn:%u scatter error[%d]: %s\n", \
+                    c->connid, ctx->error.err, ctx->error.msg);
+
+    if(ctx->head_sent){
+        conn_close(c);
+        return -1;
+    }
+
+    sg_release_shards(ctx);
+    ctx->done = ctx->num;
+    ctx->ended = 1;
+
+    ctx->error.pktno = 1;
+    ctx->error.field_count = 0xff;
+    ctx->error.marker = '#';
+    make_result_error(&(c->buf), &(ctx->error));
+
+    sg_flush(ctx);
+
+    return -1;
+}
+
+/*
+ * fun: set scatter error
+ * arg: scatter context, error code, message format
+ * ret: always return -1
+ *
+ */
+
+static int sg_error(sg_ctx_t *ctx, uint16_t err, const char *fmt, ...)
+{
+    va_list ap;
+
+    ctx->error.err = err;
+    memcpy(ctx->error.sqlstate, "HY000", 5);
+
+    va_start(ap, fmt);
+    vsnprintf(ctx->error.msg, sizeof(ctx->error.msg), fmt, ap);
+    va_end(ap);
+
+    return -1;
+}
+
+/*
+ * fun: set scatter error from shard error packet
+ * arg: scatter context, error packet payload, payload length
+ * ret: always return -1
+ *
+ */
+
+static int sg_error_pkt(sg_ctx_t *ctx, char *payload, uint32_t len)
+{
+    uint32_t n;
+
+    if(len < 3){
+        return sg_error(ctx, 1105, "malformed packet from shard");
+    }
+
+    ctx->error.err = (uint8_t)payload[1] | ((uint8_t)payload[2] << 8);
+    payload += 3;
+    len -= 3;
+
+    if( (len >= 6) && (payload[0] == '#') ){
+        memcpy(ctx->error.sqlstate, payload + 1, 5);
+        payload += 6;
+        len -= 6;
+    } else {
+        memcpy(ctx->error.sqlstate, "HY000", 5);
+    }
+
+    n = (len < sizeof(ctx->error.msg)) ? len : sizeof(ctx->error.msg) - 1;
+    memcpy(ctx->error.msg, payload, n);
+    ctx->error.msg[n] = '\0';
+
+    return -1;
+}
@@ -0,0 +1,10 @@
+#ifndef _MY_SCATTER_H_
+#define _MY_SCATTER_H_
+
+#include "conn_pool.h"
+
+int my_scatter_need(conn_t *c);
+int my_scatter_start(conn_t *c);
+int my_scatter_abort(conn_t *c);
+
+#endif
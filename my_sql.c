@@ -0,0 +1,605 @@
+/*
+ * Copyright 2011-2013 Alibaba Group Holding Limited. All rights reserved.
+ * Use and distribution licensed under the GPL license.
+ *
+ * Authors: XiaoJinliang <xiaoshi.xjl@taobao.com>
+ *
+ */
+
+/*
+ * minimal sql lexer, splits statement into tokens, normalizes statement
+ * and finds referenced tables
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "my_sql.h"
+
+static const char *sql_volatile_func[] = {
+    "now", "rand", "uuid", "uuid_short", "sysdate", "curdate", "curtime",
+    "unix_timestamp", "connection_id", "last_insert_id", "found_rows",
+    "row_count", "database", "schema", "user", "session_user",
+    "system_user", "sleep", "get_lock", "release_lock", "is_free_lock",
+    "is_used_lock", "benchmark",
+    NULL
+};
+
+static const char *sql_volatile_word[] = {
+    "current_date", "current_time", "current_timestamp", "current_user",
+    "localtime", "localtimestamp", "utc_date", "utc_time", "utc_timestamp",
+    "update", "share", "into",
+    NULL
+};
+
+static int is_ident_char(int ch);
+static const char *skip_blank(const char *ptr, const char *end);
+static int sql_table_ref(sql_lexer_t *lex, sql_token_t *tk, sql_table_t *table);
+static int sql_tk_is_literal(sql_token_t *tk);
+static int sql_literal_list(sql_lexer_t *lex);
+static int sql_rewrite(const char *sql, int len, char *out, int size, int mask);
+
+/*
+ * fun: init sql lexer
+ * arg: lexer, sql text, sql length
+ * ret: always return 0
+ *
+ */
+
+int sql_lex_init(sql_lexer_t *lex, const char *sql, int len)
+{
+    lex->ptr = sql;
+    lex->end = sql + len;
+
+    return 0;
+}
+
+/*
+ * fun: check ident character
+ * arg: character
+ * ret: yes 1, no 0
+ *
+ */
+
+static int is_ident_char(int ch)
+{
+    return isalnum(ch) || (ch == '_') || (ch == '$') || (ch >= 0x80);
+}
+
+/*
+ * fun: skip blank and comments
+ * arg: current position, end position
+ * ret: first position of next token
+ *
+ */
+
+static const char *skip_blank(const char *ptr, const char *end)
+{
+    while(ptr < end){
+        if(isspace((unsigned char)*ptr)){
+            ptr++;
+        } else if(*ptr == '#') {
+            while( (ptr < end) && (*ptr != '\n') ){
+                ptr++;
+            }
+        } else if( (*ptr == '-') && (ptr + 1 < end) && (ptr[1] == '-') && \
+                   ((ptr + 2 == end) || isspace((unsigned char)ptr[2])) ){
+            while( (ptr < end) && (*ptr != '\n') ){
+                ptr++;
+            }
+        } else if( (*ptr == '/') && (ptr + 1 < end) && (ptr[1] == '*') ){
+            ptr += 2;
+            while( (ptr + 1 < end) && !((ptr[0] == '*') && (ptr[1] == '/')) ){
+                ptr++;
+            }
+            ptr = (ptr + 1 < end) ? ptr + 2 : end;
+        } else {
+            break;
+        }
+    }
+
+    return ptr;
+}
+
+/*
+ * fun: get next token
+ * arg: lexer, token
+ * ret: token type, TK_END at end of statement
+ *
+ */
+
+int sql_lex_next(sql_lexer_t *lex, sql_token_t *tk)
+{
+    const char *ptr, *end = lex->end;
+    char quote;
+
+    ptr = skip_blank(lex->ptr, end);
+
+    tk->ptr = ptr;
+    tk->len = 0;
+
+    if(ptr >= end){
+        lex->ptr = end;
+        tk->type = TK_END;
+        return TK_END;
+    }
+
+    if( (*ptr == '\'') || (*ptr == '"') || (*ptr == '`') ){
+        quote = *ptr++;
+        tk->ptr = ptr;
+        while(ptr < end){
+            if( (*ptr == '\\') && (quote != '`') && (ptr + 1 < end) ){
+                ptr += 2;
+            } else if(*ptr == quote) {
+                if( (ptr + 1 < end) && (ptr[1] == quote) ){
+                    ptr += 2;
+                } else {
+                    break;
+                }
+            } else {
+                ptr++;
+            }
+        }
+        tk->len = ptr - tk->ptr;
+        tk->type = (quote == '`') ? TK_QIDENT : TK_STRING;
+        lex->ptr = (ptr < end) ? ptr + 1 : end;
+        return tk->type;
+    }
+
+    if( isdigit((unsigned char)*ptr) || \
+        ((*ptr == '.') && (ptr + 1 < end) && isdigit((unsigned char)ptr[1])) ){
+        if( (*ptr == '0') && (ptr + 1 < end) && \
+            ((ptr[1] == 'x') || (ptr[1] == 'X') || (ptr[1] == 'b') || (ptr[1] == 'B')) ){
+            ptr += 2;
+            while( (ptr < end) && isxdigit((unsigned char)*ptr) ){
+                ptr++;
+            }
+        } else {
+            while( (ptr < end) && (isdigit((unsigned char)*ptr) || (*ptr == '.')) ){
+                ptr++;
+            }
+            if( (ptr + 1 < end) && ((*ptr == 'e') || (*ptr == 'E')) && \
+                (isdigit((unsigned char)ptr[1]) || (ptr[1] == '-') || (ptr[1] == '+')) ){
+                ptr += 2;
+                while( (ptr < end) && isdigit((unsigned char)*ptr) ){
+                    ptr++;
+                }
+            }
+        }
+
+        if( (ptr < end) && is_ident_char((unsigned char)*ptr) ){
+            while( (ptr < end) && is_ident_char((unsigned char)*ptr) ){
+                ptr++;
+            }
+            tk->type = TK_IDENT;
+        } else {
+            tk->type = TK_NUMBER;
+        }
+        tk->len = ptr - tk->ptr;
+        lex->ptr = ptr;
+        return tk->type;
+    }
+
+    if(*ptr == '@'){
+        ptr++;
+        while( (ptr < end) && (is_ident_char((unsigned char)*ptr) || \
+                                (*ptr == '@') || (*ptr == '.')) ){
+            ptr++;
+        }
+        tk->len = ptr - tk->ptr;
+        tk->type = TK_VARIABLE;
+        lex->ptr = ptr;
+        return TK_VARIABLE;
+    }
+
+    if(is_ident_char((unsigned char)*ptr)){
+        while( (ptr < end) && is_ident_char((unsigned char)*ptr) ){
+            ptr++;
+        }
+        tk->len = ptr - tk->ptr;
+        tk->type = TK_IDENT;
+        lex->ptr = ptr;
+        return TK_IDENT;
+    }
+
+    tk->len = 1;
+    tk->type = TK_PUNCT;
+    lex->ptr = ptr + 1;
+
+    return TK_PUNCT;
+}
+
+/*
+ * fun: check token is the given keyword, case insensitive
+ * arg: token, keyword
+ * ret: yes 1, no 0
+ *
+ */
+
+int sql_tk_is(sql_token_t *tk, const char *word)
+{
+    if(tk->type != TK_IDENT){
+        return 0;
+    }
+
+    return (strlen(word) == tk->len) && !strncasecmp(tk->ptr, word, tk->len);
+}
+
+/*
+ * fun: check token is the given punctuation
+ * arg: token, punctuation character
+ * ret: yes 1, no 0
+ *
+ */
+
+int sql_tk_is_punct(sql_token_t *tk, char ch)
+{
+    return (tk->type == TK_PUNCT) && (*(tk->ptr) == ch);
+}
+
+static const char *sql_keywords[] = {
+    "select", "from", "where", "and", "or", "not", "in", "is", "null",
+    "like", "between", "as", "on", "using", "join", "inner", "left",
+    "right", "outer", "cross", "group", "by", "order", "having", "limit",
+    "offset", "asc", "desc", "distinct", "union", "all", "count", "sum",
+    "min", "max", "avg", "case", "when", "then", "else", "end", "exists",
+    "insert", "into", "values", "value", "update", "set", "delete",
+    "replace", "for", "show",
+    NULL
+};
+
+static const char *sql_table_stop[] = {
+    "where", "join", "inner", "left", "right", "cross", "natural", "outer",
+    "straight_join", "on", "using", "group", "order", "limit", "having",
+    "union", "set", "values", "value", "select", "for", "lock", "into",
+    "partition", "force", "use", "ignore", "window", "procedure", "as",
+    "table",
+    NULL
+};
+
+/*
+ * fun: check token is one of the keywords
+ * arg: token, keyword list end with NULL
+ * ret: yes 1, no 0
+ *
+ */
+
+int sql_tk_in(sql_token_t *tk, const char **words)
+{
+    for(; *words; words++){
+        if(sql_tk_is(tk, *words)){
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * fun: check token is a literal value
+ * arg: token
+ * ret: yes 1, no 0
+ *
+ */
+
+static int sql_tk_is_literal(sql_token_t *tk)
+{
+    return (tk->type == TK_STRING) || (tk->type == TK_NUMBER) || \
+                                            sql_tk_is(tk, "null");
+}
+
+/*
+ * fun: skip a parenthesized literal list, lexer is after '('
+ * arg: lexer
+ * ret: list skipped and lexer is after ')' 1, not a literal list 0
+ *
+ */
+
+static int sql_literal_list(sql_lexer_t *lex)
+{
+    sql_lexer_t save = *lex;
+    sql_token_t tk;
+
+    while(1){
+        sql_lex_next(lex, &tk);
+        if( sql_tk_is_punct(&tk, '-') || sql_tk_is_punct(&tk, '+') ){
+            sql_lex_next(lex, &tk);
+        }
+        if(!sql_tk_is_literal(&tk)){
+            break;
+        }
+
+        sql_lex_next(lex, &tk);
+        if(sql_tk_is_punct(&tk, ')')){
+            return 1;
+        } else if(!sql_tk_is_punct(&tk, ',')) {
+            break;
+        }
+    }
+
+    *lex = save;
+
+    return 0;
+}
+
+/*
+ * fun: rewrite sql, blank and comments are collapsed, keywords lowercased,
+ *      literals are replaced by ? if mask is set
+ * arg: sql text, sql length, output buffer, buffer size, mask literals
+ * ret: success return rewritten length, too long -1
+ *
+ */
+
+static int sql_rewrite(const char *sql, int len, char *out, int size, int mask)
+{
+    int i, n = 0, need;
+    sql_lexer_t lex, save;
+    sql_token_t tk, next, prev;
+    const char *text;
+    char quote;
+
+    prev.type = TK_END;
+    sql_lex_init(&lex, sql, len);
+    while(sql_lex_next(&lex, &tk) != TK_END){
+        if( (tk.type == TK_PUNCT) && (*(tk.ptr) == ';') ){
+            continue;
+        }
+
+        text = NULL;
+        if(mask){
+            // sign of a number after operator is part of the literal
+            if( (sql_tk_is_punct(&tk, '-') || sql_tk_is_punct(&tk, '+')) && \
+                ((prev.type == TK_END) || \
+                 ((prev.type == TK_PUNCT) && !sql_tk_is_punct(&prev, ')')) || \
+                 ((prev.type == TK_IDENT) && sql_tk_in(&prev, sql_keywords))) ){
+                save = lex;
+                if(sql_lex_next(&lex, &next) == TK_NUMBER){
+                    tk = next;
+                } else {
+                    lex = save;
+                }
+            }
+
+            // in (1, 2, 3) and values (1, 2), (3, 4) collapse to (?+)
+            if( sql_tk_is_punct(&tk, '(') && (sql_tk_is(&prev, "in") || \
+                sql_tk_is(&prev, "values") || sql_tk_is(&prev, "value")) ){
+                if(sql_literal_list(&lex)){
+                    text = "(?+)";
+                    while(!sql_tk_is(&prev, "in")){
+                        save = lex;
+                        if( (sql_lex_next(&lex, &next) == TK_PUNCT) && \
+                            sql_tk_is_punct(&next, ',') && \
+                            (sql_lex_next(&lex, &next) == TK_PUNCT) && \
+                            sql_tk_is_punct(&next, '(') && sql_literal_list(&lex) ){
+                            continue;
+                        }
+                        lex = save;
+                        break;
+                    }
+                }
+            } else if(sql_tk_is_literal(&tk) && !sql_tk_is(&tk, "null")) {
+                text = "?";
+            }
+        }
+
+        need = (text ? strlen(text) : tk.len) + 3;
+        if(n + need >= size){
+            return -1;
+        }
+
+        if(n > 0){
+            out[n++] = ' ';
+        }
+
+        if(text){
+            memcpy(out + n, text, need - 3);
+            n += need - 3;
+        } else if( (tk.type == TK_STRING) || (tk.type == TK_QIDENT) ){
+            quote = tk.ptr[-1];
+            out[n++] = quote;
+            memcpy(out + n, tk.ptr, tk.len);
+            n += tk.len;
+            out[n++] = quote;
+        } else if( (tk.type == TK_IDENT) && sql_tk_in(&tk, sql_keywords) ) {
+            for(i = 0; i < tk.len; i++){
+                out[n++] = tolower((unsigned char)tk.ptr[i]);
+            }
+        } else {
+            memcpy(out + n, tk.ptr, tk.len);
+            n += tk.len;
+        }
+
+        prev = tk;
+    }
+
+    out[n] = '\0';
+
+    return n;
+}
+
+/*
+ * fun: normalize sql, blank and comments are collapsed, keywords lowercased
+ * arg: sql text, sql length, output buffer, buffer size
+ * ret: success return normalized length, too long -1
+ *
+ */
+
+int sql_normalize(const char *sql, int len, char *out, int size)
+{
+    return sql_rewrite(sql, len, out, size, 0);
+}
+
+/*
+ * fun: fingerprint sql, normalized and literals replaced by ?, literal
+ *      lists of IN and VALUES collapsed
+ * arg: sql text, sql length, output buffer, buffer size
+ * ret: success return fingerprint length, too long -1
+ *
+ */
+
+int sql_fingerprint(const char *sql, int len, char *out, int size)
+{
+    return sql_rewrite(sql, len, out, size, 1);
+}
+
+/*
+ * fun: read one table reference, [db.]table
+ * arg: lexer, token after keyword, table
+ * ret: success 0, not a table -1
+ *
+ */
+
+static int sql_table_ref(sql_lexer_t *lex, sql_token_t *tk, sql_table_t *table)
+{
+    sql_lexer_t save;
+    sql_token_t next;
+
+    if( ((tk->type != TK_IDENT) && (tk->type != TK_QIDENT)) || \
+                                    sql_tk_in(tk, sql_table_stop) ){
+        return -1;
+    }
+
+    table->db.len = 0;
+    table->db.ptr = NULL;
+    table->name = *tk;
+
+    save = *lex;
+    if( (sql_lex_next(lex, &next) == TK_PUNCT) && sql_tk_is_punct(&next, '.') ){
+        sql_lex_next(lex, &next);
+        if( (next.type == TK_IDENT) || (next.type == TK_QIDENT) ){
+            table->db = *tk;
+            table->name = next;
+            return 0;
+        }
+    }
+    *lex = save;
+
+    return 0;
+}
+
+/*
+ * fun: find tables referenced by sql, after FROM JOIN INTO UPDATE TABLE
+ * arg: sql text, sql length, table array, array size
+ * ret: number of tables found, more than size return size + 1
+ *
+ */
+
+int sql_tables(const char *sql, int len, sql_table_t *tables, int size)
+{
+    int n = 0, list;
+    sql_lexer_t lex, save;
+    sql_token_t tk;
+    sql_table_t table;
+
+    sql_lex_init(&lex, sql, len);
+    while(sql_lex_next(&lex, &tk) != TK_END){
+        if( !(sql_tk_is(&tk, "from") || sql_tk_is(&tk, "join") || \
+              sql_tk_is(&tk, "into") || sql_tk_is(&tk, "update") || \
+              sql_tk_is(&tk, "table") || sql_tk_is(&tk, "truncate")) ){
+            continue;
+        }
+
+        list = sql_tk_is(&tk, "from") || sql_tk_is(&tk, "update") || \
+                                            sql_tk_is(&tk, "table");
+
+        for(;;){
+            save = lex;
+            sql_lex_next(&lex, &tk);
+            if(sql_table_ref(&lex, &tk, &table) < 0){
+                lex = save;
+                break;
+            }
+
+            if(n < size){
+                tables[n] = table;
+            }
+            n++;
+
+            if(!list){
+                break;
+            }
+
+            // skip alias then look for next table of the list
+            save = lex;
+            sql_lex_next(&lex, &tk);
+            if(sql_tk_is(&tk, "as")){
+                sql_lex_next(&lex, &tk);
+                save = lex;
+                sql_lex_next(&lex, &tk);
+            } else if( ((tk.type == TK_IDENT) || (tk.type == TK_QIDENT)) && \
+                                        !sql_tk_in(&tk, sql_table_stop) ){
+                save = lex;
+                sql_lex_next(&lex, &tk);
+            }
+
+            if(!sql_tk_is_punct(&tk, ',')){
+                lex = save;
+                break;
+            }
+        }
+    }
+
+    return (n > size) ? size + 1 : n;
+}
+
+/*
+ * fun: check select only reads, without FOR UPDATE, FOR SHARE, LOCK IN
+ *      SHARE MODE or INTO
+ * arg: sql text, sql length
+ * ret: yes 1, no 0
+ *
+ */
+
+int sql_is_pure_read(const char *sql, int len)
+{
+    sql_lexer_t lex;
+    sql_token_t tk, prev;
+
+    prev.type = TK_END;
+    sql_lex_init(&lex, sql, len);
+    while(sql_lex_next(&lex, &tk) != TK_END){
+        if( sql_tk_is(&tk, "into") || \
+            (sql_tk_is(&prev, "for") && (sql_tk_is(&tk, "update") || sql_tk_is(&tk, "share"))) || \
+            (sql_tk_is(&prev, "lock") && sql_tk_is(&tk, "in")) ){
+            return 0;
+        }
+        prev = tk;
+    }
+
+    return 1;
+}
+
+/*
+ * fun: check select gives the same rows on any connection at the same
+ *      time, no variable, no locking or INTO, no function of the session
+ *      or of the clock
+ * arg: sql text, sql length
+ * ret: yes 1, no 0
+ *
+ */
+
+int sql_is_stable_read(const char *sql, int len)
+{
+    sql_lexer_t lex;
+    sql_token_t tk, prev;
+
+    sql_lex_init(&lex, sql, len);
+    if( (sql_lex_next(&lex, &tk) != TK_IDENT) || (!sql_tk_is(&tk, "select")) ){
+        return 0;
+    }
+
+    prev = tk;
+    while(sql_lex_next(&lex, &tk) != TK_END){
+        if( (tk.type == TK_VARIABLE) || sql_tk_in(&tk, sql_volatile_word) ){
+            return 0;
+        }
+        if( sql_tk_is_punct(&tk, '(') && sql_tk_in(&prev, sql_volatile_func) ){
+            return 0;
+        }
+        prev = tk;
+    }
+
+    return 1;
+}
@@ -0,0 +1,44 @@
+#ifndef _MY_SQL_H_
+#define _MY_SQL_H_
+
+#include <stdint.h>
+
+enum{
+    TK_END = 0,
+    TK_IDENT,
+    TK_QIDENT,
+    TK_NUMBER,
+    TK_STRING,
+    TK_VARIABLE,
+    TK_PUNCT
+};
+
+typedef struct{
+    int type;
+    const char *ptr;
+    int len;
+} sql_token_t;
+
+typedef struct{
+    const char *ptr;
+    const char *end;
+} sql_lexer_t;
+
+typedef struct{
+    sql_token_t db;
+    sql_token_t name;
+} sql_table_t;
+
+int sql_lex_init(sql_lexer_t *lex, const char *sql, int len);
+int sql_lex_next(sql_lexer_t *lex, sql_token_t *tk);
+int sql_tk_is(sql_token_t *tk, const char *word);
+int sql_tk_is_punct(sql_token_t *tk, char ch);
+int sql_tk_in(sql_token_t *tk, const char **words);
+
+int sql_normalize(const char *sql, int len, char *out, int size);
+int sql_fingerprint(const char *sql, int len, char *out, int size);
+int sql_tables(const char *sql, int len, sql_table_t *tables, int size);
+int sql_is_pure_read(const char *sql, int len);
+int sql_is_stable_read(const char *sql, int len);
+
+#endif
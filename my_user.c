@@ -0,0 +1,206 @@
+/*
+ * Copyright 2011-2013 Alibaba Group Holding Limited. All rights reserved.
+ * Use and distribution licensed under the GPL license.
+ *
+ * Authors: XiaoJinliang <xiaoshi.xjl@taobao.com>
+ *
+ */
+
+/*
+ * client user table
+ *
+ * users of user_conf and the user of myrelay.conf are kept in a my_htab
+ * table keyed by mmhash64 of the name. only the stage 2 hash,
+ * sha1(sha1(password)) as mysql.user stores it, is kept, so a login costs
+ * the two sha1 rounds of the check instead of hashing the password again.
+ * the table is rebuilt on usr1 and swapped in whole.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <log.h>
+#include <hash.h>
+#include <common.h>
+#include "my_user.h"
+#include "my_htab.h"
+#include "my_conf.h"
+#include "passwd.h"
+#include "def.h"
+
+extern log_t *g_log;
+extern struct conf_t g_conf;
+
+#define USER_ENTRY 1
+
+typedef struct{
+    my_htab_entry_t head;
+    char name[MAX_USER_LEN];
+    int nopass;
+    uint8_t stage2[PASSWD_HASH_SIZE];
+} user_entry_t;
+
+static __thread my_htab_t *table = NULL;
+
+static int user_add(my_htab_t *t, const char *name, const char *pass);
+static user_entry_t *user_find(my_htab_t *t, const char *name);
+
+/*
+ * fun: load user table of worker
+ * arg:
+ * ret: success 0, error -1
+ *
+ */
+
+int my_user_init(void)
+{
+    return my_user_load(g_conf.user_conf);
+}
+
+/*
+ * fun: build user table from config, "user password" or "user *hash",
+ *      the table in use is kept on error
+ * arg: user config path, empty for the user of myrelay.conf only
+ * ret: success 0, error -1
+ *
+ */
+
+int my_user_load(const char *conf)
+{
+    int line = 0, count = 0;
+    FILE *fp = NULL;
+    char buf[1024], name[MAX_USER_LEN], pass[128];
+    my_htab_t *t;
+
+    if( conf && (*conf != '\0') && ((fp = fopen(conf, "r")) == NULL) ){
+        log(g_log, "fopen %s error\n", conf);
+        return -1;
+    }
+
+    while( fp && fgets(buf, sizeof(buf), fp) ){
+        count++;
+    }
+    if(fp){
+        rewind(fp);
+    }
+
+    if( (t = my_htab_new(count + 1, sizeof(user_entry_t))) == NULL ){
+        if(fp){
+            fclose(fp);
+        }
+        return -1;
+    }
+
+    if(*g_conf.user != '\0'){
+        user_add(t, g_conf.user, g_conf.passwd);
+    }
+
+    while( fp && fgets(buf, sizeof(buf), fp) ){
+        line++;
+        trim(buf);
+        if( (*buf == '#') || (*buf == '\0') ){
+            continue;
+        }
+
+        pass[0] = '\0';
+        if(sscanf(buf, "%63s %127s", name, pass) < 1){
+            log(g_log, "user line[%d] error\n", line);
+            continue;
+        }
+
+        if(user_add(t, name, pass) < 0){
+            log(g_log, "user line[%d] error\n", line);
+            continue;
+        }
+    }
+
+    if(fp){
+        fclose(fp);
+    }
+
+    free(table);
+    table = t;
+
+    log(g_log, "user %s loaded, %d users\n", conf ? conf : "", t->count);
+
+    return 0;
+}
+
+/*
+ * fun: check client login token
+ * arg: user name, client token, scram sent to client
+ * ret: success 0, wrong user or password -1
+ *
+ */
+
+int my_user_check(const char *user, const char *token, const char *scram)
+{
+    user_entry_t *e;
+
+    if( (table == NULL) || ((e = user_find(table, user)) == NULL) ){
+        return -1;
+    }
+
+    if(e->nopass){
+        return (token[0] == '\0') ? 0 : -1;
+    }
+
+    return scramble_check(token, scram, e->stage2);
+}
+
+/*
+ * fun: add user to table, a user already in table is replaced
+ * arg: table, user name, password or "*" stage 2 hex hash
+ * ret: success 0, error -1
+ *
+ */
+
+static int user_add(my_htab_t *t, const char *name, const char *pass)
+{
+    uint8_t stage1[PASSWD_HASH_SIZE];
+    user_entry_t *e;
+
+    if(strlen(name) >= MAX_USER_LEN){
+        return -1;
+    }
+
+    if( (e = my_htab_add(t, USER_ENTRY, mmhash64(name, strlen(name)))) == NULL ){
+        return -1;
+    }
+
+    // another name of the same hash
+    if( (e->name[0] != '\0') && strcmp(e->name, name) ){
+        return -1;
+    }
+    strcpy(e->name, name);
+
+    e->nopass = 0;
+    if(*pass == '\0'){
+        e->nopass = 1;
+    } else if(passwd_parse_hash(pass, e->stage2) < 0) {
+        passwd_hash(stage1, e->stage2, pass);
+    }
+
+    return 0;
+}
+
+/*
+ * fun: find user in table
+ * arg: table, user name
+ * ret: found return entry, not found NULL
+ *
+ */
+
+static user_entry_t *user_find(my_htab_t *t, const char *name)
+{
+    user_entry_t *e;
+
+    if( ((e = my_htab_find(t, USER_ENTRY, mmhash64(name, strlen(name)))) == NULL) || \
+                                                        strcmp(e->name, name) ){
+        return NULL;
+    }
+
+    return e;
+}
@@ -0,0 +1,8 @@
+#ifndef _MY_USER_H_
+#define _MY_USER_H_
+
+int my_user_init(void);
+int my_user_load(const char *conf);
+int my_user_check(const char *user, const char *token, const char *scram);
+
+#endif
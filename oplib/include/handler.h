@@ -15,6 +15,7 @@ int in_handler(int fd);
 int mod_handler(int fd, uint32_t event, void *cb, void *arg);
 */
 int epoll_handler(int timeout);
+uint64_t handler_idle(void);
 
 #ifdef __cplusplus
 }
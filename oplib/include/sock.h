@@ -12,10 +12,20 @@ extern "C" {
 
 inline int make_listen_nonblock(const char *host, const char *serv);
 inline int connect_nonblock(const char *host, const char *serv, int *flag);
+int connect_addr_nonblock(const struct sockaddr *addr, socklen_t len, int *flag);
 inline int setnonblock(int fd);
 
 inline int accept_client(int sockfd, struct sockaddr_in *cliaddr, socklen_t *len);
 
+int make_listen_reuseport(const char *host, const char *serv);
+int reuseport_steer_cpu(int fd, const int *cpu, int count);
+
+int make_listen_unix(const char *path);
+int make_unix_listen(const char *name);
+int connect_unix(const char *name);
+int send_fd(int fd, const void *msg, size_t len, int passfd);
+int recv_fd(int fd, void *msg, size_t len, int *passfd);
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,15 +1,39 @@
 #ifndef _TIMER_H_
 #define _TIMER_H_
 
+#include <stdint.h>
+#include <time.h>
+#include "list.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+typedef struct{
+    struct list_head link;
+    uint64_t expire;
+    int (*func)(void *arg);
+    void *arg;
+} timer_node_t;
+
 typedef int (*timer_func_t)(unsigned long arg);
 int timer_init(void);
 int timer_register(timer_func_t func, unsigned long arg, char *info, int interval);
 int timer(void);
 
+uint64_t timer_update(void);
+void timer_precise(int on);
+uint64_t timer_us(void);
+uint64_t timer_ms(void);
+time_t timer_sec(void);
+const char *timer_str(time_t *wall);
+
+int timer_wait(int max);
+void timer_node_init(timer_node_t *t, int (*func)(void *arg), void *arg);
+int timer_add(timer_node_t *t, uint64_t ms);
+int timer_del(timer_node_t *t);
+int timer_pending(timer_node_t *t);
+
 #ifdef __cplusplus
 }
 #endif
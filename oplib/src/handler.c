@@ -12,6 +12,7 @@
 #include <sys/epoll.h>
 #include <errno.h>
 #include <log.h>
+#include <timer.h>
 #include "handler.h"
 
 extern log_t *g_log;
@@ -26,9 +27,11 @@ typedef struct{
     int fd;
 } handler_callback_t;
 
-static int epfd;
-static handler_callback_t *hcptr = NULL;
-static int hccount = 0;
+// per thread, every worker thread runs its own epoll loop
+static __thread int epfd;
+static __thread handler_callback_t *hcptr = NULL;
+static __thread int hccount = 0;
+static __thread uint64_t idle_usec = 0;
 
 /*
  * fun: init handler
@@ -236,8 +239,12 @@ int epoll_handler(int timeout)
     int i, nfds, res = 0;
     struct epoll_event events[MAX_EVENT];
     handler_callback_t *ptr;
+    uint64_t us;
 
+    // loop clock is read here, events of this iteration share it
+    us = timer_update();
     nfds = epoll_wait(epfd, events, MAX_EVENT, timeout);
+    idle_usec += timer_update() - us;
     debug(g_log, "nfds: %d ready\n", nfds);
 
     for(i = 0; i < nfds; i++){
@@ -249,3 +256,15 @@ int epoll_handler(int timeout)
 
     return nfds;
 }
+
+/*
+ * fun: time this loop spent waiting in epoll_wait
+ * arg: void
+ * ret: idle time in usec
+ *
+ */
+
+uint64_t handler_idle(void)
+{
+    return idle_usec;
+}
@@ -17,6 +17,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include "log.h"
+#include "timer.h"
 
 #define BUFFSIZE 8192
 
@@ -24,6 +25,7 @@ static int log_inited = 0;
 
 static int log_doit(log_t *log, int level, int flag, const char *file, \
                     int line, const char *func, const char *fmt, va_list ap);
+static int log_reopen(log_t *log);
 
 /*
  * fun: open log file and init log_t
@@ -74,6 +76,7 @@ log_t *log_init(const char *fname, int level)
         return NULL;
     }
     log->statbuf = statbuf;
+    pthread_mutex_init(&(log->lock), NULL);
 
     log_inited = 1;
 
@@ -93,6 +96,7 @@ int log_deinit(log_t *log)
 
     close(log->fd);
     free(log->fname);
+    pthread_mutex_destroy(&(log->lock));
 
     free(log);
 
@@ -129,15 +133,13 @@ int log_ret(log_t *log, int level, int flag, const char *file, int line, const c
 static int log_doit(log_t *log, int level, int flag, const char *file, int line, \
                             const char *func, const char *fmt, va_list ap)
 {
-    int n = 0, len = 0, errno_res, ret, fd;
+    int n = 0, len = 0, errno_res;
     char buf[BUFFSIZE], timebuf[64], strerr[1024] = "";
+    const char *ts;
     time_t t;
     struct tm tm;
     static time_t last = 0;
 
-    struct stat statbuf;
-    ino_t  i1, i2;
-
     errno_res = errno;
 
     if(log_inited){
@@ -152,12 +154,16 @@ static int log_doit(log_t *log, int level, int flag, const char *file, int line,
 
     pid_t pid = getpid();
 
-    t = time(NULL);
-    localtime_r(&t, &tm);
-    strftime(timebuf, sizeof(timebuf), "%F %T", &tm);
+    // threads running a loop keep the time string formatted
+    if( (ts = timer_str(&t)) == NULL ){
+        t = time(NULL);
+        localtime_r(&t, &tm);
+        strftime(timebuf, sizeof(timebuf), "%F %T", &tm);
+        ts = timebuf;
+    }
 
     n = snprintf(buf + len, BUFFSIZE - len - 1, "%s pid[%d] %s[%d] %s() - ", \
-                                    timebuf, pid, file, line, func);
+                                    ts, pid, file, line, func);
 
     if(n > BUFFSIZE - len - 1){
         n = BUFFSIZE - len - 1;
@@ -190,59 +196,67 @@ static int log_doit(log_t *log, int level, int flag, const char *file, int line,
         return n;
     }
 
+    // threads share the log, one reopens it and the fd number writers
+    // use is never closed, the new file is put on it by dup2
     if(t > last){
-        last = t;
-        i1 = log->statbuf.st_ino;
-
-        ret = stat(log->fname, &statbuf);
-        if(ret < 0){
-            if(errno != ENOENT){
-                fprintf(stderr, "stat %s error, %s", log->fname, \
-                            strerror_r(errno, strerr, sizeof(strerr) - 1));
-                return -1;
-            } else {
-                fd = open(log->fname, O_WRONLY|O_APPEND|O_CREAT, S_IRWXU|S_IRGRP|S_IROTH);
-
-                if(fd < 0){
-                    fprintf(stderr, "open %s error, %s", log->fname, \
-                                strerror_r(errno, strerr, sizeof(strerr) - 1));
-                    return -1;
-                } else {
-                    ret = fstat(fd, &statbuf);
-                    if(ret < 0){
-                        fprintf(stderr, "stat %s error, %s", log->fname, \
-                                    strerror_r(errno, strerr, sizeof(strerr) - 1));
-                        close(fd);
-                        return -1;
-                    } else {
-                        close(log->fd);
-                        log->fd = fd;
-                        log->statbuf = statbuf;
-                        fprintf(stdout, "reopen %s success\n", log->fname);
-                    }
-
-                }
-            }
-        } else {
-            i2 = statbuf.st_ino;
-
-            if(i1 != i2){
-                fd = open(log->fname, O_WRONLY|O_APPEND|O_CREAT, S_IRWXU|S_IRGRP|S_IROTH);
-
-                if(fd < 0){
-                    fprintf(stderr, "open %s error, %s", log->fname, \
-                            strerror_r(errno, strerr, sizeof(strerr) - 1));
-                    return -1;
-                } else {
-                    fprintf(stdout, "reopen %s success\n", log->fname);
-                    close(log->fd);
-                    log->fd = fd;
-                    log->statbuf = statbuf;
-                }
-            }
+        pthread_mutex_lock(&(log->lock));
+        if(t > last){
+            last = t;
+            log_reopen(log);
         }
-
+        pthread_mutex_unlock(&(log->lock));
     }
 
     return n;
 }
+
+/*
+ * fun: reopen log file if it is moved or removed, must hold log lock
+ * arg: log handler
+ * ret: error=-1, success=0
+ *
+ */
+
+static int log_reopen(log_t *log)
+{
+    int ret, fd;
+    char strerr[1024];
+    struct stat statbuf;
+
+    ret = stat(log->fname, &statbuf);
+    if( (ret < 0) && (errno != ENOENT) ){
+        fprintf(stderr, "stat %s error, %s", log->fname, \
+                    strerror_r(errno, strerr, sizeof(strerr) - 1));
+        return -1;
+    } else if( (ret == 0) && (statbuf.st_ino == log->statbuf.st_ino) ){
+        return 0;
+    }
+
+    fd = open(log->fname, O_WRONLY|O_APPEND|O_CREAT, S_IRWXU|S_IRGRP|S_IROTH);
+    if(fd < 0){
+        fprintf(stderr, "open %s error, %s", log->fname, \
+                    strerror_r(errno, strerr, sizeof(strerr) - 1));
+        return -1;
+    }
+
+    ret = fstat(fd, &statbuf);
+    if(ret < 0){
+        fprintf(stderr, "stat %s error, %s", log->fname, \
+                    strerror_r(errno, strerr, sizeof(strerr) - 1));
+        close(fd);
+        return -1;
+    }
+
+    if(dup2(fd, log->fd) < 0){
+        fprintf(stderr, "dup2 %s error, %s", log->fname, \
+                    strerror_r(errno, strerr, sizeof(strerr) - 1));
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    log->statbuf = statbuf;
+    fprintf(stdout, "reopen %s success\n", log->fname);
+
+    return 0;
+}
@@ -7,15 +7,20 @@
  */                                                                       
 
 #include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/un.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netinet/tcp.h>
+#include <linux/filter.h>
 #include <errno.h>
 #include "sock.h"
 #include "log.h"
@@ -24,6 +29,17 @@
 extern log_t *g_log;
 
 #define RESERVE_FOR_HEADER 64
+#define MAX_STEER_SOCK 256
+
+#ifndef SO_REUSEPORT
+#define SO_REUSEPORT 15
+#endif
+
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+
+static int listen_nonblock(const char *host, const char *serv, int reuseport);
 
 /*
  * fun: make listen socket and set nonblock
@@ -33,6 +49,79 @@ extern log_t *g_log;
  */
 
 inline int make_listen_nonblock(const char *host, const char *serv)
+{
+    return listen_nonblock(host, serv, 0);
+}
+
+/*
+ * fun: make SO_REUSEPORT listen socket and set nonblock, sockets of the
+ *      same address form a group in the order they are made
+ * arg: listen address string, listen port string
+ * ret: success=listen fd, error=-1
+ *
+ */
+
+int make_listen_reuseport(const char *host, const char *serv)
+{
+    return listen_nonblock(host, serv, 1);
+}
+
+/*
+ * fun: steer connections of a reuseport group by the cpu receiving them,
+ *      socket i takes connections received on cpu[i], others by cpu number
+ * arg: any socket of the group, cpu of every socket, socket number
+ * ret: success=0, error=-1
+ *
+ */
+
+int reuseport_steer_cpu(int fd, const int *cpu, int count)
+{
+    int i, j, n = 0;
+    struct sock_filter code[2 * MAX_STEER_SOCK + 4];
+    struct sock_fprog prog;
+
+    if( (count <= 0) || (count > MAX_STEER_SOCK) ){
+        return -1;
+    }
+
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, \
+                                                SKF_AD_OFF + SKF_AD_CPU);
+
+    for(i = 0; i < count; i++){
+        // first socket on a cpu takes it
+        for(j = 0; (j < i) && (cpu[j] != cpu[i]); j++);
+        if(j < i){
+            continue;
+        }
+
+        code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, \
+                                                            cpu[i], 0, 1);
+        code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, i);
+    }
+
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, count);
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+
+    prog.len = n;
+    prog.filter = code;
+
+    if(setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, \
+                                            &prog, sizeof(prog)) < 0){
+        log_strerr(g_log, "attach reuseport cbpf error\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * fun: make listen socket and set nonblock
+ * arg: listen address string, listen port string, set SO_REUSEPORT
+ * ret: success=listen fd, error=-1
+ *
+ */
+
+static int listen_nonblock(const char *host, const char *serv, int reuseport)
 {
     int                 fd;
     const int           on = 1;
@@ -59,6 +148,12 @@ inline int make_listen_nonblock(const char *host, const char *serv)
         debug(g_log, "socket success\n");
         // set socket reusable
         setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if(reuseport && \
+            (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)){
+            log_strerr(g_log, "set reuseport error\n");
+            close(fd);
+            continue;
+        }
         // disable nagle
         setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
 
@@ -150,6 +245,49 @@ inline int connect_nonblock(const char *host, const char *serv, int *flag)
     return(sockfd);
 }
 
+/*
+ * fun: connect resolved address
+ * arg: remote address, address length, connect status
+ * ret: success=fd, error=-1
+ *
+ */
+
+int connect_addr_nonblock(const struct sockaddr *addr, socklen_t len, int *flag)
+{
+    const int on = 1;
+    int sockfd;
+
+    if( (sockfd = socket(addr->sa_family, SOCK_STREAM, 0)) < 0 ){
+        log_strerr(g_log, "socket error\n");
+        return -1;
+    }
+
+    if(addr->sa_family != AF_UNIX){
+        // set socket reusable
+        setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        // disable nagle
+        setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+
+    if(setnonblock(sockfd) != 0){
+        close(sockfd);
+        return -1;
+    }
+
+    if(connect(sockfd, addr, len) < 0){
+        if(errno != EINPROGRESS){
+            log_strerr(g_log, "connect error\n");
+            close(sockfd);
+            return -1;
+        }
+        *flag = 0;
+    } else {
+        *flag = 1;
+    }
+
+    return sockfd;
+}
+
 /*
  * fun: set fd nonblock
  * arg: fd
@@ -193,3 +331,185 @@ inline int accept_client(int sockfd, struct sockaddr_in *cliaddr, socklen_t *len
 
     return fd;
 }
+
+/*
+ * fun: make unix stream listen socket on a path and set nonblock, a stale
+ *      socket file left on the path is removed
+ * arg: socket path
+ * ret: success=listen fd, error=-1
+ *
+ */
+
+int make_listen_unix(const char *path)
+{
+    int fd;
+    struct sockaddr_un addr;
+    struct stat st;
+
+    if(strlen(path) >= sizeof(addr.sun_path)){
+        log(g_log, "unix socket path %s too long\n", path);
+        return -1;
+    }
+
+    if( (fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0 ){
+        log_strerr(g_log, "socket error\n");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if( (lstat(path, &st) == 0) && S_ISSOCK(st.st_mode) ){
+        unlink(path);
+    }
+
+    if( (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) || \
+        (chmod(path, 0777) < 0) || (listen(fd, 1024) < 0) ){
+        log_strerr(g_log, "%s bind or listen error\n", path);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+ * fun: make abstract unix seqpacket listen socket and set nonblock
+ * arg: socket name without the leading '\0'
+ * ret: success=listen fd, error=-1
+ *
+ */
+
+int make_unix_listen(const char *name)
+{
+    int fd, len;
+    struct sockaddr_un addr;
+
+    if( (fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0)) < 0 ){
+        log_strerr(g_log, "socket error\n");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    len = snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1, "%s", name);
+    len += offsetof(struct sockaddr_un, sun_path) + 1;
+
+    if( (bind(fd, (struct sockaddr *)&addr, len) < 0) || (listen(fd, 128) < 0) ){
+        log_strerr(g_log, "%s bind or listen error\n", name);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+ * fun: connect abstract unix seqpacket socket and set nonblock
+ * arg: socket name without the leading '\0'
+ * ret: success=fd, error=-1
+ *
+ */
+
+int connect_unix(const char *name)
+{
+    int fd, len;
+    struct sockaddr_un addr;
+
+    if( (fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0)) < 0 ){
+        log_strerr(g_log, "socket error\n");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    len = snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1, "%s", name);
+    len += offsetof(struct sockaddr_un, sun_path) + 1;
+
+    if(connect(fd, (struct sockaddr *)&addr, len) < 0){
+        log_strerr(g_log, "connect %s error\n", name);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+ * fun: send one message with a fd passed by SCM_RIGHTS
+ * arg: unix socket fd, message, message length, fd to pass or -1
+ * ret: success=0, error=-1
+ *
+ */
+
+int send_fd(int fd, const void *msg, size_t len, int passfd)
+{
+    struct msghdr mh;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char ctl[CMSG_SPACE(sizeof(int))];
+
+    memset(&mh, 0, sizeof(mh));
+    iov.iov_base = (void *)msg;
+    iov.iov_len = len;
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+
+    if(passfd >= 0){
+        memset(ctl, 0, sizeof(ctl));
+        mh.msg_control = ctl;
+        mh.msg_controllen = sizeof(ctl);
+        cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &passfd, sizeof(int));
+    }
+
+    if(sendmsg(fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL) != len){
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * fun: receive one message and the fd passed with it
+ * arg: unix socket fd, message buffer, buffer length, passed fd or -1
+ * ret: success=message length, no message=0, closed or error=-1
+ *
+ */
+
+int recv_fd(int fd, void *msg, size_t len, int *passfd)
+{
+    ssize_t n;
+    struct msghdr mh;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char ctl[CMSG_SPACE(sizeof(int))];
+
+    *passfd = -1;
+
+    memset(&mh, 0, sizeof(mh));
+    iov.iov_base = msg;
+    iov.iov_len = len;
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = ctl;
+    mh.msg_controllen = sizeof(ctl);
+
+    if( (n = recvmsg(fd, &mh, MSG_DONTWAIT | MSG_CMSG_CLOEXEC)) < 0 ){
+        return ((errno == EAGAIN) || (errno == EINTR)) ? 0 : -1;
+    } else if(n == 0){
+        return -1;
+    }
+
+    cmsg = CMSG_FIRSTHDR(&mh);
+    if( (cmsg != NULL) && (cmsg->cmsg_level == SOL_SOCKET) && \
+                                    (cmsg->cmsg_type == SCM_RIGHTS) ){
+        memcpy(passfd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    return n;
+}
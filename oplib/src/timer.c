@@ -1,13 +1,33 @@
 /*
  * Copyright 2011-2013 Alibaba Group Holding Limited. All rights reserved.
- * Use and distribution licensed under the GPL license.                   
+ * Use and distribution licensed under the GPL license.
  *
- * Authors: XiaoJinliang <xiaoshi.xjl@taobao.com>                          
+ * Authors: XiaoJinliang <xiaoshi.xjl@taobao.com>
+ *
+ */
+
+/*
+ * hierarchical timing wheel of millisecond ticks
+ *
+ * level 0 has 256 slots of 1ms, four upper levels have 64 slots each of
+ * 256ms, 16s, 17min and 18h, about 49 days in all. a timer goes into the
+ * slot of its expire time on the lowest level covering it, so arming and
+ * cancelling are O(1). when level 0 wraps, the next slot of the upper
+ * level is cascaded down. registered functions are periodic timers.
+ *
+ * the wheel and callers share a loop clock, it is read once per epoll
+ * iteration from CLOCK_MONOTONIC_COARSE and gives the same time to every
+ * event handled in that iteration. precise mode reads CLOCK_MONOTONIC on
+ * every call instead. a "%F %T" wall time string is kept for logs and
+ * formatted only when the second changes.
  *
  */
 
 #include <time.h>
+#include <stdint.h>
+#include <string.h>
 #include "log.h"
+#include "list.h"
 #include "timer.h"
 
 extern log_t *g_log;
@@ -16,14 +36,142 @@ struct timer_func_map{
     timer_func_t func;
     char *info;
     unsigned long arg;
-    time_t lasttime;
     int interval;
+    timer_node_t node;
 };
 
 #define MAX_FUNC_MAP 256
 
-static struct timer_func_map func_map[MAX_FUNC_MAP];
-static int func_map_index;
+#define TVR_BITS 8
+#define TVN_BITS 6
+#define TVR_SIZE (1 << TVR_BITS)
+#define TVN_SIZE (1 << TVN_BITS)
+#define TVR_MASK (TVR_SIZE - 1)
+#define TVN_MASK (TVN_SIZE - 1)
+#define TVN_LEVEL 4
+#define TV_MAX_DELAY ((1ULL << (TVR_BITS + TVN_LEVEL * TVN_BITS)) - 1)
+
+#define TVN_INDEX(ms, n) (((ms) >> (TVR_BITS + (n) * TVN_BITS)) & TVN_MASK)
+
+// per thread, timers run in the loop that registered them
+static __thread struct timer_func_map func_map[MAX_FUNC_MAP];
+static __thread int func_map_index;
+
+static __thread struct list_head tv1[TVR_SIZE];
+static __thread struct list_head tvn[TVN_LEVEL][TVN_SIZE];
+static __thread uint64_t wheel_ms;
+static __thread int wheel_count;
+
+static int clock_precise = 0;
+static __thread uint64_t clock_us;
+static __thread time_t clock_wall;
+static __thread char clock_str[32];
+
+static void wheel_add(timer_node_t *t);
+static int wheel_cascade(int n, int index);
+static int timer_func_run(void *arg);
+
+/*
+ * fun: read clock once for the loop iteration, called around epoll_wait
+ * arg: void
+ * ret: monotonic time in microseconds
+ *
+ */
+
+uint64_t timer_update(void)
+{
+    struct timespec ts;
+    struct tm tm;
+
+    clock_gettime(clock_precise ? CLOCK_MONOTONIC : CLOCK_MONOTONIC_COARSE, &ts);
+    clock_us = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    if(ts.tv_sec != clock_wall){
+        clock_wall = ts.tv_sec;
+        localtime_r(&clock_wall, &tm);
+        strftime(clock_str, sizeof(clock_str), "%F %T", &tm);
+    }
+
+    return clock_us;
+}
+
+/*
+ * fun: read the precise clock on every call instead of once per iteration
+ * arg: on 1, off 0
+ * ret: void
+ *
+ */
+
+void timer_precise(int on)
+{
+    clock_precise = on;
+}
+
+/*
+ * fun: loop clock in microseconds
+ * arg: void
+ * ret: microseconds
+ *
+ */
+
+uint64_t timer_us(void)
+{
+    // precise mode, or a thread not running a loop
+    if( clock_precise || (clock_us == 0) ){
+        return timer_update();
+    }
+
+    return clock_us;
+}
+
+/*
+ * fun: loop clock in milliseconds
+ * arg: void
+ * ret: milliseconds
+ *
+ */
+
+uint64_t timer_ms(void)
+{
+    return timer_us() / 1000;
+}
+
+/*
+ * fun: loop clock in seconds, for timeouts kept in time_t
+ * arg: void
+ * ret: seconds
+ *
+ */
+
+time_t timer_sec(void)
+{
+    return timer_us() / 1000000;
+}
+
+/*
+ * fun: cached "%F %T" local time of the loop clock
+ * arg: wall clock seconds returned if not NULL
+ * ret: time string, NULL when this thread runs no loop clock
+ *
+ */
+
+const char *timer_str(time_t *wall)
+{
+    if(clock_us == 0){
+        return NULL;
+    }
+
+    if(clock_precise){
+        timer_update();
+    }
+
+    if(wall){
+        *wall = clock_wall;
+    }
+
+    return clock_str;
+}
 
 /*
  * fun: init timer
@@ -34,29 +182,209 @@ static int func_map_index;
 
 int timer_init(void)
 {
-    int i;
+    int i, j;
 
     for(i = 0; i < MAX_FUNC_MAP; i++){
         func_map[i].func = NULL;
         func_map[i].info = NULL;
         func_map[i].arg = 0;
-        func_map[i].lasttime= 0;
         func_map[i].interval = 0;
+        timer_node_init(&(func_map[i].node), timer_func_run, &(func_map[i]));
     }
     func_map_index = 0;
 
+    for(i = 0; i < TVR_SIZE; i++){
+        INIT_LIST_HEAD(&(tv1[i]));
+    }
+
+    for(i = 0; i < TVN_LEVEL; i++){
+        for(j = 0; j < TVN_SIZE; j++){
+            INIT_LIST_HEAD(&(tvn[i][j]));
+        }
+    }
+
+    timer_update();
+    wheel_ms = timer_ms();
+    wheel_count = 0;
+
     return 0;
 }
 
+/*
+ * fun: init timer node, it is not armed
+ * arg: timer node, callback function and its argument
+ * ret: void
+ *
+ */
+
+void timer_node_init(timer_node_t *t, int (*func)(void *arg), void *arg)
+{
+    INIT_LIST_HEAD(&(t->link));
+    t->expire = 0;
+    t->func = func;
+    t->arg = arg;
+}
+
+/*
+ * fun: arm timer node, an armed node is moved to the new expire time
+ * arg: timer node, milliseconds from now
+ * ret: success=0, error=-1
+ *
+ */
+
+int timer_add(timer_node_t *t, uint64_t ms)
+{
+    if( (t == NULL) || (t->func == NULL) ){
+        return -1;
+    }
+
+    timer_del(t);
+
+    t->expire = timer_ms() + ms;
+    wheel_add(t);
+    wheel_count++;
+
+    return 0;
+}
+
+/*
+ * fun: cancel timer node
+ * arg: timer node
+ * ret: cancelled=1, not armed=0
+ *
+ */
+
+int timer_del(timer_node_t *t)
+{
+    if(list_empty(&(t->link))){
+        return 0;
+    }
+
+    list_del_init(&(t->link));
+    wheel_count--;
+
+    return 1;
+}
+
+/*
+ * fun: check timer node is armed
+ * arg: timer node
+ * ret: armed=1, not=0
+ *
+ */
+
+int timer_pending(timer_node_t *t)
+{
+    return !list_empty(&(t->link));
+}
+
+/*
+ * fun: put timer node into the wheel slot of its expire time
+ * arg: timer node
+ * ret: void
+ *
+ */
+
+static void wheel_add(timer_node_t *t)
+{
+    int n;
+    uint64_t delay;
+    struct list_head *vec;
+
+    if(t->expire < wheel_ms){
+        t->expire = wheel_ms;
+    }
+
+    delay = t->expire - wheel_ms;
+    if(delay > TV_MAX_DELAY){
+        delay = TV_MAX_DELAY;
+        t->expire = wheel_ms + delay;
+    }
+
+    if(delay < TVR_SIZE){
+        vec = &(tv1[t->expire & TVR_MASK]);
+    } else {
+        for(n = 0; n < TVN_LEVEL - 1; n++){
+            if(delay < (1ULL << (TVR_BITS + (n + 1) * TVN_BITS))){
+                break;
+            }
+        }
+        vec = &(tvn[n][TVN_INDEX(t->expire, n)]);
+    }
+
+    list_add_tail(&(t->link), vec);
+}
+
+/*
+ * fun: move timers of an upper level slot down to lower levels
+ * arg: level, slot index
+ * ret: slot index
+ *
+ */
+
+static int wheel_cascade(int n, int index)
+{
+    timer_node_t *t;
+    struct list_head head;
+
+    INIT_LIST_HEAD(&head);
+    list_splice_init(&(tvn[n][index]), &head);
+
+    while(!list_empty(&head)){
+        t = list_entry(head.next, timer_node_t, link);
+        list_del_init(&(t->link));
+        wheel_add(t);
+    }
+
+    return index;
+}
+
+/*
+ * fun: milliseconds to wait for the nearest timer
+ * arg: max milliseconds
+ * ret: milliseconds, 0 when timers expired
+ *
+ */
+
+int timer_wait(int max)
+{
+    uint64_t now, ms;
+
+    if(wheel_count <= 0){
+        return max;
+    }
+
+    now = timer_ms();
+
+    for(ms = wheel_ms; ms <= now + max; ms++){
+        // upper level cascades on wrap, wake up for it
+        if( (ms != wheel_ms) && ((ms & TVR_MASK) == 0) ){
+            break;
+        }
+
+        if(!list_empty(&(tv1[ms & TVR_MASK]))){
+            break;
+        }
+    }
+
+    if(ms <= now){
+        return 0;
+    }
+
+    return (ms - now > max) ? max : (int)(ms - now);
+}
+
 /*
  * fun: register timer func
- * arg: callback function, argument, message, call interval
+ * arg: callback function, argument, message, call interval in seconds
  * ret: success=0, error=-1
  *
  */
 
 int timer_register(timer_func_t func, unsigned long arg, char *info, int interval)
 {
+    struct timer_func_map *fmap;
+
     if(func_map_index >= MAX_FUNC_MAP){
         return -1;
     }
@@ -69,19 +397,44 @@ int timer_register(timer_func_t func, unsigned long arg, char *info, int interva
         info = "";
     }
 
-    func_map[func_map_index].func = func;
-    func_map[func_map_index].info = info;
-    func_map[func_map_index].arg  = arg;
-    func_map[func_map_index].lasttime = 0;
-    func_map[func_map_index].interval= interval;
+    fmap = &(func_map[func_map_index]);
+    fmap->func = func;
+    fmap->info = info;
+    fmap->arg  = arg;
+    fmap->interval = interval;
 
     func_map_index++;
 
-    return 0;
+    // first call at next timer run
+    return timer_add(&(fmap->node), 0);
+}
+
+/*
+ * fun: call registered func and arm it for next interval
+ * arg: func map
+ * ret: func return
+ *
+ */
+
+static int timer_func_run(void *arg)
+{
+    int ret;
+    struct timer_func_map *fmap = arg;
+
+    timer_add(&(fmap->node), (uint64_t)fmap->interval * 1000);
+
+    ret = fmap->func(fmap->arg);
+    if(ret > 0){
+        debug(g_log, "%s, ret[%d]\n", fmap->info, ret);
+    } else if(ret < 0) {
+        log(g_log, "%s error, ret[%d]\n", fmap->info, ret);
+    }
+
+    return ret;
 }
 
 /*
- * fun: run timer loop
+ * fun: run expired timers
  * arg: void
  * ret: always return 0
  *
@@ -89,24 +442,39 @@ int timer_register(timer_func_t func, unsigned long arg, char *info, int interva
 
 int timer(void)
 {
-    int i, ret;
-    time_t now = time(NULL);
-    struct timer_func_map *fmap;
+    int index;
+    uint64_t now = timer_ms();
+    timer_node_t *t;
+    struct list_head head;
 
-    for(i = 0; i < func_map_index; i++){
-        fmap = &(func_map[i]);
-        if(fmap->func == NULL){
-            break;
-        } else {
-            if(now - fmap->lasttime >= fmap->interval){
-                fmap->lasttime = now;
-                ret = fmap->func(fmap->arg);
-                if(ret > 0){
-                    debug(g_log, "%s, ret[%d]\n", fmap->info, ret);
-                } else if(ret < 0) {
-                    log(g_log, "%s error, ret[%d]\n", fmap->info, ret);
-                }
-            }
+    // nothing armed, no slot to walk through
+    if(wheel_count <= 0){
+        wheel_ms = now + 1;
+        return 0;
+    }
+
+    INIT_LIST_HEAD(&head);
+
+    while(wheel_ms <= now){
+        index = wheel_ms & TVR_MASK;
+
+        if( (index == 0) && \
+            (wheel_cascade(0, TVN_INDEX(wheel_ms, 0)) == 0) && \
+            (wheel_cascade(1, TVN_INDEX(wheel_ms, 1)) == 0) && \
+            (wheel_cascade(2, TVN_INDEX(wheel_ms, 2)) == 0) ){
+            wheel_cascade(3, TVN_INDEX(wheel_ms, 3));
+        }
+
+        wheel_ms++;
+
+        list_splice_init(&(tv1[index]), &head);
+
+        // callbacks may arm or cancel any timer, including those in head
+        while(!list_empty(&head)){
+            t = list_entry(head.next, timer_node_t, link);
+            list_del_init(&(t->link));
+            wheel_count--;
+            t->func(t->arg);
         }
     }
 
@@ -4,6 +4,19 @@
 #include "mysql_com.h"
 #include "passwd.h"
 
+static int hex_val(char c)
+{
+    if( (c >= '0') && (c <= '9') ){
+        return c - '0';
+    } else if( (c >= 'a') && (c <= 'f') ){
+        return c - 'a' + 10;
+    } else if( (c >= 'A') && (c <= 'F') ){
+        return c - 'A' + 10;
+    }
+
+    return -1;
+}
+
 static void my_crypt(char *to, const char *s1, const char *s2, uint32_t len)
 {
     const char *s1_end = s1 + len;
@@ -14,33 +27,112 @@ static void my_crypt(char *to, const char *s1, const char *s2, uint32_t len)
 }
 
 /*
- * fun: calculate scram token
- * arg: token, scram, password
+ * fun: hash password, stage 2 is what mysql.user stores
+ * arg: stage 1 hash, stage 2 hash, password
  * ret:
  *
  */
 
-void scramble(char *to, const char *message, const char *password)
+void passwd_hash(uint8_t *stage1, uint8_t *stage2, const char *password)
 {
     SHA1_CONTEXT sha1_context;
-    uint8_t hash_stage1[SHA1_HASH_SIZE];
-    uint8_t hash_stage2[SHA1_HASH_SIZE];
-    
+
     mysql_sha1_reset(&sha1_context);
-    /* stage 1: hash password */
-    mysql_sha1_input(&sha1_context, (char *) password, (uint32_t) strlen(password));
-    mysql_sha1_result(&sha1_context, hash_stage1);
-    /* stage 2: hash stage 1; note that hash_stage2 is stored in the database */
+    mysql_sha1_input(&sha1_context, (const uint8_t *) password, (uint32_t) strlen(password));
+    mysql_sha1_result(&sha1_context, stage1);
+
     mysql_sha1_reset(&sha1_context);
-    mysql_sha1_input(&sha1_context, hash_stage1, SHA1_HASH_SIZE);
-    mysql_sha1_result(&sha1_context, hash_stage2);
+    mysql_sha1_input(&sha1_context, stage1, SHA1_HASH_SIZE);
+    mysql_sha1_result(&sha1_context, stage2);
+}
+
+/*
+ * fun: parse "*" and 40 hex digits stage 2 hash of mysql.user
+ * arg: hash text, stage 2 hash
+ * ret: success 0, not a hash -1
+ *
+ */
+
+int passwd_parse_hash(const char *text, uint8_t *stage2)
+{
+    int i, hi, lo;
+
+    if( (text[0] != '*') || (strlen(text) != SHA1_HASH_SIZE * 2 + 1) ){
+        return -1;
+    }
+    text++;
+
+    for(i = 0; i < SHA1_HASH_SIZE; i++){
+        if( ((hi = hex_val(text[i * 2])) < 0) || ((lo = hex_val(text[i * 2 + 1])) < 0) ){
+            return -1;
+        }
+        stage2[i] = (hi << 4) | lo;
+    }
+
+    return 0;
+}
+
+/*
+ * fun: calculate scram token from hashed password, one sha1 round
+ * arg: token, scram, stage 1 hash, stage 2 hash
+ * ret:
+ *
+ */
+
+void scramble_hash(char *to, const char *message, const uint8_t *stage1, const uint8_t *stage2)
+{
+    SHA1_CONTEXT sha1_context;
+
     /* create crypt string as sha1(message, hash_stage2) */
     mysql_sha1_reset(&sha1_context);
-    mysql_sha1_input(&sha1_context, (const char *) message, SCRAMBLE_LENGTH);
-    mysql_sha1_input(&sha1_context, hash_stage2, SHA1_HASH_SIZE);
+    mysql_sha1_input(&sha1_context, (const uint8_t *) message, SCRAMBLE_LENGTH);
+    mysql_sha1_input(&sha1_context, stage2, SHA1_HASH_SIZE);
     /* xor allows 'from' and 'to' overlap: lets take advantage of it */
-    mysql_sha1_result(&sha1_context, (char *) to);
-    my_crypt(to, (const char *) to, hash_stage1, SCRAMBLE_LENGTH);
+    mysql_sha1_result(&sha1_context, (uint8_t *) to);
+    my_crypt(to, (const char *) to, (const char *) stage1, SCRAMBLE_LENGTH);
+}
+
+/*
+ * fun: check client token against stored stage 2 hash, the xor of token
+ *      and sha1(scram, stage 2) is stage 1, whose sha1 must be stage 2
+ * arg: client token, scram, stage 2 hash
+ * ret: match 0, not -1
+ *
+ */
+
+int scramble_check(const char *token, const char *message, const uint8_t *stage2)
+{
+    SHA1_CONTEXT sha1_context;
+    char buf[SHA1_HASH_SIZE];
+    uint8_t check[SHA1_HASH_SIZE];
+
+    mysql_sha1_reset(&sha1_context);
+    mysql_sha1_input(&sha1_context, (const uint8_t *) message, SCRAMBLE_LENGTH);
+    mysql_sha1_input(&sha1_context, stage2, SHA1_HASH_SIZE);
+    mysql_sha1_result(&sha1_context, (uint8_t *) buf);
+    my_crypt(buf, buf, token, SCRAMBLE_LENGTH);
+
+    mysql_sha1_reset(&sha1_context);
+    mysql_sha1_input(&sha1_context, (const uint8_t *) buf, SHA1_HASH_SIZE);
+    mysql_sha1_result(&sha1_context, check);
+
+    return memcmp(check, stage2, SHA1_HASH_SIZE) ? -1 : 0;
+}
+
+/*
+ * fun: calculate scram token
+ * arg: token, scram, password
+ * ret:
+ *
+ */
+
+void scramble(char *to, const char *message, const char *password)
+{
+    uint8_t hash_stage1[SHA1_HASH_SIZE];
+    uint8_t hash_stage2[SHA1_HASH_SIZE];
+
+    passwd_hash(hash_stage1, hash_stage2, password);
+    scramble_hash(to, message, hash_stage1, hash_stage2);
 }
 
 /*
@@ -1,7 +1,16 @@
 #ifndef _PASSWD_H_
 #define _PASSWD_H_
 
+#include <stdint.h>
+
+#define PASSWD_HASH_SIZE 20
+
 int make_rand_scram(char *scram, int len);
 void scramble(char *to, const char *message, const char *password);
 
+void passwd_hash(uint8_t *stage1, uint8_t *stage2, const char *password);
+int passwd_parse_hash(const char *text, uint8_t *stage2);
+void scramble_hash(char *to, const char *message, const uint8_t *stage1, const uint8_t *stage2);
+int scramble_check(const char *token, const char *message, const uint8_t *stage2);
+
 #endif
@@ -46,12 +46,22 @@
      - Some optimizations
      - All checking is now done in debug only mode
      - More comments
+
+    The block function is picked at run time, cpus with the x86 sha
+    extensions use sha1rnds4/sha1msg1/sha1msg2, the others the portable
+    rounds below.
 */
 
 #include <stdint.h>
 #include <string.h>
 #include "sha1.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define SHA1_NI
+#endif
+
 /*
   Define the SHA1 circular left shift macro
 */
@@ -62,6 +72,14 @@
 /* Local Function Prototyptes */
 static void SHA1PadMessage(SHA1_CONTEXT*);
 static void SHA1ProcessMessageBlock(SHA1_CONTEXT*);
+static void SHA1BlockPortable(uint32_t *, const uint8_t *);
+static void SHA1BlockDispatch(uint32_t *, const uint8_t *);
+#ifdef SHA1_NI
+static void SHA1BlockNI(uint32_t *, const uint8_t *);
+#endif
+
+/* Block function, resolved on first use */
+static void (*SHA1Block)(uint32_t *, const uint8_t *)= SHA1BlockDispatch;
 
 
 /*
@@ -191,18 +209,23 @@ int mysql_sha1_input(SHA1_CONTEXT *context, const uint8_t *message_array,
     return context->Corrupted;
 #endif
 
-  while (length--)
+  while (length)
   {
-    context->Message_Block[context->Message_Block_Index++]=
-      (*message_array & 0xFF);
-    context->Length  += 8;  /* Length is in bits */
+    unsigned n= 64 - context->Message_Block_Index;
+
+    if (n > length)
+      n= length;
+    memcpy(context->Message_Block + context->Message_Block_Index,
+           message_array, n);
+    context->Message_Block_Index+= n;
+    context->Length+= (uint64_t) n << 3;  /* Length is in bits */
 
 #ifndef DBUG_OFF
     /*
       Then we're not debugging we assume we never will get message longer
       2^64 bits.
     */
-    if (context->Length == 0)
+    if (context->Length < ((uint64_t) n << 3))
       return (context->Corrupted= 1);	   /* Message is too long */
 #endif
 
@@ -210,7 +233,8 @@ int mysql_sha1_input(SHA1_CONTEXT *context, const uint8_t *message_array,
     {
       SHA1ProcessMessageBlock(context);
     }
-    message_array++;
+    message_array+= n;
+    length-= n;
   }
   return SHA_SUCCESS;
 }
@@ -239,6 +263,44 @@ static const uint32_t  K[]=
 
 
 static void SHA1ProcessMessageBlock(SHA1_CONTEXT *context)
+{
+  SHA1Block(context->Intermediate_Hash, context->Message_Block);
+  context->Message_Block_Index = 0;
+}
+
+
+/*
+  Pick the block function for this cpu and run it
+
+  SYNOPSIS
+    SHA1BlockDispatch()
+    hash: [in/out]		Intermediate hash
+    block: [in]			64 bytes message block
+
+  DESCRIPTION
+    Only the first call lands here, it stores the function found so
+    later blocks go straight to it. Threads racing on the first call
+    store the same pointer.
+*/
+
+static void SHA1BlockDispatch(uint32_t *hash, const uint8_t *block)
+{
+  void (*fn)(uint32_t *, const uint8_t *)= SHA1BlockPortable;
+#ifdef SHA1_NI
+  unsigned int eax, ebx, ecx, edx;
+
+  /* sha is cpuid.7.ebx bit 29, the shuffles need sse4.1, cpuid.1.ecx bit 19 */
+  if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_1) &&
+      __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & (1 << 29)))
+    fn= SHA1BlockNI;
+#endif
+
+  SHA1Block= fn;
+  fn(hash, block);
+}
+
+
+static void SHA1BlockPortable(uint32_t *hash, const uint8_t *block)
 {
   int		t;		   /* Loop counter		  */
   uint32_t	temp;		   /* Temporary word value	  */
@@ -253,10 +315,10 @@ static void SHA1ProcessMessageBlock(SHA1_CONTEXT *context)
   for (t = 0; t < 16; t++)
   {
     idx=t*4;
-    W[t] = context->Message_Block[idx] << 24;
-    W[t] |= context->Message_Block[idx + 1] << 16;
-    W[t] |= context->Message_Block[idx + 2] << 8;
-    W[t] |= context->Message_Block[idx + 3];
+    W[t] = block[idx] << 24;
+    W[t] |= block[idx + 1] << 16;
+    W[t] |= block[idx + 2] << 8;
+    W[t] |= block[idx + 3];
   }
 
 
@@ -265,11 +327,11 @@ static void SHA1ProcessMessageBlock(SHA1_CONTEXT *context)
     W[t] = SHA1CircularShift(1,W[t-3] ^ W[t-8] ^ W[t-14] ^ W[t-16]);
   }
 
-  A = context->Intermediate_Hash[0];
-  B = context->Intermediate_Hash[1];
-  C = context->Intermediate_Hash[2];
-  D = context->Intermediate_Hash[3];
-  E = context->Intermediate_Hash[4];
+  A = hash[0];
+  B = hash[1];
+  C = hash[2];
+  D = hash[3];
+  E = hash[4];
 
   for (t = 0; t < 20; t++)
   {
@@ -312,14 +374,88 @@ static void SHA1ProcessMessageBlock(SHA1_CONTEXT *context)
     A = temp;
   }
 
-  context->Intermediate_Hash[0] += A;
-  context->Intermediate_Hash[1] += B;
-  context->Intermediate_Hash[2] += C;
-  context->Intermediate_Hash[3] += D;
-  context->Intermediate_Hash[4] += E;
+  hash[0] += A;
+  hash[1] += B;
+  hash[2] += C;
+  hash[3] += D;
+  hash[4] += E;
+}
+
 
-  context->Message_Block_Index = 0;
+#ifdef SHA1_NI
+/*
+  One sha1rnds4 does four rounds, step i runs rounds 4i..4i+3 with
+  message words m0 and finishes/starts the schedule of the next ones.
+*/
+
+#define SHA1_NI_STEP(ea, eb, m0, m1, m2, m3, f)        \
+  ea= _mm_sha1nexte_epu32(ea, m0);                       \
+  eb= abcd;                                              \
+  m1= _mm_sha1msg2_epu32(m1, m0);                        \
+  abcd= _mm_sha1rnds4_epu32(abcd, ea, f);                \
+  m3= _mm_sha1msg1_epu32(m3, m0);                        \
+  m2= _mm_xor_si128(m2, m0)
+
+__attribute__((target("sha,sse4.1")))
+static void SHA1BlockNI(uint32_t *hash, const uint8_t *block)
+{
+  __m128i abcd, abcd_save, e0, e0_save, e1;
+  __m128i m0, m1, m2, m3;
+  const __m128i mask= _mm_set_epi64x(0x0001020304050607ULL,
+                                     0x08090a0b0c0d0e0fULL);
+
+  abcd= _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) hash), 0x1B);
+  e0= _mm_set_epi32((int) hash[4], 0, 0, 0);
+  abcd_save= abcd;
+  e0_save= e0;
+
+  m0= _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) block), mask);
+  m1= _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (block + 16)), mask);
+  m2= _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (block + 32)), mask);
+  m3= _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (block + 48)), mask);
+
+  /* Rounds 0-11, the schedule is not full yet */
+  e0= _mm_add_epi32(e0, m0);
+  e1= abcd;
+  abcd= _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+  e1= _mm_sha1nexte_epu32(e1, m1);
+  e0= abcd;
+  abcd= _mm_sha1rnds4_epu32(abcd, e1, 0);
+  m0= _mm_sha1msg1_epu32(m0, m1);
+
+  e0= _mm_sha1nexte_epu32(e0, m2);
+  e1= abcd;
+  abcd= _mm_sha1rnds4_epu32(abcd, e0, 0);
+  m1= _mm_sha1msg1_epu32(m1, m2);
+  m0= _mm_xor_si128(m0, m2);
+
+  /* Rounds 12-79, words computed after round 79 are dropped */
+  SHA1_NI_STEP(e1, e0, m3, m0, m1, m2, 0);
+  SHA1_NI_STEP(e0, e1, m0, m1, m2, m3, 0);
+  SHA1_NI_STEP(e1, e0, m1, m2, m3, m0, 1);
+  SHA1_NI_STEP(e0, e1, m2, m3, m0, m1, 1);
+  SHA1_NI_STEP(e1, e0, m3, m0, m1, m2, 1);
+  SHA1_NI_STEP(e0, e1, m0, m1, m2, m3, 1);
+  SHA1_NI_STEP(e1, e0, m1, m2, m3, m0, 1);
+  SHA1_NI_STEP(e0, e1, m2, m3, m0, m1, 2);
+  SHA1_NI_STEP(e1, e0, m3, m0, m1, m2, 2);
+  SHA1_NI_STEP(e0, e1, m0, m1, m2, m3, 2);
+  SHA1_NI_STEP(e1, e0, m1, m2, m3, m0, 2);
+  SHA1_NI_STEP(e0, e1, m2, m3, m0, m1, 2);
+  SHA1_NI_STEP(e1, e0, m3, m0, m1, m2, 3);
+  SHA1_NI_STEP(e0, e1, m0, m1, m2, m3, 3);
+  SHA1_NI_STEP(e1, e0, m1, m2, m3, m0, 3);
+  SHA1_NI_STEP(e0, e1, m2, m3, m0, m1, 3);
+  SHA1_NI_STEP(e1, e0, m3, m0, m1, m2, 3);
+
+  e0= _mm_sha1nexte_epu32(e0, e0_save);
+  abcd= _mm_add_epi32(abcd, abcd_save);
+
+  _mm_storeu_si128((__m128i *) hash, _mm_shuffle_epi32(abcd, 0x1B));
+  hash[4]= (uint32_t) _mm_extract_epi32(e0, 3);
 }
+#endif
 
 
 /*
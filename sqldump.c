@@ -15,13 +15,14 @@
 #include <stdio.h>
 #include <common.h>
 #include <sock.h>
+#include <timer.h>
 #include "conn_pool.h"
 #include "cli_pool.h"
 #include "my_pool.h"
 #include "mysql_com.h"
 
-static int sql_fd = -1;
-static int sql_count = 0;
+static __thread int sql_fd = -1;
+static __thread int sql_count = 0;
 static char sqldump_fname[1024] = "./sql.log";
 
 static int parse_req_sql(conn_t *c, char *buf, int len);
@@ -62,16 +63,33 @@ int sqldump(conn_t *c)
     char buf[8192], tmp[4096];
     char timebuf[64];
     char ipstr[64];
+    const char *ts;
     time_t t;
     struct tm tm;
 
     cli_conn_t *cli = c->cli;
     my_conn_t *my = c->my;
-    my_node_t *node = my->node;
+    const char *host = "scatter", *srv = "-";
+
+    if(c->local == LOCAL_CACHE){
+        host = "cache";
+    } else if(c->local == LOCAL_ADMIN) {
+        host = "admin";
+    } else if(c->local == LOCAL_SESSION) {
+        host = "local";
+    } else if(c->local == LOCAL_FLIGHT) {
+        host = "flight";
+    } else if( (c->sg == NULL) && my ){
+        host = ((my_node_t *)my->node)->host;
+        srv = ((my_node_t *)my->node)->srv;
+    }
 
-    t = time(NULL);
-    localtime_r(&t, &tm);
-    strftime(timebuf, sizeof(timebuf), "%F %T", &tm);
+    if( (ts = timer_str(NULL)) == NULL ){
+        t = time(NULL);
+        localtime_r(&t, &tm);
+        strftime(timebuf, sizeof(timebuf), "%F %T", &tm);
+        ts = timebuf;
+    }
 
     if((++sql_count % 1024) == 0){
         if(sql_fd >= 0){
@@ -83,13 +101,12 @@ int sqldump(conn_t *c)
     }
 
     ipint2str(ipstr, sizeof(ipstr), cli->ip);
-    msec = (c->tv_end.tv_sec - c->tv_start.tv_sec) * 1000 + \
-                        (c->tv_end.tv_usec - c->tv_start.tv_usec) / 1000;
+    msec = (c->end_us - c->start_us) / 1000;
 
     parse_req_sql(c, tmp, sizeof(tmp));
 
     n = snprintf(buf, sizeof(buf), "%s conn:%u %s:%d %s:%s %ums - %s\n", \
-                timebuf, c->connid, ipstr, cli->port, node->host, node->srv, msec, tmp);
+                ts, c->connid, ipstr, cli->port, host, srv, msec, tmp);
     res = write(sql_fd, buf, n);
 
     return res;
@@ -6,6 +6,8 @@
  *
  */                                                                       
 
+#define _GNU_SOURCE
+#include <sched.h>
 #include <sys/socket.h>
 #include <sys/epoll.h>
 #include <netinet/in.h>
@@ -18,50 +20,60 @@
 #include <log.h>
 #include <sock.h>
 #include <handler.h>
+#include <timer.h>
 #include "my_ops.h"
 #include "conn_pool.h"
 #include "my_pool.h"
 #include "my_conf.h"
+#include "my_cache.h"
+#include "my_digest.h"
+#include "my_local.h"
+#include "my_user.h"
+#include "my_route.h"
+#include "my_flight.h"
+#include "my_broker.h"
+#include "my_balance.h"
+#include "my_dns.h"
 
 extern log_t *g_log;
 extern struct conf_t g_conf;
-extern int g_usr1_reload;
+extern volatile int g_usr1_reload;
 
-static my_conf_t myconf_cur, myconf_new;
+static __thread my_conf_t myconf_cur, myconf_new;
+static __thread int usr1_seen;
 
 static int accept_client_cb(int listenfd, void *arg);
 static int usr1_reload(void);
+static int work_pin(int index);
 
 /*
  * fun: real work process
- * arg: listen fd
+ * arg: listen fds by route, -1 if not listened, unix socket listen fd or -1,
+ *      worker index
  * ret: it should not return
  *
  */
 
-int work(int fd)
+int work(int *fd, int ufd, int index)
 {
     int i, res = 0, level;
     my_node_conf_t *mynode;
 
-    // log init
-    if(!strcmp(g_conf.loglevel, "none")){
-        level = LOG_NONE;
-    } else if(!strcmp(g_conf.loglevel, "log")) {
-        level = LOG_LEVEL_LOG;
-    } else if(!strcmp(g_conf.loglevel, "debug")) {
-        level = LOG_LEVEL_DEBUG;
-    } else if(!strcmp(g_conf.loglevel, "info")) {
-        level = LOG_LEVEL_INFO;
-    } else {
-        level = LOG_LEVEL_LOG;
-    }
+    // log init, worker threads share the log opened by main
+    level = my_conf_loglevel();
 
-    if( (g_log = log_init(g_conf.log, level)) == NULL ){
+    if( (g_log == NULL) && ((g_log = log_init(g_conf.log, level)) == NULL) ){
         fprintf(stderr, "log init error\n");
         exit(-1);
     }
 
+    usr1_seen = g_usr1_reload;
+
+    // pin before any pool is allocated, first touch keeps them node local
+    if(work_pin(index) < 0){
+        log(g_log, "worker %d cpu pin error\n", index);
+    }
+
     if(init_handler(100000) < 0){
         log(g_log, "handler init error\n");
         exit(-1);
@@ -70,6 +82,7 @@ int work(int fd)
     }
 
     // timer init must before cli_pool_init conn_pool_init my_pool_init
+    timer_precise(g_conf.precise_clock);
     if(timer_init() < 0){
         log(g_log, "timer_inti error\n");
         exit(-1);
@@ -93,6 +106,13 @@ int work(int fd)
         log(g_log, "conn pool init success\n");
     }
 
+    // backend host resolver, without it hosts are resolved in loop
+    if(my_dns_init() < 0){
+        log(g_log, "dns init error\n");
+    } else {
+        log(g_log, "dns init success\n");
+    }
+
     // mysql connection pool init
     if(my_pool_init(g_conf.max_connections) < 0){
         log(g_log, "mysql pool init error\n");
@@ -101,6 +121,68 @@ int work(int fd)
         log(g_log, "mysql pool init success\n");
     }
 
+    // idle mysql connections broker, connection failure is retried
+    if(my_broker_init() < 0){
+        log(g_log, "broker init error\n");
+    } else {
+        log(g_log, "broker init success\n");
+    }
+
+    // client rebalance between workers
+    if(my_balance_init() < 0){
+        log(g_log, "balance init error\n");
+    } else {
+        log(g_log, "balance init success\n");
+    }
+
+    // result cache init
+    if(my_cache_init() < 0){
+        log(g_log, "cache init error\n");
+        exit(-1);
+    } else {
+        log(g_log, "cache init success\n");
+    }
+
+    // query digest init
+    if(my_digest_init() < 0){
+        log(g_log, "digest init error\n");
+        exit(-1);
+    } else {
+        log(g_log, "digest init success\n");
+    }
+
+    // client user table init
+    if(my_user_init() < 0){
+        log(g_log, "user init error\n");
+        exit(-1);
+    } else {
+        log(g_log, "user init success\n");
+    }
+
+    // slave group routing init
+    if(my_route_init() < 0){
+        log(g_log, "route init error\n");
+        exit(-1);
+    } else {
+        log(g_log, "route init success\n");
+    }
+
+    // single flight init
+    if(my_flight_init() < 0){
+        log(g_log, "flight init error\n");
+        exit(-1);
+    } else {
+        log(g_log, "flight init success\n");
+    }
+
+    // local responder init
+    if(my_local_init() < 0){
+        log(g_log, "local init error\n");
+        exit(-1);
+    } else {
+        log(g_log, "local init success\n");
+    }
+
     // mysql dump log init
     if(sqldump_init(g_conf.sqllog) < 0){
         log(g_log, "sqldump %s init error\n", g_conf.sqllog);
@@ -126,7 +208,8 @@ int work(int fd)
     for(i = 0; i < myconf_cur.mcount; i++){
         mynode = &(myconf_cur.master[i]);
         res = my_master_reg(mynode->host, mynode->port, \
-                    mynode->user, mynode->pass, mynode->cnum);
+                    mynode->user, mynode->pass, mynode->cnum, \
+                    mynode->cmax, mynode->ccap);
         if(res < 0){
             log(g_log, "my_master_reg error\n");
         }
@@ -135,27 +218,51 @@ int work(int fd)
     for(i = 0; i < myconf_cur.scount; i++){
         mynode = &(myconf_cur.slave[i]);
         res = my_slave_reg(mynode->host, mynode->port, \
-                    mynode->user, mynode->pass, mynode->cnum);
+                    mynode->user, mynode->pass, mynode->cnum, \
+                    mynode->cmax, mynode->ccap, mynode->group);
         if(res < 0){
             log(g_log, "my_slave_reg error\n");
         }
     }
 
-    // listen fd epoll
-    if( (res = add_handler(fd, EPOLLIN, accept_client_cb, NULL)) < 0 ){
-        log(g_log, "add_handler listenfd[%d] fail\n", fd);
+    for(i = 0; i < myconf_cur.shcount; i++){
+        mynode = &(myconf_cur.shard[i]);
+        res = my_shard_reg(mynode->host, mynode->port, \
+                    mynode->user, mynode->pass, mynode->cnum, \
+                    mynode->cmax, mynode->ccap);
+        if(res < 0){
+            log(g_log, "my_shard_reg error\n");
+        }
+    }
+
+    // listen fd epoll, the route of the port is the callback argument
+    for(i = 0; i < ROUTE_NUM; i++){
+        if(fd[i] < 0){
+            continue;
+        }
+
+        if( (res = add_handler(fd[i], EPOLLIN, accept_client_cb, \
+                                            (void *)(long)i)) < 0 ){
+            log(g_log, "add_handler listenfd[%d] fail\n", fd[i]);
+            return -1;
+        } else {
+            debug(g_log, "add_handler listenfd[%d] success\n", fd[i]);
+        }
+    }
+
+    if( (ufd >= 0) && \
+        (add_handler(ufd, EPOLLIN, accept_client_cb, (void *)ROUTE_AUTO) < 0) ){
+        log(g_log, "add_handler unix listenfd[%d] fail\n", ufd);
         return -1;
-    } else {
-        debug(g_log, "add_handler listenfd[%d] success\n", fd);
     }
 
     while(1){
         debug(g_log, "epoll_handler\n");
-        res = epoll_handler(1000);
+        res = epoll_handler(timer_wait(1000));
         // timer
         timer();
         // catch usr1 signal
-        if(g_usr1_reload){
+        if(g_usr1_reload != usr1_seen){
             usr1_reload();
         }
     }
@@ -165,7 +272,7 @@ int work(int fd)
 
 /*
  * fun: accept client callback
- * arg: listen fd, arg(not used)
+ * arg: listen fd, route of the port
  * ret: success 0, error -1
  *
  */
@@ -175,7 +282,8 @@ static int accept_client_cb(int listenfd, void *arg)
     int clientfd, res = 0;
     uint32_t clientip;
     uint16_t clientport;
-    struct sockaddr_in cliaddr;
+    struct sockaddr_storage addr;
+    struct sockaddr_in *cliaddr = (struct sockaddr_in *)&addr;
     socklen_t clen;
 
     conn_t *c;
@@ -183,12 +291,8 @@ static int accept_client_cb(int listenfd, void *arg)
     debug(g_log, "accept_client_cb callback\n");
 
     while(1){
-        if(!my_pool_have_conn()){
-            debug(g_log, "mysql pool is empty, waiting\n");
-            break;
-        }
-        clen = sizeof(cliaddr);
-        clientfd = accept_client(listenfd, &cliaddr, &clen);
+        clen = sizeof(addr);
+        clientfd = accept_client(listenfd, cliaddr, &clen);
         if(clientfd < 0){
             if(errno != EAGAIN){
                 log_err(g_log, "accept client error\n");
@@ -201,19 +305,32 @@ static int accept_client_cb(int listenfd, void *arg)
             close(clientfd);
         }
 
-        clientip = ntohl(cliaddr.sin_addr.s_addr);
-        clientport = ntohs(cliaddr.sin_port);
+        // unix socket clients have no address, fd spreads them over slaves
+        if(addr.ss_family == AF_UNIX){
+            clientip = 0;
+            clientport = clientfd;
+        } else {
+            clientip = ntohl(cliaddr->sin_addr.s_addr);
+            clientport = ntohs(cliaddr->sin_port);
+        }
 
         if( (c = conn_open(clientfd, clientip, clientport)) == NULL ){
             log(g_log, "connection alloc fail, close connection\n");
             close(clientfd);
+            continue;
         } else {
             debug(g_log, "conn:%d connection alloc success\n", c->connid);
         }
 
-        log(g_log, "conn:%d client[%s:%d] connection accept\n", \
-                    c->connid, inet_ntoa(cliaddr.sin_addr), \
-                    ntohs(cliaddr.sin_port));
+        c->route = (long)arg;
+
+        if(addr.ss_family == AF_UNIX){
+            log(g_log, "conn:%d client[unix] connection accept\n", c->connid);
+        } else {
+            log(g_log, "conn:%d client[%s:%d] connection accept\n", \
+                        c->connid, inet_ntoa(cliaddr->sin_addr), \
+                        ntohs(cliaddr->sin_port));
+        }
 
         if( (res = cli_hs_stage1_prepare(c)) < 0 ){
             log(g_log, "conn:%d cli_hs_sate1_prepare error, \
@@ -237,13 +354,20 @@ static int usr1_reload(void)
     int i, j, res;
     my_node_conf_t *cur, *new;
 
-    if(!g_usr1_reload){
+    if(g_usr1_reload == usr1_seen){
         return 0;
     } else {
         log(g_log, "catch usr1 signal\n");
     }
 
-    g_usr1_reload = 0;
+    usr1_seen = g_usr1_reload;
+
+    if(g_conf.cache){
+        my_cache_rule_load(g_conf.cache_conf);
+    }
+
+    my_user_load(g_conf.user_conf);
+    my_route_load(g_conf.route_conf);
 
     res = mysql_conf_parse(g_conf.mysql_conf, &myconf_new);
     if(res < 0){
@@ -281,6 +405,21 @@ static int usr1_reload(void)
         }
     }
 
+    for(i = 0; i < myconf_cur.shcount; i++){
+        cur = &(myconf_cur.shard[i]);
+        for(j = 0; j < myconf_new.shcount; j++){
+            new = &(myconf_new.shard[j]);
+            if((!strcmp(new->host, cur->host)) && \
+                                (!strcmp(new->port, cur->port))){
+                break;
+            }
+        }
+
+        if(j == myconf_new.shcount){
+            my_unreg(cur->host, cur->port);
+        }
+    }
+
     for(i = 0; i < myconf_new.mcount; i++){
         new = &(myconf_new.master[i]);
         for(j = 0; j < myconf_cur.mcount; j++){
@@ -293,7 +432,7 @@ static int usr1_reload(void)
 
         if(j == myconf_cur.mcount){
             my_master_reg(new->host, new->port, new->user, \
-                                            new->pass, new->cnum);
+                                new->pass, new->cnum, new->cmax, new->ccap);
         }
     }
 
@@ -308,8 +447,26 @@ static int usr1_reload(void)
         }
 
         if(j == myconf_cur.scount){
-            my_slave_reg(new->host, new->port, new->user, \
-                                            new->pass, new->cnum);
+            my_slave_reg(new->host, new->port, new->user, new->pass, \
+                                new->cnum, new->cmax, new->ccap, new->group);
+        } else {
+            my_slave_group_set(new->host, new->port, new->group);
+        }
+    }
+
+    for(i = 0; i < myconf_new.shcount; i++){
+        new = &(myconf_new.shard[i]);
+        for(j = 0; j < myconf_cur.shcount; j++){
+            cur = &(myconf_cur.shard[j]);
+            if((!strcmp(new->host, cur->host)) && \
+                                (!strcmp(new->port, cur->port))){
+                break;
+            }
+        }
+
+        if(j == myconf_cur.shcount){
+            my_shard_reg(new->host, new->port, new->user, \
+                                new->pass, new->cnum, new->cmax, new->ccap);
         }
     }
 
@@ -317,3 +474,33 @@ static int usr1_reload(void)
 
     return 0;
 }
+
+/*
+ * fun: pin worker to its cpu of cpu_affinity
+ * arg: worker index
+ * ret: success or not set 0, error -1
+ *
+ */
+
+static int work_pin(int index)
+{
+    int n, cpus[CPU_SETSIZE];
+    cpu_set_t set;
+
+    if( (n = my_conf_cpus(cpus, CPU_SETSIZE)) <= 0 ){
+        return 0;
+    }
+
+    CPU_ZERO(&set);
+    CPU_SET(cpus[index % n], &set);
+
+    // pins the calling thread only in thread mode
+    if(sched_setaffinity(0, sizeof(set), &set) < 0){
+        log_err(g_log, "sched_setaffinity cpu %d error\n", cpus[index % n]);
+        return -1;
+    }
+
+    log(g_log, "worker %d pinned on cpu %d\n", index, cpus[index % n]);
+
+    return 0;
+}